@@ -8,7 +8,9 @@ function fetch_current_date()
     
     -- Fetch timestamp from nex://idea.fritz.box/now.txt
     -- Format: "2025-12-17 22:09:20"
-    local content, err = nex.load("nex://idea.fritz.box/now.txt")
+    -- A copy from the last 10 minutes is good enough for the date; older
+    -- ones (or any from before a reboot) are only used if the network fails
+    local content, err = nex.load("nex://idea.fritz.box/now.txt", {max_age = 600, stale = false})
     
     if content then
         -- Extract date part (YYYY-MM-DD) from timestamp
@@ -3,129 +3,75 @@
 
 -- Browser state
 local current_url = "nex://idea.fritz.box"
-local page_content = nil
-local parsed_lines = {}
+local fetch = nil  -- nex.fetch in progress, polled from draw()
+local doc = nil  -- nex.document the fetch fills; indexed and laid out in C
+local rows = 0  -- Wrapped rows of doc at the current width
 local scroll_offset = 0
+local drawn_offset = nil  -- scroll_offset of the last frame, to time scrolling
 local selected_link = 1
-local link_indices = {}
 local error_message = nil
 local loading = false
 local history = {}
 
 -- Display settings
-local LINE_HEIGHT = 12
 local LINES_PER_PAGE = 24
 local MARGIN_X = 5
 local MARGIN_Y = 10
-local MAX_LINE_WIDTH = 35  -- Maximum characters per line before wrapping
+local PREWARM = true  -- Resolve and connect to linked hosts while reading
 
--- Wrap text to fit within MAX_LINE_WIDTH characters
-function wrap_text(text, max_width)
-    if #text <= max_width then
-        return {text}
+-- Start loading a NEX page; lines are shown while the rest downloads
+function load_page(url)
+    if fetch then
+        fetch:close()
     end
     
-    local lines = {}
-    local current_line = ""
+    print("Loading: " .. url)
     
-    -- Split by words
-    for word in text:gmatch("%S+") do
-        if #current_line == 0 then
-            current_line = word
-        elseif #current_line + 1 + #word <= max_width then
-            current_line = current_line .. " " .. word
-        else
-            table.insert(lines, current_line)
-            current_line = word
-        end
-    end
+    doc = nex.document()
+    rows = 0
+    current_url = url
+    scroll_offset = 0
+    drawn_offset = nil
+    selected_link = 1
+    error_message = nil
     
-    -- Add remaining text
-    if #current_line > 0 then
-        table.insert(lines, current_line)
+    local err
+    fetch, err = nex.fetch(url, doc)
+    loading = fetch ~= nil
+    if not fetch then
+        error_message = err or "Failed to load page"
+        print("Error: " .. error_message)
     end
-    
-    return lines
 end
 
--- Load a NEX page
-function load_page(url)
-    loading = true
-    error_message = nil
-    
-    print("Loading: " .. url)
-    
-    local content, err = nex.load(url)
+-- Deliver newly received lines (called every frame while loading)
+function poll_page()
+    local status, err = fetch:poll()
+    if status == "loading" then
+        return
+    end
     
-    if content then
-        page_content = content
-        local raw_lines = nex.parse(content)
-        
-        -- Wrap long lines and rebuild parsed_lines
-        parsed_lines = {}
-        for _, line in ipairs(raw_lines) do
-            if line.type == "link" then
-                -- For links, wrap the label but keep the full text for URL extraction
-                local label = extract_label(line.text)
-                local wrapped = wrap_text(label, MAX_LINE_WIDTH - 2)  -- Account for "> " prefix
-                for i, wrapped_line in ipairs(wrapped) do
-                    table.insert(parsed_lines, {
-                        type = "link",
-                        text = line.text,  -- Keep original for URL extraction
-                        display = wrapped_line,  -- Wrapped text for display
-                        is_continuation = i > 1
-                    })
-                end
-            else
-                -- Wrap regular text and headings
-                local wrapped = wrap_text(line.text, MAX_LINE_WIDTH)
-                for _, wrapped_line in ipairs(wrapped) do
-                    table.insert(parsed_lines, {
-                        type = line.type,
-                        text = wrapped_line,
-                        display = wrapped_line
-                    })
-                end
-            end
-        end
-        
-        -- Find all links (only count first line of each link, not continuations)
-        link_indices = {}
-        for i, line in ipairs(parsed_lines) do
-            if line.type == "link" and not line.is_continuation then
-                table.insert(link_indices, i)
-            end
+    fetch = nil
+    loading = false
+    if status == "done" then
+        local stats = nex.stats()
+        local doc_stats = doc:stats()
+        print("Loaded " .. doc_stats.lines .. " lines, " .. doc_stats.links .. " links")
+        print(string.format("Indexed in %d us, %d bytes; %d rows laid out in %d us",
+            doc_stats.parse_us, doc_stats.index_bytes, doc_stats.rows, doc_stats.layout_us))
+        print(string.format("From %s: first line after %d ms, all after %d ms, peak %d bytes",
+            stats.source, stats.first_line_ms, stats.total_ms, stats.peak_bytes))
+        print(string.format("Cache: %d RAM, %d SD, %d stale hits, %d misses",
+            stats.ram_hits, stats.sd_hits, stats.stale_hits, stats.misses))
+        print(string.format("Prewarmed: %s, DNS cache %d hits, %d misses",
+            tostring(stats.prewarmed), stats.dns_hits, stats.dns_misses))
+        if PREWARM then
+            prefetch_links()
         end
-        
-        current_url = url
-        scroll_offset = 0
-        selected_link = 1
-        error_message = nil
-        
-        print("Loaded " .. #parsed_lines .. " lines, " .. #link_indices .. " links")
     else
         error_message = err or "Failed to load page"
         print("Error: " .. error_message)
     end
-    
-    loading = false
-end
-
--- Extract URL from link line
-function extract_url(link_text)
-    -- Link format: "=> url [label]"
-    local url = link_text:match("^%s*(%S+)")
-    return url
-end
-
--- Extract label from link line
-function extract_label(link_text)
-    local url, label = link_text:match("^%s*(%S+)%s+(.+)")
-    if label then
-        return label
-    else
-        return url or link_text
-    end
 end
 
 -- Resolve relative URL
@@ -149,26 +95,26 @@ function resolve_url(base, relative)
     return relative
 end
 
+-- Warm up connections for the links on the page (one per host)
+function prefetch_links()
+    for _, url in doc:links() do
+        nex.prefetch(resolve_url(current_url, url))
+    end
+end
+
 -- Navigate to link
 function navigate_to_link()
-    if #link_indices == 0 then return end
+    local url, label = doc:link(selected_link)
+    if not url then return end
+    print('LINK ', selected_link, label)
+    print('URL ', url)
     
-    local line_idx = link_indices[selected_link]
-    local line = parsed_lines[line_idx]
-    print('LINK ', line_idx, line.type, line.text)
+    -- Add current page to history
+    table.insert(history, current_url)
     
-    if line and line.type == "link" then
-        local url = extract_url(line.text)
-        print('URL ', url)
-        if url then
-            -- Add current page to history
-            table.insert(history, current_url)
-            
-            -- Resolve and load new URL
-            local full_url = resolve_url(current_url, url)
-            load_page(full_url)
-        end
-    end
+    -- Resolve and load new URL
+    local full_url = resolve_url(current_url, url)
+    load_page(full_url)
 end
 
 -- Go back in history
@@ -191,9 +137,19 @@ function draw()
     background(0, 0, 50)
     
     if loading then
-        -- Show loading message
+        poll_page()
+    end
+    
+    if doc then
+        -- Wraps only lines that arrived since the last frame
+        rows = doc:layout(WIDTH - 2 * MARGIN_X)
+    end
+    
+    if loading and rows == 0 then
+        -- Show loading message until the first line arrives
         fill(255, 255, 255, 1)
         text(WIDTH/2 - 50, HEIGHT/2, "Loading...")
+        handle_input()
         return
     end
     
@@ -214,51 +170,15 @@ function draw()
     
     -- Draw title bar
     fill(200, 200, 100, 1)
-    text(MARGIN_X, HEIGHT - MARGIN_Y, current_url)
-    
-    -- Draw page content
-    local y = HEIGHT - MARGIN_Y - 20
-    local visible_start = scroll_offset + 1
-    local visible_end = math.min(scroll_offset + LINES_PER_PAGE, #parsed_lines)
+    text(MARGIN_X, HEIGHT - MARGIN_Y, loading and (current_url .. " ...") or current_url)
     
-    for i = visible_start, visible_end do
-        local line = parsed_lines[i]
-        
-        if line.type == "heading" then
-            -- Heading in yellow
-            fill(255, 255, 100, 1)
-            text(MARGIN_X, y, line.display or line.text)
-        elseif line.type == "link" then
-            -- Check if this link is selected (only for first line of link)
-            local is_selected = false
-            if not line.is_continuation then
-                for idx, link_idx in ipairs(link_indices) do
-                    if link_idx == i and idx == selected_link then
-                        is_selected = true
-                        break
-                    end
-                end
-            end
-            
-            if is_selected then
-                -- Selected link in bright cyan with marker
-                fill(0, 255, 255, 1)
-                text(MARGIN_X, y, "> " .. (line.display or extract_label(line.text)))
-            else
-                -- Unselected link or continuation in cyan
-                fill(100, 200, 255, 1)
-                local indent = line.is_continuation and 12 or 10
-                text(MARGIN_X + indent, y, line.display or extract_label(line.text))
-            end
-        else
-            -- Regular text in white
-            fill(200, 200, 200, 1)
-            text(MARGIN_X, y, line.display or line.text)
-        end
-        
-        y = y - LINE_HEIGHT
-        if y < MARGIN_Y then break end
+    -- Draw the visible rows with per-type colors, selected link highlighted
+    doc:draw(MARGIN_X, HEIGHT - MARGIN_Y - 20, scroll_offset + 1, LINES_PER_PAGE, selected_link)
+    if drawn_offset and drawn_offset ~= scroll_offset then
+        print(string.format("Scrolled to row %d of %d: drawn in %d us",
+            scroll_offset + 1, rows, doc:stats().draw_us))
     end
+    drawn_offset = scroll_offset
     
     -- Draw controls at bottom
     fill(150, 150, 150, 1)
@@ -266,8 +186,8 @@ function draw()
     text(MARGIN_X, 12, "W/S: Scroll  B: Back  ESC: Exit")
     
     -- Draw scroll indicator
-    if #parsed_lines > LINES_PER_PAGE then
-        local scroll_pct = scroll_offset / (#parsed_lines - LINES_PER_PAGE)
+    if rows > LINES_PER_PAGE then
+        local scroll_pct = scroll_offset / (rows - LINES_PER_PAGE)
         fill(100, 100, 255, 1)
         text(WIDTH - 30, HEIGHT/2, string.format("%d%%", scroll_pct * 100))
     end
@@ -287,21 +207,22 @@ function handle_input()
             selected_link = selected_link - 1
             
             -- Auto-scroll to keep selected link visible
-            local line_idx = link_indices[selected_link]
-            if line_idx <= scroll_offset then
-                scroll_offset = math.max(0, line_idx - 1)
+            local _, _, row = doc:link(selected_link)
+            if row and row <= scroll_offset then
+                scroll_offset = math.max(0, row - 1)
             end
         end
     end
     
     if keyboard.pressed['down'] and not prev_keys['down'] then
-        if selected_link < #link_indices then
+        local _, links = doc:count()
+        if selected_link < links then
             selected_link = selected_link + 1
             
             -- Auto-scroll to keep selected link visible
-            local line_idx = link_indices[selected_link]
-            if line_idx > scroll_offset + LINES_PER_PAGE then
-                scroll_offset = math.min(#parsed_lines - LINES_PER_PAGE, line_idx - LINES_PER_PAGE)
+            local _, _, row = doc:link(selected_link)
+            if row and row > scroll_offset + LINES_PER_PAGE then
+                scroll_offset = math.min(rows - LINES_PER_PAGE, row - LINES_PER_PAGE)
             end
         end
     end
@@ -312,7 +233,7 @@ function handle_input()
     end
     
     if keyboard.pressed['s'] and not prev_keys['s'] then
-        scroll_offset = math.min(math.max(0, #parsed_lines - LINES_PER_PAGE), scroll_offset + LINES_PER_PAGE)
+        scroll_offset = math.min(math.max(0, rows - LINES_PER_PAGE), scroll_offset + LINES_PER_PAGE)
     end
     
     -- Follow link (ENTER/RETURN)
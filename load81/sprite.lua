@@ -1,11 +1,13 @@
 local t, x = 0, 0
 
+pack.mount("sprite.pak")
+
 function draw()
     background(0, 0, 0)
     local c = math.abs(math.cos(2*3.14*t));
     local y = 0.5*HEIGHT*c/math.exp(0.8*t);
 
-    sprite("examples/sprite.png", x, y,t*-150);
+    sprite("sprite.png", x, y,t*-150);
     x = x + 3
     t = t + 0.01
 
@@ -19,8 +19,10 @@ if wifi.connect(WIFI_SSID, WIFI_PASSWORD) then
     local content, err = nex.load("nex://idea.fritz.box/")
     if content then
         print("NEX page loaded successfully!")
-        local parsed = nex.parse(content)
-        print("Found " .. #parsed .. " lines")
+        local doc = nex.document(content)
+        local stats = doc:stats()
+        print("Found " .. #doc .. " lines, " .. stats.links .. " links")
+        print("Indexed in " .. stats.parse_us .. " us, " .. stats.index_bytes .. " bytes")
     else
         print("NEX load failed: " .. (err or "unknown error"))
     end
@@ -26,7 +26,7 @@
 #define MEM_SIZE                    (16 * 1024)
 #define PBUF_POOL_SIZE              16
 #define MEMP_NUM_UDP_PCB            4
-#define MEMP_NUM_TCP_PCB            4
+#define MEMP_NUM_TCP_PCB            6   /* File and diag clients, a NEX load, prewarms */
 #define MEMP_NUM_TCP_PCB_LISTEN     2
 #define MEMP_NUM_NETBUF             4
 #define MEMP_NUM_NETCONN            4
@@ -28,15 +28,24 @@
 #include "picocalc_wifi.h"
 #include "picocalc_nex.h"
 #include "picocalc_repl.h"
+#include "picocalc_reload.h"
+#include "picocalc_repl_handler.h"
+#include "picocalc_fs_worker.h"
+#include "picocalc_prog_index.h"
+#include "picocalc_prefetch.h"
 #include "picocalc_debug_log.h"
 
 #define FPS 30
 #define FRAME_TIME_MS (1000 / FPS)
+#define FS_WORKER_MARGIN_MS 2  /* Slack kept back for the worker's last slice */
 
 /* Global state */
 static lua_State *g_lua = NULL;
 static bool g_program_running = false;
 static uint64_t g_frame_count = 0;
+static const char *g_launch_name = NULL;  /* Menu program being started */
+static uint64_t g_launch_start_us = 0;    /* When its key was pressed */
+static bool g_launch_prefetched = false;  /* Started from a prefetched chunk */
 
 /* Keyboard interrupt callback (required by PicoCalc keyboard driver) */
 void user_interrupt(void) {
@@ -237,6 +246,15 @@ static void program_loop(lua_State *L) {
         /* Poll network stack for incoming connections */
         cyw43_arch_poll();
         
+        /* Swap in code queued by RELOAD while no Lua function is running */
+        reload_service(L);
+        
+        /* Run remote REPL code in the program's state */
+        repl_service(L);
+        
+        /* Callbacks of fs.read_async() reads finished last frame */
+        lua_call_async(L);
+        
         /* Poll keyboard */
         kb_poll();
         
@@ -276,14 +294,30 @@ static void program_loop(lua_State *L) {
         
         /* Present framebuffer to screen */
         fb_present();
+        reload_frame_presented();
+        
+        /* Launch time (selection to first frame) goes into the index */
+        if (g_frame_count == 0 && g_launch_name) {
+            uint32_t launch_ms = (uint32_t)((time_us_64() - g_launch_start_us) / 1000);
+            DEBUG_PRINTF("[MENU] %s: key press to first frame %lu ms (%s)\n", g_launch_name,
+                         (unsigned long)launch_ms, g_launch_prefetched ? "prefetched" : "loaded");
+            prog_index_note_run(g_launch_name, launch_ms);
+            g_launch_name = NULL;
+        }
         
         /* Reset keyboard events for next frame */
         kb_reset_events();
         
         g_frame_count++;
         
-        /* Frame rate limiting */
+        /* Frame rate limiting; queued filesystem work uses the slack first */
         uint32_t frame_time = to_ms_since_boot(get_absolute_time()) - frame_start;
+        if (fs_worker_busy()) {
+            uint32_t slack = frame_time < FRAME_TIME_MS ? FRAME_TIME_MS - frame_time : 0;
+            fs_worker_run(slack > FS_WORKER_MARGIN_MS ? (slack - FS_WORKER_MARGIN_MS) * 1000 : 0);
+            frame_time = to_ms_since_boot(get_absolute_time()) - frame_start;
+        }
+        fs_worker_poll();  /* PUT replies and read completions go out this frame */
         if (frame_time < FRAME_TIME_MS) {
             sleep_ms(FRAME_TIME_MS - frame_time);
         }
@@ -382,6 +416,7 @@ int main(void) {
         
         /* Show menu and select program */
         int selected = menu_select_program();
+        g_launch_start_us = menu_selected_at_us();
         
         if (selected < 0) {
             /* User cancelled - show splash again and retry */
@@ -446,7 +481,13 @@ int main(void) {
         }
         
         /* Load program file */
-        char *program_code = menu_load_file(item->filename);
+        char *program_code = NULL;
+        size_t program_size = 0;
+        g_launch_prefetched = prefetch_take(item->filename, &program_code, &program_size);
+        if (!g_launch_prefetched) {
+            program_code = menu_load_file(item->filename);
+            program_size = program_code ? strlen(program_code) : 0;
+        }
         if (!program_code) {
             /* Error loading file */
             fb_fill_background(50, 0, 0);
@@ -469,7 +510,7 @@ int main(void) {
         nex_register_lua(g_lua);
         
         /* Load program */
-        if (lua_load_program(g_lua, program_code, item->filename) != 0) {
+        if (lua_load_program(g_lua, program_code, program_size, item->filename) != 0) {
             /* Error loading program */
             fb_fill_background(50, 0, 0);
             g_draw_r = 255; g_draw_g = 255; g_draw_b = 255; g_draw_alpha = 255;
@@ -494,7 +535,13 @@ int main(void) {
         free(program_code);
         
         /* Run program */
+        char program_path[256];
+        snprintf(program_path, sizeof(program_path), "/load81/%s", item->filename);
+        reload_set_program(program_path);
+        g_launch_name = item->filename;
         program_loop(g_lua);
+        g_launch_name = NULL;
+        reload_set_program(NULL);
         
         /* Clean up */
         lua_close_load81(g_lua);
@@ -0,0 +1,389 @@
+/**
+ * @file picocalc_block_cache.c
+ * @brief LRU cache of SD card sectors beneath the FAT32 driver
+ *
+ * Linked with -Wl,--wrap for sd_read_block, sd_write_block and the
+ * fat32_ calls below: calls from other object files land in the __wrap_
+ * functions, which reach the real ones as __real_. fat32_delete and
+ * fat32_rename flush like fat32_close, as nothing closes after them.
+ * Everything runs on core 0, like the rest of the file system code.
+ */
+
+#include "picocalc_block_cache.h"
+#include "fat32.h"
+#include "sdcard.h"
+#include "debug.h"
+#include <string.h>
+
+#define SECTOR_SIZE 512
+
+#if BLOCK_CACHE_PIN_MAX >= BLOCK_CACHE_SECTORS
+#error "BLOCK_CACHE_PIN_MAX must leave room for file data"
+#endif
+
+typedef struct {
+    uint32_t lba;
+    uint32_t last_used;
+    bool valid;
+    bool dirty;
+    bool pinned;                 /* FAT or directory sector */
+    bool readahead;              /* Read ahead and not requested yet */
+    uint8_t data[SECTOR_SIZE];
+} cache_entry_t;
+
+static struct {
+    cache_entry_t entries[BLOCK_CACHE_SECTORS];
+    uint32_t use_clock;
+    uint32_t pinned_count;
+    int meta_depth;              /* Inside a wrapped directory operation */
+
+    /* FAT region of the mounted volume, from its boot sector */
+    uint32_t fat_start;
+    uint32_t fat_end;
+    block_cache_volume_t volume;
+    block_cache_fat_observer_t fat_observer;
+
+    uint32_t last_read;
+    uint32_t seq_run;            /* Sequential reads in a row before this one */
+    block_cache_stats_t stats;
+} g_cache;
+
+sd_error_t __real_sd_read_block(uint32_t block, uint8_t *buffer);
+sd_error_t __real_sd_write_block(uint32_t block, const uint8_t *buffer);
+fat32_error_t __real_fat32_open(fat32_file_t *file, const char *path);
+fat32_error_t __real_fat32_dir_read(fat32_file_t *dir, fat32_entry_t *entry);
+fat32_error_t __real_fat32_close(fat32_file_t *file);
+fat32_error_t __real_fat32_delete(const char *path);
+fat32_error_t __real_fat32_rename(const char *old_path, const char *new_path);
+
+static uint16_t get_u16(const uint8_t *p) {
+    return (uint16_t)(p[0] | p[1] << 8);
+}
+
+static uint32_t get_u32(const uint8_t *p) {
+    return (uint32_t)p[0] | (uint32_t)p[1] << 8 | (uint32_t)p[2] << 16 | (uint32_t)p[3] << 24;
+}
+
+/* Remember where the FAT is when the driver reads a FAT32 boot sector */
+static void note_boot_sector(uint32_t lba, const uint8_t *data) {
+    if (data[510] != 0x55 || data[511] != 0xAA || memcmp(data + 82, "FAT32   ", 8) != 0 ||
+        get_u16(data + 11) != SECTOR_SIZE) {
+        return;
+    }
+    uint32_t reserved = get_u16(data + 14);
+    uint32_t fat_size = get_u32(data + 36);
+    uint32_t fat_sectors = data[16] * fat_size;
+    g_cache.fat_start = lba + reserved;
+    g_cache.fat_end = g_cache.fat_start + fat_sectors;
+
+    block_cache_volume_t *volume = &g_cache.volume;
+    uint32_t total = get_u16(data + 19) ? get_u16(data + 19) : get_u32(data + 32);
+    volume->generation++;
+    volume->fat_start = g_cache.fat_start;
+    volume->fat_sectors = fat_size;
+    volume->num_fats = data[16];
+    volume->sectors_per_cluster = data[13];
+    volume->data_start = g_cache.fat_end;
+    volume->clusters = data[13] ? (total - reserved - fat_sectors) / data[13] : 0;
+    DEBUG_PRINTF("[BCACHE] FAT at sectors %lu-%lu\n",
+                 (unsigned long)g_cache.fat_start, (unsigned long)g_cache.fat_end - 1);
+}
+
+static void observe_fat(uint32_t lba, const uint8_t *data) {
+    if (g_cache.fat_observer && g_cache.volume.fat_start &&
+        lba >= g_cache.volume.fat_start && lba < g_cache.volume.fat_start + g_cache.volume.fat_sectors) {
+        g_cache.fat_observer(lba - g_cache.volume.fat_start, data);
+    }
+}
+
+static bool is_metadata(uint32_t lba) {
+    return g_cache.meta_depth > 0 || (lba >= g_cache.fat_start && lba < g_cache.fat_end);
+}
+
+static cache_entry_t *find(uint32_t lba) {
+    for (int i = 0; i < BLOCK_CACHE_SECTORS; i++) {
+        if (g_cache.entries[i].valid && g_cache.entries[i].lba == lba) {
+            return &g_cache.entries[i];
+        }
+    }
+    return NULL;
+}
+
+static void set_pinned(cache_entry_t *entry, bool pinned) {
+    if (entry->pinned != pinned) {
+        entry->pinned = pinned;
+        if (pinned) {
+            g_cache.pinned_count++;
+        } else {
+            g_cache.pinned_count--;
+        }
+    }
+}
+
+static sd_error_t write_back(cache_entry_t *entry) {
+    sd_error_t err = __real_sd_write_block(entry->lba, entry->data);
+    if (err != SD_OK) {
+        DEBUG_PRINTF("[BCACHE] Write of sector %lu failed: %d\n", (unsigned long)entry->lba, err);
+        return err;
+    }
+    entry->dirty = false;
+    g_cache.stats.sd_writes++;
+    return SD_OK;
+}
+
+/*
+ * Free a slot for a new sector: an empty one, else the least recently used
+ * data sector. Pinned sectors only give way to other pinned sectors once
+ * BLOCK_CACHE_PIN_MAX of them are cached.
+ */
+static sd_error_t take_slot(bool pin, cache_entry_t **slot) {
+    cache_entry_t *oldest_data = NULL;
+    cache_entry_t *oldest_pinned = NULL;
+    cache_entry_t *victim = NULL;
+    for (int i = 0; i < BLOCK_CACHE_SECTORS && !victim; i++) {
+        cache_entry_t *entry = &g_cache.entries[i];
+        if (!entry->valid) {
+            victim = entry;
+        } else if (entry->pinned) {
+            if (!oldest_pinned || entry->last_used < oldest_pinned->last_used) {
+                oldest_pinned = entry;
+            }
+        } else if (!oldest_data || entry->last_used < oldest_data->last_used) {
+            oldest_data = entry;
+        }
+    }
+    if (!victim) {
+        if (pin && g_cache.pinned_count >= BLOCK_CACHE_PIN_MAX) {
+            victim = oldest_pinned;
+        } else {
+            victim = oldest_data ? oldest_data : oldest_pinned;
+        }
+        if (victim->dirty) {
+            sd_error_t err = write_back(victim);
+            if (err != SD_OK) {
+                return err;
+            }
+        }
+        set_pinned(victim, false);
+        victim->valid = false;
+        g_cache.stats.evictions++;
+    }
+    *slot = victim;
+    return SD_OK;
+}
+
+static void install(cache_entry_t *entry, uint32_t lba, bool pin) {
+    entry->lba = lba;
+    entry->valid = true;
+    entry->dirty = false;
+    entry->readahead = false;
+    entry->last_used = ++g_cache.use_clock;
+    set_pinned(entry, pin);
+}
+
+/*
+ * Read up to BLOCK_CACHE_READAHEAD sectors from lba, stopping at a cached
+ * one, with a single multi-block read
+ */
+static void read_ahead(uint32_t lba) {
+    static uint8_t buffer[BLOCK_CACHE_READAHEAD * SECTOR_SIZE];
+    uint32_t count = 0;
+    while (count < BLOCK_CACHE_READAHEAD && !find(lba + count)) {
+        count++;
+    }
+    if (count == 0 || sd_read_blocks(lba, count, buffer) != SD_OK) {
+        return;
+    }
+    g_cache.stats.sd_reads += count;
+    for (uint32_t i = 0; i < count; i++) {
+        cache_entry_t *entry;
+        if (take_slot(false, &entry) != SD_OK) {
+            return;
+        }
+        memcpy(entry->data, buffer + i * SECTOR_SIZE, SECTOR_SIZE);
+        install(entry, lba + i, false);
+        entry->readahead = true;
+        g_cache.stats.readahead++;
+    }
+}
+
+sd_error_t __wrap_sd_read_block(uint32_t block, uint8_t *buffer) {
+    g_cache.seq_run = (block == g_cache.last_read + 1) ? g_cache.seq_run + 1 : 0;
+    g_cache.last_read = block;
+    bool pin = is_metadata(block);
+
+    cache_entry_t *entry = find(block);
+    if (entry) {
+        g_cache.stats.hits++;
+        if (entry->readahead) {
+            entry->readahead = false;
+            g_cache.stats.readahead_hits++;
+        }
+        if (pin && !entry->pinned && g_cache.pinned_count < BLOCK_CACHE_PIN_MAX) {
+            set_pinned(entry, true);
+        }
+        entry->last_used = ++g_cache.use_clock;
+        memcpy(buffer, entry->data, SECTOR_SIZE);
+        return SD_OK;
+    }
+
+    g_cache.stats.misses++;
+    sd_error_t err = take_slot(pin, &entry);
+    if (err != SD_OK) {
+        return err;
+    }
+    err = __real_sd_read_block(block, entry->data);
+    if (err != SD_OK) {
+        return err;
+    }
+    g_cache.stats.sd_reads++;
+    install(entry, block, pin);
+    note_boot_sector(block, entry->data);
+    observe_fat(block, entry->data);
+    memcpy(buffer, entry->data, SECTOR_SIZE);
+
+    if (!pin && g_cache.seq_run >= BLOCK_CACHE_SEQ_TRIGGER) {
+        read_ahead(block + 1);
+    }
+    return SD_OK;
+}
+
+sd_error_t __wrap_sd_write_block(uint32_t block, const uint8_t *buffer) {
+    g_cache.stats.writes++;
+    if (block >= g_cache.fat_start && block < g_cache.fat_end) {
+        g_cache.volume.fat_writes++;
+    }
+    cache_entry_t *entry = find(block);
+    if (!entry) {
+        bool pin = is_metadata(block);
+        sd_error_t err = take_slot(pin, &entry);
+        if (err != SD_OK) {
+            return err;
+        }
+        install(entry, block, pin);
+    }
+    memcpy(entry->data, buffer, SECTOR_SIZE);
+    entry->dirty = true;
+    entry->readahead = false;
+    entry->last_used = ++g_cache.use_clock;
+    note_boot_sector(block, entry->data);
+    observe_fat(block, entry->data);
+    return SD_OK;
+}
+
+fat32_error_t __wrap_fat32_open(fat32_file_t *file, const char *path) {
+    g_cache.meta_depth++;
+    fat32_error_t err = __real_fat32_open(file, path);
+    g_cache.meta_depth--;
+    return err;
+}
+
+fat32_error_t __wrap_fat32_dir_read(fat32_file_t *dir, fat32_entry_t *entry) {
+    g_cache.meta_depth++;
+    fat32_error_t err = __real_fat32_dir_read(dir, entry);
+    g_cache.meta_depth--;
+    return err;
+}
+
+/* Flush after an operation that completes a change, keeping its error */
+static fat32_error_t flush_after(fat32_error_t err) {
+    if (!block_cache_flush() && err == FAT32_OK) {
+        err = FAT32_ERROR_WRITE_FAILED;
+    }
+    return err;
+}
+
+fat32_error_t __wrap_fat32_close(fat32_file_t *file) {
+    return flush_after(__real_fat32_close(file));
+}
+
+fat32_error_t __wrap_fat32_delete(const char *path) {
+    g_cache.meta_depth++;
+    fat32_error_t err = __real_fat32_delete(path);
+    g_cache.meta_depth--;
+    return flush_after(err);
+}
+
+fat32_error_t __wrap_fat32_rename(const char *old_path, const char *new_path) {
+    g_cache.meta_depth++;
+    fat32_error_t err = __real_fat32_rename(old_path, new_path);
+    g_cache.meta_depth--;
+    return flush_after(err);
+}
+
+/* Dirty sectors are written in LBA order */
+bool block_cache_flush(void) {
+    bool wrote = false;
+    for (;;) {
+        cache_entry_t *next = NULL;
+        for (int i = 0; i < BLOCK_CACHE_SECTORS; i++) {
+            cache_entry_t *entry = &g_cache.entries[i];
+            if (entry->valid && entry->dirty && (!next || entry->lba < next->lba)) {
+                next = entry;
+            }
+        }
+        if (!next) {
+            break;
+        }
+        if (write_back(next) != SD_OK) {
+            return false;
+        }
+        wrote = true;
+    }
+    if (wrote) {
+        g_cache.stats.flushes++;
+    }
+    return true;
+}
+
+void block_cache_invalidate(void) {
+    block_cache_flush();
+    for (int i = 0; i < BLOCK_CACHE_SECTORS; i++) {
+        g_cache.entries[i].valid = false;
+        g_cache.entries[i].dirty = false;
+        g_cache.entries[i].pinned = false;
+    }
+    g_cache.pinned_count = 0;
+    g_cache.fat_start = 0;
+    g_cache.fat_end = 0;
+    g_cache.seq_run = 0;
+    uint32_t generation = g_cache.volume.generation;
+    memset(&g_cache.volume, 0, sizeof(g_cache.volume));
+    g_cache.volume.generation = generation + 1;
+}
+
+bool block_cache_peek(uint32_t block, uint8_t *buffer) {
+    cache_entry_t *entry = find(block);
+    if (entry) {
+        memcpy(buffer, entry->data, SECTOR_SIZE);
+        return true;
+    }
+    if (__real_sd_read_block(block, buffer) != SD_OK) {
+        return false;
+    }
+    g_cache.stats.sd_reads++;
+    return true;
+}
+
+void block_cache_discard(uint32_t block, uint32_t count) {
+    for (int i = 0; i < BLOCK_CACHE_SECTORS; i++) {
+        cache_entry_t *entry = &g_cache.entries[i];
+        if (entry->valid && entry->lba >= block && entry->lba - block < count) {
+            set_pinned(entry, false);
+            entry->valid = false;
+            entry->dirty = false;
+        }
+    }
+}
+
+const block_cache_volume_t *block_cache_volume(void) {
+    return &g_cache.volume;
+}
+
+void block_cache_set_fat_observer(block_cache_fat_observer_t observer) {
+    g_cache.fat_observer = observer;
+}
+
+const block_cache_stats_t *block_cache_stats(void) {
+    return &g_cache.stats;
+}
@@ -0,0 +1,101 @@
+#ifndef PICOCALC_BLOCK_CACHE_H
+#define PICOCALC_BLOCK_CACHE_H
+
+#include <stdbool.h>
+#include <stdint.h>
+
+/**
+ * @file picocalc_block_cache.h
+ * @brief LRU cache of SD card sectors beneath the FAT32 driver
+ *
+ * The FAT32 driver's sd_read_block()/sd_write_block() calls are routed
+ * through this cache with the linker's --wrap (see CMakeLists.txt), so the
+ * driver itself is unchanged. FAT sectors (found from the boot sector) and
+ * directory sectors (read during fat32_open, fat32_dir_read, fat32_delete
+ * and fat32_rename) are pinned: they are only evicted by each other, never
+ * by file data. Misses that continue a sequential run read
+ * BLOCK_CACHE_READAHEAD sectors at once, with one multi-block command.
+ *
+ * Writes are write-back: dirty sectors go to the card when evicted, when a
+ * file or directory is closed (fat32_close), after fat32_delete and
+ * fat32_rename, before a remount (block_cache_invalidate()), or on
+ * block_cache_flush().
+ */
+
+#define BLOCK_CACHE_SECTORS 32       /* 16KB of sector buffers */
+#define BLOCK_CACHE_PIN_MAX 16       /* At most this many FAT/directory sectors */
+#define BLOCK_CACHE_READAHEAD 4      /* Sectors read on a sequential miss */
+#define BLOCK_CACHE_SEQ_TRIGGER 2    /* Sequential reads in a row before reading ahead */
+
+typedef struct {
+    uint32_t hits;
+    uint32_t misses;
+    uint32_t readahead;          /* Sectors read ahead of a request */
+    uint32_t readahead_hits;     /* Of those, requested later */
+    uint32_t sd_reads;           /* Sectors read from the card */
+    uint32_t sd_writes;          /* Sectors written to the card */
+    uint32_t writes;             /* Sector writes by the FAT32 driver */
+    uint32_t evictions;
+    uint32_t flushes;
+} block_cache_stats_t;
+
+/* Geometry of the mounted FAT32 volume, from its boot sector */
+typedef struct {
+    uint32_t generation;         /* Changes whenever a volume is (re)detected */
+    uint32_t fat_start;          /* First sector of the first FAT, 0 if unknown */
+    uint32_t fat_sectors;        /* Sectors per FAT */
+    uint8_t num_fats;
+    uint8_t sectors_per_cluster;
+    uint32_t data_start;         /* Sector of cluster 2 */
+    uint32_t clusters;           /* Data clusters on the volume */
+    uint32_t fat_writes;         /* FAT sector writes so far, to spot changed chains */
+} block_cache_volume_t;
+
+/*
+ * Called with every sector of the first FAT that is read from the card or
+ * written by anyone, with its index in the FAT
+ */
+typedef void (*block_cache_fat_observer_t)(uint32_t index, const uint8_t *data);
+
+/**
+ * Write all dirty sectors to the card
+ *
+ * @return false if a write failed (the sector stays dirty)
+ */
+bool block_cache_flush(void);
+
+/**
+ * Flush, then forget every cached sector (card removed or remounted)
+ */
+void block_cache_invalidate(void);
+
+/**
+ * Read a sector, from the cache if it holds it, without caching it
+ * Used for scans that would otherwise evict everything else.
+ *
+ * @return false if the card read failed
+ */
+bool block_cache_peek(uint32_t block, uint8_t *buffer);
+
+/**
+ * Forget cached copies of count sectors from block, without writing them
+ * Called after writing those sectors to the card directly.
+ */
+void block_cache_discard(uint32_t block, uint32_t count);
+
+/**
+ * Get the geometry of the mounted volume
+ */
+const block_cache_volume_t *block_cache_volume(void);
+
+/**
+ * Register the function told about FAT sector contents (NULL to remove)
+ */
+void block_cache_set_fat_observer(block_cache_fat_observer_t observer);
+
+/**
+ * Get the cache counters
+ */
+const block_cache_stats_t *block_cache_stats(void);
+
+#endif /* PICOCALC_BLOCK_CACHE_H */
@@ -1,31 +1,194 @@
 /**
  * @file picocalc_debug_log.c
- * @brief Thread-safe debug logging system
- * 
- * Provides a circular buffer for debug messages that can be accessed
- * via the diagnostic server. Thread-safe for use from both cores.
+ * @brief Per-core debug log rings
+ *
+ * A ring is written only by its own core. head and tail count bytes since
+ * boot: head is the end of the newest record and is published with a
+ * release store once the record is in place; tail is the start of the
+ * oldest record and is moved past the records about to be overwritten
+ * before any of their bytes change. A reader on either core copies a
+ * record and then re-reads tail: if tail has moved past the record, the
+ * copy may be torn and is discarded. Writers therefore never wait, and a
+ * reader only loses the records that were overwritten under it.
+ *
+ * On a core, interrupts are disabled while a message is formatted and
+ * copied, so a handler cannot interleave with the code it interrupted.
  */
 
 #include "picocalc_debug_log.h"
 #include "pico/stdlib.h"
-#include "pico/mutex.h"
+#include "hardware/sync.h"
 #include <string.h>
 #include <stdarg.h>
 #include <stdio.h>
 
-#define DEBUG_LOG_SIZE 8192  /* 8KB circular buffer */
+/* Record header, followed in the ring by len bytes of text */
+typedef struct {
+    uint64_t time_us;
+    uint32_t seq;                /* Per core, from 0 */
+    uint16_t len;                /* Text bytes, newline included */
+    uint16_t core;
+} debug_record_t;
+
+/* A record assembled before it is copied into the ring */
+typedef struct {
+    debug_record_t header;
+    char text[DEBUG_LOG_MAX_LINE];
+} debug_line_t;
+
+typedef struct {
+    uint8_t data[DEBUG_LOG_RING_SIZE];
+    uint32_t head;               /* End of the newest record, writer only */
+    uint32_t tail;               /* Start of the oldest record, writer only */
+    uint32_t seq;                /* Next sequence number */
+    uint32_t cleared;            /* Records before this are hidden from readers */
+    debug_line_t line;           /* Formatting space for this core */
+} debug_ring_t;
+
+/* Position in one ring during a read */
+typedef struct {
+    const debug_ring_t *ring;
+    uint32_t pos;                /* Record under the cursor */
+    uint32_t end;                /* head when the read started */
+    debug_record_t header;       /* Header at pos, if valid */
+    bool valid;
+} debug_cursor_t;
 
 static struct {
-    char buffer[DEBUG_LOG_SIZE];
-    uint32_t write_pos;
-    uint32_t total_bytes;
-    mutex_t mutex;
+    debug_ring_t rings[DEBUG_LOG_CORES];
     bool initialized;
 } g_debug_log;
 
+/* Copy into the ring at pos, in at most two pieces */
+static void ring_write(debug_ring_t *ring, uint32_t pos, const void *src, uint32_t n) {
+    uint32_t offset = pos & (DEBUG_LOG_RING_SIZE - 1);
+    uint32_t first = DEBUG_LOG_RING_SIZE - offset;
+    if (first > n) {
+        first = n;
+    }
+    memcpy(ring->data + offset, src, first);
+    if (n > first) {
+        memcpy(ring->data, (const uint8_t *)src + first, n - first);
+    }
+}
+
+/* Copy out of the ring at pos, in at most two pieces */
+static void ring_read(const debug_ring_t *ring, uint32_t pos, void *dst, uint32_t n) {
+    uint32_t offset = pos & (DEBUG_LOG_RING_SIZE - 1);
+    uint32_t first = DEBUG_LOG_RING_SIZE - offset;
+    if (first > n) {
+        first = n;
+    }
+    memcpy(dst, ring->data + offset, first);
+    if (n > first) {
+        memcpy((uint8_t *)dst + first, ring->data, n - first);
+    }
+}
+
+static void ring_append(debug_ring_t *ring, const debug_line_t *line) {
+    uint32_t size = sizeof(debug_record_t) + line->header.len;
+    uint32_t head = ring->head;
+    uint32_t tail = ring->tail;
+
+    if (head + size - tail > DEBUG_LOG_RING_SIZE) {
+        while (head + size - tail > DEBUG_LOG_RING_SIZE) {
+            debug_record_t oldest;
+            ring_read(ring, tail, &oldest, sizeof(oldest));
+            tail += sizeof(oldest) + oldest.len;
+        }
+        __atomic_store_n(&ring->tail, tail, __ATOMIC_RELEASE);
+        /* The new tail must be visible before the old bytes change */
+        __atomic_thread_fence(__ATOMIC_SEQ_CST);
+    }
+    ring_write(ring, head, line, size);
+    __atomic_store_n(&ring->head, head + size, __ATOMIC_RELEASE);
+}
+
+/* True if the writer has moved tail past pos since the caller copied from it */
+static bool overwritten(const debug_ring_t *ring, uint32_t pos) {
+    __atomic_thread_fence(__ATOMIC_ACQUIRE);
+    uint32_t tail = __atomic_load_n(&ring->tail, __ATOMIC_ACQUIRE);
+    return (int32_t)(tail - pos) > 0;
+}
+
+/* Read the header at the cursor, skipping ahead if the writer overtook it */
+static void cursor_load(debug_cursor_t *cursor) {
+    cursor->valid = false;
+    for (;;) {
+        uint32_t tail = __atomic_load_n(&cursor->ring->tail, __ATOMIC_ACQUIRE);
+        if ((int32_t)(tail - cursor->pos) > 0) {
+            cursor->pos = tail;
+        }
+        if ((int32_t)(cursor->end - cursor->pos) <= 0) {
+            return;
+        }
+        ring_read(cursor->ring, cursor->pos, &cursor->header, sizeof(cursor->header));
+        if (!overwritten(cursor->ring, cursor->pos)) {
+            break;
+        }
+    }
+    cursor->valid = true;
+}
+
+static uint32_t format_prefix(const debug_record_t *header, char *prefix, uint32_t size) {
+    uint64_t ms = header->time_us / 1000;
+    int len = snprintf(prefix, size, "[%5lu.%03lu c%u] ", (unsigned long)(ms / 1000),
+                       (unsigned long)(ms % 1000), (unsigned)header->core);
+    return len < 0 ? 0 : (uint32_t)len >= size ? size - 1 : (uint32_t)len;
+}
+
+/*
+ * Walk every ring up to end in timestamp order. Without out, return the
+ * bytes the lines would take. With out, leave out whole lines from the
+ * oldest until skip bytes are passed, then copy the rest into out.
+ */
+static uint32_t merge_rings(const uint32_t *end, char *out, uint32_t size, uint32_t skip) {
+    debug_cursor_t cursors[DEBUG_LOG_CORES];
+    for (int i = 0; i < DEBUG_LOG_CORES; i++) {
+        cursors[i].ring = &g_debug_log.rings[i];
+        cursors[i].pos = g_debug_log.rings[i].cleared;
+        cursors[i].end = end[i];
+        cursor_load(&cursors[i]);
+    }
+
+    uint32_t len = 0;
+    for (;;) {
+        debug_cursor_t *next = NULL;
+        for (int i = 0; i < DEBUG_LOG_CORES; i++) {
+            if (cursors[i].valid && (!next || cursors[i].header.time_us < next->header.time_us)) {
+                next = &cursors[i];
+            }
+        }
+        if (!next) {
+            break;
+        }
+
+        char prefix[32];
+        uint32_t prefix_len = format_prefix(&next->header, prefix, sizeof(prefix));
+        uint32_t line_len = prefix_len + next->header.len;
+        if (skip > 0) {
+            skip = skip > line_len ? skip - line_len : 0;
+        } else if (!out) {
+            len += line_len;
+        } else {
+            if (len + line_len > size) {
+                break;
+            }
+            memcpy(out + len, prefix, prefix_len);
+            ring_read(next->ring, next->pos + sizeof(debug_record_t), out + len + prefix_len,
+                      next->header.len);
+            if (!overwritten(next->ring, next->pos)) {
+                len += line_len;
+            }
+        }
+        next->pos += sizeof(debug_record_t) + next->header.len;
+        cursor_load(next);
+    }
+    return len;
+}
+
 void debug_log_init(void) {
     memset(&g_debug_log, 0, sizeof(g_debug_log));
-    mutex_init(&g_debug_log.mutex);
     g_debug_log.initialized = true;
 }
 
@@ -33,85 +196,69 @@ void debug_log(const char *format, ...) {
     if (!g_debug_log.initialized) {
         return;
     }
-    
-    char temp[256];
+
+    uint32_t irq = save_and_disable_interrupts();
+    unsigned core = get_core_num();
+    debug_ring_t *ring = &g_debug_log.rings[core];
+    debug_line_t *line = &ring->line;
+
     va_list args;
     va_start(args, format);
-    int len = vsnprintf(temp, sizeof(temp), format, args);
+    int len = vsnprintf(line->text, sizeof(line->text), format, args);
     va_end(args);
-    
-    if (len <= 0) {
-        return;
+
+    if (len > 0) {
+        if (len > (int)sizeof(line->text) - 1) {
+            len = sizeof(line->text) - 1;
+        }
+        /* The text is not NUL-terminated in the ring, so the last byte is free */
+        if (line->text[len - 1] != '\n') {
+            line->text[len++] = '\n';
+        }
+        line->header.time_us = time_us_64();
+        line->header.seq = ring->seq;
+        line->header.len = (uint16_t)len;
+        line->header.core = (uint16_t)core;
+        ring_append(ring, line);
+        __atomic_store_n(&ring->seq, ring->seq + 1, __ATOMIC_RELAXED);
     }
-    
-    /* Ensure newline at end */
-    if (len < (int)sizeof(temp) - 1 && temp[len-1] != '\n') {
-        temp[len++] = '\n';
-        temp[len] = '\0';
-    }
-    
-    /* BLOCKING write to circular buffer with timeout
-     * Use a timeout to avoid deadlock but ensure messages get written */
-    absolute_time_t timeout = make_timeout_time_ms(100);  /* 100ms timeout */
-    if (!mutex_enter_block_until(&g_debug_log.mutex, &timeout)) {
-        return;  /* Timeout - skip this log entry */
-    }
-    
-    for (int i = 0; i < len; i++) {
-        g_debug_log.buffer[g_debug_log.write_pos] = temp[i];
-        g_debug_log.write_pos = (g_debug_log.write_pos + 1) % DEBUG_LOG_SIZE;
-        g_debug_log.total_bytes++;
-    }
-    
-    mutex_exit(&g_debug_log.mutex);
+    restore_interrupts(irq);
 }
 
-const char* debug_log_get(uint32_t *out_len) {
+uint32_t debug_log_read(char *out, uint32_t size) {
+    if (size == 0) {
+        return 0;
+    }
+    out[0] = '\0';
     if (!g_debug_log.initialized) {
-        *out_len = 0;
-        return "";
-    }
-    
-    /* NON-BLOCKING read - safe for interrupt context */
-    if (!mutex_try_enter(&g_debug_log.mutex, NULL)) {
-        *out_len = 0;
-        return "";  /* Mutex busy, return empty */
-    }
-    
-    /* If buffer hasn't wrapped, return from start */
-    if (g_debug_log.total_bytes < DEBUG_LOG_SIZE) {
-        *out_len = g_debug_log.write_pos;
-        mutex_exit(&g_debug_log.mutex);
-        return g_debug_log.buffer;
-    }
-    
-    /* Buffer has wrapped - need to return in chronological order
-     * Most recent data is at write_pos, oldest is at write_pos+1
-     * We need to rearrange: [write_pos..end] + [0..write_pos-1]
-     * Use a static buffer to avoid dynamic allocation */
-    static char ordered_buffer[DEBUG_LOG_SIZE];
-    uint32_t first_part_len = DEBUG_LOG_SIZE - g_debug_log.write_pos;
-    uint32_t second_part_len = g_debug_log.write_pos;
-    
-    /* Copy oldest messages first (from write_pos to end) */
-    memcpy(ordered_buffer, g_debug_log.buffer + g_debug_log.write_pos, first_part_len);
-    /* Then copy newer messages (from start to write_pos) */
-    memcpy(ordered_buffer + first_part_len, g_debug_log.buffer, second_part_len);
-    
-    *out_len = DEBUG_LOG_SIZE;
-    mutex_exit(&g_debug_log.mutex);
-    
-    return ordered_buffer;
+        return 0;
+    }
+
+    uint32_t end[DEBUG_LOG_CORES];
+    for (int i = 0; i < DEBUG_LOG_CORES; i++) {
+        end[i] = __atomic_load_n(&g_debug_log.rings[i].head, __ATOMIC_ACQUIRE);
+    }
+    /* The first pass sizes the lines so the copy can start at the oldest that fits */
+    uint32_t total = merge_rings(end, NULL, 0, 0);
+    uint32_t skip = total > size - 1 ? total - (size - 1) : 0;
+    uint32_t len = merge_rings(end, out, size - 1, skip);
+    out[len] = '\0';
+    return len;
+}
+
+uint32_t debug_log_count(void) {
+    uint32_t count = 0;
+    for (int i = 0; i < DEBUG_LOG_CORES; i++) {
+        count += __atomic_load_n(&g_debug_log.rings[i].seq, __ATOMIC_RELAXED);
+    }
+    return count;
 }
 
 void debug_log_clear(void) {
     if (!g_debug_log.initialized) {
         return;
     }
-    
-    mutex_enter_blocking(&g_debug_log.mutex);
-    memset(g_debug_log.buffer, 0, DEBUG_LOG_SIZE);
-    g_debug_log.write_pos = 0;
-    g_debug_log.total_bytes = 0;
-    mutex_exit(&g_debug_log.mutex);
-}
\ No newline at end of file
+    for (int i = 0; i < DEBUG_LOG_CORES; i++) {
+        g_debug_log.rings[i].cleared = __atomic_load_n(&g_debug_log.rings[i].head, __ATOMIC_ACQUIRE);
+    }
+}
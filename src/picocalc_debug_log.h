@@ -4,6 +4,20 @@
 #include <stdint.h>
 #include <stdbool.h>
 
+/**
+ * @file picocalc_debug_log.h
+ * @brief Debug log kept in RAM for the diagnostic server
+ *
+ * Each core appends to its own ring, so writers never wait for each other
+ * or for a reader. When a ring is full the oldest records are overwritten.
+ * Records carry a per-core sequence number and a timestamp; the reader
+ * merges both rings in timestamp order.
+ */
+
+#define DEBUG_LOG_CORES 2
+#define DEBUG_LOG_RING_SIZE 4096     /* Per core, power of two */
+#define DEBUG_LOG_MAX_LINE 192       /* Longer messages are cut */
+
 /**
  * @brief Initialize debug log buffer
  */
@@ -11,29 +25,40 @@ void debug_log_init(void);
 
 /**
  * @brief Add a message to the debug log
- * 
- * Thread-safe function to add debug messages to a circular buffer.
- * Messages are timestamped and can be retrieved via diagnostic server.
- * 
+ *
+ * Safe from either core and from interrupt handlers. Never blocks: the
+ * message is formatted and copied into the calling core's ring with that
+ * core's interrupts briefly disabled. A newline is added if missing.
+ *
  * @param format Printf-style format string
  * @param ... Variable arguments
  */
 void debug_log(const char *format, ...);
 
 /**
- * @brief Get debug log contents
- * 
- * Returns pointer to the debug log buffer for reading.
- * Buffer contains newline-separated log entries.
- * 
- * @param out_len Pointer to receive buffer length
- * @return Pointer to log buffer (read-only)
+ * @brief Copy the most recent messages out, oldest first
+ *
+ * Each line is prefixed with its time since boot and core, e.g.
+ * "[   12.345 c0] ". Only whole lines are copied: as many of the newest as
+ * fit. Writers may keep logging meanwhile; records they overwrite during
+ * the copy are left out.
+ *
+ * @param out Buffer to fill, NUL-terminated
+ * @param size Size of out
+ * @return Bytes written, excluding the NUL
+ */
+uint32_t debug_log_read(char *out, uint32_t size);
+
+/**
+ * @brief Number of messages logged since boot, including overwritten ones
  */
-const char* debug_log_get(uint32_t *out_len);
+uint32_t debug_log_count(void);
 
 /**
  * @brief Clear debug log
+ *
+ * Hides the messages logged so far from debug_log_read().
  */
 void debug_log_clear(void);
 
-#endif /* PICOCALC_DEBUG_LOG_H */
\ No newline at end of file
+#endif /* PICOCALC_DEBUG_LOG_H */
@@ -20,7 +20,6 @@
 #include <stdio.h>
 
 #define DIAG_PORT 1901
-#define DIAG_MAX_CLIENTS 2
 
 typedef struct {
     struct tcp_pcb *pcb;
@@ -226,31 +225,16 @@ static void diag_send_status(diag_client_t *client) {
         wifi_ip,
         wifi_ip);
     
-    /* Add debug log - limit to 2KB to avoid buffer overflow */
-    uint32_t log_len = 0;
-    const char *log = debug_log_get(&log_len);
+    /* Add debug log - the newest lines that fit in 2KB */
+    uint32_t max_log = 2048;
+    if (len + max_log > sizeof(response) - 100) {  /* Leave 100 bytes margin */
+        max_log = sizeof(response) - len - 100;
+    }
+    int header_len = snprintf(response + len, sizeof(response) - len,
+        "## Debug Log (%lu messages since boot)\n", (unsigned long)debug_log_count());
+    uint32_t log_len = debug_log_read(response + len + header_len, max_log);
     if (log_len > 0) {
-        len += snprintf(response + len, sizeof(response) - len,
-            "## Debug Log (last %lu bytes)\n", (unsigned long)log_len);
-        
-        /* Copy log data, ensuring we don't overflow response buffer */
-        uint32_t copy_len = log_len;
-        uint32_t max_log = 2048;  /* Limit debug log to 2KB in response */
-        if (copy_len > max_log) {
-            copy_len = max_log;
-        }
-        if (len + copy_len > sizeof(response) - 100) {  /* Leave 100 bytes margin */
-            copy_len = sizeof(response) - len - 100;
-        }
-        if (copy_len > 0) {
-            memcpy(response + len, log, copy_len);
-            len += copy_len;
-            if (log_len > copy_len) {
-                len += snprintf(response + len, sizeof(response) - len,
-                    "\n... (truncated, %lu more bytes)\n", (unsigned long)(log_len - copy_len));
-            }
-        }
-        response[len] = '\0';
+        len += header_len + log_len;
     } else {
         len += snprintf(response + len, sizeof(response) - len,
             "## Debug Log\n(empty - no debug messages yet)\n\n");
@@ -3,6 +3,8 @@
 
 #include <stdbool.h>
 
+#define DIAG_MAX_CLIENTS 2
+
 /**
  * @brief Initialize diagnostic HTTP server
  * 
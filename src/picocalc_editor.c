@@ -5,6 +5,10 @@
 #include "picocalc_keyboard.h"
 #include "keyboard.h"
 #include "fat32.h"
+#include "picocalc_fs_handler.h"
+#include "picocalc_fat_alloc.h"
+#include "picocalc_fat_io.h"
+#include "picocalc_fs_worker.h"
 #include "pico/stdlib.h"
 #include "pico/cyw43_arch.h"
 #include "debug.h"
@@ -396,6 +400,18 @@ static char *editorTemplate[] = {
     NULL
 };
 
+/*
+ * Run the worker until no job that conflicts with opening or saving the
+ * file is in flight (an upload of it, a Lua read), keeping the network up
+ */
+static void editorWaitForWorker(const char *filename, bool saving) {
+    while (fs_worker_path_busy(filename, saving)) {
+        cyw43_arch_poll();
+        fs_worker_run(FS_WORKER_IDLE_US);
+        fs_worker_poll();
+    }
+}
+
 /* Load file into editor */
 static int editorOpen(char *filename) {
     fat32_file_t file;
@@ -406,6 +422,7 @@ static int editorOpen(char *filename) {
     E.filename = strdup(filename);
     
     DEBUG_PRINTF("[Editor] Attempting to open file: '%s'\n", filename);
+    editorWaitForWorker(filename, false);
     result = fat32_open(&file, filename);
     if (result != FAT32_OK) {
         /* No such file - check if it's a .lua file */
@@ -447,7 +464,7 @@ static int editorOpen(char *filename) {
     
     /* Read entire file */
     size_t bytes_read = 0;
-    result = fat32_read(&file, buffer, file_size, &bytes_read);
+    result = fat_io_read(&file, buffer, file_size, &bytes_read);
     if (result != FAT32_OK) {
         DEBUG_PRINTF("[Editor] Error reading file: %s\n", fat32_error_string(result));
         free(buffer);
@@ -568,6 +585,7 @@ static int ensure_parent_directories(const char *filepath) {
                            current_path, fat32_error_string(result));
                 return 1;
             }
+            fs_notify_change(current_path, FS_CHANGE_CREATED);
         } else {
             /* Some other error occurred */
             DEBUG_PRINTF("[Editor] Error checking directory %s: %s\n",
@@ -587,6 +605,7 @@ static int editorSave(char *filename) {
     char *buf = editorRowsToString(&len);
     fat32_file_t file;
     fat32_error_t result;
+    fs_change_t change = FS_CHANGE_MODIFIED;
 
     /* Ensure parent directories exist */
     if (ensure_parent_directories(filename) != 0) {
@@ -596,16 +615,19 @@ static int editorSave(char *filename) {
     }
 
     /* Try to open existing file */
+    editorWaitForWorker(filename, true);
     result = fat32_open(&file, filename);
     if (result != FAT32_OK) {
         /* File doesn't exist, create it */
         DEBUG_PRINTF("[Editor] Creating new file: %s\n", filename);
+        change = FS_CHANGE_CREATED;
         result = fat32_create(&file, filename);
         if (result != FAT32_OK) {
             DEBUG_PRINTF("[Editor] Error creating file: %s\n", fat32_error_string(result));
             free(buf);
             return 1;
         }
+        fat_alloc_reserve(&file, len);
     }
     
     /* Seek to beginning to overwrite */
@@ -618,12 +640,14 @@ static int editorSave(char *filename) {
         DEBUG_PRINTF("[Editor] Error writing file: %s\n", fat32_error_string(result));
         free(buf);
         fat32_close(&file);
+        fs_notify_change(filename, change);  /* Partly written */
         return 1;
     }
     
     DEBUG_PRINTF("[Editor] Wrote %zu bytes to file\n", bytes_written);
     fat32_close(&file);
     free(buf);
+    fs_notify_change(filename, change);
     E.dirty = 0;
     return 0;
 }
@@ -836,7 +860,12 @@ static int editorEvents(void) {
     editorDraw();
     
     /* Small delay - reduced to allow network operations to proceed */
-    sleep_ms(10); /* Faster polling for better network responsiveness */
+    if (fs_worker_busy()) {
+        fs_worker_run(FS_WORKER_IDLE_US);
+    } else {
+        sleep_ms(10); /* Faster polling for better network responsiveness */
+    }
+    fs_worker_poll();
     
     return 0;
 }
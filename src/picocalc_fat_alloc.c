@@ -0,0 +1,223 @@
+/**
+ * @file picocalc_fat_alloc.c
+ * @brief Contiguous cluster preallocation for writes of known size
+ *
+ * FAT and directory sectors are read and written with sd_read_block and
+ * sd_write_block, which the linker routes through the block cache, so the
+ * driver sees the new chain at once and it reaches the card when the file
+ * is closed. The bitmap scan uses block_cache_peek() to stay out of the
+ * cache.
+ */
+
+#include "picocalc_fat_alloc.h"
+#include "picocalc_block_cache.h"
+#include "sdcard.h"
+#include "debug.h"
+#include <string.h>
+
+#define SECTOR_SIZE 512
+#define ENTRIES_PER_SECTOR (SECTOR_SIZE / 4)
+#define FAT_ENTRY_MASK 0x0FFFFFFF
+#define FAT_END_OF_CHAIN 0x0FFFFFFF
+
+/* Directory entry fields holding the first cluster */
+#define DIR_CLUSTER_HIGH 20
+#define DIR_CLUSTER_LOW 26
+
+static struct {
+    bool observing;
+    uint32_t generation;         /* Volume the bitmaps describe */
+    uint32_t tracked;            /* FAT sectors covered by the bitmaps */
+    uint8_t known[FAT_ALLOC_MAX_FAT_SECTORS / 8];
+    uint8_t free[FAT_ALLOC_MAX_FAT_SECTORS / 8];
+    fat_alloc_stats_t stats;
+} g_alloc;
+
+static uint32_t get_u32(const uint8_t *p) {
+    return (uint32_t)p[0] | (uint32_t)p[1] << 8 | (uint32_t)p[2] << 16 | (uint32_t)p[3] << 24;
+}
+
+static void put_u32(uint8_t *p, uint32_t value) {
+    p[0] = value;
+    p[1] = value >> 8;
+    p[2] = value >> 16;
+    p[3] = value >> 24;
+}
+
+static void put_u16(uint8_t *p, uint16_t value) {
+    p[0] = value;
+    p[1] = value >> 8;
+}
+
+static bool bit_get(const uint8_t *bits, uint32_t index) {
+    return (bits[index / 8] >> (index % 8)) & 1;
+}
+
+static void bit_set(uint8_t *bits, uint32_t index, bool value) {
+    if (value) {
+        bits[index / 8] |= 1 << (index % 8);
+    } else {
+        bits[index / 8] &= ~(1 << (index % 8));
+    }
+}
+
+/* Start over whenever a different volume has been mounted */
+static void sync_volume(void) {
+    const block_cache_volume_t *volume = block_cache_volume();
+    if (volume->generation == g_alloc.generation) {
+        return;
+    }
+    g_alloc.generation = volume->generation;
+    g_alloc.tracked = volume->fat_sectors < FAT_ALLOC_MAX_FAT_SECTORS ?
+                      volume->fat_sectors : FAT_ALLOC_MAX_FAT_SECTORS;
+    memset(g_alloc.known, 0, sizeof(g_alloc.known));
+    memset(g_alloc.free, 0, sizeof(g_alloc.free));
+}
+
+/* True if every cluster FAT sector index describes exists and is free */
+static bool sector_all_free(uint32_t index, const uint8_t *data) {
+    uint32_t clusters = block_cache_volume()->clusters;
+    for (uint32_t i = 0; i < ENTRIES_PER_SECTOR; i++) {
+        uint32_t cluster = index * ENTRIES_PER_SECTOR + i;
+        if (cluster < 2 || cluster >= clusters + 2 ||
+            (get_u32(data + i * 4) & FAT_ENTRY_MASK) != 0) {
+            return false;
+        }
+    }
+    return true;
+}
+
+static void note_sector(uint32_t index, const uint8_t *data) {
+    if (index < g_alloc.tracked) {
+        bit_set(g_alloc.known, index, true);
+        bit_set(g_alloc.free, index, sector_all_free(index, data));
+    }
+}
+
+static void observe_fat(uint32_t index, const uint8_t *data) {
+    sync_volume();
+    note_sector(index, data);
+}
+
+/* First run of free FAT sectors long enough for count clusters */
+static bool find_run(uint32_t count, uint32_t *first_sector) {
+    const block_cache_volume_t *volume = block_cache_volume();
+    uint32_t needed = (count + ENTRIES_PER_SECTOR - 1) / ENTRIES_PER_SECTOR;
+    uint32_t run = 0;
+    uint8_t data[SECTOR_SIZE];
+
+    for (uint32_t i = 0; i < g_alloc.tracked; i++) {
+        if (!bit_get(g_alloc.known, i)) {
+            if (!block_cache_peek(volume->fat_start + i, data)) {
+                return false;
+            }
+            note_sector(i, data);
+            g_alloc.stats.sectors_scanned++;
+        }
+        run = bit_get(g_alloc.free, i) ? run + 1 : 0;
+        if (run == needed) {
+            *first_sector = i + 1 - needed;
+            return true;
+        }
+    }
+    return false;
+}
+
+/*
+ * Chain clusters first..first+count-1 in every FAT. Sectors are written
+ * last to first, so a failure part way only leaves unreferenced clusters.
+ */
+static fat32_error_t link_run(uint32_t first, uint32_t count) {
+    const block_cache_volume_t *volume = block_cache_volume();
+    uint32_t last = first + count - 1;
+    uint8_t data[SECTOR_SIZE];
+
+    for (uint32_t sector = last / ENTRIES_PER_SECTOR + 1; sector-- > first / ENTRIES_PER_SECTOR;) {
+        if (sd_read_block(volume->fat_start + sector, data) != SD_OK) {
+            return FAT32_ERROR_READ_FAILED;
+        }
+        for (uint32_t i = 0; i < ENTRIES_PER_SECTOR; i++) {
+            uint32_t cluster = sector * ENTRIES_PER_SECTOR + i;
+            if (cluster < first || cluster > last) {
+                continue;
+            }
+            uint32_t old = get_u32(data + i * 4);
+            uint32_t next = (cluster == last) ? FAT_END_OF_CHAIN : cluster + 1;
+            put_u32(data + i * 4, (old & ~FAT_ENTRY_MASK) | next);
+        }
+        for (uint32_t fat = 0; fat < volume->num_fats; fat++) {
+            if (sd_write_block(volume->fat_start + fat * volume->fat_sectors + sector, data) != SD_OK) {
+                return FAT32_ERROR_WRITE_FAILED;
+            }
+        }
+    }
+    return FAT32_OK;
+}
+
+/* Point the file's directory entry at its first cluster */
+static fat32_error_t set_first_cluster(const fat32_file_t *file, uint32_t cluster) {
+    uint8_t data[SECTOR_SIZE];
+    if (file->dir_entry_offset + 32 > SECTOR_SIZE ||
+        sd_read_block(file->dir_entry_sector, data) != SD_OK) {
+        return FAT32_ERROR_READ_FAILED;
+    }
+    uint8_t *entry = data + file->dir_entry_offset;
+    put_u16(entry + DIR_CLUSTER_HIGH, cluster >> 16);
+    put_u16(entry + DIR_CLUSTER_LOW, cluster & 0xFFFF);
+    if (sd_write_block(file->dir_entry_sector, data) != SD_OK) {
+        return FAT32_ERROR_WRITE_FAILED;
+    }
+    return FAT32_OK;
+}
+
+fat32_error_t fat_alloc_reserve(fat32_file_t *file, uint32_t size) {
+    const block_cache_volume_t *volume = block_cache_volume();
+    if (!volume->fat_start || !volume->sectors_per_cluster) {
+        return FAT32_ERROR_NOT_MOUNTED;
+    }
+    if (!file || !file->is_open || file->start_cluster != 0 || file->file_size != 0) {
+        return FAT32_ERROR_INVALID_PARAMETER;
+    }
+
+    uint32_t cluster_bytes = volume->sectors_per_cluster * SECTOR_SIZE;
+    uint32_t count = (uint32_t)(((uint64_t)size + cluster_bytes - 1) / cluster_bytes);
+    if (count < FAT_ALLOC_MIN_CLUSTERS) {
+        return FAT32_OK;
+    }
+
+    if (!g_alloc.observing) {
+        block_cache_set_fat_observer(observe_fat);
+        g_alloc.observing = true;
+    }
+    sync_volume();
+
+    uint32_t first_sector;
+    if (!find_run(count, &first_sector)) {
+        g_alloc.stats.no_run++;
+        DEBUG_PRINTF("[FAT_ALLOC] No free run of %lu clusters\n", (unsigned long)count);
+        return FAT32_ERROR_DISK_FULL;
+    }
+
+    uint32_t first = first_sector * ENTRIES_PER_SECTOR;
+    fat32_error_t err = link_run(first, count);
+    if (err == FAT32_OK) {
+        err = set_first_cluster(file, first);
+    }
+    if (err != FAT32_OK) {
+        DEBUG_PRINTF("[FAT_ALLOC] Linking clusters %lu+%lu failed: %d\n",
+                     (unsigned long)first, (unsigned long)count, err);
+        return err;
+    }
+
+    file->start_cluster = first;
+    file->current_cluster = first;
+    g_alloc.stats.reserved++;
+    g_alloc.stats.clusters += count;
+    DEBUG_PRINTF("[FAT_ALLOC] Clusters %lu+%lu for %lu bytes\n",
+                 (unsigned long)first, (unsigned long)count, (unsigned long)size);
+    return FAT32_OK;
+}
+
+const fat_alloc_stats_t *fat_alloc_stats(void) {
+    return &g_alloc.stats;
+}
@@ -0,0 +1,53 @@
+#ifndef PICOCALC_FAT_ALLOC_H
+#define PICOCALC_FAT_ALLOC_H
+
+#include <stdbool.h>
+#include <stdint.h>
+#include "fat32.h"
+
+/**
+ * @file picocalc_fat_alloc.h
+ * @brief Contiguous cluster preallocation for writes of known size
+ *
+ * The FAT32 driver grows a file one cluster at a time from wherever the
+ * next free cluster is, so files written next to others end up
+ * interleaved. When the final size is known up front, fat_alloc_reserve()
+ * links a contiguous run of free clusters to a freshly created file; the
+ * driver's fat32_write then follows that chain instead of allocating.
+ *
+ * Free space is tracked with one bit per FAT sector (128 clusters), set
+ * when every cluster it describes is free. The bits are filled in lazily,
+ * scanning the FAT only as far as the first fitting run, and kept exact
+ * by observing every FAT sector the driver reads or writes through the
+ * block cache (see picocalc_block_cache.h).
+ */
+
+#define FAT_ALLOC_MIN_CLUSTERS 2          /* Smaller files cannot fragment */
+#define FAT_ALLOC_MAX_FAT_SECTORS 8192    /* Tracked FAT sectors: 1M clusters, 2KB of bitmaps */
+
+typedef struct {
+    uint32_t reserved;           /* Files given a contiguous run */
+    uint32_t clusters;           /* Clusters reserved for them */
+    uint32_t no_run;             /* Requests with no run long enough */
+    uint32_t sectors_scanned;    /* FAT sectors read to fill in the bitmap */
+} fat_alloc_stats_t;
+
+/**
+ * Give a newly created, still empty file a contiguous run of clusters
+ * for size bytes
+ *
+ * @param file File from fat32_create() that nothing was written to yet
+ * @param size Number of bytes about to be written
+ * @return FAT32_OK if the run was linked (or the file is too small to
+ *         need one), FAT32_ERROR_DISK_FULL if no free run is long enough,
+ *         another error if the file cannot take a run. In every case the
+ *         file can still be written normally.
+ */
+fat32_error_t fat_alloc_reserve(fat32_file_t *file, uint32_t size);
+
+/**
+ * Get the allocator counters
+ */
+const fat_alloc_stats_t *fat_alloc_stats(void);
+
+#endif /* PICOCALC_FAT_ALLOC_H */
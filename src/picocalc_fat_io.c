@@ -0,0 +1,333 @@
+/**
+ * @file picocalc_fat_io.c
+ * @brief Multi-block reads and writes for large sequential file I/O
+ *
+ * Chains are walked through sd_read_block (the block cache), one FAT
+ * sector at a time, and the last cluster reached in each of two files is
+ * remembered so a file read in chunks is not walked from its start on
+ * every call. The driver's view of the file (position, current cluster)
+ * is brought up to date with fat32_seek() after each direct transfer.
+ */
+
+#include "picocalc_fat_io.h"
+#include "picocalc_block_cache.h"
+#include "sdcard.h"
+#include "debug.h"
+#include <string.h>
+
+#define SECTOR_SIZE 512
+#define ENTRIES_PER_SECTOR (SECTOR_SIZE / 4)
+#define FAT_ENTRY_MASK 0x0FFFFFFF
+#define FAT_BAD_CLUSTER 0x0FFFFFF7
+
+/* Directory entry field holding the file size */
+#define DIR_FILE_SIZE 28
+
+/* Last cluster reached in a file, valid while no FAT sector has been written */
+typedef struct {
+    const fat32_file_t *file;
+    uint32_t start_cluster;
+    uint32_t index;              /* Position in the chain */
+    uint32_t cluster;
+    uint32_t last_used;
+} chain_cursor_t;
+
+/* One per file in use at once: a copy reads one file and writes another */
+#define CURSORS 2
+
+static struct {
+    chain_cursor_t cursors[CURSORS];
+    uint32_t use_clock;
+    uint32_t generation;
+    uint32_t fat_writes;
+
+    /* Copy of the FAT sector last walked through */
+    bool fat_valid;
+    uint32_t fat_lba;
+    uint8_t fat[SECTOR_SIZE];
+
+    fat_io_stats_t stats;
+} g_io;
+
+static uint32_t get_u32(const uint8_t *p) {
+    return (uint32_t)p[0] | (uint32_t)p[1] << 8 | (uint32_t)p[2] << 16 | (uint32_t)p[3] << 24;
+}
+
+static void put_u32(uint8_t *p, uint32_t value) {
+    p[0] = value;
+    p[1] = value >> 8;
+    p[2] = value >> 16;
+    p[3] = value >> 24;
+}
+
+/* True while nothing cached here can have changed on the card */
+static bool snapshot_current(void) {
+    const block_cache_volume_t *volume = block_cache_volume();
+    return g_io.generation == volume->generation && g_io.fat_writes == volume->fat_writes;
+}
+
+static void snapshot_take(void) {
+    const block_cache_volume_t *volume = block_cache_volume();
+    if (!snapshot_current()) {
+        g_io.generation = volume->generation;
+        g_io.fat_writes = volume->fat_writes;
+        g_io.fat_valid = false;
+        memset(g_io.cursors, 0, sizeof(g_io.cursors));
+    }
+}
+
+/* Next cluster in the chain, or 0 at its end */
+static bool next_cluster(uint32_t cluster, uint32_t *next) {
+    const block_cache_volume_t *volume = block_cache_volume();
+    uint32_t lba = volume->fat_start + cluster / ENTRIES_PER_SECTOR;
+    if (!g_io.fat_valid || g_io.fat_lba != lba) {
+        if (sd_read_block(lba, g_io.fat) != SD_OK) {
+            g_io.fat_valid = false;
+            return false;
+        }
+        g_io.fat_valid = true;
+        g_io.fat_lba = lba;
+    }
+    uint32_t value = get_u32(g_io.fat + (cluster % ENTRIES_PER_SECTOR) * 4) & FAT_ENTRY_MASK;
+    *next = (value >= 2 && value < FAT_BAD_CLUSTER) ? value : 0;
+    return true;
+}
+
+/* The file's cursor, else the least recently used one */
+static chain_cursor_t *cursor_for(const fat32_file_t *file) {
+    chain_cursor_t *oldest = &g_io.cursors[0];
+    for (int i = 0; i < CURSORS; i++) {
+        chain_cursor_t *cursor = &g_io.cursors[i];
+        if (cursor->file == file && cursor->start_cluster == file->start_cluster) {
+            return cursor;
+        }
+        if (cursor->last_used < oldest->last_used) {
+            oldest = cursor;
+        }
+    }
+    return oldest;
+}
+
+static void remember(const fat32_file_t *file, uint32_t index, uint32_t cluster) {
+    chain_cursor_t *cursor = cursor_for(file);
+    cursor->file = file;
+    cursor->start_cluster = file->start_cluster;
+    cursor->index = index;
+    cursor->cluster = cluster;
+    cursor->last_used = ++g_io.use_clock;
+}
+
+/* Cluster number index of the file's chain, 0 past its end */
+static bool cluster_at(const fat32_file_t *file, uint32_t index, uint32_t *cluster) {
+    uint32_t i = 0;
+    uint32_t current = file->start_cluster;
+    chain_cursor_t *cursor = cursor_for(file);
+    if (cursor->file == file && cursor->start_cluster == file->start_cluster &&
+        cursor->index <= index) {
+        i = cursor->index;
+        current = cursor->cluster;
+    }
+    while (i < index && current) {
+        if (!next_cluster(current, &current)) {
+            return false;
+        }
+        i++;
+    }
+    if (current) {
+        remember(file, index, current);
+    }
+    *cluster = current;
+    return true;
+}
+
+/*
+ * Move whole sectors between buffer and the file's clusters from its
+ * position, one multi-block command per run of consecutive clusters.
+ * Stops early at the end of the chain; returns the sectors moved.
+ */
+static uint32_t transfer(fat32_file_t *file, uint8_t *buffer, uint32_t sectors, bool write,
+                         fat32_error_t *err) {
+    const block_cache_volume_t *volume = block_cache_volume();
+    uint32_t per_cluster = volume->sectors_per_cluster;
+    uint32_t sector = file->position / SECTOR_SIZE;
+    uint32_t done = 0;
+    *err = FAT32_OK;
+
+    while (done < sectors) {
+        uint32_t index = (sector + done) / per_cluster;
+        uint32_t cluster;
+        if (!cluster_at(file, index, &cluster)) {
+            *err = FAT32_ERROR_READ_FAILED;
+            break;
+        }
+        if (!cluster) {
+            break;
+        }
+
+        /* Extend the run while the chain stays consecutive */
+        uint32_t offset = (sector + done) % per_cluster;
+        uint32_t lba = volume->data_start + (cluster - 2) * per_cluster + offset;
+        uint32_t count = per_cluster - offset;
+        uint32_t next;
+        while (done + count < sectors && next_cluster(cluster, &next) && next == cluster + 1) {
+            cluster = next;
+            count += per_cluster;
+            remember(file, ++index, cluster);
+        }
+        if (count > sectors - done) {
+            count = sectors - done;
+        }
+
+        uint8_t *data = buffer + (size_t)done * SECTOR_SIZE;
+        if (write) {
+            if (sd_write_blocks(lba, count, data) != SD_OK) {
+                *err = FAT32_ERROR_WRITE_FAILED;
+                break;
+            }
+            block_cache_discard(lba, count);
+            g_io.stats.direct_writes++;
+            g_io.stats.sectors_written += count;
+        } else {
+            if (sd_read_blocks(lba, count, data) != SD_OK) {
+                *err = FAT32_ERROR_READ_FAILED;
+                break;
+            }
+            g_io.stats.direct_reads++;
+            g_io.stats.sectors_read += count;
+        }
+        done += count;
+    }
+    return done;
+}
+
+/* True if the file can use the direct path at all */
+static bool direct_capable(const fat32_file_t *file) {
+    const block_cache_volume_t *volume = block_cache_volume();
+    return file && file->is_open && volume->fat_start && volume->sectors_per_cluster &&
+           file->start_cluster && !(file->attributes & FAT32_ATTR_DIRECTORY);
+}
+
+fat32_error_t fat_io_read(fat32_file_t *file, void *buffer, size_t size, size_t *bytes_read) {
+    if (!direct_capable(file)) {
+        return fat32_read(file, buffer, size, bytes_read);
+    }
+
+    uint32_t available = file->file_size > file->position ? file->file_size - file->position : 0;
+    if (size > available) {
+        size = available;
+    }
+    size_t head = (SECTOR_SIZE - file->position % SECTOR_SIZE) % SECTOR_SIZE;
+    if (head > size) {
+        head = size;
+    }
+    if (size - head < FAT_IO_MIN_SECTORS * SECTOR_SIZE) {
+        return fat32_read(file, buffer, size, bytes_read);
+    }
+
+    uint8_t *out = buffer;
+    size_t total = 0;
+    size_t got = 0;
+    fat32_error_t err = FAT32_OK;
+    if (head) {
+        err = fat32_read(file, out, head, &got);
+        total += got;
+        if (err != FAT32_OK || got < head) {
+            *bytes_read = total;
+            return err;
+        }
+    }
+
+    /* Dirty sectors must reach the card before it is read directly */
+    if (!block_cache_flush()) {
+        *bytes_read = total;
+        return FAT32_ERROR_WRITE_FAILED;
+    }
+    snapshot_take();
+    uint32_t moved = transfer(file, out + total, (size - total) / SECTOR_SIZE, false, &err);
+    if (moved) {
+        total += (size_t)moved * SECTOR_SIZE;
+        fat32_error_t seek_err = fat32_seek(file, file->position + moved * SECTOR_SIZE);
+        if (err == FAT32_OK) {
+            err = seek_err;
+        }
+    }
+
+    if (err == FAT32_OK && total < size) {
+        err = fat32_read(file, out + total, size - total, &got);
+        total += got;
+    }
+    *bytes_read = total;
+    return err;
+}
+
+/* Record a size grown by direct writes in the directory entry */
+static fat32_error_t write_size(const fat32_file_t *file) {
+    uint8_t data[SECTOR_SIZE];
+    if (file->dir_entry_offset + 32 > SECTOR_SIZE ||
+        sd_read_block(file->dir_entry_sector, data) != SD_OK) {
+        return FAT32_ERROR_READ_FAILED;
+    }
+    put_u32(data + file->dir_entry_offset + DIR_FILE_SIZE, file->file_size);
+    if (sd_write_block(file->dir_entry_sector, data) != SD_OK) {
+        return FAT32_ERROR_WRITE_FAILED;
+    }
+    return FAT32_OK;
+}
+
+fat32_error_t fat_io_write(fat32_file_t *file, const void *buffer, size_t size,
+                           size_t *bytes_written) {
+    if (!direct_capable(file)) {
+        return fat32_write(file, buffer, size, bytes_written);
+    }
+
+    size_t head = (SECTOR_SIZE - file->position % SECTOR_SIZE) % SECTOR_SIZE;
+    if (head > size) {
+        head = size;
+    }
+    if (size - head < FAT_IO_MIN_SECTORS * SECTOR_SIZE) {
+        return fat32_write(file, buffer, size, bytes_written);
+    }
+
+    const uint8_t *in = buffer;
+    size_t total = 0;
+    size_t put = 0;
+    fat32_error_t err = FAT32_OK;
+    if (head) {
+        err = fat32_write(file, in, head, &put);
+        total += put;
+        if (err != FAT32_OK || put < head) {
+            *bytes_written = total;
+            return err;
+        }
+    }
+
+    /* The buffer is only read: transfer() takes a mutable pointer for both directions */
+    snapshot_take();
+    uint32_t moved = transfer(file, (uint8_t *)in + total, (size - total) / SECTOR_SIZE, true, &err);
+    if (moved) {
+        total += (size_t)moved * SECTOR_SIZE;
+        uint32_t position = file->position + moved * SECTOR_SIZE;
+        bool grown = position > file->file_size;
+        if (grown) {
+            file->file_size = position;
+        }
+        fat32_error_t step_err = fat32_seek(file, position);
+        if (step_err == FAT32_OK && grown) {
+            step_err = write_size(file);
+        }
+        if (err == FAT32_OK) {
+            err = step_err;
+        }
+    }
+
+    if (err == FAT32_OK && total < size) {
+        err = fat32_write(file, in + total, size - total, &put);
+        total += put;
+    }
+    *bytes_written = total;
+    return err;
+}
+
+const fat_io_stats_t *fat_io_stats(void) {
+    return &g_io.stats;
+}
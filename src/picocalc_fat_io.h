@@ -0,0 +1,48 @@
+#ifndef PICOCALC_FAT_IO_H
+#define PICOCALC_FAT_IO_H
+
+#include <stdbool.h>
+#include <stddef.h>
+#include <stdint.h>
+#include "fat32.h"
+
+/**
+ * @file picocalc_fat_io.h
+ * @brief Multi-block reads and writes for large sequential file I/O
+ *
+ * Drop-in replacements for fat32_read() and fat32_write(). The whole
+ * sectors of a request are mapped to runs of consecutive clusters and
+ * moved with one multi-block SD command per run (CMD18/CMD25), straight
+ * into or out of the caller's buffer. The partial sectors at either end,
+ * and small requests, go through the driver and the block cache as
+ * before. Writes only take the direct path over clusters the file
+ * already owns, such as a run from fat_alloc_reserve(); beyond them the
+ * driver grows the file.
+ */
+
+#define FAT_IO_MIN_SECTORS 2         /* Smaller requests go through the driver */
+
+typedef struct {
+    uint32_t direct_reads;       /* Multi-block read commands */
+    uint32_t direct_writes;      /* Multi-block write commands */
+    uint32_t sectors_read;       /* Sectors moved by them */
+    uint32_t sectors_written;
+} fat_io_stats_t;
+
+/**
+ * Read from the file's current position, like fat32_read()
+ */
+fat32_error_t fat_io_read(fat32_file_t *file, void *buffer, size_t size, size_t *bytes_read);
+
+/**
+ * Write at the file's current position, like fat32_write()
+ */
+fat32_error_t fat_io_write(fat32_file_t *file, const void *buffer, size_t size,
+                           size_t *bytes_written);
+
+/**
+ * Get the direct transfer counters
+ */
+const fat_io_stats_t *fat_io_stats(void);
+
+#endif /* PICOCALC_FAT_IO_H */
@@ -1,8 +1,12 @@
 #include "picocalc_file_server.h"
 #include "picocalc_fs_handler.h"
+#include "picocalc_fs_worker.h"
 #include "picocalc_repl_handler.h"
 #include "picocalc_debug_log.h"
 #include "picocalc_framebuffer.h"
+#include "picocalc_reload.h"
+#include "picocalc_block_cache.h"
+#include "picocalc_fat_io.h"
 #include "debug.h"
 #include "pico/stdlib.h"
 #include "pico/cyw43_arch.h"
@@ -12,6 +16,8 @@
 #include <string.h>
 #include <stdlib.h>
 #include <stdio.h>
+#include <malloc.h>
+#include <strings.h>
 
 /* Client connection state */
 typedef struct {
@@ -28,8 +34,44 @@ typedef struct {
     uint32_t data_received;
     uint8_t *data_buffer;
     char data_path[256];
+    
+    /* Protocol v2 framing state */
+    uint8_t protocol;            /* 1 = text lines, 2 = binary frames */
+    uint8_t frame_header[FILE_SERVER_FRAME_HEADER_SIZE];
+    uint8_t frame_header_len;
+    uint8_t frame_opcode;
+    uint8_t frame_flags;
+    uint16_t frame_tag;
+    uint32_t frame_len;
+    uint32_t frame_received;
+    char *frame_payload;         /* NUL-terminated command payload */
+    bool frame_discard;          /* Oversized payload, skip its bytes */
+    uint16_t reply_tag;          /* Tag echoed in response frames */
+    
+    /* WATCH subscription */
+    bool watching;
+    char watch_path[256];
+    
+    /* Reply sent later from the Lua loop (REPL, RELOAD) */
+    bool reply_deferred;
+    uint16_t deferred_tag;
+    uint32_t repl_dropped;       /* REPL output the send buffer could not take */
+    
+    /* Live reload */
+    bool auto_reload;            /* PUT of the running program reloads it */
+    bool reload_after_put;       /* The deferred reply is PUT's */
+    uint64_t put_start_us;
+    
+    /* Upload being written by the filesystem worker */
+    fs_job_t *put_job;
 } file_client_t;
 
+/* A change waiting to be reported to the watching client */
+typedef struct {
+    char path[FS_MAX_PATH];
+    fs_change_t change;
+} watch_event_t;
+
 /* Server state */
 static struct {
     struct tcp_pcb *listen_pcb;
@@ -37,6 +79,13 @@ static struct {
     bool running;
     uint32_t total_requests;
     uint32_t total_connections;
+    uint64_t recv_us;      /* Time spent in file_recv */
+    uint64_t handler_us;   /* Part of recv_us spent in command handlers */
+    uint32_t ls_heap_peak; /* Peak heap growth during the last LS */
+    bool in_handler;       /* A command handler is writing a reply */
+    watch_event_t watch_events[FILE_SERVER_WATCH_MAX_EVENTS];
+    uint8_t watch_count;
+    bool watch_overflow;
 } g_server;
 
 /* Forward declarations */
@@ -44,6 +93,7 @@ static err_t file_accept(void *arg, struct tcp_pcb *newpcb, err_t err);
 static err_t file_recv(void *arg, struct tcp_pcb *tpcb, struct pbuf *p, err_t err);
 static void file_err(void *arg, err_t err);
 static void file_close_client(file_client_t *client);
+static err_t file_poll(void *arg, struct tcp_pcb *tpcb);
 
 /* Command handlers */
 static void cmd_hello(file_client_t *client, const char *args);
@@ -57,32 +107,58 @@ static void cmd_rm(file_client_t *client, const char *args);
 static void cmd_stat(file_client_t *client, const char *args);
 static void cmd_repl(file_client_t *client, const char *args);
 static void cmd_sshot(file_client_t *client, const char *args);
+static void cmd_stats(file_client_t *client, const char *args);
 static void cmd_ping(file_client_t *client, const char *args);
 static void cmd_quit(file_client_t *client, const char *args);
+static void cmd_rmtree(file_client_t *client, const char *args);
+static void cmd_mkdirs(file_client_t *client, const char *args);
+static void cmd_copy(file_client_t *client, const char *args);
+static void cmd_move(file_client_t *client, const char *args);
+static void cmd_du(file_client_t *client, const char *args);
+static void cmd_find(file_client_t *client, const char *args);
+static void cmd_grep(file_client_t *client, const char *args);
+static void cmd_watch(file_client_t *client, const char *args);
+static void cmd_unwatch(file_client_t *client, const char *args);
+static void cmd_reload(file_client_t *client, const char *args);
+static void cmd_autoreload(file_client_t *client, const char *args);
+static void send_done(file_client_t *client, const char *status, const char *text);
 
 /* Command dispatch table */
 typedef void (*cmd_handler_t)(file_client_t *client, const char *args);
 
 typedef struct {
     const char *name;
+    uint8_t opcode;
     cmd_handler_t handler;
 } command_entry_t;
 
 static const command_entry_t commands[] = {
-    {"HELLO", cmd_hello},
-    {"PWD", cmd_pwd},
-    {"CD", cmd_cd},
-    {"LS", cmd_ls},
-    {"CAT", cmd_cat},
-    {"PUT", cmd_put},
-    {"MKDIR", cmd_mkdir},
-    {"RM", cmd_rm},
-    {"STAT", cmd_stat},
-    {"REPL", cmd_repl},
-    {"SSHOT", cmd_sshot},
-    {"PING", cmd_ping},
-    {"QUIT", cmd_quit},
-    {NULL, NULL}
+    {"HELLO", FILE_OP_HELLO, cmd_hello},
+    {"PWD", FILE_OP_PWD, cmd_pwd},
+    {"CD", FILE_OP_CD, cmd_cd},
+    {"LS", FILE_OP_LS, cmd_ls},
+    {"CAT", FILE_OP_CAT, cmd_cat},
+    {"PUT", FILE_OP_PUT, cmd_put},
+    {"MKDIR", FILE_OP_MKDIR, cmd_mkdir},
+    {"RM", FILE_OP_RM, cmd_rm},
+    {"STAT", FILE_OP_STAT, cmd_stat},
+    {"REPL", FILE_OP_REPL, cmd_repl},
+    {"SSHOT", FILE_OP_SSHOT, cmd_sshot},
+    {"STATS", FILE_OP_STATS, cmd_stats},
+    {"PING", FILE_OP_PING, cmd_ping},
+    {"QUIT", FILE_OP_QUIT, cmd_quit},
+    {"RMTREE", FILE_OP_RMTREE, cmd_rmtree},
+    {"MKDIRS", FILE_OP_MKDIRS, cmd_mkdirs},
+    {"COPY", FILE_OP_COPY, cmd_copy},
+    {"MOVE", FILE_OP_MOVE, cmd_move},
+    {"DU", FILE_OP_DU, cmd_du},
+    {"FIND", FILE_OP_FIND, cmd_find},
+    {"GREP", FILE_OP_GREP, cmd_grep},
+    {"WATCH", FILE_OP_WATCH, cmd_watch},
+    {"UNWATCH", FILE_OP_UNWATCH, cmd_unwatch},
+    {"RELOAD", FILE_OP_RELOAD, cmd_reload},
+    {"AUTORELOAD", FILE_OP_AUTORELOAD, cmd_autoreload},
+    {NULL, 0, NULL}
 };
 
 /* Helper functions */
@@ -96,95 +172,176 @@ static void send_response(file_client_t *client, const char *response) {
     }
 }
 
+/*
+ * True if a reply of len bytes in the given number of tcp_write() calls
+ * can be queued whole. Replies made of several writes are only started
+ * when this holds, so a full send queue drops the reply rather than
+ * leaving a header without its payload.
+ */
+static bool reply_fits(file_client_t *client, size_t len, int writes) {
+    return client->pcb && tcp_sndbuf(client->pcb) >= len &&
+           tcp_sndqueuelen(client->pcb) + writes + len / TCP_MSS <= TCP_SND_QUEUELEN;
+}
+
+/* Queue a v2 frame header; payload bytes are written by the caller */
+static void send_frame_header(file_client_t *client, uint8_t opcode, uint8_t flags, uint32_t len) {
+    if (!client || !client->pcb) return;
+    
+    uint8_t header[FILE_SERVER_FRAME_HEADER_SIZE];
+    header[0] = opcode;
+    header[1] = flags;
+    header[2] = client->reply_tag & 0xFF;
+    header[3] = client->reply_tag >> 8;
+    header[4] = len & 0xFF;
+    header[5] = (len >> 8) & 0xFF;
+    header[6] = (len >> 16) & 0xFF;
+    header[7] = (len >> 24) & 0xFF;
+    tcp_write(client->pcb, header, sizeof(header),
+              TCP_WRITE_FLAG_COPY | (len ? TCP_WRITE_FLAG_MORE : 0));
+}
+
+/* Send a complete short frame (OK/ERR/READY) */
+static void send_frame(file_client_t *client, uint8_t opcode, const char *payload) {
+    if (!client || !client->pcb) return;
+    
+    size_t len = payload ? strlen(payload) : 0;
+    if (!reply_fits(client, FILE_SERVER_FRAME_HEADER_SIZE + len, 2)) {
+        DEBUG_PRINTF("[FILE_SERVER] Send queue full, frame %d dropped\n", opcode);
+        return;
+    }
+    send_frame_header(client, opcode, 0, len);
+    if (len > 0) {
+        tcp_write(client->pcb, payload, len, TCP_WRITE_FLAG_COPY);
+    }
+    tcp_output(client->pcb);
+}
+
+/* Send "<prefix><data>\n" without formatting into an intermediate buffer */
+static void send_text_reply(file_client_t *client, const char *prefix, const char *data) {
+    if (!client || !client->pcb) return;
+    
+    size_t len = strlen(prefix) + (data ? strlen(data) + 1 : 0) + 1;
+    if (!reply_fits(client, len, 4)) {
+        DEBUG_PRINTF("[FILE_SERVER] Send queue full, %s reply dropped\n", prefix);
+        return;
+    }
+    tcp_write(client->pcb, prefix, strlen(prefix), TCP_WRITE_FLAG_COPY | TCP_WRITE_FLAG_MORE);
+    if (data && data[0]) {
+        tcp_write(client->pcb, " ", 1, TCP_WRITE_FLAG_COPY | TCP_WRITE_FLAG_MORE);
+        tcp_write(client->pcb, data, strlen(data), TCP_WRITE_FLAG_COPY | TCP_WRITE_FLAG_MORE);
+    }
+    tcp_write(client->pcb, "\n", 1, TCP_WRITE_FLAG_COPY);
+    tcp_output(client->pcb);
+}
+
 static void send_ok(file_client_t *client, const char *data) {
-    char response[FILE_SERVER_RESPONSE_BUFFER_SIZE];
-    if (data) {
-        snprintf(response, sizeof(response), "+OK %s\n", data);
+    if (client->protocol == 2) {
+        send_frame(client, FILE_OP_OK, data);
     } else {
-        snprintf(response, sizeof(response), "+OK\n");
+        send_text_reply(client, "+OK", data);
     }
-    send_response(client, response);
 }
 
 static void send_error(file_client_t *client, const char *message) {
-    char response[FILE_SERVER_RESPONSE_BUFFER_SIZE];
-    snprintf(response, sizeof(response), "-ERR %s\n", message ? message : "Unknown error");
-    send_response(client, response);
+    if (!message) message = "Unknown error";
+    if (client->protocol == 2) {
+        send_frame(client, FILE_OP_ERR, message);
+    } else {
+        send_text_reply(client, "-ERR", message);
+    }
 }
 
-static void send_data(file_client_t *client, const uint8_t *data, size_t len) {
-    if (!client || !client->pcb || !data) {
-        DEBUG_PRINTF("[FILE_SERVER] send_data: Invalid parameters\n");
-        return;
+static void send_ready(file_client_t *client) {
+    if (client->protocol == 2) {
+        send_frame(client, FILE_OP_READY, NULL);
+    } else {
+        send_response(client, "+READY\n");
     }
-    
-    DEBUG_PRINTF("[FILE_SERVER] send_data: Starting, len=%lu bytes\n", (unsigned long)len);
-    
-    /* Send +DATA header */
-    char header[64];
-    snprintf(header, sizeof(header), "+DATA %zu\n", len);
-    DEBUG_PRINTF("[FILE_SERVER] send_data: Sending header: %s", header);
-    send_response(client, header);
-    
-    /* Send binary data in chunks, respecting TCP send buffer */
-    size_t sent = 0;
-    while (sent < len) {
-        /* Check available space in TCP send buffer */
-        u16_t available = tcp_sndbuf(client->pcb);
-        if (available == 0) {
-            /* Send buffer full - flush and wait */
-            DEBUG_PRINTF("[FILE_SERVER] send_data: Buffer full, flushing...\n");
-            tcp_output(client->pcb);
-            
-            /* Poll network stack to process ACKs */
-            for (int i = 0; i < 100 && tcp_sndbuf(client->pcb) == 0; i++) {
-                cyw43_arch_poll();
-                sleep_ms(1);
-            }
-            
-            available = tcp_sndbuf(client->pcb);
-            if (available == 0) {
-                DEBUG_PRINTF("[FILE_SERVER] send_data: Timeout waiting for buffer space\n");
-                break;
-            }
-        }
-        
-        /* Send chunk that fits in available buffer space */
-        size_t chunk = len - sent;
-        if (chunk > available) {
-            chunk = available;
-        }
-        if (chunk > 1024) {  /* Limit chunk size to 1KB for better flow control */
-            chunk = 1024;
-        }
-        
-        DEBUG_PRINTF("[FILE_SERVER] send_data: Sending chunk at offset %lu, size %lu (available=%u)\n",
-                    (unsigned long)sent, (unsigned long)chunk, available);
-        
-        err_t err = tcp_write(client->pcb, data + sent, chunk, TCP_WRITE_FLAG_COPY);
-        if (err != ERR_OK) {
-            DEBUG_PRINTF("[FILE_SERVER] send_data: tcp_write error %d at offset %lu\n",
-                        err, (unsigned long)sent);
-            break;
-        }
-        
-        sent += chunk;
-        DEBUG_PRINTF("[FILE_SERVER] send_data: Chunk queued, total sent=%lu\n", (unsigned long)sent);
-        
-        /* Flush every 4KB to avoid buffer buildup */
-        if (sent % 4096 == 0) {
-            tcp_output(client->pcb);
+}
+
+/* Wait until the TCP send queue can take len bytes in up to three writes */
+static bool wait_sndbuf(file_client_t *client, size_t len) {
+    for (int i = 0; client->pcb && !reply_fits(client, len, 3); i++) {
+        if (i >= 1000) {
+            DEBUG_PRINTF("[FILE_SERVER] Timeout waiting for send buffer space\n");
+            return false;
         }
+        tcp_output(client->pcb);
+        cyw43_arch_poll();
+        sleep_ms(1);
+    }
+    return client->pcb != NULL;
+}
+
+/* Stream one result record (+LINE in v1, a LINE frame in v2) */
+static bool send_line(file_client_t *client, const char *text, size_t len) {
+    if (!wait_sndbuf(client, len + FILE_SERVER_FRAME_HEADER_SIZE)) {
+        return false;
     }
     
-    /* Final flush */
+    if (client->protocol == 2) {
+        send_frame_header(client, FILE_OP_LINE, 0, len + 1);
+    } else {
+        tcp_write(client->pcb, "+LINE ", 6, TCP_WRITE_FLAG_COPY | TCP_WRITE_FLAG_MORE);
+    }
+    tcp_write(client->pcb, text, len, TCP_WRITE_FLAG_COPY | TCP_WRITE_FLAG_MORE);
+    tcp_write(client->pcb, "\n", 1, TCP_WRITE_FLAG_COPY);
     tcp_output(client->pcb);
-    DEBUG_PRINTF("[FILE_SERVER] send_data: All data sent, sending +END marker\n");
-    
-    /* Send +END marker */
-    send_response(client, "+END\n");
+    return true;
+}
+
+/* Bytes currently allocated from the heap */
+static uint32_t heap_used(void) {
+    struct mallinfo mi = mallinfo();
+    return (uint32_t)mi.uordblks;
+}
+
+/* Announce a data payload of known length (+DATA line or DATA frame) */
+static void send_data_begin(file_client_t *client, size_t len) {
+    if (client->protocol == 2) {
+        send_frame_header(client, FILE_OP_DATA, 0, len);
+    } else {
+        char header[32];
+        snprintf(header, sizeof(header), "+DATA %lu\n", (unsigned long)len);
+        send_response(client, header);
+    }
+}
+
+/* Terminate a data payload (v2 frames are delimited by their length) */
+static void send_data_end(file_client_t *client) {
+    if (client->protocol == 2) {
+        tcp_output(client->pcb);
+    } else {
+        send_response(client, "+END\n");
+    }
+}
+
+/* Run a command handler, accounting its time separately from parsing */
+static void dispatch_command(file_client_t *client, const command_entry_t *entry, const char *args) {
+    client->request_count++;
+    g_server.total_requests++;
+    
+    /*
+     * A client has one deferred reply (deferred_tag, put_job). A pipelined
+     * PUT, REPL or RELOAD that could defer while it is taken, or while a
+     * PUT upload is still arriving, is refused rather than overwriting it
+     */
+    bool defers = entry->opcode == FILE_OP_PUT || entry->opcode == FILE_OP_REPL ||
+                  entry->opcode == FILE_OP_RELOAD;
+    if (defers && (client->reply_deferred || client->receiving_data)) {
+        if (entry->opcode == FILE_OP_REPL) {
+            send_done(client, "error", "Busy");
+        } else {
+            send_error(client, "Busy");
+        }
+        return;
+    }
     
-    DEBUG_PRINTF("[FILE_SERVER] send_data: Complete\n");
+    uint64_t start = time_us_64();
+    g_server.in_handler = true;
+    entry->handler(client, args);
+    g_server.in_handler = false;
+    g_server.handler_us += time_us_64() - start;
 }
 
 /* Parse and execute command */
@@ -212,9 +369,7 @@ static void parse_command(file_client_t *client, const char *line) {
     /* Find and execute command */
     for (int i = 0; commands[i].name; i++) {
         if (strcmp(cmd, commands[i].name) == 0) {
-            client->request_count++;
-            g_server.total_requests++;
-            commands[i].handler(client, args);
+            dispatch_command(client, &commands[i], args);
             return;
         }
     }
@@ -225,7 +380,14 @@ static void parse_command(file_client_t *client, const char *line) {
 
 /* Command implementations */
 static void cmd_hello(file_client_t *client, const char *args) {
-    send_ok(client, FILE_SERVER_PROTOCOL_VERSION);
+    /* Reply in the current framing, then switch if v2 was requested */
+    if (args && strcmp(args, FILE_SERVER_PROTOCOL_VERSION_V2) == 0) {
+        send_ok(client, FILE_SERVER_PROTOCOL_VERSION_V2);
+        client->protocol = 2;
+        return;
+    }
+    send_ok(client, client->protocol == 2 ? FILE_SERVER_PROTOCOL_VERSION_V2
+                                          : FILE_SERVER_PROTOCOL_VERSION);
 }
 
 static void cmd_pwd(file_client_t *client, const char *args) {
@@ -248,14 +410,12 @@ static void cmd_cd(file_client_t *client, const char *args) {
         return;
     }
     
-    /* Verify it's a directory by trying to open it */
-    char *json;
-    err = fs_list_dir(new_path, &json);
+    /* Verify it's a directory */
+    err = fs_is_dir(new_path);
     if (err != FS_OK) {
         send_error(client, fs_error_string(err));
         return;
     }
-    free(json);
     
     /* Update current directory */
     strncpy(client->current_dir, new_path, sizeof(client->current_dir) - 1);
@@ -263,11 +423,90 @@ static void cmd_cd(file_client_t *client, const char *args) {
     send_ok(client, NULL);
 }
 
+/* Streaming LS state: entries are staged in a small buffer and flushed to TCP */
+typedef struct {
+    file_client_t *client;
+    char buffer[FILE_SERVER_LIST_CHUNK_SIZE];
+    size_t used;
+    uint32_t entries;
+    size_t total_len;     /* Bytes produced, for the v1 +DATA length pass */
+    bool measure_only;
+    bool started;         /* A header is out: errors can no longer be reported */
+    bool error;
+    uint32_t heap_base;
+    uint32_t heap_peak;
+} ls_stream_t;
+
+/* mallinfo() walks the heap, so it is sampled per flush rather than per entry */
+static void ls_sample_heap(ls_stream_t *ctx) {
+    uint32_t used = heap_used();
+    if (used > ctx->heap_peak) {
+        ctx->heap_peak = used;
+    }
+}
+
+static void ls_flush(ls_stream_t *ctx, bool more) {
+    file_client_t *client = ctx->client;
+    if (ctx->error || (ctx->used == 0 && more)) return;
+    ls_sample_heap(ctx);
+    
+    if (!wait_sndbuf(client, ctx->used + FILE_SERVER_FRAME_HEADER_SIZE)) {
+        ctx->error = true;
+        return;
+    }
+    
+    if (client->protocol == 2) {
+        send_frame_header(client, FILE_OP_DATA, more ? FILE_FLAG_MORE : 0, ctx->used);
+        ctx->started = true;
+    }
+    if (ctx->used > 0 &&
+        tcp_write(client->pcb, ctx->buffer, ctx->used, TCP_WRITE_FLAG_COPY) != ERR_OK) {
+        ctx->error = true;
+        return;
+    }
+    tcp_output(client->pcb);
+    
+    ctx->used = 0;
+}
+
+static void ls_emit(ls_stream_t *ctx, const char *text, size_t len) {
+    ctx->total_len += len;
+    if (ctx->measure_only) {
+        return;
+    }
+    if (ctx->used + len > sizeof(ctx->buffer)) {
+        ls_flush(ctx, true);
+    }
+    memcpy(ctx->buffer + ctx->used, text, len);
+    ctx->used += len;
+}
+
+static bool ls_entry_callback(const fs_entry_t *entry, void *user_data) {
+    ls_stream_t *ctx = (ls_stream_t *)user_data;
+    
+    char entry_json[384];
+    size_t len = fs_entry_to_json(entry, entry_json, sizeof(entry_json));
+    if (ctx->entries > 0) {
+        ls_emit(ctx, ",", 1);
+    }
+    ls_emit(ctx, entry_json, len);
+    ctx->entries++;
+    return !ctx->error;
+}
+
 static void cmd_ls(file_client_t *client, const char *args) {
+    /* Parse: LS [path [offset count]] */
+    char path_arg[256] = "";
+    unsigned long offset = 0;
+    unsigned long count = 0;
+    if (args && args[0]) {
+        sscanf(args, "%255s %lu %lu", path_arg, &offset, &count);
+    }
+    
     /* Determine path */
     char path[256];
-    if (args && args[0]) {
-        fs_error_t err = fs_normalize_path(args, client->current_dir, path, sizeof(path));
+    if (path_arg[0]) {
+        fs_error_t err = fs_normalize_path(path_arg, client->current_dir, path, sizeof(path));
         if (err != FS_OK) {
             send_error(client, fs_error_string(err));
             return;
@@ -277,63 +516,63 @@ static void cmd_ls(file_client_t *client, const char *args) {
         path[sizeof(path) - 1] = '\0';
     }
     
-    /* List directory */
-    char *json;
-    fs_error_t err = fs_list_dir(path, &json);
-    if (err != FS_OK) {
-        send_error(client, fs_error_string(err));
+    ls_stream_t *ctx = calloc(1, sizeof(ls_stream_t));
+    if (!ctx) {
+        send_error(client, "Out of memory");
         return;
     }
-    
-    /* Send as data */
-    send_data(client, (uint8_t *)json, strlen(json));
-    free(json);
-}
-
-/* Context for chunked file reading */
-typedef struct {
-    file_client_t *client;
-    uint32_t total_size;
-    uint32_t bytes_sent;
-    bool header_sent;
-    bool error_occurred;
-} cat_chunk_context_t;
-
-/* Callback for chunked file reading */
-static bool cat_chunk_callback(const uint8_t *chunk, size_t size, void *user_data) {
-    cat_chunk_context_t *ctx = (cat_chunk_context_t *)user_data;
-    
-    /* Send header on first chunk */
-    if (!ctx->header_sent) {
-        /* If total_size is still 0, something went wrong - abort */
-        if (ctx->total_size == 0) {
-            ctx->error_occurred = true;
-            return false;
+    ctx->client = client;
+    ctx->heap_base = heap_used();
+    ctx->heap_peak = ctx->heap_base;
+    
+    /* v1 announces the length up front: size the listing in a first pass */
+    size_t announced = 0;
+    if (client->protocol != 2) {
+        ctx->measure_only = true;
+        fs_error_t err = fs_list_dir_stream(path, offset, count, ls_entry_callback, ctx);
+        if (err != FS_OK) {
+            send_error(client, fs_error_string(err));
+            free(ctx);
+            return;
         }
-        
-        char header[64];
-        snprintf(header, sizeof(header), "+DATA %lu\n", (unsigned long)ctx->total_size);
-        send_response(ctx->client, header);
-        ctx->header_sent = true;
-        ctx->bytes_sent = 0;  /* Reset counter after header */
-    }
-    
-    /* Send chunk */
-    if (ctx->client && ctx->client->pcb) {
-        err_t err = tcp_write(ctx->client->pcb, chunk, size, TCP_WRITE_FLAG_COPY);
-        if (err != ERR_OK) {
-            ctx->error_occurred = true;
-            return false;  /* Abort on error */
-        }
-        tcp_output(ctx->client->pcb);
-        ctx->bytes_sent += size;
+        ls_sample_heap(ctx);
+        announced = ctx->total_len + 2;  /* Plus brackets */
+        send_data_begin(client, announced);
+        ctx->started = true;
+        ctx->measure_only = false;
+        ctx->entries = 0;
+        ctx->total_len = 0;
+    }
+    
+    ls_emit(ctx, "[", 1);
+    fs_error_t err = fs_list_dir_stream(path, offset, count, ls_entry_callback, ctx);
+    if (err == FS_OK) {
+        ls_emit(ctx, "]", 1);
+        ls_flush(ctx, false);
+    }
+    
+    /*
+     * An error before any header is an ordinary error reply. After one, an
+     * ERR would land inside the announced payload (v1) or follow MORE
+     * frames under the same tag (v2), so the stream is ended by closing
+     * the connection. So is a v1 listing that came out a different length
+     * from the one the first pass measured.
+     */
+    bool complete = err == FS_OK && !ctx->error &&
+                    (client->protocol == 2 || ctx->total_len == announced);
+    if (complete) {
+        send_data_end(client);
+    } else if (!ctx->started) {
+        send_error(client, fs_error_string(err != FS_OK ? err : FS_ERR_IO));
     } else {
-        /* No client or PCB - connection lost */
-        ctx->error_occurred = true;
-        return false;
+        DEBUG_PRINTF("[FILE_SERVER] LS: listing failed after its header, closing\n");
+        file_close_client(client);
     }
     
-    return true;  /* Continue */
+    g_server.ls_heap_peak = ctx->heap_peak - ctx->heap_base;
+    DEBUG_PRINTF("[FILE_SERVER] LS: %lu entries, peak heap +%lu bytes\n",
+                (unsigned long)ctx->entries, (unsigned long)g_server.ls_heap_peak);
+    free(ctx);
 }
 
 static void cmd_cat(file_client_t *client, const char *args) {
@@ -355,6 +594,12 @@ static void cmd_cat(file_client_t *client, const char *args) {
     
     DEBUG_PRINTF("[FILE_SERVER] CAT: Normalized path='%s'\n", path);
     
+    /* Streamed below straight from the card, so check the worker here */
+    if (fs_worker_path_busy(path, false)) {
+        send_error(client, fs_error_string(FS_ERR_BUSY));
+        return;
+    }
+    
     /* Get file size first */
     size_t file_size = 0;
     err = fs_get_file_size(path, &file_size);
@@ -366,22 +611,21 @@ static void cmd_cat(file_client_t *client, const char *args) {
     
     DEBUG_PRINTF("[FILE_SERVER] CAT: File size=%lu bytes\n", (unsigned long)file_size);
     
-    /* Send +DATA header with size */
-    char header[64];
-    snprintf(header, sizeof(header), "+DATA %zu\n", file_size);
-    DEBUG_PRINTF("[FILE_SERVER] CAT: Sending header: %s", header);
-    send_response(client, header);
-    
-    /* Open file for streaming */
+    /* Open file for streaming; failures before the header still get an error reply */
     fat32_file_t file;
     fat32_error_t fat_err = fat32_open(&file, path);
     if (fat_err != FAT32_OK) {
         DEBUG_PRINTF("[FILE_SERVER] CAT: fat32_open failed: %d\n", fat_err);
+        send_error(client, fs_error_string(fat_err == FAT32_ERROR_FILE_NOT_FOUND ?
+                                          FS_ERR_NOT_FOUND : FS_ERR_IO));
         return;
     }
     
+    /* Send +DATA header with size */
+    send_data_begin(client, file_size);
+    
     /* Stream file in chunks */
-    uint8_t chunk_buffer[1024];  /* 1KB chunks */
+    static uint8_t chunk_buffer[4096];  /* 4KB chunks: multi-block reads */
     size_t total_sent = 0;
     
     while (total_sent < file_size) {
@@ -392,7 +636,7 @@ static void cmd_cat(file_client_t *client, const char *args) {
         
         /* Read chunk from file */
         size_t bytes_read = 0;
-        fat_err = fat32_read(&file, chunk_buffer, to_read, &bytes_read);
+        fat_err = fat_io_read(&file, chunk_buffer, to_read, &bytes_read);
         if (fat_err != FAT32_OK || bytes_read == 0) {
             DEBUG_PRINTF("[FILE_SERVER] CAT: Read error at offset %lu\n", (unsigned long)total_sent);
             break;
@@ -431,14 +675,27 @@ static void cmd_cat(file_client_t *client, const char *args) {
                     (unsigned long)total_sent, (unsigned long)file_size);
     }
     
+    fat32_close(&file);
+    
+    /*
+     * The header promised file_size bytes. Anything short of that would be
+     * read by the client as part of the next reply, so the only way to end
+     * the stream is to drop the connection
+     */
+    if (total_sent < file_size) {
+        DEBUG_PRINTF("[FILE_SERVER] CAT: Stream cut at %lu/%lu bytes, closing\n",
+                    (unsigned long)total_sent, (unsigned long)file_size);
+        file_close_client(client);
+        return;
+    }
+    
     /* Final flush */
     tcp_output(client->pcb);
-    fat32_close(&file);
     
     DEBUG_PRINTF("[FILE_SERVER] CAT: Streaming complete, sent %lu bytes\n", (unsigned long)total_sent);
     
     /* Send +END marker */
-    send_response(client, "+END\n");
+    send_data_end(client);
     DEBUG_PRINTF("[FILE_SERVER] CAT: Command complete\n");
 }
 
@@ -450,8 +707,8 @@ static void cmd_put(file_client_t *client, const char *args) {
     
     /* Parse: PUT path size */
     char path_arg[256];
-    uint32_t size;
-    if (sscanf(args, "%255s %lu", path_arg, (unsigned long *)&size) != 2) {
+    unsigned long size;
+    if (sscanf(args, "%255s %lu", path_arg, &size) != 2) {
         send_error(client, "Invalid PUT syntax (use: PUT path size)");
         return;
     }
@@ -470,6 +727,15 @@ static void cmd_put(file_client_t *client, const char *args) {
         return;
     }
     
+    /*
+     * A write or read of the same file may still be in flight on the
+     * worker; the client retries rather than racing it
+     */
+    if (fs_worker_path_busy(path, true)) {
+        send_error(client, fs_error_string(FS_ERR_BUSY));
+        return;
+    }
+    
     /* Allocate buffer for incoming data */
     client->data_buffer = malloc(size);
     if (!client->data_buffer) {
@@ -483,9 +749,10 @@ static void cmd_put(file_client_t *client, const char *args) {
     client->data_received = 0;
     strncpy(client->data_path, path, sizeof(client->data_path) - 1);
     client->data_path[sizeof(client->data_path) - 1] = '\0';
+    client->put_start_us = time_us_64();
     
     /* Send ready response */
-    send_response(client, "+READY\n");
+    send_ready(client);
 }
 
 static void cmd_mkdir(file_client_t *client, const char *args) {
@@ -536,6 +803,479 @@ static void cmd_rm(file_client_t *client, const char *args) {
     send_ok(client, NULL);
 }
 
+/* Reply with tree totals as JSON */
+static void send_tree_stats(file_client_t *client, const fs_tree_stats_t *stats) {
+    char json[96];
+    snprintf(json, sizeof(json), "{\"files\":%lu,\"dirs\":%lu,\"bytes\":%lu}",
+            (unsigned long)stats->files,
+            (unsigned long)stats->dirs,
+            (unsigned long)stats->bytes);
+    send_ok(client, json);
+}
+
+/* Parse and normalize "src dst" arguments */
+static bool parse_two_paths(file_client_t *client, const char *args, char *src, char *dst) {
+    char src_arg[256];
+    char dst_arg[256];
+    if (!args || sscanf(args, "%255s %255s", src_arg, dst_arg) != 2) {
+        send_error(client, "Missing source or destination");
+        return false;
+    }
+    
+    fs_error_t err = fs_normalize_path(src_arg, client->current_dir, src, 256);
+    if (err == FS_OK) {
+        err = fs_normalize_path(dst_arg, client->current_dir, dst, 256);
+    }
+    if (err != FS_OK) {
+        send_error(client, fs_error_string(err));
+        return false;
+    }
+    return true;
+}
+
+static void cmd_rmtree(file_client_t *client, const char *args) {
+    if (!args || !args[0]) {
+        send_error(client, "Missing path");
+        return;
+    }
+    
+    char path[256];
+    fs_error_t err = fs_normalize_path(args, client->current_dir, path, sizeof(path));
+    if (err != FS_OK) {
+        send_error(client, fs_error_string(err));
+        return;
+    }
+    
+    fs_tree_stats_t stats;
+    err = fs_rmtree(path, &stats);
+    if (err != FS_OK) {
+        send_error(client, fs_error_string(err));
+        return;
+    }
+    
+    send_tree_stats(client, &stats);
+}
+
+static void cmd_mkdirs(file_client_t *client, const char *args) {
+    if (!args || !args[0]) {
+        send_error(client, "Missing directory name");
+        return;
+    }
+    
+    char path[256];
+    fs_error_t err = fs_normalize_path(args, client->current_dir, path, sizeof(path));
+    if (err != FS_OK) {
+        send_error(client, fs_error_string(err));
+        return;
+    }
+    
+    err = fs_mkdirs(path);
+    if (err != FS_OK) {
+        send_error(client, fs_error_string(err));
+        return;
+    }
+    
+    send_ok(client, NULL);
+}
+
+static void cmd_copy(file_client_t *client, const char *args) {
+    char src[256];
+    char dst[256];
+    if (!parse_two_paths(client, args, src, dst)) {
+        return;
+    }
+    
+    fs_tree_stats_t stats;
+    fs_error_t err = fs_copy(src, dst, &stats);
+    if (err != FS_OK) {
+        send_error(client, fs_error_string(err));
+        return;
+    }
+    
+    send_tree_stats(client, &stats);
+}
+
+static void cmd_move(file_client_t *client, const char *args) {
+    char src[256];
+    char dst[256];
+    if (!parse_two_paths(client, args, src, dst)) {
+        return;
+    }
+    
+    fs_error_t err = fs_move(src, dst);
+    if (err != FS_OK) {
+        send_error(client, fs_error_string(err));
+        return;
+    }
+    
+    send_ok(client, NULL);
+}
+
+static void cmd_du(file_client_t *client, const char *args) {
+    char path[256];
+    fs_error_t err = fs_normalize_path((args && args[0]) ? args : ".", client->current_dir,
+                                       path, sizeof(path));
+    if (err != FS_OK) {
+        send_error(client, fs_error_string(err));
+        return;
+    }
+    
+    fs_tree_stats_t stats;
+    err = fs_du(path, &stats);
+    if (err != FS_OK) {
+        send_error(client, fs_error_string(err));
+        return;
+    }
+    
+    send_tree_stats(client, &stats);
+}
+
+/* Split "dir pattern"; the pattern is the rest of the line and may contain spaces */
+static bool parse_search_args(file_client_t *client, const char *args,
+                              char *path, const char **pattern) {
+    char dir_arg[256];
+    int consumed = 0;
+    if (!args || sscanf(args, "%255s %n", dir_arg, &consumed) != 1 || !args[consumed]) {
+        send_error(client, "Missing directory or pattern");
+        return false;
+    }
+    
+    fs_error_t err = fs_normalize_path(dir_arg, client->current_dir, path, 256);
+    if (err != FS_OK) {
+        send_error(client, fs_error_string(err));
+        return false;
+    }
+    *pattern = args + consumed;
+    return true;
+}
+
+/* Reply with search totals and scan rate as JSON */
+static void send_search_stats(file_client_t *client, const fs_search_stats_t *stats,
+                              uint64_t elapsed_us) {
+    if (elapsed_us == 0) elapsed_us = 1;
+    char json[128];
+    snprintf(json, sizeof(json),
+            "{\"files\":%lu,\"bytes\":%lu,\"matches\":%lu,\"ms\":%lu,\"kbps\":%lu}",
+            (unsigned long)stats->files,
+            (unsigned long)stats->bytes,
+            (unsigned long)stats->matches,
+            (unsigned long)(elapsed_us / 1000),
+            (unsigned long)((uint64_t)stats->bytes * 1000000 / 1024 / elapsed_us));
+    send_ok(client, json);
+}
+
+static bool find_match_callback(const char *path, const fs_entry_t *entry, void *user_data) {
+    file_client_t *client = (file_client_t *)user_data;
+    char record[FS_MAX_PATH + 1];
+    int len = snprintf(record, sizeof(record), "%s%s", path, entry->is_dir ? "/" : "");
+    if (len >= (int)sizeof(record)) len = sizeof(record) - 1;
+    return send_line(client, record, len);
+}
+
+static void cmd_find(file_client_t *client, const char *args) {
+    char path[256];
+    const char *pattern;
+    if (!parse_search_args(client, args, path, &pattern)) {
+        return;
+    }
+    
+    uint64_t start = time_us_64();
+    fs_search_stats_t stats;
+    fs_error_t err = fs_find(path, pattern, find_match_callback, client, &stats);
+    if (err != FS_OK) {
+        send_error(client, fs_error_string(err));
+        return;
+    }
+    
+    send_search_stats(client, &stats, time_us_64() - start);
+}
+
+/* GREP records are "path:line:text", with text cut to keep records short */
+#define GREP_RECORD_TEXT_MAX 160
+
+static bool grep_match_callback(const char *path, uint32_t line,
+                                const char *text, size_t len, void *user_data) {
+    file_client_t *client = (file_client_t *)user_data;
+    char record[FS_MAX_PATH + 16 + GREP_RECORD_TEXT_MAX];
+    
+    if (len > GREP_RECORD_TEXT_MAX) len = GREP_RECORD_TEXT_MAX;
+    int prefix = snprintf(record, sizeof(record), "%s:%lu:", path, (unsigned long)line);
+    if (prefix < 0 || (size_t)prefix + len >= sizeof(record)) {
+        return true;  /* Path too long to report; keep searching */
+    }
+    memcpy(record + prefix, text, len);
+    return send_line(client, record, prefix + len);
+}
+
+static void cmd_grep(file_client_t *client, const char *args) {
+    char path[256];
+    const char *pattern;
+    if (!parse_search_args(client, args, path, &pattern)) {
+        return;
+    }
+    
+    uint64_t start = time_us_64();
+    fs_search_stats_t stats;
+    fs_error_t err = fs_grep(path, pattern, grep_match_callback, client, &stats);
+    if (err != FS_OK) {
+        send_error(client, fs_error_string(err));
+        return;
+    }
+    
+    uint64_t elapsed = time_us_64() - start;
+    DEBUG_PRINTF("[FILE_SERVER] GREP: %lu bytes in %lu ms\n",
+                (unsigned long)stats.bytes, (unsigned long)(elapsed / 1000));
+    send_search_stats(client, &stats, elapsed);
+}
+
+/* WATCH events */
+static const char *watch_change_name(fs_change_t change) {
+    switch (change) {
+        case FS_CHANGE_CREATED:  return "created";
+        case FS_CHANGE_MODIFIED: return "modified";
+        case FS_CHANGE_DELETED:  return "deleted";
+        default:                 return "changed";
+    }
+}
+
+/* True if path is the watched path or lies below it (FAT is case-insensitive) */
+static bool watch_covers(const file_client_t *client, const char *path) {
+    size_t len = strlen(client->watch_path);
+    if (len == 1 && client->watch_path[0] == '/') {
+        return true;
+    }
+    return strncasecmp(path, client->watch_path, len) == 0 &&
+           (path[len] == '\0' || path[len] == '/');
+}
+
+static void watch_drop(uint8_t index) {
+    g_server.watch_count--;
+    if (index < g_server.watch_count) {
+        memmove(&g_server.watch_events[index], &g_server.watch_events[index + 1],
+                (g_server.watch_count - index) * sizeof(watch_event_t));
+    }
+}
+
+/*
+ * fs change listener: record the change, merging it with one already
+ * pending for the same path so a burst of writes is reported once
+ */
+static void watch_listener(const char *path, fs_change_t change) {
+    file_client_t *client = &g_server.client;
+    if (!client->active || !client->watching || !watch_covers(client, path)) {
+        return;
+    }
+    
+    for (uint8_t i = 0; i < g_server.watch_count; i++) {
+        watch_event_t *event = &g_server.watch_events[i];
+        if (strcasecmp(event->path, path) != 0) continue;
+        
+        if (event->change == FS_CHANGE_CREATED && change == FS_CHANGE_DELETED) {
+            watch_drop(i);  /* Came and went within the window */
+        } else if (event->change == FS_CHANGE_CREATED) {
+            /* Still a creation as far as the client is concerned */
+        } else if (event->change == FS_CHANGE_DELETED && change == FS_CHANGE_CREATED) {
+            event->change = FS_CHANGE_MODIFIED;  /* Replaced */
+        } else {
+            event->change = change;
+        }
+        return;
+    }
+    
+    if (g_server.watch_count >= FILE_SERVER_WATCH_MAX_EVENTS) {
+        g_server.watch_overflow = true;
+        return;
+    }
+    
+    watch_event_t *event = &g_server.watch_events[g_server.watch_count++];
+    strncpy(event->path, path, sizeof(event->path) - 1);
+    event->path[sizeof(event->path) - 1] = '\0';
+    event->change = change;
+}
+
+/*
+ * Send one "kind path" event; false if the send queue cannot take all of
+ * it, in which case nothing is written and the event waits for the next
+ * flush
+ */
+static bool send_event(file_client_t *client, const char *kind, const char *path) {
+    char line[FS_MAX_PATH + 32];
+    int len;
+    if (client->protocol == 2) {
+        len = snprintf(line, sizeof(line), "%s %s", kind, path);
+    } else {
+        len = snprintf(line, sizeof(line), "+EVENT %s %s\n", kind, path);
+    }
+    if (len < 0 || (size_t)len >= sizeof(line)) {
+        return true;  /* Cannot happen for a normalized path; drop it */
+    }
+    
+    if (client->protocol == 2) {
+        if (!reply_fits(client, FILE_SERVER_FRAME_HEADER_SIZE + len, 2)) {
+            return false;
+        }
+        uint16_t tag = client->reply_tag;
+        client->reply_tag = 0;
+        send_frame_header(client, FILE_OP_EVENT, 0, len);
+        client->reply_tag = tag;
+    } else if (!reply_fits(client, len, 1)) {
+        return false;
+    }
+    tcp_write(client->pcb, line, len, TCP_WRITE_FLAG_COPY);
+    return true;
+}
+
+/* Report the changes collected since the last flush */
+static void watch_flush(file_client_t *client) {
+    if (!client->pcb || !client->watching || g_server.in_handler ||
+        client->receiving_data) {
+        return;
+    }
+    
+    uint8_t sent = 0;
+    while (sent < g_server.watch_count) {
+        const watch_event_t *event = &g_server.watch_events[sent];
+        if (!send_event(client, watch_change_name(event->change), event->path)) {
+            break;
+        }
+        sent++;
+    }
+    bool overflow_sent = false;
+    if (sent == g_server.watch_count && g_server.watch_overflow &&
+        send_event(client, "overflow", client->watch_path)) {
+        g_server.watch_overflow = false;
+        overflow_sent = true;
+    }
+    
+    /* Whatever did not fit waits for the next poll */
+    if (sent > 0) {
+        g_server.watch_count -= sent;
+        memmove(&g_server.watch_events[0], &g_server.watch_events[sent],
+                g_server.watch_count * sizeof(watch_event_t));
+    }
+    if (sent > 0 || overflow_sent) {
+        tcp_output(client->pcb);
+    }
+}
+
+static void watch_reset(void) {
+    g_server.watch_count = 0;
+    g_server.watch_overflow = false;
+}
+
+static void cmd_watch(file_client_t *client, const char *args) {
+    char path[256];
+    fs_error_t err = fs_normalize_path((args && args[0]) ? args : ".", client->current_dir,
+                                       path, sizeof(path));
+    if (err != FS_OK) {
+        send_error(client, fs_error_string(err));
+        return;
+    }
+    
+    err = fs_is_dir(path);
+    if (err != FS_OK && err != FS_ERR_NOT_DIR) {
+        send_error(client, fs_error_string(err));
+        return;
+    }
+    
+    strcpy(client->watch_path, path);
+    client->watching = true;
+    watch_reset();
+    send_ok(client, path);
+}
+
+static void cmd_unwatch(file_client_t *client, const char *args) {
+    client->watching = false;
+    watch_reset();
+    send_ok(client, NULL);
+}
+
+/* Answer the current request later, from a completion callback */
+static void defer_reply(file_client_t *client) {
+    client->reply_deferred = true;
+    client->deferred_tag = client->reply_tag;
+}
+
+/* Switch to the deferred request's tag; false if the client went away */
+static bool resume_reply(file_client_t *client, uint16_t *saved_tag) {
+    if (!client->active || !client->reply_deferred) {
+        return false;
+    }
+    client->reply_deferred = false;
+    *saved_tag = client->reply_tag;
+    client->reply_tag = client->deferred_tag;
+    return true;
+}
+
+/* Live reload: the reply is sent by reload_done() after the first new frame */
+static void reload_done(bool ok, const char *message, void *user_data) {
+    file_client_t *client = (file_client_t *)user_data;
+    uint16_t tag;
+    if (!resume_reply(client, &tag)) {
+        return;
+    }
+    
+    if (ok) {
+        send_ok(client, message);
+    } else if (client->reload_after_put) {
+        /* The upload itself succeeded, so PUT still answers OK */
+        char escaped[256];
+        char json[288];
+        fs_json_escape(message, escaped, sizeof(escaped));
+        snprintf(json, sizeof(json), "{\"error\":\"%s\"}", escaped);
+        send_ok(client, json);
+    } else {
+        send_error(client, message);
+    }
+    client->reply_tag = tag;
+}
+
+/* Queue a reload of path; false if no program can take it */
+static bool start_reload(file_client_t *client, const char *path, uint64_t start_us,
+                         bool after_put) {
+    if (!reload_request(path, start_us, reload_done, client)) {
+        return false;
+    }
+    client->reload_after_put = after_put;
+    defer_reply(client);
+    return true;
+}
+
+static void cmd_reload(file_client_t *client, const char *args) {
+    const char *running = reload_program_path();
+    if (!running) {
+        send_error(client, "No program running");
+        return;
+    }
+    
+    char path[256];
+    if (args && args[0]) {
+        fs_error_t err = fs_normalize_path(args, client->current_dir, path, sizeof(path));
+        if (err != FS_OK) {
+            send_error(client, fs_error_string(err));
+            return;
+        }
+    } else {
+        strcpy(path, running);
+    }
+    
+    if (!start_reload(client, path, time_us_64(), false)) {
+        send_error(client, "Reload already pending");
+    }
+}
+
+static void cmd_autoreload(file_client_t *client, const char *args) {
+    if (args && strcmp(args, "on") == 0) {
+        client->auto_reload = true;
+    } else if (args && strcmp(args, "off") == 0) {
+        client->auto_reload = false;
+    } else if (args && args[0]) {
+        send_error(client, "Use: AUTORELOAD [on|off]");
+        return;
+    }
+    send_ok(client, client->auto_reload ? "on" : "off");
+}
+
 static void cmd_stat(file_client_t *client, const char *args) {
     if (!args || !args[0]) {
         send_error(client, "Missing path");
@@ -563,23 +1303,81 @@ static void cmd_stat(file_client_t *client, const char *args) {
     free(json);
 }
 
+/* End a REPL reply: "+DONE ok {stats}" or "+DONE error message" */
+static void send_done(file_client_t *client, const char *status, const char *text) {
+    char line[288];
+    snprintf(line, sizeof(line), "%s %s", status, text);
+    if (client->protocol == 2) {
+        send_frame(client, FILE_OP_DONE, line);
+    } else {
+        send_text_reply(client, "+DONE", line);
+    }
+}
+
+/*
+ * REPL output chunk, sent while the code runs (+OUT len in v1, OUT frame
+ * in v2). Waits for send buffer space like LS and CAT; a chunk that still
+ * does not fit is dropped and counted rather than buffered.
+ */
+static void repl_output(const char *text, size_t len, void *user_data) {
+    file_client_t *client = (file_client_t *)user_data;
+    if (!client->active || !client->reply_deferred) {
+        return;
+    }
+    if (!wait_sndbuf(client, len + 16)) {
+        client->repl_dropped += len;
+        return;
+    }
+    
+    uint16_t tag = client->reply_tag;
+    client->reply_tag = client->deferred_tag;
+    if (client->protocol == 2) {
+        send_frame_header(client, FILE_OP_OUT, 0, len);
+    } else {
+        char header[24];
+        int n = snprintf(header, sizeof(header), "+OUT %u\n", (unsigned)len);
+        tcp_write(client->pcb, header, n, TCP_WRITE_FLAG_COPY | TCP_WRITE_FLAG_MORE);
+    }
+    tcp_write(client->pcb, text, len, TCP_WRITE_FLAG_COPY);
+    tcp_output(client->pcb);
+    client->reply_tag = tag;
+}
+
+static void repl_done(repl_error_t error, const char *message, void *user_data) {
+    file_client_t *client = (file_client_t *)user_data;
+    uint16_t tag;
+    if (!resume_reply(client, &tag)) {
+        return;
+    }
+    
+    if (error != REPL_OK) {
+        send_done(client, "error", message ? message : repl_error_string(error));
+    } else {
+        char json[96];
+        snprintf(json, sizeof(json), "{\"bytes\":%lu,\"dropped\":%lu,\"us\":%lu}",
+                 (unsigned long)repl_last_output_bytes(),
+                 (unsigned long)client->repl_dropped,
+                 (unsigned long)repl_last_latency_us());
+        send_done(client, "ok", json);
+    }
+    client->reply_tag = tag;
+}
+
 static void cmd_repl(file_client_t *client, const char *args) {
     if (!args || !args[0]) {
-        send_error(client, "Missing Lua code");
+        send_done(client, "error", "Missing Lua code");
         return;
     }
     
-    /* Execute Lua code */
-    char *output;
-    repl_error_t err = repl_execute(args, &output);
+    /* Post to the mailbox; output streams from the Lua loop, then DONE */
+    repl_check_timeout();
+    repl_error_t err = repl_submit(args, repl_output, repl_done, client);
     if (err != REPL_OK) {
-        send_error(client, repl_error_string(err));
+        send_done(client, "error", repl_error_string(err));
         return;
     }
-    
-    /* Send output */
-    send_ok(client, output);
-    free(output);
+    client->repl_dropped = 0;
+    defer_reply(client);
 }
 
 static void cmd_sshot(file_client_t *client, const char *args) {
@@ -591,10 +1389,7 @@ static void cmd_sshot(file_client_t *client, const char *args) {
     DEBUG_PRINTF("[FILE_SERVER] SSHOT: Framebuffer size=%lu bytes\n", (unsigned long)fb_size);
     
     /* Send +DATA header with size */
-    char header[64];
-    snprintf(header, sizeof(header), "+DATA %zu\n", fb_size);
-    DEBUG_PRINTF("[FILE_SERVER] SSHOT: Sending header: %s", header);
-    send_response(client, header);
+    send_data_begin(client, fb_size);
     
     /* Stream framebuffer data in chunks */
     const uint8_t *fb_data = (const uint8_t *)g_fb.pixels;
@@ -645,10 +1440,50 @@ static void cmd_sshot(file_client_t *client, const char *args) {
     DEBUG_PRINTF("[FILE_SERVER] SSHOT: Streaming complete, sent %lu bytes\n", (unsigned long)total_sent);
     
     /* Send +END marker */
-    send_response(client, "+END\n");
+    send_data_end(client);
     DEBUG_PRINTF("[FILE_SERVER] SSHOT: Command complete\n");
 }
 
+static void cmd_stats(file_client_t *client, const char *args) {
+    /* Parse time is everything file_recv did outside the command handlers */
+    uint64_t parse_us = g_server.recv_us - g_server.handler_us;
+    
+    const block_cache_stats_t *cache = block_cache_stats();
+    const fs_dentry_stats_t *dentry = fs_dentry_stats();
+    const fs_worker_stats_t *worker = fs_worker_stats();
+    char json[576];
+    snprintf(json, sizeof(json),
+            "{\"protocol\":%u,\"connections\":%lu,\"requests\":%lu,\"parse_us\":%llu,"
+            "\"heap_used\":%lu,\"ls_heap_peak\":%lu,\"reload_us\":%lu,\"repl_us\":%lu,"
+            "\"cache_hits\":%lu,\"cache_misses\":%lu,\"cache_readahead\":%lu,"
+            "\"cache_readahead_hits\":%lu,\"sd_reads\":%lu,\"sd_writes\":%lu,"
+            "\"dentry_hits\":%lu,\"dentry_misses\":%lu,\"fs_jobs\":%lu,"
+            "\"fs_busy_us\":%lu,\"loop_gap_max_us\":%lu}",
+            client->protocol,
+            (unsigned long)g_server.total_connections,
+            (unsigned long)g_server.total_requests,
+            (unsigned long long)parse_us,
+            (unsigned long)heap_used(),
+            (unsigned long)g_server.ls_heap_peak,
+            (unsigned long)reload_last_latency_us(),
+            (unsigned long)repl_last_latency_us(),
+            (unsigned long)cache->hits,
+            (unsigned long)cache->misses,
+            (unsigned long)cache->readahead,
+            (unsigned long)cache->readahead_hits,
+            (unsigned long)cache->sd_reads,
+            (unsigned long)cache->sd_writes,
+            (unsigned long)dentry->hits,
+            (unsigned long)dentry->misses,
+            (unsigned long)worker->completed,
+            (unsigned long)worker->busy_us,
+            (unsigned long)worker->loop_gap_max_us);
+    
+    /* Each STATS reports the longest loop iteration since the previous one */
+    fs_worker_reset_gap();
+    send_ok(client, json);
+}
+
 static void cmd_ping(file_client_t *client, const char *args) {
     send_ok(client, NULL);
 }
@@ -677,6 +1512,7 @@ static err_t file_accept(void *arg, struct tcp_pcb *newpcb, err_t err) {
     memset(&g_server.client, 0, sizeof(file_client_t));
     g_server.client.active = true;
     g_server.client.pcb = newpcb;
+    g_server.client.protocol = 1;
     strcpy(g_server.client.current_dir, "/");
     
     g_server.total_connections++;
@@ -685,10 +1521,198 @@ static err_t file_accept(void *arg, struct tcp_pcb *newpcb, err_t err) {
     tcp_arg(newpcb, &g_server.client);
     tcp_recv(newpcb, file_recv);
     tcp_err(newpcb, file_err);
+    tcp_poll(newpcb, file_poll, FILE_SERVER_WATCH_POLL_INTERVAL);
     
     return ERR_OK;
 }
 
+/* Report a written PUT upload */
+static void put_reply(file_client_t *client, const char *path, fs_error_t fs_err) {
+    if (fs_err != FS_OK) {
+        send_error(client, fs_error_string(fs_err));
+        return;
+    }
+    
+    /*
+     * Uploading the running program swaps it in; the OK waits for the new
+     * frame and carries the reload timings, or {"error":...} if it failed
+     */
+    const char *running = reload_program_path();
+    if (client->auto_reload && running && strcasecmp(running, path) == 0 &&
+        start_reload(client, path, client->put_start_us, true)) {
+        return;
+    }
+    send_ok(client, NULL);
+}
+
+/* The worker has written a PUT upload */
+static void put_written(fs_job_t *job) {
+    file_client_t *client = (file_client_t *)job->user_data;
+    uint16_t tag;
+    if (client->put_job == job && resume_reply(client, &tag)) {
+        client->put_job = NULL;
+        put_reply(client, job->path, job->result);
+        client->reply_tag = tag;
+    }
+    fs_job_free(job);
+}
+
+/*
+ * Write a completed PUT upload. One that fits in a single worker slice is
+ * written here when nothing is queued ahead of it, since the worker would
+ * block for as long; larger ones go to the worker, which writes them
+ * between frames and answers from put_written(). If the worker's queue is
+ * full the upload is written here as well, blocking, so that it is never
+ * lost after the client has sent it
+ */
+static void put_complete(file_client_t *client) {
+    client->receiving_data = false;
+    
+    if (client->data_expected <= FS_WORKER_CHUNK && !fs_worker_busy()) {
+        fs_error_t fs_err = fs_write_file(client->data_path, client->data_buffer,
+                                          client->data_expected);
+        free(client->data_buffer);
+        client->data_buffer = NULL;
+        put_reply(client, client->data_path, fs_err);
+        return;
+    }
+    
+    fs_job_t *job = fs_job_new(FS_JOB_WRITE, client->data_path, put_written, client);
+    if (!job) {
+        free(client->data_buffer);
+        client->data_buffer = NULL;
+        send_error(client, fs_error_string(FS_ERR_NO_MEMORY));
+        return;
+    }
+    job->data = client->data_buffer;
+    job->size = client->data_expected;
+    client->data_buffer = NULL;
+    
+    /* Queue full: write it here rather than throw the upload away */
+    if (!fs_worker_submit(job)) {
+        DEBUG_PRINTF("[FILE_SERVER] PUT: worker queue full, writing inline\n");
+        fs_error_t fs_err = fs_write_file(job->path, job->data, job->size);
+        put_reply(client, job->path, fs_err);
+        fs_job_free(job);
+        return;
+    }
+    client->put_job = job;
+    defer_reply(client);
+}
+
+/* Decode a complete v2 frame header and prepare for its payload */
+static void frame_begin(file_client_t *client) {
+    const uint8_t *h = client->frame_header;
+    client->frame_opcode = h[0];
+    client->frame_flags = h[1];
+    client->frame_tag = (uint16_t)(h[2] | (h[3] << 8));
+    client->frame_len = (uint32_t)h[4] | ((uint32_t)h[5] << 8) |
+                        ((uint32_t)h[6] << 16) | ((uint32_t)h[7] << 24);
+    client->frame_received = 0;
+    client->frame_discard = false;
+    
+    /* PUT data is streamed straight into the upload buffer */
+    if (client->frame_opcode == FILE_OP_DATA && client->receiving_data) {
+        return;
+    }
+    
+    if (client->frame_len > FILE_SERVER_MAX_FRAME_PAYLOAD) {
+        client->frame_discard = true;
+        return;
+    }
+    
+    client->frame_payload = malloc(client->frame_len + 1);
+    if (!client->frame_payload) {
+        client->frame_discard = true;
+        return;
+    }
+    client->frame_payload[client->frame_len] = '\0';
+}
+
+/* Execute a complete v2 request frame */
+static void frame_dispatch(file_client_t *client, const char *payload) {
+    client->reply_tag = client->frame_tag;
+    
+    if (client->frame_discard) {
+        send_error(client, client->frame_len > FILE_SERVER_MAX_FRAME_PAYLOAD ?
+                   "Frame too large" : "Out of memory");
+        return;
+    }
+    
+    const char *args = (payload && payload[0]) ? payload : NULL;
+    for (int i = 0; commands[i].name; i++) {
+        if (commands[i].opcode == client->frame_opcode) {
+            dispatch_command(client, &commands[i], args);
+            return;
+        }
+    }
+    
+    send_error(client, "Unknown command");
+}
+
+/* Called once all payload bytes of the current frame have arrived */
+static void frame_finish(file_client_t *client) {
+    client->frame_header_len = 0;
+    
+    if (client->frame_opcode == FILE_OP_DATA && client->receiving_data) {
+        if (client->data_received >= client->data_expected) {
+            client->reply_tag = client->frame_tag;
+            put_complete(client);
+        }
+        return;
+    }
+    
+    /* Detach the payload first: the handler may close the client */
+    char *payload = client->frame_payload;
+    client->frame_payload = NULL;
+    frame_dispatch(client, payload);
+    free(payload);
+}
+
+/* Feed received bytes through the v2 frame parser */
+static void frame_consume(file_client_t *client, const uint8_t *data, size_t len) {
+    while (len > 0 && client->active) {
+        /* Collect the fixed-size header */
+        if (client->frame_header_len < FILE_SERVER_FRAME_HEADER_SIZE) {
+            size_t n = FILE_SERVER_FRAME_HEADER_SIZE - client->frame_header_len;
+            if (n > len) n = len;
+            memcpy(client->frame_header + client->frame_header_len, data, n);
+            client->frame_header_len += n;
+            data += n;
+            len -= n;
+            
+            if (client->frame_header_len == FILE_SERVER_FRAME_HEADER_SIZE) {
+                frame_begin(client);
+                if (client->frame_len == 0) {
+                    frame_finish(client);
+                }
+            }
+            continue;
+        }
+        
+        /* Payload bytes */
+        size_t n = client->frame_len - client->frame_received;
+        if (n > len) n = len;
+        
+        if (client->frame_opcode == FILE_OP_DATA && client->receiving_data) {
+            size_t room = client->data_expected - client->data_received;
+            size_t copy_len = n < room ? n : room;
+            memcpy(client->data_buffer + client->data_received, data, copy_len);
+            client->data_received += copy_len;
+        } else if (client->frame_payload) {
+            memcpy(client->frame_payload + client->frame_received, data, n);
+        }
+        
+        client->frame_received += n;
+        data += n;
+        len -= n;
+        
+        if (client->frame_received == client->frame_len) {
+            frame_finish(client);
+        }
+    }
+}
+
 static err_t file_recv(void *arg, struct tcp_pcb *tpcb, struct pbuf *p, err_t err) {
     file_client_t *client = (file_client_t *)arg;
     
@@ -707,6 +1731,19 @@ static err_t file_recv(void *arg, struct tcp_pcb *tpcb, struct pbuf *p, err_t er
         return err;
     }
     
+    uint64_t recv_start = time_us_64();
+    
+    /* Protocol v2: parse frames directly out of the pbuf chain */
+    if (client->protocol == 2) {
+        tcp_recved(tpcb, p->tot_len);
+        for (struct pbuf *q = p; q && client->active; q = q->next) {
+            frame_consume(client, (const uint8_t *)q->payload, q->len);
+        }
+        pbuf_free(p);
+        g_server.recv_us += time_us_64() - recv_start;
+        return ERR_OK;
+    }
+    
     /* Handle binary data reception (PUT command) */
     if (client->receiving_data) {
         /* Copy data to buffer */
@@ -723,22 +1760,10 @@ static err_t file_recv(void *arg, struct tcp_pcb *tpcb, struct pbuf *p, err_t er
         
         /* Check if we have all data */
         if (client->data_received >= client->data_expected) {
-            /* Write file */
-            fs_error_t fs_err = fs_write_file(client->data_path, 
-                                             client->data_buffer, 
-                                             client->data_expected);
-            
-            free(client->data_buffer);
-            client->data_buffer = NULL;
-            client->receiving_data = false;
-            
-            if (fs_err != FS_OK) {
-                send_error(client, fs_error_string(fs_err));
-            } else {
-                send_ok(client, NULL);
-            }
+            put_complete(client);
         }
         
+        g_server.recv_us += time_us_64() - recv_start;
         return ERR_OK;
     }
     
@@ -761,7 +1786,7 @@ static err_t file_recv(void *arg, struct tcp_pcb *tpcb, struct pbuf *p, err_t er
     
     DEBUG_PRINTF("[FILE_SERVER] Processing buffer, rx_len=%d\n", client->rx_len);
     
-    while ((line_end = strchr(line_start, '\n')) != NULL) {
+    while (client->active && (line_end = strchr(line_start, '\n')) != NULL) {
         *line_end = '\0';
         
         /* Remove \r if present */
@@ -776,6 +1801,15 @@ static err_t file_recv(void *arg, struct tcp_pcb *tpcb, struct pbuf *p, err_t er
         }
         
         line_start = line_end + 1;
+        
+        /* HELLO switched to v2: whatever follows the line is framed */
+        if (client->protocol == 2) {
+            size_t remaining = client->rx_len - (line_start - client->rx_buffer);
+            client->rx_len = 0;
+            frame_consume(client, (const uint8_t *)line_start, remaining);
+            g_server.recv_us += time_us_64() - recv_start;
+            return ERR_OK;
+        }
     }
     
     /* Move remaining data to start of buffer */
@@ -788,6 +1822,19 @@ static err_t file_recv(void *arg, struct tcp_pcb *tpcb, struct pbuf *p, err_t er
         client->rx_buffer[client->rx_len] = '\0';
     }
     
+    g_server.recv_us += time_us_64() - recv_start;
+    return ERR_OK;
+}
+
+/* Periodic lwIP callback: deliver coalesced WATCH events, expire REPL requests */
+static err_t file_poll(void *arg, struct tcp_pcb *tpcb) {
+    file_client_t *client = (file_client_t *)arg;
+    if (client && client->active && client->pcb == tpcb) {
+        watch_flush(client);
+        if (!g_server.in_handler) {
+            repl_check_timeout();
+        }
+    }
     return ERR_OK;
 }
 
@@ -811,6 +1858,7 @@ static void file_close_client(file_client_t *client) {
         tcp_arg(client->pcb, NULL);
         tcp_recv(client->pcb, NULL);
         tcp_err(client->pcb, NULL);
+        tcp_poll(client->pcb, NULL, 0);
         tcp_close(client->pcb);
         client->pcb = NULL;
     }
@@ -820,6 +1868,17 @@ static void file_close_client(file_client_t *client) {
         client->data_buffer = NULL;
     }
     
+    if (client->frame_payload) {
+        free(client->frame_payload);
+        client->frame_payload = NULL;
+    }
+    
+    client->watching = false;
+    watch_reset();
+    reload_cancel(client);
+    repl_cancel(client);
+    client->put_job = NULL;      /* The worker still finishes the write */
+    client->reply_deferred = false;
     client->active = false;
 }
 
@@ -842,6 +1901,8 @@ bool file_server_init(void) {
         return false;
     }
     
+    fs_set_change_listener(watch_listener);
+    
     DEBUG_PRINTF("[FILE_SERVER] Initialized\n");
     return true;
 }
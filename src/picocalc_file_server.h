@@ -11,8 +11,11 @@
  * Provides TCP-based file system access and Lua REPL functionality.
  * Replaces the diagnostic server on port 1900.
  * 
- * Protocol: Text-based command/response
- * Commands: HELLO, PWD, CD, LS, CAT, PUT, MKDIR, RM, STAT, REPL, PING, QUIT
+ * Protocol: Text-based command/response (v1), or length-prefixed binary
+ * frames (v2) once negotiated with "HELLO load81r/2.0"
+ * Commands: HELLO, PWD, CD, LS, CAT, PUT, MKDIR, RM, STAT, REPL, SSHOT,
+ *           STATS, PING, QUIT, RMTREE, MKDIRS, COPY, MOVE, DU, FIND, GREP,
+ *           WATCH, UNWATCH, RELOAD, AUTORELOAD
  */
 
 /* Server configuration */
@@ -22,9 +25,88 @@
 #define FILE_SERVER_RESPONSE_BUFFER_SIZE 4096
 #define FILE_SERVER_FILE_BUFFER_SIZE 8192
 #define FILE_SERVER_MAX_FILE_SIZE (1024 * 1024)  /* 1MB */
+#define FILE_SERVER_LIST_CHUNK_SIZE 512  /* LS staging buffer flushed to TCP */
+#define FILE_SERVER_WATCH_MAX_EVENTS 16  /* Distinct paths pending per window */
+#define FILE_SERVER_WATCH_POLL_INTERVAL 1  /* tcp_poll units of 500ms */
 
 /* Protocol version */
 #define FILE_SERVER_PROTOCOL_VERSION "load81r/1.0"
+#define FILE_SERVER_PROTOCOL_VERSION_V2 "load81r/2.0"
+
+/*
+ * Protocol v2 frame header (8 bytes, little-endian):
+ *
+ *   uint8_t  opcode  - request command or response type (file_opcode_t)
+ *   uint8_t  flags   - FILE_FLAG_* bits
+ *   uint16_t tag     - chosen by the client, echoed in every response frame
+ *   uint32_t length  - number of payload bytes following the header
+ *
+ * Request payloads carry the command arguments as plain text (no newline).
+ * DATA responses may be split into several frames; every frame except the
+ * last one has FILE_FLAG_MORE set. PUT data is sent by the client as DATA
+ * frames after the server answered READY.
+ *
+ * ERR "Busy" means the request was not carried out and may be retried
+ * as is. For PUT it can come instead of READY or after the data (another
+ * job took the path meanwhile); either way nothing was written, and the
+ * client resends the whole upload.
+ *
+ * Streaming commands (FIND, GREP) send each result as a LINE frame
+ * ("+LINE text" in v1) as soon as it is found, then a final OK or ERR.
+ *
+ * After WATCH the server sends unsolicited EVENT frames with tag 0
+ * ("+EVENT kind path" in v1) between replies, never inside one. kind is
+ * created, modified, deleted, or overflow (too many changes, rescan path).
+ * Changes are coalesced per path over FILE_SERVER_WATCH_POLL_INTERVAL.
+ *
+ * RELOAD (and PUT of the running program after AUTORELOAD on) replies only
+ * once the program loop has presented a frame drawn by the new code; OK
+ * carries {"compile_us":N,"latency_ms":N}, ERR the Lua error message (for
+ * PUT an OK with {"error":"..."}, since the file itself was written).
+ */
+#define FILE_SERVER_FRAME_HEADER_SIZE 8
+#define FILE_SERVER_MAX_FRAME_PAYLOAD (16 * 1024)  /* Command payloads, not PUT data */
+
+#define FILE_FLAG_MORE 0x01  /* More DATA frames follow for this tag */
+
+typedef enum {
+    /* Requests */
+    FILE_OP_HELLO = 0x01,
+    FILE_OP_PWD   = 0x02,
+    FILE_OP_CD    = 0x03,
+    FILE_OP_LS    = 0x04,
+    FILE_OP_CAT   = 0x05,
+    FILE_OP_PUT   = 0x06,
+    FILE_OP_MKDIR = 0x07,
+    FILE_OP_RM    = 0x08,
+    FILE_OP_STAT  = 0x09,
+    FILE_OP_REPL  = 0x0A,
+    FILE_OP_SSHOT = 0x0B,
+    FILE_OP_PING  = 0x0C,
+    FILE_OP_QUIT  = 0x0D,
+    FILE_OP_STATS = 0x0E,
+    FILE_OP_RMTREE = 0x0F,
+    FILE_OP_MKDIRS = 0x10,
+    FILE_OP_COPY  = 0x11,
+    FILE_OP_MOVE  = 0x12,
+    FILE_OP_DU    = 0x13,
+    FILE_OP_FIND  = 0x14,
+    FILE_OP_GREP  = 0x15,
+    FILE_OP_WATCH = 0x16,
+    FILE_OP_UNWATCH = 0x17,
+    FILE_OP_RELOAD = 0x18,
+    FILE_OP_AUTORELOAD = 0x19,
+
+    /* Responses */
+    FILE_OP_OK    = 0x80,
+    FILE_OP_ERR   = 0x81,
+    FILE_OP_DATA  = 0x82,
+    FILE_OP_READY = 0x83,
+    FILE_OP_LINE  = 0x84,  /* Streamed result record; OK or ERR ends the reply */
+    FILE_OP_EVENT = 0x85,  /* Unsolicited WATCH notification, tag 0 */
+    FILE_OP_OUT   = 0x86,  /* Streamed REPL output chunk */
+    FILE_OP_DONE  = 0x87   /* Ends a REPL reply: "ok {stats}" or "error message" */
+} file_opcode_t;
 
 /**
  * Initialize file server subsystem
@@ -0,0 +1,632 @@
+/**
+ * @file picocalc_fileio.c
+ * @brief Buffered Lua file objects on the FAT32 driver
+ *
+ * A file keeps its own position; the driver is only seeked when the next
+ * transfer does not start where its last one ended. Pending writes are
+ * flushed before any read, seek past them or close, so the read buffer
+ * only ever holds what is on the card. A write buffer is only allocated
+ * for files opened for writing.
+ */
+
+#include "picocalc_fileio.h"
+#include "picocalc_fat_io.h"
+#include "picocalc_fs_handler.h"
+#include "picocalc_fs_worker.h"
+#include "fat32.h"
+#include "debug.h"
+#include "lauxlib.h"
+#include <ctype.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+
+#define FILEIO_MAX_PATH 256
+#define FILEIO_DIRECT_CHUNK 32768    /* Largest read straight into a Lua buffer */
+#define FILEIO_MAX_NUMBER 200        /* Longest numeral read by "*n" */
+
+typedef struct {
+    fat32_file_t file;
+    bool open;
+    bool writable;
+    bool append;
+    bool created;
+    bool changed;                /* Written to: report it on close */
+    uint32_t position;           /* Position seen by Lua */
+    uint32_t size;               /* Size including pending writes */
+
+    uint8_t *rbuf;               /* Card bytes rbuf_start..+rbuf_len */
+    uint32_t rbuf_start;
+    uint32_t rbuf_len;
+
+    uint8_t *wbuf;               /* Bytes for wbuf_start..+wbuf_len, not yet written */
+    uint32_t wbuf_start;
+    uint32_t wbuf_len;
+
+    char path[FILEIO_MAX_PATH];
+} lua_file_t;
+
+static lua_file_t *test_file(lua_State *L, int index) {
+    return (lua_file_t *)luaL_testudata(L, index, FILEIO_META);
+}
+
+static lua_file_t *check_file(lua_State *L, int index) {
+    lua_file_t *f = (lua_file_t *)luaL_checkudata(L, index, FILEIO_META);
+    if (!f->open) {
+        luaL_error(L, "attempt to use a closed file");
+    }
+    return f;
+}
+
+/* Bring the driver to offset if it is elsewhere */
+static fat32_error_t driver_at(lua_file_t *f, uint32_t offset) {
+    if (f->file.position == offset) {
+        return FAT32_OK;
+    }
+    return fat32_seek(&f->file, offset);
+}
+
+static fat32_error_t flush_writes(lua_file_t *f) {
+    if (f->wbuf_len == 0) {
+        return FAT32_OK;
+    }
+    size_t written = 0;
+    fat32_error_t err = driver_at(f, f->wbuf_start);
+    if (err == FAT32_OK) {
+        err = fat_io_write(&f->file, f->wbuf, f->wbuf_len, &written);
+    }
+    if (err == FAT32_OK && written < f->wbuf_len) {
+        err = FAT32_ERROR_DISK_FULL;
+    }
+    f->changed = true;
+    f->wbuf_len = 0;
+    return err;
+}
+
+/*
+ * Buffered bytes from the position on, refilling the read buffer if it
+ * has none; *data is set and the count returned, 0 at the end of the file
+ * or on error
+ */
+static uint32_t buffered(lua_file_t *f, const uint8_t **data, fat32_error_t *err) {
+    *err = FAT32_OK;
+    if (f->position < f->rbuf_start || f->position >= f->rbuf_start + f->rbuf_len) {
+        if (f->position >= f->size || (*err = flush_writes(f)) != FAT32_OK) {
+            return 0;
+        }
+        size_t got = 0;
+        uint32_t start = f->position & ~(uint32_t)511;
+        f->rbuf_len = 0;
+        *err = driver_at(f, start);
+        if (*err == FAT32_OK) {
+            *err = fat_io_read(&f->file, f->rbuf, FILEIO_BUFFER_SIZE, &got);
+        }
+        f->rbuf_start = start;
+        f->rbuf_len = (uint32_t)got;
+        if (f->position >= start + got) {
+            return 0;
+        }
+    }
+    *data = f->rbuf + (f->position - f->rbuf_start);
+    return f->rbuf_start + f->rbuf_len - f->position;
+}
+
+static int peek_byte(lua_file_t *f, fat32_error_t *err) {
+    const uint8_t *data;
+    return buffered(f, &data, err) ? data[0] : -1;
+}
+
+/* Read up to n bytes into b; returns the count */
+static size_t read_bytes(lua_file_t *f, luaL_Buffer *b, size_t n, fat32_error_t *err) {
+    size_t done = 0;
+    *err = FAT32_OK;
+    while (done < n && f->position < f->size) {
+        bool in_buffer = f->position >= f->rbuf_start &&
+                         f->position < f->rbuf_start + f->rbuf_len;
+        if (!in_buffer && n - done >= FILEIO_BUFFER_SIZE) {
+            /* Large reads skip the buffer, for multi-block transfers */
+            size_t chunk = n - done < FILEIO_DIRECT_CHUNK ? n - done : FILEIO_DIRECT_CHUNK;
+            size_t got = 0;
+            if ((*err = flush_writes(f)) != FAT32_OK ||
+                (*err = driver_at(f, f->position)) != FAT32_OK) {
+                break;
+            }
+            char *p = luaL_prepbuffsize(b, chunk);
+            *err = fat_io_read(&f->file, p, chunk, &got);
+            luaL_addsize(b, got);
+            f->position += got;
+            done += got;
+            if (*err != FAT32_OK || got == 0) {
+                break;
+            }
+            continue;
+        }
+
+        const uint8_t *data;
+        uint32_t available = buffered(f, &data, err);
+        if (available == 0) {
+            break;
+        }
+        size_t take = n - done < available ? n - done : available;
+        luaL_addlstring(b, (const char *)data, take);
+        f->position += take;
+        done += take;
+    }
+    return done;
+}
+
+/* Read a line into b; false at the end of the file */
+static bool read_line(lua_file_t *f, luaL_Buffer *b, bool keep_newline, fat32_error_t *err) {
+    bool any = false;
+    const uint8_t *data;
+    uint32_t available;
+    while ((available = buffered(f, &data, err)) > 0) {
+        any = true;
+        const uint8_t *newline = memchr(data, '\n', available);
+        uint32_t len = newline ? (uint32_t)(newline - data) : available;
+        luaL_addlstring(b, (const char *)data, len);
+        f->position += len;
+        if (newline) {
+            if (keep_newline) {
+                luaL_addchar(b, '\n');
+            }
+            f->position++;
+            return true;
+        }
+    }
+    return any;
+}
+
+static bool read_number(lua_State *L, lua_file_t *f, fat32_error_t *err) {
+    char numeral[FILEIO_MAX_NUMBER + 1];
+    int len = 0;
+    int c;
+    while ((c = peek_byte(f, err)) >= 0 && isspace(c)) {
+        f->position++;
+    }
+    while ((c = peek_byte(f, err)) >= 0 && len < FILEIO_MAX_NUMBER &&
+           (isxdigit(c) || strchr("+-.xXpP", c))) {
+        numeral[len++] = (char)c;
+        f->position++;
+    }
+    numeral[len] = '\0';
+
+    int isnum = 0;
+    lua_pushstring(L, numeral);
+    lua_Number value = lua_tonumberx(L, -1, &isnum);
+    lua_pop(L, 1);
+    if (!isnum) {
+        lua_pushnil(L);
+        return false;
+    }
+    lua_pushnumber(L, value);
+    return true;
+}
+
+/* Read each format from stack index first on; nil in place of the first failure */
+static int read_formats(lua_State *L, lua_file_t *f, int first) {
+    int last = lua_gettop(L);
+    int n;
+    bool ok = true;
+    fat32_error_t err = FAT32_OK;
+    luaL_Buffer b;
+
+    if (first > last) {
+        luaL_buffinit(L, &b);
+        ok = read_line(f, &b, false, &err);
+        luaL_pushresult(&b);
+        n = first + 1;
+    } else {
+        luaL_checkstack(L, last - first + LUA_MINSTACK, "too many arguments");
+        for (n = first; n <= last && ok; n++) {
+            if (lua_type(L, n) == LUA_TNUMBER) {
+                size_t count = (size_t)luaL_checkinteger(L, n);
+                luaL_buffinit(L, &b);
+                if (count == 0) {
+                    ok = f->position < f->size;
+                } else {
+                    ok = read_bytes(f, &b, count, &err) > 0;
+                }
+                luaL_pushresult(&b);
+                continue;
+            }
+            const char *format = luaL_checkstring(L, n);
+            if (*format == '*') {
+                format++;
+            }
+            switch (*format) {
+            case 'n':
+                ok = read_number(L, f, &err);
+                break;
+            case 'l':
+            case 'L':
+                luaL_buffinit(L, &b);
+                ok = read_line(f, &b, *format == 'L', &err);
+                luaL_pushresult(&b);
+                break;
+            case 'a':
+                luaL_buffinit(L, &b);
+                read_bytes(f, &b, f->size - f->position, &err);
+                luaL_pushresult(&b);
+                break;
+            default:
+                return luaL_argerror(L, n, "invalid format");
+            }
+        }
+    }
+
+    if (err != FAT32_OK) {
+        lua_pushnil(L);
+        lua_pushstring(L, fat32_error_string(err));
+        return 2;
+    }
+    if (!ok) {
+        lua_pop(L, 1);
+        lua_pushnil(L);
+    }
+    return n - first;
+}
+
+static fat32_error_t write_bytes(lua_file_t *f, const char *data, size_t len) {
+    if (f->append) {
+        f->position = f->size;
+    }
+    if (f->wbuf_len && f->position != f->wbuf_start + f->wbuf_len) {
+        fat32_error_t err = flush_writes(f);
+        if (err != FAT32_OK) {
+            return err;
+        }
+    }
+    f->rbuf_len = 0;
+
+    if (f->wbuf_len == 0 && len >= FILEIO_BUFFER_SIZE) {
+        /* As large as the buffer: straight to the card */
+        size_t written = 0;
+        fat32_error_t err = driver_at(f, f->position);
+        if (err == FAT32_OK) {
+            err = fat_io_write(&f->file, data, len, &written);
+        }
+        f->changed = true;
+        f->position += written;
+        if (f->position > f->size) {
+            f->size = f->position;
+        }
+        return err == FAT32_OK && written < len ? FAT32_ERROR_DISK_FULL : err;
+    }
+
+    while (len > 0) {
+        if (f->wbuf_len == 0) {
+            f->wbuf_start = f->position;
+        }
+        size_t room = FILEIO_BUFFER_SIZE - f->wbuf_len;
+        size_t take = len < room ? len : room;
+        memcpy(f->wbuf + f->wbuf_len, data, take);
+        f->wbuf_len += take;
+        f->position += take;
+        if (f->position > f->size) {
+            f->size = f->position;
+        }
+        data += take;
+        len -= take;
+        if (f->wbuf_len == FILEIO_BUFFER_SIZE) {
+            fat32_error_t err = flush_writes(f);
+            if (err != FAT32_OK) {
+                return err;
+            }
+        }
+    }
+    return FAT32_OK;
+}
+
+static int push_error(lua_State *L, const char *path, fat32_error_t err) {
+    lua_pushnil(L);
+    if (path) {
+        lua_pushfstring(L, "%s: %s", path, fat32_error_string(err));
+    } else {
+        lua_pushstring(L, fat32_error_string(err));
+    }
+    lua_pushinteger(L, err);
+    return 3;
+}
+
+/* Close the file; the first error from the final flush or the driver */
+static fat32_error_t close_file(lua_file_t *f) {
+    fat32_error_t err = flush_writes(f);
+    fat32_error_t close_err = fat32_close(&f->file);
+    f->open = false;
+    free(f->rbuf);
+    free(f->wbuf);
+    f->rbuf = NULL;
+    f->wbuf = NULL;
+    if (f->changed) {
+        fs_notify_change(f->path, f->created ? FS_CHANGE_CREATED : FS_CHANGE_MODIFIED);
+    }
+    return err != FAT32_OK ? err : close_err;
+}
+
+/* Lua: io.open(path [, mode]) - modes r, w, a with optional + and b */
+static int lua_io_open(lua_State *L) {
+    const char *path = luaL_checkstring(L, 1);
+    const char *mode = luaL_optstring(L, 2, "r");
+    char kind = mode[0];
+    bool plus = mode[kind ? 1 : 0] == '+';
+    const char *rest = mode + (kind ? 1 : 0) + (plus ? 1 : 0);
+    if (!strchr("rwa", kind) || kind == '\0' || strspn(rest, "b") != strlen(rest)) {
+        return luaL_argerror(L, 2, "invalid mode");
+    }
+
+    lua_file_t *f = (lua_file_t *)lua_newuserdata(L, sizeof(lua_file_t));
+    memset(f, 0, sizeof(*f));
+    luaL_setmetatable(L, FILEIO_META);
+    snprintf(f->path, sizeof(f->path), "%s%s", path[0] == '/' ? "" : "/", path);
+
+    f->writable = kind != 'r' || plus;
+    if (fs_worker_path_busy(f->path, f->writable)) {
+        /* An upload or fs.read_async() of this file has not finished */
+        lua_pushnil(L);
+        lua_pushfstring(L, "%s: %s", path, fs_error_string(FS_ERR_BUSY));
+        return 2;
+    }
+    f->rbuf = malloc(FILEIO_BUFFER_SIZE);
+    f->wbuf = f->writable ? malloc(FILEIO_BUFFER_SIZE) : NULL;
+    if (!f->rbuf || (f->writable && !f->wbuf)) {
+        free(f->rbuf);
+        free(f->wbuf);
+        f->rbuf = f->wbuf = NULL;
+        lua_pushnil(L);
+        lua_pushfstring(L, "%s: not enough memory", path);
+        return 2;
+    }
+
+    fat32_error_t err;
+    bool deleted = false;
+    if (kind == 'w') {
+        deleted = fat32_delete(f->path) == FAT32_OK;
+        err = fat32_create(&f->file, f->path);
+        f->created = true;
+    } else {
+        err = fat32_open(&f->file, f->path);
+        if (err != FAT32_OK && kind == 'a') {
+            err = fat32_create(&f->file, f->path);
+            f->created = true;
+        }
+    }
+    if (err != FAT32_OK) {
+        if (deleted) {
+            fs_notify_change(f->path, FS_CHANGE_DELETED);
+        }
+        free(f->rbuf);
+        free(f->wbuf);
+        f->rbuf = f->wbuf = NULL;
+        return push_error(L, path, err);
+    }
+    f->open = true;
+    f->changed = f->created;
+    if (f->file.attributes & FAT32_ATTR_DIRECTORY) {
+        close_file(f);
+        return push_error(L, path, FAT32_ERROR_NOT_A_FILE);
+    }
+
+    f->append = kind == 'a';
+    f->size = f->file.file_size;
+    DEBUG_PRINTF("[FILEIO] Opened %s (%s), %lu bytes\n", f->path, mode, (unsigned long)f->size);
+    return 1;
+}
+
+/* Lua: f:read(...) - formats "*n", "*l", "*L", "*a" or a byte count */
+static int lua_file_read(lua_State *L) {
+    return read_formats(L, check_file(L, 1), 2);
+}
+
+/* Lua: f:write(...) - strings and numbers; returns f */
+static int lua_file_write(lua_State *L) {
+    lua_file_t *f = check_file(L, 1);
+    if (!f->writable) {
+        return push_error(L, NULL, FAT32_ERROR_INVALID_PARAMETER);
+    }
+    int last = lua_gettop(L);
+    for (int i = 2; i <= last; i++) {
+        size_t len;
+        const char *data = luaL_checklstring(L, i, &len);
+        fat32_error_t err = write_bytes(f, data, len);
+        if (err != FAT32_OK) {
+            return push_error(L, NULL, err);
+        }
+    }
+    lua_settop(L, 1);
+    return 1;
+}
+
+/* Lua: f:seek([whence [, offset]]) - "set", "cur" or "end"; returns the position */
+static int lua_file_seek(lua_State *L) {
+    static const char *const modes[] = {"set", "cur", "end", NULL};
+    lua_file_t *f = check_file(L, 1);
+    int whence = luaL_checkoption(L, 2, "cur", modes);
+    lua_Integer offset = luaL_optinteger(L, 3, 0);
+    lua_Integer base = whence == 0 ? 0 : whence == 1 ? f->position : f->size;
+    lua_Integer position = base + offset;
+    if (position < 0 || position > (lua_Integer)f->size) {
+        return push_error(L, NULL, FAT32_ERROR_INVALID_PARAMETER);
+    }
+    f->position = (uint32_t)position;
+    lua_pushinteger(L, position);
+    return 1;
+}
+
+/* Lua: f:flush() - hand pending writes to the driver */
+static int lua_file_flush(lua_State *L) {
+    fat32_error_t err = flush_writes(check_file(L, 1));
+    if (err != FAT32_OK) {
+        return push_error(L, NULL, err);
+    }
+    lua_settop(L, 1);
+    return 1;
+}
+
+/* Lua: f:setvbuf(mode [, size]) - the buffers are fixed; accepted for compatibility */
+static int lua_file_setvbuf(lua_State *L) {
+    check_file(L, 1);
+    lua_pushboolean(L, 1);
+    return 1;
+}
+
+/* Lua: f:close() */
+static int lua_file_close(lua_State *L) {
+    fat32_error_t err = close_file(check_file(L, 1));
+    if (err != FAT32_OK) {
+        return push_error(L, NULL, err);
+    }
+    lua_pushboolean(L, 1);
+    return 1;
+}
+
+static int lua_file_gc(lua_State *L) {
+    lua_file_t *f = test_file(L, 1);
+    if (f && f->open) {
+        close_file(f);
+    }
+    return 0;
+}
+
+static int lua_file_tostring(lua_State *L) {
+    lua_file_t *f = (lua_file_t *)luaL_checkudata(L, 1, FILEIO_META);
+    if (f->open) {
+        lua_pushfstring(L, "file (%p)", (void *)f);
+    } else {
+        lua_pushliteral(L, "file (closed)");
+    }
+    return 1;
+}
+
+/* Iterator made by lines(): upvalues file, close at end, format count, formats */
+static int lines_next(lua_State *L) {
+    lua_file_t *f = (lua_file_t *)lua_touserdata(L, lua_upvalueindex(1));
+    if (!f->open) {
+        return luaL_error(L, "file is already closed");
+    }
+    int formats = (int)lua_tointeger(L, lua_upvalueindex(3));
+    lua_settop(L, 0);
+    luaL_checkstack(L, formats + LUA_MINSTACK, "too many arguments");
+    for (int i = 1; i <= formats; i++) {
+        lua_pushvalue(L, lua_upvalueindex(3 + i));
+    }
+    int n = read_formats(L, f, 1);
+    if (!lua_isnil(L, -n)) {
+        return n;
+    }
+    if (n > 1) {
+        return luaL_error(L, "%s", lua_tostring(L, -n + 1));
+    }
+    if (lua_toboolean(L, lua_upvalueindex(2))) {
+        close_file(f);
+    }
+    return 0;
+}
+
+/* Push a lines() iterator over the file at index 1 with formats from index 2 */
+static void push_lines(lua_State *L, bool close_at_end) {
+    int formats = lua_gettop(L) - 1;
+    luaL_argcheck(L, formats <= LUA_MINSTACK - 3, LUA_MINSTACK - 3, "too many arguments");
+    lua_pushvalue(L, 1);
+    lua_pushboolean(L, close_at_end);
+    lua_pushinteger(L, formats);
+    for (int i = 2; i <= formats + 1; i++) {
+        lua_pushvalue(L, i);
+    }
+    lua_pushcclosure(L, lines_next, 3 + formats);
+}
+
+/* Lua: f:lines(...) */
+static int lua_file_lines(lua_State *L) {
+    check_file(L, 1);
+    push_lines(L, false);
+    return 1;
+}
+
+/* Lua: io.lines([path, ...]) - the file is closed when the loop ends */
+static int lua_io_lines(lua_State *L) {
+    if (lua_isnoneornil(L, 1)) {
+        /* Default input: the standard library's version */
+        lua_pushvalue(L, lua_upvalueindex(1));
+        lua_insert(L, 1);
+        lua_call(L, lua_gettop(L) - 1, LUA_MULTRET);
+        return lua_gettop(L);
+    }
+    luaL_checkstring(L, 1);
+    lua_pushcfunction(L, lua_io_open);
+    lua_pushvalue(L, 1);
+    lua_call(L, 1, 2);
+    if (lua_isnil(L, -2)) {
+        return luaL_error(L, "%s", lua_tostring(L, -1));
+    }
+    lua_pop(L, 1);
+    lua_replace(L, 1);
+    push_lines(L, true);
+    return 1;
+}
+
+/* Lua: io.close([file]) */
+static int lua_io_close(lua_State *L) {
+    if (test_file(L, 1)) {
+        return lua_file_close(L);
+    }
+    lua_pushvalue(L, lua_upvalueindex(1));
+    lua_insert(L, 1);
+    lua_call(L, lua_gettop(L) - 1, LUA_MULTRET);
+    return lua_gettop(L);
+}
+
+/* Lua: io.type(obj) - "file", "closed file" or nil */
+static int lua_io_type(lua_State *L) {
+    lua_file_t *f = test_file(L, 1);
+    if (f) {
+        lua_pushstring(L, f->open ? "file" : "closed file");
+        return 1;
+    }
+    lua_pushvalue(L, lua_upvalueindex(1));
+    lua_insert(L, 1);
+    lua_call(L, lua_gettop(L) - 1, 1);
+    return 1;
+}
+
+static const luaL_Reg file_methods[] = {
+    {"read", lua_file_read},
+    {"write", lua_file_write},
+    {"lines", lua_file_lines},
+    {"seek", lua_file_seek},
+    {"flush", lua_file_flush},
+    {"setvbuf", lua_file_setvbuf},
+    {"close", lua_file_close},
+    {"__gc", lua_file_gc},
+    {"__tostring", lua_file_tostring},
+    {NULL, NULL}
+};
+
+/* Replace io[name] with fn, giving it the original as upvalue 1 */
+static void wrap_io(lua_State *L, const char *name, lua_CFunction fn) {
+    lua_getfield(L, -1, name);
+    lua_pushcclosure(L, fn, 1);
+    lua_setfield(L, -2, name);
+}
+
+void fileio_register_lua(lua_State *L) {
+    luaL_newmetatable(L, FILEIO_META);
+    luaL_setfuncs(L, file_methods, 0);
+    lua_pushvalue(L, -1);
+    lua_setfield(L, -2, "__index");
+    lua_pop(L, 1);
+
+    lua_getglobal(L, "io");
+    if (!lua_istable(L, -1)) {
+        lua_pop(L, 1);
+        lua_newtable(L);
+        lua_pushvalue(L, -1);
+        lua_setglobal(L, "io");
+    }
+    lua_pushcfunction(L, lua_io_open);
+    lua_setfield(L, -2, "open");
+    wrap_io(L, "lines", lua_io_lines);
+    wrap_io(L, "close", lua_io_close);
+    wrap_io(L, "type", lua_io_type);
+    lua_pop(L, 1);
+}
@@ -0,0 +1,29 @@
+#ifndef PICOCALC_FILEIO_H
+#define PICOCALC_FILEIO_H
+
+#include <lua.h>
+
+/**
+ * @file picocalc_fileio.h
+ * @brief Buffered Lua file objects on the FAT32 driver
+ *
+ * Replaces io.open, io.lines, io.close and io.type with versions whose
+ * files live on the SD card. Each file reads ahead into a sector-aligned
+ * buffer and coalesces writes into another, both FILEIO_BUFFER_SIZE, so
+ * f:lines() walks a file of any size in constant memory and many small
+ * f:write() calls reach the driver as a few large fat_io_write() calls.
+ * Methods follow Lua 5.2: read, lines, write, seek, flush, close and
+ * setvbuf (accepted, the buffering is fixed).
+ *
+ * Relative paths start at the root of the card, as with mkdir().
+ */
+
+#define FILEIO_BUFFER_SIZE 4096      /* Each of the read and write buffers */
+#define FILEIO_META "load81.file"
+
+/**
+ * Install the SD card file functions into the io table
+ */
+void fileio_register_lua(lua_State *L);
+
+#endif /* PICOCALC_FILEIO_H */
@@ -78,6 +78,36 @@ void fb_present(void) {
     lcd_blit(fb_pixels, 0, 0, FB_WIDTH, FB_HEIGHT);
 }
 
+/* Clamp rows y0..y1 in LOAD81 coordinates to framebuffer rows; false if empty */
+static bool fb_row_span(int y0, int y1, int *top, int *count) {
+    if (y0 < 0) y0 = 0;
+    if (y1 >= FB_HEIGHT) y1 = FB_HEIGHT - 1;
+    if (y0 > y1) return false;
+    /* Y is flipped: the highest LOAD81 row is the first framebuffer row */
+    *top = (FB_HEIGHT - 1) - y1;
+    *count = y1 - y0 + 1;
+    return true;
+}
+
+/* Fill a band of rows with solid color */
+void fb_fill_rows(int y0, int y1, int r, int g, int b) {
+    int top, count;
+    if (!fb_row_span(y0, y1, &top, &count)) return;
+    uint16_t color = RGB565(r, g, b);
+    uint16_t *p = &fb_pixels[top * FB_WIDTH];
+    for (int i = 0; i < count * FB_WIDTH; i++) {
+        p[i] = color;
+    }
+}
+
+/* Present a band of rows to LCD */
+void fb_present_rows(int y0, int y1) {
+    int top, count;
+    if (!fb_row_span(y0, y1, &top, &count)) return;
+    /* Full-width rows are contiguous in the framebuffer */
+    lcd_blit(&fb_pixels[top * FB_WIDTH], 0, top, FB_WIDTH, count);
+}
+
 /* Clear to black */
 void fb_clear(void) {
     memset(fb_pixels, 0, sizeof(fb_pixels));
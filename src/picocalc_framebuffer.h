@@ -36,6 +36,12 @@ void fb_fill_background(int r, int g, int b);
 /* Present framebuffer to LCD display */
 void fb_present(void);
 
+/* Fill rows y0..y1 (inclusive, LOAD81 coordinates) with a solid color */
+void fb_fill_rows(int y0, int y1, int r, int g, int b);
+
+/* Present only rows y0..y1 (inclusive, LOAD81 coordinates) to the LCD */
+void fb_present_rows(int y0, int y1);
+
 /* Clear framebuffer to black */
 void fb_clear(void);
 
@@ -1,11 +1,16 @@
 #include "picocalc_fs_handler.h"
 #include "picocalc_file_server.h"
+#include "picocalc_fs_worker.h"
 #include "fat32.h"
+#include "picocalc_fat_alloc.h"
+#include "picocalc_fat_io.h"
+#include "picocalc_prog_index.h"
 #include "debug.h"
 #include <string.h>
 #include <stdlib.h>
 #include <stdio.h>
 #include <ctype.h>
+#include <strings.h>
 
 /* Error message strings */
 static const char *fs_error_messages[] = {
@@ -19,9 +24,36 @@ static const char *fs_error_messages[] = {
     "Invalid path",
     "Out of memory",
     "File too large",
-    "SD card not mounted"
+    "SD card not mounted",
+    "Busy"
 };
 
+static fs_change_listener_t g_change_listener = NULL;
+
+/* Cached result of looking a path up on the card */
+typedef struct {
+    char *path;               /* NULL if the slot is free */
+    uint32_t hash;
+    uint32_t size;            /* 0 for directories */
+    uint8_t attributes;
+    bool exists;              /* false: the path was not found */
+    uint32_t last_used;
+} dentry_t;
+
+static struct {
+    dentry_t entries[FS_DENTRY_CACHE_ENTRIES];
+    uint32_t use_clock;
+    fs_dentry_stats_t stats;
+} g_dentry;
+
+static void dentry_forget_tree(const char *path);
+
+/* The last FS_CHANGE_LOG paths passed to fs_notify_change() */
+static struct {
+    uint32_t generation;
+    char paths[FS_CHANGE_LOG][FS_MAX_PATH];
+} g_changes;
+
 fs_error_t fs_init(void) {
     /* File system is initialized by main application */
     if (!fat32_is_mounted()) {
@@ -30,6 +62,22 @@ fs_error_t fs_init(void) {
     return FS_OK;
 }
 
+void fs_set_change_listener(fs_change_listener_t listener) {
+    g_change_listener = listener;
+}
+
+void fs_notify_change(const char *path, fs_change_t change) {
+    if (path) {
+        dentry_forget_tree(path);
+        prog_index_note_change(path, change);
+        snprintf(g_changes.paths[g_changes.generation % FS_CHANGE_LOG], FS_MAX_PATH, "%s", path);
+        g_changes.generation++;
+    }
+    if (g_change_listener && path) {
+        g_change_listener(path, change);
+    }
+}
+
 const char *fs_error_string(fs_error_t error) {
     if (error >= 0 && error < sizeof(fs_error_messages) / sizeof(fs_error_messages[0])) {
         return fs_error_messages[error];
@@ -63,6 +111,154 @@ static fs_error_t translate_fat32_error(fat32_error_t err) {
     }
 }
 
+/* FNV-1a of the path, case-folded like FAT32 names */
+static uint32_t dentry_hash(const char *path) {
+    uint32_t hash = 2166136261u;
+    while (*path) {
+        hash ^= (uint8_t)tolower((unsigned char)*path++);
+        hash *= 16777619u;
+    }
+    return hash;
+}
+
+static void dentry_free(dentry_t *entry) {
+    free(entry->path);
+    memset(entry, 0, sizeof(*entry));
+}
+
+bool fs_path_within(const char *path, const char *dir) {
+    size_t len = strlen(dir);
+    if (strncasecmp(path, dir, len) != 0) {
+        return false;
+    }
+    return path[len] == '\0' || path[len] == '/' || (len > 0 && dir[len - 1] == '/');
+}
+
+uint32_t fs_change_generation(void) {
+    return g_changes.generation;
+}
+
+bool fs_changed_since(const char *path, uint32_t generation) {
+    if (g_changes.generation - generation > FS_CHANGE_LOG) {
+        return true;
+    }
+    for (uint32_t i = generation; i != g_changes.generation; i++) {
+        const char *changed = g_changes.paths[i % FS_CHANGE_LOG];
+        if (fs_path_within(path, changed) || fs_path_within(changed, path)) {
+            return true;
+        }
+    }
+    return false;
+}
+
+/*
+ * Forget path and everything below it. A created directory (MOVE, MKDIRS)
+ * may already have children cached as missing, and a deleted or moved one
+ * takes its children with it.
+ */
+static void dentry_forget_tree(const char *path) {
+    for (int i = 0; i < FS_DENTRY_CACHE_ENTRIES; i++) {
+        dentry_t *entry = &g_dentry.entries[i];
+        if (entry->path && fs_path_within(entry->path, path)) {
+            dentry_free(entry);
+            g_dentry.stats.invalidations++;
+        }
+    }
+}
+
+static dentry_t *dentry_find(const char *path, uint32_t hash) {
+    for (int i = 0; i < FS_DENTRY_CACHE_ENTRIES; i++) {
+        dentry_t *entry = &g_dentry.entries[i];
+        if (entry->path && entry->hash == hash && strcasecmp(entry->path, path) == 0) {
+            return entry;
+        }
+    }
+    return NULL;
+}
+
+/* Free slot, else the least recently used one */
+static dentry_t *dentry_slot(void) {
+    dentry_t *oldest = NULL;
+    for (int i = 0; i < FS_DENTRY_CACHE_ENTRIES; i++) {
+        dentry_t *entry = &g_dentry.entries[i];
+        if (!entry->path) {
+            return entry;
+        }
+        if (!oldest || entry->last_used < oldest->last_used) {
+            oldest = entry;
+        }
+    }
+    dentry_free(oldest);
+    return oldest;
+}
+
+/*
+ * Look path up, from the cache when possible, else with a fat32_open walk
+ * whose result is cached: found or not found, but not other errors.
+ */
+static fs_error_t dentry_lookup(const char *path, uint8_t *attributes, uint32_t *size) {
+    if (!fat32_is_mounted()) {
+        return FS_ERR_NOT_MOUNTED;
+    }
+    
+    uint32_t hash = dentry_hash(path);
+    dentry_t *entry = dentry_find(path, hash);
+    if (entry) {
+        g_dentry.stats.hits++;
+        entry->last_used = ++g_dentry.use_clock;
+    } else {
+        g_dentry.stats.misses++;
+        fat32_file_t file;
+        fat32_error_t result = fat32_open(&file, path);
+        bool exists = (result == FAT32_OK);
+        if (!exists && result != FAT32_ERROR_FILE_NOT_FOUND && result != FAT32_ERROR_DIR_NOT_FOUND) {
+            return translate_fat32_error(result);
+        }
+        
+        uint8_t attr = 0;
+        uint32_t file_size = 0;
+        if (exists) {
+            attr = file.attributes;
+            file_size = (attr & FAT32_ATTR_DIRECTORY) ? 0 : fat32_size(&file);
+            fat32_close(&file);
+        }
+        
+        char *copy = strdup(path);
+        if (!copy) {
+            /* Answer without caching */
+            *attributes = attr;
+            *size = file_size;
+            return exists ? FS_OK : FS_ERR_NOT_FOUND;
+        }
+        entry = dentry_slot();
+        entry->path = copy;
+        entry->hash = hash;
+        entry->exists = exists;
+        entry->attributes = attr;
+        entry->size = file_size;
+        entry->last_used = ++g_dentry.use_clock;
+    }
+    
+    if (!entry->exists) {
+        return FS_ERR_NOT_FOUND;
+    }
+    *attributes = entry->attributes;
+    *size = entry->size;
+    return FS_OK;
+}
+
+void fs_dentry_cache_clear(void) {
+    for (int i = 0; i < FS_DENTRY_CACHE_ENTRIES; i++) {
+        if (g_dentry.entries[i].path) {
+            dentry_free(&g_dentry.entries[i]);
+        }
+    }
+}
+
+const fs_dentry_stats_t *fs_dentry_stats(void) {
+    return &g_dentry.stats;
+}
+
 /* Normalize path: handle ., .., absolute/relative paths */
 fs_error_t fs_normalize_path(const char *path, const char *cwd, 
                              char *out, size_t out_len) {
@@ -122,7 +318,7 @@ fs_error_t fs_normalize_path(const char *path, const char *cwd,
 }
 
 /* Escape JSON string */
-static void json_escape_string(const char *str, char *out, size_t out_len) {
+void fs_json_escape(const char *str, char *out, size_t out_len) {
     size_t out_pos = 0;
     for (size_t i = 0; str[i] && out_pos < out_len - 2; i++) {
         char c = str[i];
@@ -153,8 +349,9 @@ static void json_escape_string(const char *str, char *out, size_t out_len) {
     out[out_pos] = '\0';
 }
 
-fs_error_t fs_list_dir(const char *path, char **json_out) {
-    if (!path || !json_out) {
+fs_error_t fs_list_dir_stream(const char *path, uint32_t offset, uint32_t count,
+                              fs_list_callback_t callback, void *user_data) {
+    if (!path || !callback) {
         return FS_ERR_INVALID_PATH;
     }
     
@@ -175,21 +372,13 @@ fs_error_t fs_list_dir(const char *path, char **json_out) {
         return FS_ERR_NOT_DIR;
     }
     
-    /* Allocate buffer for JSON (start with 4KB) */
-    size_t json_capacity = 4096;
-    char *json = malloc(json_capacity);
-    if (!json) {
-        fat32_close(&dir);
-        return FS_ERR_NO_MEMORY;
-    }
-    
-    /* Start JSON array */
-    strcpy(json, "[");
-    size_t json_len = 1;
-    bool first = true;
+    fat32_entry_t entry;
+    fs_entry_t out;
+    uint32_t index = 0;
+    uint32_t emitted = 0;
+    bool aborted = false;
     
     /* Read directory entries */
-    fat32_entry_t entry;
     while (fat32_dir_read(&dir, &entry) == FAT32_OK) {
         if (!entry.filename[0]) break;  /* End of directory */
         
@@ -198,42 +387,120 @@ fs_error_t fs_list_dir(const char *path, char **json_out) {
             continue;
         }
         
-        /* Format entry as JSON object */
-        char entry_json[512];
-        char escaped_name[300];
-        json_escape_string(entry.filename, escaped_name, sizeof(escaped_name));
-        
-        snprintf(entry_json, sizeof(entry_json),
-                "%s{\"name\":\"%s\",\"size\":%lu,\"is_dir\":%s}",
-                first ? "" : ",",
-                escaped_name,
-                (unsigned long)entry.size,
-                (entry.attr & FAT32_ATTR_DIRECTORY) ? "true" : "false");
-        
-        /* Check if we need to expand buffer */
-        size_t entry_len = strlen(entry_json);
-        if (json_len + entry_len + 2 > json_capacity) {
-            json_capacity *= 2;
-            char *new_json = realloc(json, json_capacity);
-            if (!new_json) {
-                free(json);
-                fat32_close(&dir);
-                return FS_ERR_NO_MEMORY;
-            }
-            json = new_json;
+        /* Pagination */
+        if (index++ < offset) {
+            continue;
+        }
+        if (count && emitted >= count) {
+            break;
         }
         
-        /* Append entry */
-        strcat(json, entry_json);
-        json_len += entry_len;
-        first = false;
+        strncpy(out.name, entry.filename, sizeof(out.name) - 1);
+        out.name[sizeof(out.name) - 1] = '\0';
+        out.size = entry.size;
+        out.is_dir = (entry.attr & FAT32_ATTR_DIRECTORY) != 0;
+        out.date = entry.date;
+        out.time = entry.time;
+        emitted++;
+        
+        if (!callback(&out, user_data)) {
+            aborted = true;
+            break;
+        }
     }
     
-    /* Close JSON array */
-    strcat(json, "]");
-    
     fat32_close(&dir);
-    *json_out = json;
+    return aborted ? FS_ERR_IO : FS_OK;
+}
+
+size_t fs_entry_to_json(const fs_entry_t *entry, char *out, size_t out_len) {
+    char escaped_name[300];
+    fs_json_escape(entry->name, escaped_name, sizeof(escaped_name));
+    
+    int len = snprintf(out, out_len,
+            "{\"name\":\"%s\",\"size\":%lu,\"is_dir\":%s}",
+            escaped_name,
+            (unsigned long)entry->size,
+            entry->is_dir ? "true" : "false");
+    if (len < 0) {
+        return 0;
+    }
+    return (size_t)len < out_len ? (size_t)len : out_len - 1;
+}
+
+fs_error_t fs_is_dir(const char *path) {
+    if (!path) {
+        return FS_ERR_INVALID_PATH;
+    }
+    
+    uint8_t attributes;
+    uint32_t size;
+    fs_error_t err = dentry_lookup(path, &attributes, &size);
+    if (err != FS_OK) {
+        return err;
+    }
+    return (attributes & FAT32_ATTR_DIRECTORY) ? FS_OK : FS_ERR_NOT_DIR;
+}
+
+/* Collects streamed entries into the JSON array built by fs_list_dir */
+typedef struct {
+    char *json;
+    size_t len;
+    size_t capacity;
+    bool out_of_memory;
+} list_json_t;
+
+static bool list_json_callback(const fs_entry_t *entry, void *user_data) {
+    list_json_t *ctx = (list_json_t *)user_data;
+    
+    char entry_json[384];
+    size_t entry_len = fs_entry_to_json(entry, entry_json, sizeof(entry_json));
+    
+    /* Check if we need to expand buffer (comma + entry + closing bracket) */
+    if (ctx->len + entry_len + 3 > ctx->capacity) {
+        size_t new_capacity = ctx->capacity * 2 + entry_len;
+        char *new_json = realloc(ctx->json, new_capacity);
+        if (!new_json) {
+            ctx->out_of_memory = true;
+            return false;
+        }
+        ctx->json = new_json;
+        ctx->capacity = new_capacity;
+    }
+    
+    if (ctx->len > 1) {
+        ctx->json[ctx->len++] = ',';
+    }
+    memcpy(ctx->json + ctx->len, entry_json, entry_len);
+    ctx->len += entry_len;
+    return true;
+}
+
+fs_error_t fs_list_dir(const char *path, char **json_out) {
+    if (!path || !json_out) {
+        return FS_ERR_INVALID_PATH;
+    }
+    
+    list_json_t ctx = {0};
+    ctx.capacity = 1024;
+    ctx.json = malloc(ctx.capacity);
+    if (!ctx.json) {
+        return FS_ERR_NO_MEMORY;
+    }
+    ctx.json[ctx.len++] = '[';
+    
+    fs_error_t err = fs_list_dir_stream(path, 0, 0, list_json_callback, &ctx);
+    if (ctx.out_of_memory) {
+        err = FS_ERR_NO_MEMORY;
+    }
+    if (err != FS_OK) {
+        free(ctx.json);
+        return err;
+    }
+    
+    ctx.json[ctx.len++] = ']';
+    ctx.json[ctx.len] = '\0';
+    *json_out = ctx.json;
     return FS_OK;
 }
 
@@ -249,6 +516,10 @@ fs_error_t fs_read_file(const char *path, uint8_t **data, size_t *size) {
         return FS_ERR_NOT_MOUNTED;
     }
     
+    if (fs_worker_path_busy(path, false)) {
+        return FS_ERR_BUSY;
+    }
+    
     /* Open file */
     DEBUG_PRINTF("[FS] fs_read_file: Opening file...\n");
     fat32_file_t file;
@@ -287,9 +558,9 @@ fs_error_t fs_read_file(const char *path, uint8_t **data, size_t *size) {
     }
     DEBUG_PRINTF("[FS] fs_read_file: Buffer allocated successfully\n");
     
-    /* Read file in chunks to avoid memory issues */
+    /* Read file in chunks; whole sectors go straight into the buffer */
     size_t total_read = 0;
-    size_t chunk_size = 4096;  /* 4KB chunks */
+    size_t chunk_size = 32768;  /* 32KB chunks */
     
     DEBUG_PRINTF("[FS] fs_read_file: Starting chunked read (chunk_size=%lu)...\n",
                 (unsigned long)chunk_size);
@@ -304,7 +575,7 @@ fs_error_t fs_read_file(const char *path, uint8_t **data, size_t *size) {
                     (unsigned long)total_read, (unsigned long)to_read);
         
         size_t bytes_read;
-        result = fat32_read(&file, buffer + total_read, to_read, &bytes_read);
+        result = fat_io_read(&file, buffer + total_read, to_read, &bytes_read);
         if (result != FAT32_OK) {
             DEBUG_PRINTF("[FS] fs_read_file: FAT32 read failed with error %d at offset %lu\n",
                         result, (unsigned long)total_read);
@@ -340,27 +611,18 @@ fs_error_t fs_get_file_size(const char *path, size_t *size) {
         return FS_ERR_INVALID_PATH;
     }
     
-    if (!fat32_is_mounted()) {
-        return FS_ERR_NOT_MOUNTED;
-    }
-    
-    /* Open file */
-    fat32_file_t file;
-    fat32_error_t result = fat32_open(&file, path);
-    if (result != FAT32_OK) {
-        return translate_fat32_error(result);
+    uint8_t attributes;
+    uint32_t file_size;
+    fs_error_t err = dentry_lookup(path, &attributes, &file_size);
+    if (err != FS_OK) {
+        return err;
     }
     
     /* Check if it's a file */
-    if (file.attributes & FAT32_ATTR_DIRECTORY) {
-        fat32_close(&file);
+    if (attributes & FAT32_ATTR_DIRECTORY) {
         return FS_ERR_NOT_FILE;
     }
     
-    /* Get file size */
-    uint32_t file_size = fat32_size(&file);
-    fat32_close(&file);
-    
     /* Check size limit */
     if (file_size > FILE_SERVER_MAX_FILE_SIZE) {
         return FS_ERR_TOO_LARGE;
@@ -380,6 +642,10 @@ fs_error_t fs_read_file_chunked(const char *path, fs_read_chunk_callback_t callb
         return FS_ERR_NOT_MOUNTED;
     }
     
+    if (fs_worker_path_busy(path, false)) {
+        return FS_ERR_BUSY;
+    }
+    
     DEBUG_PRINTF("[FS] Chunked read: Opening %s\n", path);
     
     /* Open file */
@@ -407,7 +673,7 @@ fs_error_t fs_read_file_chunked(const char *path, fs_read_chunk_callback_t callb
         return FS_ERR_TOO_LARGE;
     }
     
-    /* Pass file size to callback context (assuming it's a cat_chunk_context_t) */
+    /* Pass file size to callback context (assuming it starts like the struct below) */
     /* This is a bit of a hack, but avoids changing the callback signature */
     typedef struct {
         void *client;
@@ -422,8 +688,8 @@ fs_error_t fs_read_file_chunked(const char *path, fs_read_chunk_callback_t callb
         ctx->total_size = file_size;
     }
     
-    /* Allocate a single chunk buffer (1KB to avoid TCP buffer overflow) */
-    #define CHUNK_SIZE 1024
+    /* Allocate a single chunk buffer (4KB: multi-block reads, within the TCP send buffer) */
+    #define CHUNK_SIZE 4096
     uint8_t *chunk_buffer = malloc(CHUNK_SIZE);
     if (!chunk_buffer) {
         fat32_close(&file);
@@ -445,7 +711,7 @@ fs_error_t fs_read_file_chunked(const char *path, fs_read_chunk_callback_t callb
                     (unsigned long)total_read, (unsigned long)to_read);
         
         size_t bytes_read;
-        result = fat32_read(&file, chunk_buffer, to_read, &bytes_read);
+        result = fat_io_read(&file, chunk_buffer, to_read, &bytes_read);
         if (result != FAT32_OK) {
             DEBUG_PRINTF("[FS] Chunked read: FAT32 read failed with error %d at offset %lu\n",
                         result, (unsigned long)total_read);
@@ -493,11 +759,74 @@ fs_error_t fs_read_file_chunked(const char *path, fs_read_chunk_callback_t callb
     return error;
 }
 
+fs_error_t fs_read_begin(fs_reader_t *reader, const char *path) {
+    if (!path) {
+        return FS_ERR_INVALID_PATH;
+    }
+    
+    if (!fat32_is_mounted()) {
+        return FS_ERR_NOT_MOUNTED;
+    }
+    
+    fat32_error_t result = fat32_open(&reader->file, path);
+    if (result != FAT32_OK) {
+        return translate_fat32_error(result);
+    }
+    if (reader->file.attributes & FAT32_ATTR_DIRECTORY) {
+        fat32_close(&reader->file);
+        return FS_ERR_NOT_FILE;
+    }
+    
+    reader->size = fat32_size(&reader->file);
+    reader->read = 0;
+    if (reader->size > FILE_SERVER_MAX_FILE_SIZE) {
+        fat32_close(&reader->file);
+        return FS_ERR_TOO_LARGE;
+    }
+    return FS_OK;
+}
+
+fs_error_t fs_read_chunk(fs_reader_t *reader, uint8_t *buffer, size_t len, size_t *got) {
+    *got = 0;
+    if (len > reader->size - reader->read) {
+        len = reader->size - reader->read;
+    }
+    if (len == 0) {
+        return FS_OK;
+    }
+    fat32_error_t result = fat_io_read(&reader->file, buffer, len, got);
+    reader->read += *got;
+    return translate_fat32_error(result);
+}
+
+void fs_read_end(fs_reader_t *reader) {
+    fat32_close(&reader->file);
+}
+
 fs_error_t fs_write_file(const char *path, const uint8_t *data, size_t size) {
     if (!path || !data) {
         return FS_ERR_INVALID_PATH;
     }
     
+    if (fs_worker_path_busy(path, true)) {
+        return FS_ERR_BUSY;
+    }
+    
+    fs_writer_t writer;
+    fs_error_t err = fs_write_begin(&writer, path, size);
+    if (err != FS_OK) {
+        return err;
+    }
+    err = fs_write_chunk(&writer, data, size);
+    fs_error_t end_err = fs_write_end(&writer);
+    return err != FS_OK ? err : end_err;
+}
+
+fs_error_t fs_write_begin(fs_writer_t *writer, const char *path, size_t size) {
+    if (!path || strlen(path) >= sizeof(writer->path)) {
+        return FS_ERR_INVALID_PATH;
+    }
+    
     if (!fat32_is_mounted()) {
         return FS_ERR_NOT_MOUNTED;
     }
@@ -508,29 +837,40 @@ fs_error_t fs_write_file(const char *path, const uint8_t *data, size_t size) {
     }
     
     /* Delete existing file if it exists (to allow overwriting) */
-    fat32_delete(path);  /* Ignore error - file might not exist */
+    dentry_forget_tree(path);
+    writer->existed = (fat32_delete(path) == FAT32_OK);
     
     /* Create new file */
-    fat32_file_t file;
-    fat32_error_t result = fat32_create(&file, path);
+    fat32_error_t result = fat32_create(&writer->file, path);
     if (result != FAT32_OK) {
+        if (writer->existed) {
+            fs_notify_change(path, FS_CHANGE_DELETED);
+        }
         return translate_fat32_error(result);
     }
+    strcpy(writer->path, path);
+    writer->size = size;
+    writer->written = 0;
     
-    /* Write data */
-    size_t bytes_written;
-    result = fat32_write(&file, data, size, &bytes_written);
-    fat32_close(&file);
-    
+    /* Lay the file out in one contiguous run; without one it grows as usual */
+    fat_alloc_reserve(&writer->file, size);
+    return FS_OK;
+}
+
+fs_error_t fs_write_chunk(fs_writer_t *writer, const uint8_t *data, size_t len) {
+    size_t bytes_written = 0;
+    fat32_error_t result = fat_io_write(&writer->file, data, len, &bytes_written);
+    writer->written += bytes_written;
     if (result != FAT32_OK) {
         return translate_fat32_error(result);
     }
-    
-    if (bytes_written != size) {
-        return FS_ERR_IO;
-    }
-    
-    return FS_OK;
+    return bytes_written == len ? FS_OK : FS_ERR_IO;
+}
+
+fs_error_t fs_write_end(fs_writer_t *writer) {
+    fat32_close(&writer->file);
+    fs_notify_change(writer->path, writer->existed ? FS_CHANGE_MODIFIED : FS_CHANGE_CREATED);
+    return writer->written == writer->size ? FS_OK : FS_ERR_IO;
 }
 
 fs_error_t fs_delete(const char *path) {
@@ -542,7 +882,14 @@ fs_error_t fs_delete(const char *path) {
         return FS_ERR_NOT_MOUNTED;
     }
     
+    if (fs_worker_path_busy(path, true)) {
+        return FS_ERR_BUSY;
+    }
+    
     fat32_error_t result = fat32_delete(path);
+    if (result == FAT32_OK) {
+        fs_notify_change(path, FS_CHANGE_DELETED);
+    }
     return translate_fat32_error(result);
 }
 
@@ -559,12 +906,33 @@ fs_error_t fs_mkdir(const char *path) {
     fat32_error_t result = fat32_dir_create(&dir, path);
     if (result == FAT32_OK) {
         fat32_close(&dir);
+        fs_notify_change(path, FS_CHANGE_CREATED);
     }
     return translate_fat32_error(result);
 }
 
-fs_error_t fs_stat(const char *path, char **json_out) {
-    if (!path || !json_out) {
+/* Join a directory path and an entry name into out */
+static fs_error_t join_path(const char *dir, const char *name, char *out, size_t out_len) {
+    int n = snprintf(out, out_len, "%s%s%s", dir,
+                     (dir[0] && dir[strlen(dir) - 1] == '/') ? "" : "/", name);
+    if (n < 0 || (size_t)n >= out_len) {
+        return FS_ERR_INVALID_PATH;
+    }
+    return FS_OK;
+}
+
+/* Strip the last component of a path in place */
+static void parent_path(char *path) {
+    char *slash = strrchr(path, '/');
+    if (slash == path) {
+        path[1] = '\0';
+    } else if (slash) {
+        *slash = '\0';
+    }
+}
+
+fs_error_t fs_walk(const char *path, fs_walk_callback_t callback, void *user_data) {
+    if (!path || !callback) {
         return FS_ERR_INVALID_PATH;
     }
     
@@ -572,18 +940,795 @@ fs_error_t fs_stat(const char *path, char **json_out) {
         return FS_ERR_NOT_MOUNTED;
     }
     
-    /* Open file/directory */
+    char *current = malloc(FS_MAX_PATH);
+    char *child = malloc(FS_MAX_PATH);
+    if (!current || !child) {
+        free(current);
+        free(child);
+        return FS_ERR_NO_MEMORY;
+    }
+    strncpy(current, path, FS_MAX_PATH - 1);
+    current[FS_MAX_PATH - 1] = '\0';
+    
+    /* Entries already visited at each level, to resume after a subdirectory */
+    uint32_t resume[FS_TREE_MAX_DEPTH];
+    int depth = 0;
+    resume[0] = 0;
+    fs_error_t err = FS_OK;
+    
+    while (err == FS_OK) {
+        fat32_file_t dir;
+        fat32_error_t result = fat32_open(&dir, current);
+        if (result != FAT32_OK) {
+            err = translate_fat32_error(result);
+            break;
+        }
+        if (!(dir.attributes & FAT32_ATTR_DIRECTORY)) {
+            fat32_close(&dir);
+            err = FS_ERR_NOT_DIR;
+            break;
+        }
+        
+        fat32_entry_t entry;
+        fs_entry_t out;
+        uint32_t index = 0;
+        bool descend = false;
+        
+        while (fat32_dir_read(&dir, &entry) == FAT32_OK) {
+            if (!entry.filename[0]) break;  /* End of directory */
+            if (strcmp(entry.filename, ".") == 0 || strcmp(entry.filename, "..") == 0) {
+                continue;
+            }
+            if (index++ < resume[depth]) {
+                continue;
+            }
+            resume[depth] = index;
+            
+            err = join_path(current, entry.filename, child, FS_MAX_PATH);
+            if (err != FS_OK) break;
+            
+            strncpy(out.name, entry.filename, sizeof(out.name) - 1);
+            out.name[sizeof(out.name) - 1] = '\0';
+            out.size = entry.size;
+            out.is_dir = (entry.attr & FAT32_ATTR_DIRECTORY) != 0;
+            out.date = entry.date;
+            out.time = entry.time;
+            
+            if (!callback(child, &out, user_data)) {
+                err = FS_ERR_IO;
+                break;
+            }
+            
+            if (out.is_dir) {
+                if (depth + 1 >= FS_TREE_MAX_DEPTH) {
+                    err = FS_ERR_TOO_LARGE;
+                    break;
+                }
+                descend = true;
+                break;
+            }
+        }
+        fat32_close(&dir);
+        
+        if (err != FS_OK) break;
+        
+        if (descend) {
+            strcpy(current, child);
+            resume[++depth] = 0;
+            continue;
+        }
+        
+        /* Directory done: resume the parent */
+        if (depth == 0) break;
+        depth--;
+        parent_path(current);
+    }
+    
+    free(current);
+    free(child);
+    return err;
+}
+
+/* Entries deleted per directory scan: files are collected, the directory
+ * closed, then the batch deleted, so no handle is open during deletes */
+#define FS_RMTREE_BATCH 8
+
+fs_error_t fs_rmtree(const char *path, fs_tree_stats_t *stats) {
+    if (!path || strcmp(path, "/") == 0) {
+        return FS_ERR_INVALID_PATH;
+    }
+    
+    /* Refused up front, so a busy file does not leave the tree half deleted */
+    if (fs_worker_path_busy(path, true)) {
+        return FS_ERR_BUSY;
+    }
+    
+    fs_tree_stats_t totals = {0, 0, 0};
+    fs_error_t err = fs_is_dir(path);
+    if (err == FS_ERR_NOT_DIR) {
+        /* Plain file */
+        size_t size = 0;
+        fs_get_file_size(path, &size);
+        err = fs_delete(path);
+        if (err == FS_OK) {
+            totals.files = 1;
+            totals.bytes = size;
+        }
+        if (stats) *stats = totals;
+        return err;
+    }
+    if (err != FS_OK) {
+        return err;
+    }
+    
+    char *current = malloc(FS_MAX_PATH);
+    char *child = malloc(FS_MAX_PATH);
+    fs_entry_t *batch = malloc(FS_RMTREE_BATCH * sizeof(fs_entry_t));
+    if (!current || !child || !batch) {
+        free(current);
+        free(child);
+        free(batch);
+        return FS_ERR_NO_MEMORY;
+    }
+    strncpy(current, path, FS_MAX_PATH - 1);
+    current[FS_MAX_PATH - 1] = '\0';
+    size_t root_len = strlen(current);
+    
+    while (err == FS_OK) {
+        fat32_file_t dir;
+        fat32_error_t result = fat32_open(&dir, current);
+        if (result != FAT32_OK) {
+            err = translate_fat32_error(result);
+            break;
+        }
+        
+        /* Collect files up to the batch size, stopping at the first subdirectory */
+        fat32_entry_t entry;
+        int count = 0;
+        while (count < FS_RMTREE_BATCH && fat32_dir_read(&dir, &entry) == FAT32_OK) {
+            if (!entry.filename[0]) break;
+            if (strcmp(entry.filename, ".") == 0 || strcmp(entry.filename, "..") == 0) {
+                continue;
+            }
+            strncpy(batch[count].name, entry.filename, sizeof(batch[count].name) - 1);
+            batch[count].name[sizeof(batch[count].name) - 1] = '\0';
+            batch[count].size = entry.size;
+            batch[count].is_dir = (entry.attr & FAT32_ATTR_DIRECTORY) != 0;
+            count++;
+            if (batch[count - 1].is_dir) {
+                break;
+            }
+        }
+        fat32_close(&dir);
+        
+        /* Empty: remove it and continue with the parent */
+        if (count == 0) {
+            err = fs_delete(current);
+            if (err != FS_OK) break;
+            totals.dirs++;
+            if (strlen(current) <= root_len) break;
+            parent_path(current);
+            continue;
+        }
+        
+        for (int i = 0; i < count && err == FS_OK; i++) {
+            err = join_path(current, batch[i].name, child, FS_MAX_PATH);
+            if (err != FS_OK) break;
+            
+            if (batch[i].is_dir) {
+                strcpy(current, child);
+            } else {
+                err = fs_delete(child);
+                totals.files++;
+                totals.bytes += batch[i].size;
+            }
+        }
+    }
+    
+    free(current);
+    free(child);
+    free(batch);
+    if (stats) *stats = totals;
+    return err;
+}
+
+fs_error_t fs_mkdirs(const char *path) {
+    if (!path || path[0] != '/') {
+        return FS_ERR_INVALID_PATH;
+    }
+    
+    char partial[FS_MAX_PATH];
+    strncpy(partial, path, sizeof(partial) - 1);
+    partial[sizeof(partial) - 1] = '\0';
+    
+    /* Create each missing component from the root down */
+    for (char *p = partial + 1; ; p++) {
+        if (*p != '/' && *p != '\0') {
+            continue;
+        }
+        
+        char saved = *p;
+        *p = '\0';
+        fs_error_t err = fs_is_dir(partial);
+        if (err == FS_ERR_NOT_FOUND) {
+            err = fs_mkdir(partial);
+        }
+        if (err != FS_OK) {
+            return err;
+        }
+        *p = saved;
+        
+        if (saved == '\0' || p[1] == '\0') {
+            break;
+        }
+    }
+    return FS_OK;
+}
+
+/* Copy one file in fixed-size chunks, replacing dst */
+#define FS_COPY_CHUNK_SIZE 4096
+
+static fs_error_t copy_file(const char *src, const char *dst, uint8_t *buffer, uint32_t *copied) {
+    /* An existing file is replaced below; a directory, even an empty one, is not */
+    if (fs_is_dir(dst) == FS_OK) {
+        return FS_ERR_NOT_FILE;
+    }
+    
+    fat32_file_t in;
+    fat32_error_t result = fat32_open(&in, src);
+    if (result != FAT32_OK) {
+        return translate_fat32_error(result);
+    }
+    
+    dentry_forget_tree(dst);
+    bool existed = (fat32_delete(dst) == FAT32_OK);
+    
+    fat32_file_t out;
+    result = fat32_create(&out, dst);
+    if (result != FAT32_OK) {
+        fat32_close(&in);
+        return translate_fat32_error(result);
+    }
+    fat_alloc_reserve(&out, fat32_size(&in));
+    
+    uint32_t remaining = fat32_size(&in);
+    fs_error_t err = FS_OK;
+    while (remaining > 0) {
+        size_t to_read = remaining < FS_COPY_CHUNK_SIZE ? remaining : FS_COPY_CHUNK_SIZE;
+        size_t bytes_read = 0;
+        size_t bytes_written = 0;
+        
+        result = fat_io_read(&in, buffer, to_read, &bytes_read);
+        if (result == FAT32_OK && bytes_read > 0) {
+            result = fat_io_write(&out, buffer, bytes_read, &bytes_written);
+        }
+        if (result != FAT32_OK) {
+            err = translate_fat32_error(result);
+            break;
+        }
+        if (bytes_read == 0 || bytes_written != bytes_read) {
+            err = FS_ERR_IO;
+            break;
+        }
+        remaining -= bytes_read;
+        *copied += bytes_read;
+    }
+    
+    fat32_close(&out);
+    fat32_close(&in);
+    if (err == FS_OK) {
+        fs_notify_change(dst, existed ? FS_CHANGE_MODIFIED : FS_CHANGE_CREATED);
+    }
+    return err;
+}
+
+typedef struct {
+    const char *src;
+    const char *dst;
+    uint8_t *buffer;
+    char *target;
+    fs_tree_stats_t *totals;
+    fs_error_t error;
+} copy_walk_t;
+
+static bool copy_walk_callback(const char *path, const fs_entry_t *entry, void *user_data) {
+    copy_walk_t *ctx = (copy_walk_t *)user_data;
+    
+    /* Same relative path under the destination */
+    const char *relative = path + strlen(ctx->src);
+    int n = snprintf(ctx->target, FS_MAX_PATH, "%s%s", ctx->dst,
+                     (relative[0] == '/' && strcmp(ctx->dst, "/") == 0) ? relative + 1 : relative);
+    if (n < 0 || n >= FS_MAX_PATH) {
+        ctx->error = FS_ERR_INVALID_PATH;
+        return false;
+    }
+    
+    if (entry->is_dir) {
+        ctx->error = fs_mkdir(ctx->target);
+        ctx->totals->dirs++;
+    } else {
+        ctx->error = copy_file(path, ctx->target, ctx->buffer, &ctx->totals->bytes);
+        ctx->totals->files++;
+    }
+    return ctx->error == FS_OK;
+}
+
+fs_error_t fs_copy(const char *src, const char *dst, fs_tree_stats_t *stats) {
+    if (!src || !dst || fs_path_within(dst, src)) {
+        return FS_ERR_INVALID_PATH;
+    }
+    
+    if (fs_worker_path_busy(src, false) || fs_worker_path_busy(dst, true)) {
+        return FS_ERR_BUSY;
+    }
+    
+    fs_error_t err = fs_is_dir(src);
+    if (err != FS_OK && err != FS_ERR_NOT_DIR) {
+        return err;
+    }
+    bool is_dir = (err == FS_OK);
+    
+    uint8_t *buffer = malloc(FS_COPY_CHUNK_SIZE);
+    if (!buffer) {
+        return FS_ERR_NO_MEMORY;
+    }
+    
+    fs_tree_stats_t totals = {0, 0, 0};
+    if (!is_dir) {
+        err = copy_file(src, dst, buffer, &totals.bytes);
+        if (err == FS_OK) {
+            totals.files = 1;
+        }
+    } else {
+        err = fs_mkdir(dst);
+        if (err == FS_OK) {
+            totals.dirs = 1;
+            copy_walk_t ctx = { src, dst, buffer, malloc(FS_MAX_PATH), &totals, FS_OK };
+            if (!ctx.target) {
+                err = FS_ERR_NO_MEMORY;
+            } else {
+                err = fs_walk(src, copy_walk_callback, &ctx);
+                if (ctx.error != FS_OK) {
+                    err = ctx.error;
+                }
+                free(ctx.target);
+            }
+        }
+    }
+    
+    free(buffer);
+    if (stats) *stats = totals;
+    return err;
+}
+
+fs_error_t fs_move(const char *src, const char *dst) {
+    if (!src || !dst || strcmp(src, "/") == 0 || fs_path_within(dst, src)) {
+        return FS_ERR_INVALID_PATH;
+    }
+    
+    if (!fat32_is_mounted()) {
+        return FS_ERR_NOT_MOUNTED;
+    }
+    
+    if (fs_worker_path_busy(src, true) || fs_worker_path_busy(dst, true)) {
+        return FS_ERR_BUSY;
+    }
+    
+    fs_error_t err = fs_is_dir(dst);
+    if (err == FS_OK || err == FS_ERR_NOT_DIR) {
+        return FS_ERR_EXISTS;
+    }
+    
+    fat32_error_t result = fat32_rename(src, dst);
+    err = translate_fat32_error(result);
+    if (err == FS_OK) {
+        fs_notify_change(src, FS_CHANGE_DELETED);
+        fs_notify_change(dst, FS_CHANGE_CREATED);
+        return err;
+    }
+    if (err == FS_ERR_NOT_FOUND || err == FS_ERR_EXISTS) {
+        return err;
+    }
+    
+    /* Rename refused (e.g. across directories): copy, then delete the source */
+    DEBUG_PRINTF("[FS] Move: rename failed (%d), copying instead\n", result);
+    err = fs_copy(src, dst, NULL);
+    if (err == FS_OK) {
+        err = fs_rmtree(src, NULL);
+    }
+    return err;
+}
+
+static bool du_walk_callback(const char *path, const fs_entry_t *entry, void *user_data) {
+    fs_tree_stats_t *totals = (fs_tree_stats_t *)user_data;
+    (void)path;
+    
+    if (entry->is_dir) {
+        totals->dirs++;
+    } else {
+        totals->files++;
+        totals->bytes += entry->size;
+    }
+    return true;
+}
+
+fs_error_t fs_du(const char *path, fs_tree_stats_t *stats) {
+    if (!path || !stats) {
+        return FS_ERR_INVALID_PATH;
+    }
+    
+    memset(stats, 0, sizeof(*stats));
+    fs_error_t err = fs_is_dir(path);
+    if (err == FS_ERR_NOT_DIR) {
+        size_t size = 0;
+        err = fs_get_file_size(path, &size);
+        stats->files = 1;
+        stats->bytes = size;
+        return err;
+    }
+    if (err != FS_OK) {
+        return err;
+    }
+    
+    return fs_walk(path, du_walk_callback, stats);
+}
+
+/* Search */
+
+bool fs_glob_match(const char *pattern, const char *name) {
+    const char *star = NULL;
+    const char *resume = NULL;
+    
+    while (*name) {
+        if (*pattern == '*') {
+            star = pattern++;
+            resume = name;
+        } else if (*pattern == '?' ||
+                   tolower((unsigned char)*pattern) == tolower((unsigned char)*name)) {
+            pattern++;
+            name++;
+        } else if (star) {
+            /* Let the last * swallow one more character */
+            pattern = star + 1;
+            name = ++resume;
+        } else {
+            return false;
+        }
+    }
+    
+    while (*pattern == '*') {
+        pattern++;
+    }
+    return *pattern == '\0';
+}
+
+typedef struct {
+    const char *pattern;
+    fs_walk_callback_t callback;
+    void *user_data;
+    fs_search_stats_t *stats;
+} find_walk_t;
+
+static bool find_walk_callback(const char *path, const fs_entry_t *entry, void *user_data) {
+    find_walk_t *ctx = (find_walk_t *)user_data;
+    
+    ctx->stats->files++;
+    if (!fs_glob_match(ctx->pattern, entry->name)) {
+        return true;
+    }
+    ctx->stats->matches++;
+    return ctx->callback(path, entry, ctx->user_data);
+}
+
+fs_error_t fs_find(const char *dir, const char *pattern, fs_walk_callback_t callback,
+                   void *user_data, fs_search_stats_t *stats) {
+    if (!pattern || !callback) {
+        return FS_ERR_INVALID_PATH;
+    }
+    
+    fs_search_stats_t totals = {0, 0, 0};
+    find_walk_t ctx = { pattern, callback, user_data, &totals };
+    fs_error_t err = fs_walk(dir, find_walk_callback, &ctx);
+    if (stats) *stats = totals;
+    return err;
+}
+
+/* Compiled GREP pattern */
+#define GREP_MAX_LITERAL 64
+#define GREP_MAX_ATOMS 63                 /* States 0..atoms fit in a uint64_t */
+
+typedef struct {
+    char c;
+    bool any;                         /* . */
+    bool star;                        /* Followed by * */
+} grep_atom_t;
+
+typedef struct {
+    grep_atom_t atoms[GREP_MAX_ATOMS];
+    uint8_t atom_count;
+    bool anchor_start;                /* ^ */
+    bool anchor_end;                  /* $ */
+    char literal[GREP_MAX_LITERAL];   /* Longest run that every match contains */
+    size_t literal_len;
+    uint8_t skip[256];                /* Horspool shift table for literal */
+} grep_pattern_t;
+
+/* Length of the atom at re: an escaped character takes two bytes */
+static size_t re_atom_len(const char *re) {
+    return (re[0] == '\\' && re[1]) ? 2 : 1;
+}
+
+/*
+ * The matcher tracks every atom a match could be at as one bit of a set
+ * (bit atom_count: matched), so a line costs its length times the atoms
+ * whatever the pattern; backtracking would be exponential in the stars.
+ * A starred atom can be skipped, so reaching it reaches the next one too.
+ */
+static uint64_t re_closure(const grep_pattern_t *pat, uint64_t states) {
+    for (uint8_t i = 0; i < pat->atom_count; i++) {
+        if ((states >> i & 1) && pat->atoms[i].star) {
+            states |= 1ull << (i + 1);
+        }
+    }
+    return states;
+}
+
+static uint64_t re_step(const grep_pattern_t *pat, uint64_t states, char c) {
+    uint64_t next = 0;
+    for (uint8_t i = 0; i < pat->atom_count; i++) {
+        const grep_atom_t *atom = &pat->atoms[i];
+        if ((states >> i & 1) && (atom->any || atom->c == c)) {
+            next |= 1ull << (atom->star ? i : i + 1);
+        }
+    }
+    return re_closure(pat, next);
+}
+
+/* True if the pattern matches anywhere in [text, end) */
+static bool re_match(const grep_pattern_t *pat, const char *text, const char *end) {
+    const uint64_t start = re_closure(pat, 1);
+    const uint64_t matched = 1ull << pat->atom_count;
+    uint64_t states = start;
+    for (;;) {
+        if ((states & matched) && (!pat->anchor_end || text == end)) return true;
+        if (text == end || states == 0) return false;
+        states = re_step(pat, states, *text++);
+        if (!pat->anchor_start) states |= start;
+    }
+}
+
+static fs_error_t grep_compile(grep_pattern_t *pat, const char *re) {
+    if (!re || !re[0]) {
+        return FS_ERR_INVALID_PATH;
+    }
+    
+    memset(pat, 0, sizeof(*pat));
+    
+    /* Pick the longest run of plain characters not followed by * */
+    char run[GREP_MAX_LITERAL];
+    size_t run_len = 0;
+    const char *p = re;
+    if (*p == '^') {
+        pat->anchor_start = true;
+        p++;
+    }
+    while (*p) {
+        if (p[0] == '$' && p[1] == '\0') {
+            pat->anchor_end = true;
+            break;
+        }
+        if (pat->atom_count == GREP_MAX_ATOMS) {
+            return FS_ERR_INVALID_PATH;
+        }
+        size_t len = re_atom_len(p);
+        bool plain = p[0] != '.' || len == 2;
+        bool starred = (p[len] == '*');
+        
+        grep_atom_t *atom = &pat->atoms[pat->atom_count++];
+        atom->c = p[len - 1];
+        atom->any = !plain;
+        atom->star = starred;
+        
+        if (plain && !starred && run_len < GREP_MAX_LITERAL) {
+            run[run_len++] = p[len - 1];
+        } else {
+            run_len = 0;
+        }
+        if (run_len > pat->literal_len) {
+            memcpy(pat->literal, run, run_len);
+            pat->literal_len = run_len;
+        }
+        p += len + (starred ? 1 : 0);
+    }
+    
+    for (int i = 0; i < 256; i++) {
+        pat->skip[i] = (uint8_t)(pat->literal_len ? pat->literal_len : 1);
+    }
+    for (size_t i = 0; i + 1 < pat->literal_len; i++) {
+        pat->skip[(uint8_t)pat->literal[i]] = (uint8_t)(pat->literal_len - 1 - i);
+    }
+    return FS_OK;
+}
+
+/* Next occurrence of the literal in [text, end), or NULL */
+static const char *grep_find_literal(const grep_pattern_t *pat, const char *text, const char *end) {
+    size_t n = pat->literal_len;
+    if ((size_t)(end - text) < n) return NULL;
+    
+    if (n == 1) {
+        return memchr(text, pat->literal[0], end - text);
+    }
+    
+    /* Horspool: compare the last byte first, shift by the table */
+    const char last = pat->literal[n - 1];
+    const char *p = text;
+    while (p + n <= end) {
+        char c = p[n - 1];
+        if (c == last && memcmp(p, pat->literal, n - 1) == 0) {
+            return p;
+        }
+        p += pat->skip[(uint8_t)c];
+    }
+    return NULL;
+}
+
+static uint32_t count_newlines(const char *text, const char *end) {
+    uint32_t count = 0;
+    while (text < end && (text = memchr(text, '\n', end - text)) != NULL) {
+        count++;
+        text++;
+    }
+    return count;
+}
+
+static fs_error_t grep_file(const char *path, const grep_pattern_t *pat, char *buffer,
+                            fs_grep_callback_t callback, void *user_data,
+                            fs_search_stats_t *stats) {
     fat32_file_t file;
     fat32_error_t result = fat32_open(&file, path);
     if (result != FAT32_OK) {
         return translate_fat32_error(result);
     }
+    if (file.attributes & FAT32_ATTR_DIRECTORY) {
+        fat32_close(&file);
+        return FS_ERR_NOT_FILE;
+    }
+    stats->files++;
     
-    /* Get file info */
-    bool is_dir = (file.attributes & FAT32_ATTR_DIRECTORY) != 0;
-    uint32_t size = is_dir ? 0 : fat32_size(&file);
+    size_t carry = 0;       /* Unfinished line kept at the start of buffer */
+    uint32_t line = 1;      /* Line number of buffer[0] */
+    bool eof = false;
+    fs_error_t err = FS_OK;
+    
+    while (!eof && err == FS_OK) {
+        size_t bytes_read = 0;
+        result = fat32_read(&file, buffer + carry, FS_GREP_CHUNK_SIZE, &bytes_read);
+        if (result != FAT32_OK) {
+            err = translate_fat32_error(result);
+            break;
+        }
+        eof = (bytes_read == 0);
+        stats->bytes += bytes_read;
+        
+        size_t avail = carry + bytes_read;
+        const char *text = buffer;
+        const char *end = text + avail;
+        
+        /* Stop at the last complete line unless the tail is too long to keep */
+        if (!eof) {
+            const char *nl = end;
+            while (nl > text && nl[-1] != '\n') nl--;
+            if ((size_t)(end - nl) <= FS_GREP_MAX_LINE) {
+                end = nl;
+            }
+        }
+        
+        const char *pos = text;
+        const char *counted = text;
+        while (pos < end) {
+            const char *hit = pat->literal_len ? grep_find_literal(pat, pos, end) : pos;
+            if (!hit) break;
+            
+            const char *line_start = hit;
+            while (line_start > pos && line_start[-1] != '\n') line_start--;
+            const char *line_end = memchr(hit, '\n', end - hit);
+            if (!line_end) line_end = end;
+            
+            line += count_newlines(counted, line_start);
+            counted = line_start;
+            
+            const char *text_end = line_end;
+            if (text_end > line_start && text_end[-1] == '\r') text_end--;
+            
+            if (re_match(pat, line_start, text_end)) {
+                stats->matches++;
+                if (!callback(path, line, line_start, text_end - line_start, user_data)) {
+                    err = FS_ERR_IO;
+                    break;
+                }
+            }
+            pos = line_end + 1;
+        }
+        line += count_newlines(counted, end);
+        
+        carry = avail - (end - text);
+        memmove(buffer, end, carry);
+    }
     
     fat32_close(&file);
+    return err;
+}
+
+typedef struct {
+    const grep_pattern_t *pattern;
+    char *buffer;
+    fs_grep_callback_t callback;
+    void *user_data;
+    fs_search_stats_t *stats;
+    fs_error_t error;
+} grep_walk_t;
+
+static bool grep_walk_callback(const char *path, const fs_entry_t *entry, void *user_data) {
+    grep_walk_t *ctx = (grep_walk_t *)user_data;
+    if (entry->is_dir) {
+        return true;
+    }
+    ctx->error = grep_file(path, ctx->pattern, ctx->buffer, ctx->callback,
+                           ctx->user_data, ctx->stats);
+    return ctx->error == FS_OK;
+}
+
+fs_error_t fs_grep(const char *path, const char *pattern, fs_grep_callback_t callback,
+                   void *user_data, fs_search_stats_t *stats) {
+    if (!path || !callback) {
+        return FS_ERR_INVALID_PATH;
+    }
+    
+    if (fs_worker_path_busy(path, false)) {
+        return FS_ERR_BUSY;
+    }
+    
+    grep_pattern_t *pat = malloc(sizeof(grep_pattern_t));
+    char *buffer = malloc(FS_GREP_CHUNK_SIZE + FS_GREP_MAX_LINE);
+    if (!pat || !buffer) {
+        free(pat);
+        free(buffer);
+        return FS_ERR_NO_MEMORY;
+    }
+    
+    fs_search_stats_t totals = {0, 0, 0};
+    fs_error_t err = grep_compile(pat, pattern);
+    if (err == FS_OK) {
+        err = fs_is_dir(path);
+        if (err == FS_ERR_NOT_DIR) {
+            err = grep_file(path, pat, buffer, callback, user_data, &totals);
+        } else if (err == FS_OK) {
+            grep_walk_t ctx = { pat, buffer, callback, user_data, &totals, FS_OK };
+            err = fs_walk(path, grep_walk_callback, &ctx);
+            if (ctx.error != FS_OK) {
+                err = ctx.error;
+            }
+        }
+    }
+    
+    free(pat);
+    free(buffer);
+    if (stats) *stats = totals;
+    return err;
+}
+
+fs_error_t fs_stat(const char *path, char **json_out) {
+    if (!path || !json_out) {
+        return FS_ERR_INVALID_PATH;
+    }
+    
+    uint8_t attributes;
+    uint32_t size;
+    fs_error_t err = dentry_lookup(path, &attributes, &size);
+    if (err != FS_OK) {
+        return err;
+    }
+    bool is_dir = (attributes & FAT32_ATTR_DIRECTORY) != 0;
     
     /* Format as JSON */
     char *json = malloc(512);
@@ -600,7 +1745,7 @@ fs_error_t fs_stat(const char *path, char **json_out) {
     }
     
     char escaped_name[300];
-    json_escape_string(filename, escaped_name, sizeof(escaped_name));
+    fs_json_escape(filename, escaped_name, sizeof(escaped_name));
     
     snprintf(json, 512,
             "{\"name\":\"%s\",\"size\":%lu,\"is_dir\":%s}",
@@ -4,6 +4,7 @@
 #include <stdint.h>
 #include <stdbool.h>
 #include <stddef.h>
+#include "fat32.h"
 
 /**
  * @file picocalc_fs_handler.h
@@ -11,6 +12,10 @@
  * 
  * Provides high-level file system operations that wrap the FAT32 driver
  * with path normalization, JSON formatting, and error handling.
+ *
+ * The calls that read, replace, delete, copy or move whole files answer
+ * FS_ERR_BUSY while a filesystem worker job is in flight on the path
+ * (fs_worker_path_busy()), rather than touching a file the worker has open.
  */
 
 /* Error codes */
@@ -25,7 +30,8 @@ typedef enum {
     FS_ERR_INVALID_PATH,
     FS_ERR_NO_MEMORY,
     FS_ERR_TOO_LARGE,
-    FS_ERR_NOT_MOUNTED
+    FS_ERR_NOT_MOUNTED,
+    FS_ERR_BUSY
 } fs_error_t;
 
 /* File/directory entry information */
@@ -59,7 +65,8 @@ fs_error_t fs_normalize_path(const char *path, const char *cwd,
 
 /**
  * List directory contents
- * Returns JSON array of entries
+ * Returns JSON array of entries, built in a single heap buffer.
+ * Prefer fs_list_dir_stream() for large directories.
  * 
  * @param path Directory path
  * @param json_out Output: allocated JSON string (caller must free)
@@ -67,6 +74,56 @@ fs_error_t fs_normalize_path(const char *path, const char *cwd,
  */
 fs_error_t fs_list_dir(const char *path, char **json_out);
 
+/**
+ * Directory listing callback
+ * Called once per entry; return false to stop the listing
+ */
+typedef bool (*fs_list_callback_t)(const fs_entry_t *entry, void *user_data);
+
+/**
+ * Stream directory contents entry by entry
+ * Nothing is buffered: each entry is handed to the callback as it is read
+ * from the directory cluster chain. "." and ".." are skipped.
+ * 
+ * @param path Directory path
+ * @param offset Number of entries to skip
+ * @param count Maximum number of entries to report (0 = no limit)
+ * @param callback Function called for each entry
+ * @param user_data User data passed to callback
+ * @return FS_OK on success, FS_ERR_IO if the callback aborted
+ */
+fs_error_t fs_list_dir_stream(const char *path, uint32_t offset, uint32_t count,
+                              fs_list_callback_t callback, void *user_data);
+
+/**
+ * Format a directory entry as a JSON object
+ * 
+ * @param entry Entry to format
+ * @param out Output buffer (should hold at least 384 bytes)
+ * @param out_len Size of output buffer
+ * @return Length of the JSON text
+ */
+size_t fs_entry_to_json(const fs_entry_t *entry, char *out, size_t out_len);
+
+/**
+ * Escape a string for use inside JSON quotes (truncates to fit)
+ * 
+ * @param str String to escape
+ * @param out Output buffer
+ * @param out_len Size of output buffer
+ */
+void fs_json_escape(const char *str, char *out, size_t out_len);
+
+/**
+ * Check whether a path is an existing directory
+ * Only opens the path; no directory entries are read
+ * 
+ * @param path Path to check
+ * @return FS_OK if it is a directory, FS_ERR_NOT_DIR if it is a file,
+ *         other error code otherwise
+ */
+fs_error_t fs_is_dir(const char *path);
+
 /**
  * Read entire file into memory
  *
@@ -87,6 +144,32 @@ fs_error_t fs_read_file(const char *path, uint8_t **data, size_t *size);
  */
 fs_error_t fs_get_file_size(const char *path, size_t *size);
 
+/* A file read in pieces, the counterpart of fs_writer_t */
+typedef struct {
+    fat32_file_t file;
+    size_t size;
+    size_t read;
+} fs_reader_t;
+
+/**
+ * Open a file for fs_read_chunk() (same checks as fs_read_file, except
+ * that a job in flight on the path is not checked: the filesystem worker
+ * opens its own jobs' files this way)
+ */
+fs_error_t fs_read_begin(fs_reader_t *reader, const char *path);
+
+/**
+ * Read the next piece of the file
+ *
+ * @param got Bytes read, 0 at the end of the file
+ */
+fs_error_t fs_read_chunk(fs_reader_t *reader, uint8_t *buffer, size_t len, size_t *got);
+
+/**
+ * Close the file
+ */
+void fs_read_end(fs_reader_t *reader);
+
 /**
  * Read file in chunks using a callback
  * Avoids allocating large buffers by streaming data
@@ -109,6 +192,35 @@ fs_error_t fs_read_file_chunked(const char *path, fs_read_chunk_callback_t callb
  */
 fs_error_t fs_write_file(const char *path, const uint8_t *data, size_t size);
 
+/* A file written in pieces, so a large write can be spread over time */
+typedef struct {
+    fat32_file_t file;
+    char path[256];
+    size_t size;                /* Bytes announced to fs_write_begin() */
+    size_t written;
+    bool existed;
+} fs_writer_t;
+
+/**
+ * Start writing a file of known size (creates or overwrites, and lays it
+ * out like fs_write_file, but without the fs_worker_path_busy() check)
+ *
+ * @return FS_OK if the file is open for fs_write_chunk()
+ */
+fs_error_t fs_write_begin(fs_writer_t *writer, const char *path, size_t size);
+
+/**
+ * Append the next piece of the file
+ */
+fs_error_t fs_write_chunk(fs_writer_t *writer, const uint8_t *data, size_t len);
+
+/**
+ * Close the file and report the change
+ *
+ * @return FS_ERR_IO if fewer bytes than announced were written
+ */
+fs_error_t fs_write_end(fs_writer_t *writer);
+
 /**
  * Delete file or empty directory
  * 
@@ -125,6 +237,147 @@ fs_error_t fs_delete(const char *path);
  */
 fs_error_t fs_mkdir(const char *path);
 
+/* Limits for recursive operations */
+#define FS_MAX_PATH 256
+#define FS_TREE_MAX_DEPTH 16
+
+/* Totals reported by recursive operations */
+typedef struct {
+    uint32_t files;
+    uint32_t dirs;
+    uint32_t bytes;
+} fs_tree_stats_t;
+
+/**
+ * Tree walk callback
+ * Called with the full path of each entry, directories before their contents
+ * Return false to stop the walk
+ */
+typedef bool (*fs_walk_callback_t)(const char *path, const fs_entry_t *entry, void *user_data);
+
+/**
+ * Walk a directory tree depth-first
+ * Uses one path buffer and one open directory at a time, so memory does not
+ * grow with the size of the tree
+ * 
+ * @param path Root directory (not reported to the callback)
+ * @param callback Function called for each entry
+ * @param user_data User data passed to callback
+ * @return FS_OK on success, FS_ERR_IO if the callback aborted,
+ *         FS_ERR_TOO_LARGE if the tree is deeper than FS_TREE_MAX_DEPTH
+ */
+fs_error_t fs_walk(const char *path, fs_walk_callback_t callback, void *user_data);
+
+/**
+ * Delete a file or a directory and everything below it
+ * 
+ * @param path Path to delete (not "/")
+ * @param stats Output: files, directories and bytes removed (may be NULL)
+ * @return FS_OK on success, error code otherwise
+ */
+fs_error_t fs_rmtree(const char *path, fs_tree_stats_t *stats);
+
+/**
+ * Create a directory and any missing parents
+ * 
+ * @param path Directory path
+ * @return FS_OK on success (also if it already exists), error code otherwise
+ */
+fs_error_t fs_mkdirs(const char *path);
+
+/**
+ * Copy a file or directory tree on the card
+ * Files are copied in fixed-size chunks; an existing destination file is
+ * replaced, an existing destination directory is an error (FS_ERR_EXISTS
+ * for a tree, FS_ERR_NOT_FILE for a file)
+ * 
+ * @param src Source path
+ * @param dst Destination path (must not be inside src)
+ * @param stats Output: files, directories and bytes copied (may be NULL)
+ * @return FS_OK on success, error code otherwise
+ */
+fs_error_t fs_copy(const char *src, const char *dst, fs_tree_stats_t *stats);
+
+/**
+ * Move or rename a file or directory
+ * Renames the directory entry; falls back to copy and delete if the
+ * driver cannot rename across directories
+ * 
+ * @param src Source path
+ * @param dst Destination path (must not exist)
+ * @return FS_OK on success, error code otherwise
+ */
+fs_error_t fs_move(const char *src, const char *dst);
+
+/**
+ * Sum the sizes of all files below a path
+ * 
+ * @param path File or directory path
+ * @param stats Output: files, directories and bytes found
+ * @return FS_OK on success, error code otherwise
+ */
+fs_error_t fs_du(const char *path, fs_tree_stats_t *stats);
+
+/* Totals reported by FIND and GREP */
+typedef struct {
+    uint32_t files;     /* Entries visited (FIND) or files scanned (GREP) */
+    uint32_t bytes;     /* Bytes read from the card */
+    uint32_t matches;
+} fs_search_stats_t;
+
+/**
+ * Match a name against a glob pattern (case-insensitive, like FAT)
+ * Supports * (any run of characters) and ? (any single character)
+ * 
+ * @param pattern Glob pattern
+ * @param name Name to test
+ * @return true if the whole name matches
+ */
+bool fs_glob_match(const char *pattern, const char *name);
+
+/**
+ * Find entries whose name matches a glob pattern anywhere below dir
+ * 
+ * @param dir Directory to search
+ * @param pattern Glob pattern applied to entry names
+ * @param callback Called with the full path of each match (return false to stop)
+ * @param user_data User data passed to callback
+ * @param stats Output: entries visited and matches found (may be NULL)
+ * @return FS_OK on success, error code otherwise
+ */
+fs_error_t fs_find(const char *dir, const char *pattern, fs_walk_callback_t callback,
+                   void *user_data, fs_search_stats_t *stats);
+
+/**
+ * GREP match callback
+ * text is not NUL-terminated; return false to stop the search
+ */
+typedef bool (*fs_grep_callback_t)(const char *path, uint32_t line,
+                                   const char *text, size_t len, void *user_data);
+
+/**
+ * Search file contents for a pattern
+ * Files are read in FS_GREP_CHUNK_SIZE chunks; candidate lines are located
+ * with a Horspool scan for the pattern's longest literal run and then
+ * checked against the full pattern. Pattern syntax ("regex-lite"):
+ * ^ and $ anchors, . for any character, x* for repetition, \x for a
+ * literal x, at most 63 atoms. Matching never backtracks: a line costs
+ * its length times the pattern's atoms. Lines longer than
+ * FS_GREP_MAX_LINE are matched in pieces.
+ * 
+ * @param path Directory to search recursively, or a single file
+ * @param pattern Search pattern
+ * @param callback Called for each matching line
+ * @param user_data User data passed to callback
+ * @param stats Output: files and bytes scanned, matching lines (may be NULL)
+ * @return FS_OK on success, FS_ERR_INVALID_PATH for an empty or too long pattern,
+ *         other error code otherwise
+ */
+#define FS_GREP_CHUNK_SIZE 4096
+#define FS_GREP_MAX_LINE 512
+fs_error_t fs_grep(const char *path, const char *pattern, fs_grep_callback_t callback,
+                   void *user_data, fs_search_stats_t *stats);
+
 /**
  * Get file/directory information
  * Returns JSON object with file info
@@ -135,6 +388,76 @@ fs_error_t fs_mkdir(const char *path);
  */
 fs_error_t fs_stat(const char *path, char **json_out);
 
+/* Kinds of change reported by fs_notify_change() */
+typedef enum {
+    FS_CHANGE_CREATED = 0,
+    FS_CHANGE_MODIFIED,
+    FS_CHANGE_DELETED
+} fs_change_t;
+
+typedef void (*fs_change_listener_t)(const char *path, fs_change_t change);
+
+/**
+ * Register the function told about every change made on the card
+ * (NULL to remove). The file server uses it for WATCH.
+ */
+void fs_set_change_listener(fs_change_listener_t listener);
+
+/**
+ * Report a change made on the card
+ * Called by the fs_* functions and by every other writer on the device
+ * (editor, Lua, menu) after a successful create, write, mkdir or delete.
+ * Also drops the path and everything below it from the directory entry
+ * cache, so writers that bypass fs_* must call it whenever the card
+ * changed, even if the operation then failed.
+ * 
+ * @param path Absolute path of the changed file or directory
+ * @param change What happened
+ */
+void fs_notify_change(const char *path, fs_change_t change);
+
+/* Changes remembered for fs_changed_since() */
+#define FS_CHANGE_LOG 8
+
+/**
+ * Get the number of changes reported so far, for fs_changed_since()
+ */
+uint32_t fs_change_generation(void);
+
+/**
+ * Check whether path may have changed since fs_change_generation()
+ * returned generation: a change was reported for path, a directory above
+ * it or anything below it, or more than FS_CHANGE_LOG changes were
+ * reported since, so there is no telling.
+ */
+bool fs_changed_since(const char *path, uint32_t generation);
+
+/**
+ * Check whether path is dir itself or somewhere below it, ignoring case
+ */
+bool fs_path_within(const char *path, const char *dir);
+
+/* Directory entry cache: paths looked up by STAT, ISDIR and CAT */
+#define FS_DENTRY_CACHE_ENTRIES 64
+
+typedef struct {
+    uint32_t hits;
+    uint32_t misses;            /* Lookups that walked the card */
+    uint32_t invalidations;     /* Entries dropped by changes */
+} fs_dentry_stats_t;
+
+/**
+ * Forget every cached directory entry (card removed or remounted)
+ * Changes reported through fs_notify_change() drop the entries they affect
+ * on their own.
+ */
+void fs_dentry_cache_clear(void);
+
+/**
+ * Get the directory entry cache counters
+ */
+const fs_dentry_stats_t *fs_dentry_stats(void);
+
 /**
  * Get error message string
  * 
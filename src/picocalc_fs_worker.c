@@ -0,0 +1,255 @@
+/**
+ * @file picocalc_fs_worker.c
+ * @brief Filesystem jobs run in slices between frames
+ *
+ * Each ring is written by one side and read by the other: the head index
+ * is only stored by the producer, the tail only by the consumer, and the
+ * slot is published with a release store of head that the consumer reads
+ * with acquire. The job in progress belongs to fs_worker_run() alone.
+ *
+ * The in-flight list is kept on the submitting side: jobs join it in
+ * fs_worker_submit() and leave it in fs_worker_poll(), so the worker
+ * never touches it. A job can be in the submission ring, in progress or
+ * in the completion ring, hence its size.
+ */
+
+#include "picocalc_fs_worker.h"
+#include "debug.h"
+#include "pico/stdlib.h"
+#include <string.h>
+#include <stdlib.h>
+
+typedef struct {
+    fs_job_t *slots[FS_WORKER_QUEUE];
+    uint32_t head;               /* Next slot to fill, producer only */
+    uint32_t tail;               /* Next slot to take, consumer only */
+} job_ring_t;
+
+#define FS_WORKER_INFLIGHT (2 * FS_WORKER_QUEUE + 1)
+
+static struct {
+    job_ring_t submitted;
+    job_ring_t completed;
+    fs_job_t *current;           /* Job being stepped by fs_worker_run() */
+    fs_job_t *inflight[FS_WORKER_INFLIGHT];  /* Submitted, callback not yet called */
+    uint32_t inflight_count;
+    bool current_finished;       /* Waiting for room in the completion ring */
+    uint64_t last_poll_us;
+    fs_worker_stats_t stats;
+} g_worker;
+
+static bool ring_push(job_ring_t *ring, fs_job_t *job) {
+    uint32_t head = ring->head;
+    uint32_t tail = __atomic_load_n(&ring->tail, __ATOMIC_ACQUIRE);
+    if (head - tail == FS_WORKER_QUEUE) {
+        return false;
+    }
+    ring->slots[head % FS_WORKER_QUEUE] = job;
+    __atomic_store_n(&ring->head, head + 1, __ATOMIC_RELEASE);
+    return true;
+}
+
+static fs_job_t *ring_pop(job_ring_t *ring) {
+    uint32_t tail = ring->tail;
+    uint32_t head = __atomic_load_n(&ring->head, __ATOMIC_ACQUIRE);
+    if (head == tail) {
+        return NULL;
+    }
+    fs_job_t *job = ring->slots[tail % FS_WORKER_QUEUE];
+    __atomic_store_n(&ring->tail, tail + 1, __ATOMIC_RELEASE);
+    return job;
+}
+
+fs_job_t *fs_job_new(fs_job_type_t type, const char *path, fs_job_done_t done, void *user_data) {
+    if (!path || strlen(path) >= FS_MAX_PATH) {
+        return NULL;
+    }
+    fs_job_t *job = calloc(1, sizeof(fs_job_t));
+    if (!job) {
+        return NULL;
+    }
+    job->type = type;
+    strcpy(job->path, path);
+    job->done = done;
+    job->user_data = user_data;
+    return job;
+}
+
+void fs_job_free(fs_job_t *job) {
+    if (!job) {
+        return;
+    }
+    free(job->data);
+    free(job->json);
+    free(job);
+}
+
+bool fs_worker_submit(fs_job_t *job) {
+    if (g_worker.inflight_count == FS_WORKER_INFLIGHT || !ring_push(&g_worker.submitted, job)) {
+        return false;
+    }
+    g_worker.inflight[g_worker.inflight_count++] = job;
+    g_worker.stats.submitted++;
+    return true;
+}
+
+static void inflight_remove(fs_job_t *job) {
+    for (uint32_t i = 0; i < g_worker.inflight_count; i++) {
+        if (g_worker.inflight[i] == job) {
+            g_worker.inflight[i] = g_worker.inflight[--g_worker.inflight_count];
+            return;
+        }
+    }
+}
+
+/* Start a job; true if it is already finished */
+static bool job_start(fs_job_t *job) {
+    job->started = true;
+    job->offset = 0;
+    switch (job->type) {
+        case FS_JOB_READ:
+            job->result = fs_read_begin(&job->io.reader, job->path);
+            if (job->result != FS_OK) {
+                return true;
+            }
+            job->size = job->io.reader.size;
+            job->data = malloc(job->size + 1);
+            if (!job->data) {
+                fs_read_end(&job->io.reader);
+                job->result = FS_ERR_NO_MEMORY;
+                return true;
+            }
+            return false;
+        case FS_JOB_WRITE:
+            job->result = fs_write_begin(&job->io.writer, job->path, job->size);
+            return job->result != FS_OK;
+        case FS_JOB_STAT:
+            job->result = fs_stat(job->path, &job->json);
+            return true;
+        case FS_JOB_LIST:
+            job->result = fs_list_dir(job->path, &job->json);
+            return true;
+    }
+    job->result = FS_ERR_INVALID_PATH;
+    return true;
+}
+
+/* Move the next chunk of a READ or WRITE; true once the job is finished */
+static bool job_step(fs_job_t *job) {
+    size_t len = job->size - job->offset;
+    if (len > FS_WORKER_CHUNK) {
+        len = FS_WORKER_CHUNK;
+    }
+
+    if (job->type == FS_JOB_READ) {
+        size_t got = 0;
+        job->result = fs_read_chunk(&job->io.reader, job->data + job->offset, len, &got);
+        job->offset += got;
+        if (job->result == FS_OK && got == 0 && job->offset < job->size) {
+            job->result = FS_ERR_IO;
+        }
+        if (job->result != FS_OK || job->offset == job->size) {
+            fs_read_end(&job->io.reader);
+            if (job->result == FS_OK) {
+                job->data[job->size] = '\0';
+            } else {
+                free(job->data);
+                job->data = NULL;
+            }
+            return true;
+        }
+        return false;
+    }
+
+    /* WRITE: an empty file still goes through begin and end */
+    fs_error_t err = len ? fs_write_chunk(&job->io.writer, job->data + job->offset, len) : FS_OK;
+    job->offset += len;
+    if (err != FS_OK || job->offset == job->size) {
+        fs_error_t end_err = fs_write_end(&job->io.writer);
+        job->result = err != FS_OK ? err : end_err;
+        return true;
+    }
+    return false;
+}
+
+void fs_worker_run(uint32_t budget_us) {
+    uint64_t start = time_us_64();
+    bool stepped = false;
+
+    while (!stepped || time_us_64() - start < budget_us) {
+        if (g_worker.current_finished) {
+            if (!ring_push(&g_worker.completed, g_worker.current)) {
+                return;
+            }
+            g_worker.current = NULL;
+            g_worker.current_finished = false;
+        }
+        if (!g_worker.current) {
+            g_worker.current = ring_pop(&g_worker.submitted);
+            if (!g_worker.current) {
+                return;
+            }
+        }
+
+        uint64_t step_start = time_us_64();
+        fs_job_t *job = g_worker.current;
+        g_worker.current_finished = job->started ? job_step(job) : job_start(job);
+        g_worker.stats.slices++;
+        g_worker.stats.busy_us += (uint32_t)(time_us_64() - step_start);
+        stepped = true;
+    }
+
+    /* Hand over a job that finished on the last step */
+    if (g_worker.current_finished && ring_push(&g_worker.completed, g_worker.current)) {
+        g_worker.current = NULL;
+        g_worker.current_finished = false;
+    }
+}
+
+void fs_worker_poll(void) {
+    uint64_t now = time_us_64();
+    if (g_worker.last_poll_us) {
+        uint32_t gap = (uint32_t)(now - g_worker.last_poll_us);
+        if (gap > g_worker.stats.loop_gap_max_us) {
+            g_worker.stats.loop_gap_max_us = gap;
+        }
+    }
+    g_worker.last_poll_us = now;
+
+    fs_job_t *job;
+    while ((job = ring_pop(&g_worker.completed)) != NULL) {
+        g_worker.stats.completed++;
+        inflight_remove(job);
+        DEBUG_PRINTF("[FS_WORKER] Job %d on %s done: %s\n", job->type, job->path,
+                     fs_error_string(job->result));
+        if (job->done) {
+            job->done(job);
+        } else {
+            fs_job_free(job);
+        }
+    }
+}
+
+bool fs_worker_busy(void) {
+    return g_worker.current ||
+           __atomic_load_n(&g_worker.submitted.head, __ATOMIC_ACQUIRE) != g_worker.submitted.tail;
+}
+
+bool fs_worker_path_busy(const char *path, bool modify) {
+    for (uint32_t i = 0; i < g_worker.inflight_count; i++) {
+        const fs_job_t *job = g_worker.inflight[i];
+        bool holds = job->type == FS_JOB_WRITE || (modify && job->type == FS_JOB_READ);
+        if (holds && fs_path_within(job->path, path)) {
+            return true;
+        }
+    }
+    return false;
+}
+
+const fs_worker_stats_t *fs_worker_stats(void) {
+    return &g_worker.stats;
+}
+
+void fs_worker_reset_gap(void) {
+    g_worker.stats.loop_gap_max_us = 0;
+}
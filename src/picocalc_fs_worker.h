@@ -0,0 +1,132 @@
+#ifndef PICOCALC_FS_WORKER_H
+#define PICOCALC_FS_WORKER_H
+
+#include <stdbool.h>
+#include <stddef.h>
+#include <stdint.h>
+#include "picocalc_fs_handler.h"
+
+/**
+ * @file picocalc_fs_worker.h
+ * @brief Filesystem jobs run in slices between frames
+ *
+ * Work that would otherwise block the loop that asked for it (the write
+ * at the end of a PUT, a Lua read of a large file) is submitted as a job
+ * and carried out FS_WORKER_CHUNK bytes at a time by fs_worker_run(),
+ * which the program, menu, REPL and editor loops call with whatever time
+ * they have left in the frame. Only one job is in progress at a time, so
+ * jobs touching the same file complete in submission order.
+ *
+ * Jobs enter through a single-producer submission ring and leave through
+ * a single-consumer completion ring; fs_worker_poll() hands finished jobs
+ * to their callbacks. Both rings are lock-free, so fs_worker_run() can
+ * move to core 1 without changing the submitters or the callbacks. Today
+ * it runs on core 0 like everything else that uses the FAT32 driver.
+ *
+ * A READ or WRITE job is in flight from fs_worker_submit() until its
+ * callback is called, and a WRITE keeps its file open across slices.
+ * Code that would touch such a path checks fs_worker_path_busy() first
+ * and either answers Busy or runs the worker until the job is done.
+ */
+
+#define FS_WORKER_QUEUE 16           /* Jobs in each ring (power of two) */
+#define FS_WORKER_CHUNK 8192         /* Bytes read or written per slice */
+#define FS_WORKER_IDLE_US 10000      /* Budget in loops waiting for a key */
+
+typedef enum {
+    FS_JOB_READ,                 /* Whole file into data/size */
+    FS_JOB_WRITE,                /* data/size to path, like fs_write_file */
+    FS_JOB_STAT,                 /* fs_stat() JSON into json */
+    FS_JOB_LIST                  /* fs_list_dir() JSON into json */
+} fs_job_type_t;
+
+typedef struct fs_job fs_job_t;
+
+/**
+ * Completion callback, called from fs_worker_poll()
+ * The callback owns the job and releases it with fs_job_free().
+ */
+typedef void (*fs_job_done_t)(fs_job_t *job);
+
+struct fs_job {
+    fs_job_type_t type;
+    char path[FS_MAX_PATH];
+    uint8_t *data;               /* WRITE: source; READ: result (NUL-terminated) */
+    size_t size;
+    char *json;                  /* STAT and LIST result */
+    fs_error_t result;
+    fs_job_done_t done;
+    void *user_data;
+
+    /* Worker state */
+    bool started;
+    size_t offset;
+    union {
+        fs_writer_t writer;
+        fs_reader_t reader;
+    } io;
+};
+
+typedef struct {
+    uint32_t submitted;
+    uint32_t completed;
+    uint32_t slices;             /* fs_worker_run() steps taken */
+    uint32_t busy_us;            /* Time spent in those steps */
+    uint32_t loop_gap_max_us;    /* Longest time between fs_worker_poll() calls */
+} fs_worker_stats_t;
+
+/**
+ * Allocate a job for path
+ *
+ * @return Job, or NULL if out of memory or the path is too long
+ */
+fs_job_t *fs_job_new(fs_job_type_t type, const char *path, fs_job_done_t done, void *user_data);
+
+/**
+ * Release a job and its data and json buffers
+ */
+void fs_job_free(fs_job_t *job);
+
+/**
+ * Queue a job
+ * A WRITE job owns data from here on; it is freed with the job.
+ *
+ * @return false if the submission ring is full (the job is not taken)
+ */
+bool fs_worker_submit(fs_job_t *job);
+
+/**
+ * Advance queued jobs for about budget_us
+ * Always takes at least one step when a job is waiting, so work gets done
+ * even when a loop has no time to spare.
+ */
+void fs_worker_run(uint32_t budget_us);
+
+/**
+ * Call the callbacks of finished jobs
+ * Called once per loop iteration; the time between calls is recorded.
+ */
+void fs_worker_poll(void);
+
+/**
+ * Check for unfinished jobs
+ */
+bool fs_worker_busy(void);
+
+/**
+ * Check whether a job in flight holds path or anything below it
+ * Reading conflicts with WRITE jobs only; modifying (writing, deleting,
+ * moving) conflicts with READ jobs too. STAT and LIST jobs never do.
+ * Called from the submitting core.
+ *
+ * @param modify true if the caller is about to change path
+ */
+bool fs_worker_path_busy(const char *path, bool modify);
+
+/**
+ * Get the counters; loop_gap_max_us restarts on fs_worker_reset_gap()
+ */
+const fs_worker_stats_t *fs_worker_stats(void);
+void fs_worker_reset_gap(void);
+
+#endif /* PICOCALC_FS_WORKER_H */
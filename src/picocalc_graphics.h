@@ -23,7 +23,8 @@ void gfx_draw_line(int x1, int y1, int x2, int y2);
 /* Draw a horizontal line (optimized) */
 void gfx_draw_hline(int x1, int x2, int y);
 
-/* Bitmap font rendering */
+/* Bitmap font rendering; characters advance by GFX_CHAR_ADVANCE pixels */
+#define GFX_CHAR_ADVANCE 9
 void gfx_draw_char(int x, int y, int c);
 void gfx_draw_string(int x, int y, const char *s, int len);
 
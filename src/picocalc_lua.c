@@ -4,7 +4,11 @@
 #include "picocalc_keyboard.h"
 #include "picocalc_editor.h"
 #include "picocalc_wifi.h"
+#include "picocalc_pack.h"
+#include "picocalc_fileio.h"
 #include "fat32.h"
+#include "picocalc_fs_handler.h"
+#include "picocalc_fs_worker.h"
 #include "debug.h"
 #include <string.h>
 #include <stdlib.h>
@@ -13,6 +17,21 @@
 static int lua_error_flag = 0;
 static char lua_error_msg[512] = "";
 
+/* An fs.read_async() call waiting for its callback to run */
+typedef struct async_read {
+    fs_job_t *job;
+    lua_State *L;                /* NULL once the state has been closed */
+    int callback;                /* Registry reference */
+    bool finished;
+    struct async_read *next;
+} async_read_t;
+
+static async_read_t *async_reads = NULL;
+
+/* Where print() goes while remote REPL code runs (NULL: serial console) */
+static lua_print_sink_t print_sink = NULL;
+static void *print_sink_data = NULL;
+
 /* Helper: Set Lua table field to number */
 static void set_table_field_number(lua_State *L, const char *table, const char *field, lua_Number value) {
     lua_getglobal(L, table);
@@ -132,10 +151,34 @@ static int lua_setFPS(lua_State *L) {
     return 0;
 }
 
+/* Send print() arguments to the sink as one tab-separated line */
+static int print_to_sink(lua_State *L, int first, int n) {
+    lua_getglobal(L, "tostring");
+    for (int i = first; i < first + n; i++) {
+        size_t l;
+        lua_pushvalue(L, -1);
+        lua_pushvalue(L, i);
+        lua_call(L, 1, 1);
+        const char *s = lua_tolstring(L, -1, &l);
+        if (s == NULL)
+            return luaL_error(L, "'tostring' must return a string to 'print'");
+        if (i > first) print_sink("\t", 1, print_sink_data);
+        print_sink(s, l, print_sink_data);
+        lua_pop(L, 1);
+    }
+    lua_pop(L, 1);  /* pop tostring */
+    print_sink("\n", 1, print_sink_data);
+    return 0;
+}
+
 /* Custom print() function that outputs to serial console when DEBUG_OUTPUT is enabled */
 static int lua_print(lua_State *L) {
     int n = lua_gettop(L);  /* number of arguments */
     
+    if (print_sink) {
+        return print_to_sink(L, 1, n);
+    }
+    
     #ifdef DEBUG_OUTPUT
     /* Output to serial console if DEBUG_OUTPUT is enabled */
     lua_getglobal(L, "tostring");
@@ -252,6 +295,7 @@ static int lua_mkdir(lua_State *L) {
                 lua_pushstring(L, fat32_error_string(result));
                 return 2;
             }
+            fs_notify_change(current_path, FS_CHANGE_CREATED);
         } else {
             /* Some other error occurred */
             lua_pushboolean(L, 0);
@@ -266,6 +310,59 @@ static int lua_mkdir(lua_State *L) {
     return 1;
 }
 
+/* Unlink a pending read from the list */
+static void async_read_remove(async_read_t *read) {
+    async_read_t **link = &async_reads;
+    while (*link != read) {
+        link = &(*link)->next;
+    }
+    *link = read->next;
+}
+
+/* Worker completion: the callback runs from lua_call_async() */
+static void async_read_done(fs_job_t *job) {
+    async_read_t *read = (async_read_t *)job->user_data;
+    read->finished = true;
+    if (!read->L) {
+        async_read_remove(read);
+        fs_job_free(job);
+        free(read);
+    }
+}
+
+/* Lua: fs.read_async(path, callback) - callback(data) or callback(nil, err) */
+static int lua_fs_read_async(lua_State *L) {
+    const char *path = luaL_checkstring(L, 1);
+    luaL_checktype(L, 2, LUA_TFUNCTION);
+    
+    char full_path[FS_MAX_PATH];
+    snprintf(full_path, sizeof(full_path), "%s%s", path[0] == '/' ? "" : "/", path);
+    
+    async_read_t *read = (async_read_t *)calloc(1, sizeof(async_read_t));
+    fs_job_t *job = read ? fs_job_new(FS_JOB_READ, full_path, async_read_done, read) : NULL;
+    if (!job) {
+        free(read);
+        return luaL_error(L, "fs.read_async: not enough memory");
+    }
+    if (!fs_worker_submit(job)) {
+        fs_job_free(job);
+        free(read);
+        lua_pushboolean(L, 0);
+        lua_pushstring(L, "too many requests");
+        return 2;
+    }
+    
+    lua_pushvalue(L, 2);
+    read->callback = luaL_ref(L, LUA_REGISTRYINDEX);
+    read->job = job;
+    read->L = L;
+    read->next = async_reads;
+    async_reads = read;
+    
+    lua_pushboolean(L, 1);
+    return 1;
+}
+
 /* Initialize Lua and register LOAD81 API */
 lua_State *lua_init_load81(void) {
     lua_State *L = luaL_newstate();
@@ -344,6 +441,18 @@ lua_State *lua_init_load81(void) {
     /* Register WiFi API */
     wifi_register_lua(L);
     
+    /* Register asset packs and sprite() */
+    pack_register_lua(L);
+    
+    /* Point io.open and io.lines at the SD card */
+    fileio_register_lua(L);
+    
+    /* Register fs table for reads done between frames */
+    lua_newtable(L);
+    lua_pushcfunction(L, lua_fs_read_async);
+    lua_setfield(L, -2, "read_async");
+    lua_setglobal(L, "fs");
+    
     lua_error_flag = 0;
     lua_error_msg[0] = '\0';
     
@@ -351,11 +460,11 @@ lua_State *lua_init_load81(void) {
 }
 
 /* Load Lua program */
-int lua_load_program(lua_State *L, const char *code, const char *name) {
+int lua_load_program(lua_State *L, const char *code, size_t len, const char *name) {
     lua_error_flag = 0;
     lua_error_msg[0] = '\0';
     
-    if (luaL_loadbuffer(L, code, strlen(code), name)) {
+    if (luaL_loadbuffer(L, code, len, name)) {
         const char *err = lua_tostring(L, -1);
         if (err) {
             strncpy(lua_error_msg, err, sizeof(lua_error_msg) - 1);
@@ -378,6 +487,118 @@ int lua_load_program(lua_State *L, const char *code, const char *name) {
     return 0;
 }
 
+/* Swap new code into a running program */
+int lua_reload_program(lua_State *L, const char *code, size_t len, const char *name,
+                       char *err, size_t err_size) {
+    int result = 0;
+    
+    if (luaL_loadbuffer(L, code, len, name)) {
+        result = 1;
+    } else if (lua_pcall(L, 0, 0, 0)) {
+        result = 2;
+    }
+    
+    if (result != 0) {
+        const char *msg = lua_tostring(L, -1);
+        snprintf(err, err_size, "%s", msg ? msg : "unknown error");
+        lua_pop(L, 1);
+    }
+    return result;
+}
+
+/* Redirect print() */
+void lua_set_print_sink(lua_print_sink_t sink, void *user_data) {
+    print_sink = sink;
+    print_sink_data = user_data;
+}
+
+#define REPL_ENV_KEY "load81r.repl_env"
+
+/* REPL environment __newindex: update existing globals, keep new names */
+static int repl_env_newindex(lua_State *L) {
+    lua_pushglobaltable(L);
+    lua_pushvalue(L, 2);
+    lua_rawget(L, -2);
+    if (lua_isnil(L, -1)) {
+        lua_pop(L, 2);
+        lua_rawset(L, 1);
+    } else {
+        lua_pop(L, 1);
+        lua_insert(L, 2);  /* t, _G, k, v */
+        lua_settable(L, 2);
+    }
+    return 0;
+}
+
+/* Push the REPL environment, creating it on first use */
+static void push_repl_env(lua_State *L) {
+    lua_getfield(L, LUA_REGISTRYINDEX, REPL_ENV_KEY);
+    if (lua_istable(L, -1)) {
+        return;
+    }
+    lua_pop(L, 1);
+    
+    lua_newtable(L);
+    lua_newtable(L);
+    lua_pushglobaltable(L);
+    lua_setfield(L, -2, "__index");
+    lua_pushcfunction(L, repl_env_newindex);
+    lua_setfield(L, -2, "__newindex");
+    lua_setmetatable(L, -2);
+    lua_pushvalue(L, -1);
+    lua_setfield(L, LUA_REGISTRYINDEX, REPL_ENV_KEY);
+}
+
+/* Run one chunk typed at a remote REPL */
+int lua_run_repl_chunk(lua_State *L, const char *code, size_t len, char *err, size_t err_size) {
+    int base = lua_gettop(L);
+    int result = 0;
+    
+    /* Like the stand-alone interpreter: try as an expression first */
+    luaL_Buffer b;
+    luaL_buffinit(L, &b);
+    luaL_addstring(&b, "return ");
+    luaL_addlstring(&b, code, len);
+    luaL_pushresult(&b);
+    size_t expr_len;
+    const char *expr = lua_tolstring(L, -1, &expr_len);
+    int status = luaL_loadbuffer(L, expr, expr_len, "=repl");
+    lua_remove(L, -2);  /* expression source */
+    if (status != 0) {
+        lua_pop(L, 1);
+        status = luaL_loadbuffer(L, code, len, "=repl");
+    }
+    
+    if (status != 0) {
+        result = 1;
+    } else {
+        /* The chunk's only upvalue is _ENV */
+        push_repl_env(L);
+        lua_setupvalue(L, -2, 1);
+        if (lua_pcall(L, 0, LUA_MULTRET, 0) != 0) {
+            result = 2;
+        }
+    }
+    
+    /* Show results with a protected print(), tostring may raise */
+    int nresults = lua_gettop(L) - base;
+    if (result == 0 && nresults > 0 && print_sink) {
+        lua_pushcfunction(L, lua_print);
+        lua_insert(L, base + 1);
+        if (lua_pcall(L, nresults, 0, 0) != 0) {
+            result = 2;
+        }
+    }
+    
+    if (result != 0) {
+        const char *msg = lua_tostring(L, -1);
+        snprintf(err, err_size, "%s", msg ? msg : "unknown error");
+    }
+    
+    lua_settop(L, base);
+    return result;
+}
+
 /* Call setup() function */
 void lua_call_setup(lua_State *L) {
     lua_getglobal(L, "setup");
@@ -447,8 +668,62 @@ void lua_update_keyboard(lua_State *L) {
     lua_pop(L, 1);  /* pop keyboard table */
 }
 
+/* Run the callbacks of finished fs.read_async() calls */
+void lua_call_async(lua_State *L) {
+    async_read_t *read = async_reads;
+    while (read) {
+        async_read_t *next = read->next;
+        if (read->L == L && read->finished) {
+            fs_job_t *job = read->job;
+            async_read_remove(read);
+            lua_rawgeti(L, LUA_REGISTRYINDEX, read->callback);
+            luaL_unref(L, LUA_REGISTRYINDEX, read->callback);
+            int nargs = 1;
+            if (job->result == FS_OK) {
+                lua_pushlstring(L, (const char *)job->data, job->size);
+            } else {
+                lua_pushnil(L);
+                lua_pushfstring(L, "%s: %s", job->path, fs_error_string(job->result));
+                nargs = 2;
+            }
+            fs_job_free(job);
+            free(read);
+            
+            if (lua_pcall(L, nargs, 0, 0)) {
+                const char *err = lua_tostring(L, -1);
+                if (err) {
+                    strncpy(lua_error_msg, err, sizeof(lua_error_msg) - 1);
+                    lua_error_msg[sizeof(lua_error_msg) - 1] = '\0';
+                }
+                lua_error_flag = 1;
+                lua_pop(L, 1);
+                return;
+            }
+            
+            /* The callback may have started reads of its own */
+            next = async_reads;
+        }
+        read = next;
+    }
+}
+
 /* Close Lua state */
 void lua_close_load81(lua_State *L) {
+    /* Reads still in flight are freed when the worker finishes them */
+    async_read_t *read = async_reads;
+    while (read) {
+        async_read_t *next = read->next;
+        if (read->L == L) {
+            if (read->finished) {
+                async_read_remove(read);
+                fs_job_free(read->job);
+                free(read);
+            } else {
+                read->L = NULL;
+            }
+        }
+        read = next;
+    }
     if (L) lua_close(L);
 }
 
@@ -8,8 +8,33 @@
 /* Initialize Lua state and register all LOAD81 API functions */
 lua_State *lua_init_load81(void);
 
-/* Load and execute a Lua program from string */
-int lua_load_program(lua_State *L, const char *code, const char *name);
+/* Load and execute a Lua program from source or a precompiled chunk */
+int lua_load_program(lua_State *L, const char *code, size_t len, const char *name);
+
+/*
+ * Compile code and re-run its top-level chunk in a running state, so the
+ * functions it defines replace the old ones while other globals keep their
+ * values. Errors are returned in err and do not set the program error flag.
+ * Returns 0 on success, 1 on a compile error, 2 on a runtime error.
+ */
+int lua_reload_program(lua_State *L, const char *code, size_t len, const char *name,
+                       char *err, size_t err_size);
+
+/* Receives print() output; text is not NUL-terminated */
+typedef void (*lua_print_sink_t)(const char *text, size_t len, void *user_data);
+
+/* Send print() output to sink instead of the serial console (NULL restores) */
+void lua_set_print_sink(lua_print_sink_t sink, void *user_data);
+
+/*
+ * Run code typed at a remote REPL. It is first tried as an expression
+ * ("return code") so values are shown; results are printed through the
+ * print sink. The chunk runs in a REPL environment stored in the registry,
+ * so REPL globals persist across calls; reads fall through to _G and
+ * assignments to existing globals update them. Returns 0 on success, 1 on
+ * a syntax error, 2 on a runtime error, with the message in err.
+ */
+int lua_run_repl_chunk(lua_State *L, const char *code, size_t len, char *err, size_t err_size);
 
 /* Execute setup() function if it exists */
 void lua_call_setup(lua_State *L);
@@ -17,6 +42,9 @@ void lua_call_setup(lua_State *L);
 /* Execute draw() function if it exists */
 void lua_call_draw(lua_State *L);
 
+/* Run the callbacks of fs.read_async() reads the worker has finished */
+void lua_call_async(lua_State *L);
+
 /* Update keyboard state in Lua tables */
 void lua_update_keyboard(lua_State *L);
 
@@ -9,230 +9,424 @@
 #include "picocalc_keyboard.h"
 #include "picocalc_wifi.h"
 #include "fat32.h"
+#include "picocalc_fs_handler.h"
+#include "picocalc_fat_io.h"
+#include "picocalc_fs_worker.h"
+#include "picocalc_prog_index.h"
+#include "picocalc_prefetch.h"
+#include "picocalc_repl_handler.h"
 #include "build_version.h"
+#include "pico/stdlib.h"
 #include "pico/cyw43_arch.h"
 #include <lua.h>
 #include <lauxlib.h>
 
-static MenuItem menu_items[MAX_MENU_ITEMS];
-static int menu_count = 0;
+/* Screen layout: list rows from the top down, each in a 16-pixel band */
+#define MENU_ROW_Y(k) (255 - (k) * 16)
+#define MENU_ROW_BOTTOM(k) (MENU_ROW_Y(k) - 3)
+#define MENU_ROW_TOP(k) (MENU_ROW_Y(k) + 12)
+#define MENU_SEARCH_BOTTOM 280
+#define MENU_SEARCH_TOP 298
+#define MENU_BG_R 0
+#define MENU_BG_G 0
+#define MENU_BG_B 50
+
+/* Rows that are not programs; "default" only when there is no index */
+static const char *const special_items[][2] = {
+    { "**REPL**", "[REPL]" },
+    { "**NEWFILE**", "[New file]" },
+    { "default", "Default Program" },
+};
+
+/* The list is a window onto the program index: row r is a special item
+ * for r < specials, otherwise index record first + r - specials. Only the
+ * rows on screen are read, into slot r % MENU_VISIBLE_ROWS. */
+static struct {
+    bool indexed;                      /* The program index could be read */
+    int specials;
+    uint32_t first;                    /* Index records matching the filter */
+    uint32_t end;
+    char filter[MENU_FILTER_MAX];
+    MenuItem rows[MENU_VISIBLE_ROWS];
+    int row_ids[MENU_VISIBLE_ROWS];    /* Row held by each slot, -1 if none */
+    uint64_t key_us;                   /* When the last key was read */
+} g_menu;
+
+/* Forget the materialized rows */
+static void menu_clear_rows(void) {
+    for (int i = 0; i < MENU_VISIBLE_ROWS; i++) {
+        g_menu.row_ids[i] = -1;
+    }
+}
+
+/* Narrow the list to the current filter; the specials only show unfiltered */
+static void menu_apply_filter(void) {
+    if (g_menu.indexed) {
+        prog_index_find_prefix(g_menu.filter, &g_menu.first, &g_menu.end);
+    } else {
+        g_menu.first = g_menu.end = 0;
+    }
+    if (g_menu.filter[0]) {
+        g_menu.specials = 0;
+    } else {
+        g_menu.specials = g_menu.indexed ? 2 : 3;
+    }
+    menu_clear_rows();
+}
 
 /* Initialize menu */
 void menu_init(void) {
-    menu_count = 0;
-    memset(menu_items, 0, sizeof(menu_items));
+    prog_index_close();
+    memset(&g_menu, 0, sizeof(g_menu));
+    menu_clear_rows();
 }
 
-/* Load programs from /load81/ directory */
+/* Load programs from the /load81/ index */
 int menu_load_programs(void) {
-    menu_count = 0;
+    uint64_t start = time_us_64();
     
-    DEBUG_PRINTF("Loading programs from /load81/ directory...\n");
+    /* The index is checked against the card once per boot, then kept up
+     * to date by fs_notify_change(), so this is normally a single read */
+    fs_error_t err = prog_index_refresh(PROG_INDEX_DIR, PROG_INDEX_FILE);
+    g_menu.indexed = err == FS_OK;
+    g_menu.filter[0] = '\0';
+    menu_apply_filter();
     
-    /* Try to open the /load81 directory - FAT32 will mount automatically if needed */
-    fat32_file_t dir;
-    fat32_entry_t entry;
-    fat32_error_t result = fat32_open(&dir, "/load81");
-    DEBUG_PRINTF("fat32_open(\"/load81\") returned: %d (%s)\n", result, fat32_error_string(result));
+    if (!g_menu.indexed) {
+        DEBUG_PRINTF("Could not read the program index: %s\n", fs_error_string(err));
+        DEBUG_PRINTF("No programs available, adding default program\n");
+        return menu_get_count();
+    }
     
-    if (result == FAT32_OK) {
-        DEBUG_PRINTF("Directory opened successfully, reading files...\n");
-        
-        /* Read directory entries - must check filename[0] for end of directory */
-        do {
-            result = fat32_dir_read(&dir, &entry);
-            if (result != FAT32_OK) {
-                DEBUG_PRINTF("Error reading directory: %s\n", fat32_error_string(result));
-                break;
-            }
-            
-            /* Check for end of directory (empty filename) */
-            if (!entry.filename[0]) {
-                break;
-            }
-            
-            DEBUG_PRINTF("Found file: '%s' (attr=0x%02X, size=%lu)\n", 
-                   entry.filename, entry.attr, (unsigned long)entry.size);
-            
-            /* Skip directories */
-            if (entry.attr & FAT32_ATTR_DIRECTORY) {
-                DEBUG_PRINTF("  -> Skipping (directory)\n");
-                continue;
-            }
-            
-            /* Check if it's a .lua file */
-            int len = strlen(entry.filename);
-            if (len > 4 && strcmp(&entry.filename[len-4], ".lua") == 0) {
-                DEBUG_PRINTF("  -> Adding to menu\n");
-                if (menu_count < MAX_MENU_ITEMS) {
-                    strncpy(menu_items[menu_count].filename, entry.filename, MAX_FILENAME_LEN - 1);
-                    strncpy(menu_items[menu_count].display_name, entry.filename, MAX_FILENAME_LEN - 1);
-                    menu_count++;
-                }
-            } else {
-                DEBUG_PRINTF("  -> Skipping (not .lua)\n");
-            }
-        } while (entry.filename[0] && menu_count < MAX_MENU_ITEMS);
-        
-        fat32_close(&dir);
+#ifdef DEBUG_OUTPUT
+    const prog_index_stats_t *stats = prog_index_stats();
+    DEBUG_PRINTF("Menu: %lu program(s) in %lu us (index %s, %lu walked, %lu titles read)\n",
+                 (unsigned long)prog_index_count(), (unsigned long)(time_us_64() - start),
+                 stats->last_validated ? "validated" : stats->last_rebuilt ? "updated" : "current",
+                 (unsigned long)stats->walked, (unsigned long)stats->titles_read);
+#else
+    (void)start;
+#endif
+    
+    return menu_get_count();
+}
+
+/* Fill an item, truncating names that do not fit */
+static void menu_set_item(MenuItem *item, const char *filename, const char *display_name,
+                          const char *title) {
+    snprintf(item->filename, sizeof(item->filename), "%s", filename);
+    snprintf(item->display_name, sizeof(item->display_name), "%s", display_name);
+    snprintf(item->title, sizeof(item->title), "%s", title);
+    item->load_ms = 0;
+}
+
+/* Get row r, reading it from the index if it is not in its slot */
+static const MenuItem *menu_row(int row) {
+    if (row < 0 || row >= menu_get_count()) return NULL;
+    
+    int slot = row % MENU_VISIBLE_ROWS;
+    MenuItem *item = &g_menu.rows[slot];
+    if (g_menu.row_ids[slot] == row) return item;
+    
+    if (row < g_menu.specials) {
+        menu_set_item(item, special_items[row][0], special_items[row][1], "");
     } else {
-        DEBUG_PRINTF("Could not open /load81/ directory, error: %d (%s)\n", result, fat32_error_string(result));
+        prog_record_t record;
+        if (!prog_index_get(g_menu.first + (uint32_t)(row - g_menu.specials), &record)) {
+            g_menu.row_ids[slot] = -1;
+            return NULL;
+        }
+        menu_set_item(item, record.name, record.name, record.title);
+        item->load_ms = record.runs ? record.load_ms : 0;
     }
+    g_menu.row_ids[slot] = row;
+    return item;
+}
+
+/* Draw list row k of the screen (list row scroll_offset + k), background included */
+static void menu_draw_row(int k, int row, bool selected) {
+    const int row_chars = 33;  /* (315 - 10) / 9 px per character */
+    int y = MENU_ROW_Y(k);
+    fb_fill_rows(MENU_ROW_BOTTOM(k), MENU_ROW_TOP(k), MENU_BG_R, MENU_BG_G, MENU_BG_B);
     
-    /* Always add REPL as first option */
-    if (menu_count < MAX_MENU_ITEMS) {
-        /* Shift existing items down */
-        for (int i = menu_count; i > 0; i--) {
-            menu_items[i] = menu_items[i-1];
-        }
-        strncpy(menu_items[0].filename, "**REPL**", MAX_FILENAME_LEN - 1);
-        strncpy(menu_items[0].display_name, "[REPL]", MAX_FILENAME_LEN - 1);
-        menu_count++;
+    const MenuItem *item = menu_row(row);
+    if (!item) return;
+    
+    if (selected) {
+        /* Highlight selected item */
+        g_draw_r = 255; g_draw_g = 255; g_draw_b = 0; g_draw_alpha = 128;
+        gfx_draw_box(5, y - 2, 315, y + 12);
+        g_draw_r = 0; g_draw_g = 0; g_draw_b = 0; g_draw_alpha = 255;
+    } else {
+        g_draw_r = 200; g_draw_g = 200; g_draw_b = 200; g_draw_alpha = 255;
     }
     
-    /* Add [New file] option as second item */
-    if (menu_count < MAX_MENU_ITEMS) {
-        /* Shift existing items down (except REPL) */
-        for (int i = menu_count; i > 1; i--) {
-            menu_items[i] = menu_items[i-1];
-        }
-        strncpy(menu_items[1].filename, "**NEWFILE**", MAX_FILENAME_LEN - 1);
-        strncpy(menu_items[1].display_name, "[New file]", MAX_FILENAME_LEN - 1);
-        menu_count++;
+    /* The name, then the title in the space left on the line */
+    int name_len = strlen(item->display_name);
+    if (name_len > row_chars) name_len = row_chars;
+    gfx_draw_string(10, y, item->display_name, name_len);
+    
+    int title_len = strlen(item->title);
+    int room = row_chars - name_len - 2;
+    if (title_len == 0 || room < 4) return;
+    if (title_len > room) title_len = room;
+    if (selected) {
+        g_draw_r = 80; g_draw_g = 60; g_draw_b = 0; g_draw_alpha = 255;
+    } else {
+        g_draw_r = 120; g_draw_g = 140; g_draw_b = 180; g_draw_alpha = 255;
+    }
+    gfx_draw_string(10 + (name_len + 2) * 9, y, item->title, title_len);
+}
+
+/* Draw all list rows */
+static void menu_draw_list(int scroll_offset, int selected) {
+    for (int k = 0; k < MENU_VISIBLE_ROWS; k++) {
+        menu_draw_row(k, scroll_offset + k, scroll_offset + k == selected);
+    }
+}
+
+/* Draw the line above the list: the prompt and how long the selected
+ * program last took to start, or the filter and its matches */
+static void menu_draw_search_line(bool typing, int selected) {
+    fb_fill_rows(MENU_SEARCH_BOTTOM, MENU_SEARCH_TOP, MENU_BG_R, MENU_BG_G, MENU_BG_B);
+    g_draw_r = 200; g_draw_g = 200; g_draw_b = 200; g_draw_alpha = 255;
+    char line[48];
+    int len;
+    if (typing || g_menu.filter[0]) {
+        len = snprintf(line, sizeof(line), "Find: %s%s", g_menu.filter, typing ? "_" : "");
+        gfx_draw_string(10, 285, line, len);
+        len = snprintf(line, sizeof(line), "%lu found", (unsigned long)(g_menu.end - g_menu.first));
+    } else {
+        gfx_draw_string(10, 285, "Select a program:", 17);
+        const MenuItem *item = menu_row(selected);
+        if (!item || !item->load_ms) return;
+        g_draw_r = 150; g_draw_g = 150; g_draw_b = 150; g_draw_alpha = 255;
+        len = snprintf(line, sizeof(line), "starts in %ums", (unsigned)item->load_ms);
     }
+    gfx_draw_string(320 - len * 9 - 5, 285, line, len);
+}
+
+/* Draw the whole screen */
+static void menu_draw_screen(int scroll_offset, int selected, bool typing) {
+    /* Clear screen */
+    fb_fill_background(MENU_BG_R, MENU_BG_G, MENU_BG_B);
     
-    /* If no files found, add default */
-    if (menu_count == 1) {
-        DEBUG_PRINTF("No .lua files found, adding default program\n");
-        strncpy(menu_items[1].filename, "default", MAX_FILENAME_LEN - 1);
-        strncpy(menu_items[1].display_name, "Default Program", MAX_FILENAME_LEN - 1);
-        menu_count = 2;
+    /* Draw title aligned with IP address */
+    g_draw_r = 255; g_draw_g = 255; g_draw_b = 0; g_draw_alpha = 255;
+    gfx_draw_string(10, 305, "LOAD81 on PicoCalc", 18);
+    
+    /* Draw WiFi status/IP in top right */
+    const char *wifi_status = wifi_get_status_string();
+    const char *wifi_ip = wifi_get_ip_string();
+    
+    /* Always try to show IP if we have one, otherwise show status */
+    if (strcmp(wifi_ip, "0.0.0.0") != 0) {
+        /* Have IP address - show it in green */
+        g_draw_r = 100; g_draw_g = 255; g_draw_b = 100; g_draw_alpha = 255;
+        /* Position IP address - screen is 320px wide, font is 9px per char (8px + 1px spacing)
+         * For IP like "192.168.178.122" (15 chars), need 135px width
+         * Start at x=180 to fit within 320px with margin: 180 + 135 = 315 */
+        gfx_draw_string(180, 305, wifi_ip, strlen(wifi_ip));
+    } else {
+        /* No IP - show status in blue/gray */
+        g_draw_r = 150; g_draw_g = 150; g_draw_b = 255; g_draw_alpha = 255;
+        gfx_draw_string(240, 305, wifi_status, strlen(wifi_status));
     }
     
-    DEBUG_PRINTF("Found %d program(s) total:\n", menu_count);
-    for (int i = 0; i < menu_count; i++) {
-        DEBUG_PRINTF("  [%d] %s (%s)\n", i, menu_items[i].display_name, menu_items[i].filename);
+    menu_draw_search_line(typing, selected);
+    
+    menu_draw_list(scroll_offset, selected);
+    
+    /* Draw instructions at bottom */
+    g_draw_r = 150; g_draw_g = 150; g_draw_b = 150; g_draw_alpha = 255;
+    if (typing) {
+        gfx_draw_string(10, 30, "Type a name  ENTER: Done", 24);
+        gfx_draw_string(10, 15, "ESC: Clear", 10);
+    } else {
+        gfx_draw_string(10, 30, "ENTER: Load  E: Edit  /: Find", 29);
+        gfx_draw_string(10, 15, "ESC: Cancel", 11);
     }
     
-    return menu_count;
+    /* Draw build version in lower right corner */
+    char build_str[32];
+    snprintf(build_str, sizeof(build_str), "v%s b%d", BUILD_VERSION, BUILD_NUMBER);
+    int build_len = strlen(build_str);
+    /* Position in lower right: 320 - (len * 9) - 5px margin */
+    int build_x = 320 - (build_len * 9) - 5;
+    g_draw_r = 100; g_draw_g = 100; g_draw_b = 100; g_draw_alpha = 255;
+    gfx_draw_string(build_x, 15, build_str, build_len);
+}
+
+/* Leave the menu: keep the chosen row, then release the index. The
+ * prefetched program is kept only if it is about to be started. */
+static int menu_finish(int result) {
+    if (result >= 0) {
+        menu_row(result & 0x7FFF);
+    }
+    if (result < 0 || (result & 0x8000) || result < g_menu.specials) {
+        prefetch_reset();
+    }
+    prog_index_close();
+    return result;
 }
 
 /* Display menu and select program */
 int menu_select_program(void) {
-    if (menu_count == 0) return -1;
+    if (menu_get_count() == 0) return -1;
     
     int selected = 0;
     int scroll_offset = 0;
-    const int items_per_screen = 14;  /* Reduced from 15 to prevent last item cutoff */
+    bool typing = false;        /* Keys go to the filter */
+    bool redraw_all = true;
+    bool redraw_list = false;   /* The filter changed */
+    bool drawn_typing = false;
+    int drawn_selected = -1;
+    int drawn_scroll = -1;
     
     while (1) {
-        /* Clear screen */
-        fb_fill_background(0, 0, 50);
-        
-        /* Draw title aligned with IP address */
-        g_draw_r = 255; g_draw_g = 255; g_draw_b = 0; g_draw_alpha = 255;
-        gfx_draw_string(10, 305, "LOAD81 on PicoCalc", 18);
-        
-        /* Draw WiFi status/IP in top right */
-        const char *wifi_status = wifi_get_status_string();
-        const char *wifi_ip = wifi_get_ip_string();
-        
-        /* Always try to show IP if we have one, otherwise show status */
-        if (strcmp(wifi_ip, "0.0.0.0") != 0) {
-            /* Have IP address - show it in green */
-            g_draw_r = 100; g_draw_g = 255; g_draw_b = 100; g_draw_alpha = 255;
-            /* Position IP address - screen is 320px wide, font is 9px per char (8px + 1px spacing)
-             * For IP like "192.168.178.122" (15 chars), need 135px width
-             * Start at x=180 to fit within 320px with margin: 180 + 135 = 315 */
-            gfx_draw_string(180, 305, wifi_ip, strlen(wifi_ip));
-        } else {
-            /* No IP - show status in blue/gray */
-            g_draw_r = 150; g_draw_g = 150; g_draw_b = 255; g_draw_alpha = 255;
-            gfx_draw_string(240, 305, wifi_status, strlen(wifi_status));
-        }
-        
-        g_draw_r = 200; g_draw_g = 200; g_draw_b = 200; g_draw_alpha = 255;
-        gfx_draw_string(10, 285, "Select a program:", 17);
-        
-        /* Draw menu items */
-        int y = 255;
-        for (int i = scroll_offset; i < menu_count && i < scroll_offset + items_per_screen; i++) {
-            if (i == selected) {
-                /* Highlight selected item */
-                g_draw_r = 255; g_draw_g = 255; g_draw_b = 0; g_draw_alpha = 128;
-                gfx_draw_box(5, y - 2, 315, y + 12);
-                g_draw_r = 0; g_draw_g = 0; g_draw_b = 0; g_draw_alpha = 255;
+        /* Redraw only what changed: the whole screen when the mode changed,
+         * the search line and list when the filter changed, the list when
+         * it scrolled, else the two rows the cursor moved between (plus
+         * the start time on the search line) */
+        if (redraw_all || typing != drawn_typing) {
+            menu_draw_screen(scroll_offset, selected, typing);
+            fb_present();
+        } else if (redraw_list) {
+            menu_draw_search_line(typing, selected);
+            menu_draw_list(scroll_offset, selected);
+            fb_present_rows(MENU_SEARCH_BOTTOM, MENU_SEARCH_TOP);
+            fb_present_rows(MENU_ROW_BOTTOM(MENU_VISIBLE_ROWS - 1), MENU_ROW_TOP(0));
+        } else if (selected != drawn_selected) {
+            if (scroll_offset != drawn_scroll) {
+                menu_draw_list(scroll_offset, selected);
+                fb_present_rows(MENU_ROW_BOTTOM(MENU_VISIBLE_ROWS - 1), MENU_ROW_TOP(0));
             } else {
-                g_draw_r = 200; g_draw_g = 200; g_draw_b = 200; g_draw_alpha = 255;
+                int old_k = drawn_selected - scroll_offset;
+                int new_k = selected - scroll_offset;
+                menu_draw_row(old_k, drawn_selected, false);
+                menu_draw_row(new_k, selected, true);
+                fb_present_rows(MENU_ROW_BOTTOM(old_k), MENU_ROW_TOP(old_k));
+                fb_present_rows(MENU_ROW_BOTTOM(new_k), MENU_ROW_TOP(new_k));
+            }
+            if (!typing && !g_menu.filter[0]) {
+                /* The start time shown is the selected program's */
+                menu_draw_search_line(typing, selected);
+                fb_present_rows(MENU_SEARCH_BOTTOM, MENU_SEARCH_TOP);
             }
-            
-            gfx_draw_string(10, y, menu_items[i].display_name, 
-                          strlen(menu_items[i].display_name));
-            y -= 16;
         }
         
-        /* Draw instructions at bottom */
-        g_draw_r = 150; g_draw_g = 150; g_draw_b = 150; g_draw_alpha = 255;
-        gfx_draw_string(10, 30, "UP/DOWN: Select  ENTER: Load", 29);
-        gfx_draw_string(10, 15, "E: Edit  ESC: Cancel", 20);
-        
-        /* Draw build version in lower right corner */
-        char build_str[32];
-        snprintf(build_str, sizeof(build_str), "v%s b%d", BUILD_VERSION, BUILD_NUMBER);
-        int build_len = strlen(build_str);
-        /* Position in lower right: 320 - (len * 9) - 5px margin */
-        int build_x = 320 - (build_len * 9) - 5;
-        g_draw_r = 100; g_draw_g = 100; g_draw_b = 100; g_draw_alpha = 255;
-        gfx_draw_string(build_x, 15, build_str, build_len);
-        
-        /* Present to screen */
-        fb_present();
+        /* Read and compile the program under the cursor while it rests */
+        const MenuItem *current = selected >= g_menu.specials ? menu_row(selected) : NULL;
+        prefetch_select(current ? current->filename : NULL);
+        redraw_all = false;
+        redraw_list = false;
+        drawn_typing = typing;
+        drawn_selected = selected;
+        drawn_scroll = scroll_offset;
         
         /* Wait for key with network polling */
         kb_reset_events();
         char key = 0;
         while (!kb_key_available()) {
             cyw43_arch_poll();  /* Poll network stack for incoming connections */
-            sleep_ms(10);
+            repl_service(NULL);  /* No program: remote REPL uses a scratch state */
+            if (fs_worker_busy()) {
+                fs_worker_run(FS_WORKER_IDLE_US);  /* Writes in place of the sleep */
+            } else {
+                sleep_ms(10);
+            }
+            fs_worker_poll();
+            prefetch_service();
         }
         key = kb_get_char();
+        g_menu.key_us = time_us_64();  /* Before menu_finish() and its index close */
         
         /* Debug: print key code */
         DEBUG_PRINTF("Key pressed: 0x%02X ('%c')\n", (unsigned char)key, 
                (key >= 32 && key < 127) ? key : '?');
         
+        int count = menu_get_count();
+        int filter_len = strlen(g_menu.filter);
+        bool filter_changed = false;
+        
         /* Handle input */
-        if (key == 0xB1) {  /* ESC (PicoCalc key code) */
-            return -1;
-        } else if (key == 0x0D || key == 0x0A) {  /* ENTER */
-            return selected;
-        } else if (key == 'e' || key == 'E') {  /* Edit */
-            return selected | 0x8000;  /* Set high bit to indicate edit mode */
-        } else if (key == 0xB5 || key == 'w' || key == 'W') {  /* UP arrow or W */
-            if (selected > 0) {
-                selected--;
-                if (selected < scroll_offset) scroll_offset = selected;
-            }
-        } else if (key == 0xB6 || key == 's' || key == 'S') {  /* DOWN arrow or S */
-            if (selected < menu_count - 1) {
-                selected++;
-                if (selected >= scroll_offset + items_per_screen) {
-                    scroll_offset = selected - items_per_screen + 1;
+        if (typing) {
+            if (key == (char)0xB1) {  /* ESC: drop the filter */
+                g_menu.filter[0] = '\0';
+                typing = false;
+                filter_changed = true;
+            } else if (key == 0x0D || key == 0x0A) {  /* ENTER: keep the filter */
+                typing = false;
+            } else if (key == 0x08 || key == (char)0xD4) {  /* BACKSPACE or DEL */
+                if (filter_len > 0) {
+                    g_menu.filter[filter_len - 1] = '\0';
+                } else {
+                    typing = false;
                 }
+                filter_changed = true;
+            } else if ((unsigned char)key >= 0x20 && (unsigned char)key < 0x7F) {
+                if (filter_len < MENU_FILTER_MAX - 1) {
+                    g_menu.filter[filter_len] = key;
+                    g_menu.filter[filter_len + 1] = '\0';
+                    filter_changed = true;
+                }
+            }
+        } else if (key == (char)0xB1) {  /* ESC (PicoCalc key code) */
+            if (!filter_len) {
+                return menu_finish(-1);
             }
+            g_menu.filter[0] = '\0';
+            filter_changed = true;
+        } else if (key == 0x0D || key == 0x0A) {  /* ENTER */
+            if (count > 0) return menu_finish(selected);
+        } else if (key == 'e' || key == 'E') {  /* Edit */
+            if (count > 0) return menu_finish(selected | 0x8000);  /* High bit: edit mode */
+        } else if (key == '/') {  /* Find */
+            typing = true;
+        }
+        
+        if (filter_changed) {
+            /* Type-ahead: the cursor goes to the first match */
+            menu_apply_filter();
+            selected = 0;
+            scroll_offset = 0;
+            redraw_list = true;
+            continue;
+        }
+        
+        /* Cursor movement; W and S are letters while typing */
+        if (key == (char)0xB5 || (!typing && (key == 'w' || key == 'W'))) {  /* UP arrow or W */
+            if (selected > 0) selected--;
+        } else if (key == (char)0xB6 || (!typing && (key == 's' || key == 'S'))) {  /* DOWN arrow or S */
+            if (selected < count - 1) selected++;
+        } else if (key == (char)0xB4) {  /* LEFT arrow: page up */
+            selected -= MENU_VISIBLE_ROWS;
+            if (selected < 0) selected = 0;
+        } else if (key == (char)0xB7) {  /* RIGHT arrow: page down */
+            selected += MENU_VISIBLE_ROWS;
+            if (selected > count - 1) selected = count > 0 ? count - 1 : 0;
+        }
+        if (selected < scroll_offset) {
+            scroll_offset = selected;
+        } else if (selected >= scroll_offset + MENU_VISIBLE_ROWS) {
+            scroll_offset = selected - MENU_VISIBLE_ROWS + 1;
         }
     }
 }
 
+/* Get the time the launching key was read */
+uint64_t menu_selected_at_us(void) {
+    return g_menu.key_us;
+}
+
 /* Get menu count */
 int menu_get_count(void) {
-    return menu_count;
+    return g_menu.specials + (int)(g_menu.end - g_menu.first);
 }
 
 /* Get menu item */
 const MenuItem *menu_get_item(int index) {
-    if (index < 0 || index >= menu_count) return NULL;
-    return &menu_items[index];
+    return menu_row(index);
 }
 
 /* Generate unique filename */
@@ -313,11 +507,13 @@ static char *create_new_file(void) {
     
     if (result != FAT32_OK) {
         DEBUG_PRINTF("Error writing file: %s\n", fat32_error_string(result));
+        fs_notify_change(fullpath, FS_CHANGE_CREATED);  /* Created, partly written */
         free(filename);
         return NULL;
     }
     
     DEBUG_PRINTF("Created new file: %s (%zu bytes)\n", filename, bytes_written);
+    fs_notify_change(fullpath, FS_CHANGE_CREATED);
     return filename;
 }
 
@@ -359,6 +555,13 @@ char *menu_load_file(const char *filename) {
     snprintf(fullpath, sizeof(fullpath), "/load81/%s", filename);
     DEBUG_PRINTF("Loading file: %s\n", fullpath);
     
+    /* An upload of the file may still be on the worker: let it finish */
+    while (fs_worker_path_busy(fullpath, false)) {
+        cyw43_arch_poll();
+        fs_worker_run(FS_WORKER_IDLE_US);
+        fs_worker_poll();
+    }
+    
     /* Open the file */
     fat32_file_t file;
     fat32_error_t result = fat32_open(&file, fullpath);
@@ -387,7 +590,7 @@ char *menu_load_file(const char *filename) {
     
     /* Read file content */
     size_t bytes_read = 0;
-    result = fat32_read(&file, buffer, file_size, &bytes_read);
+    result = fat_io_read(&file, buffer, file_size, &bytes_read);
     if (result != FAT32_OK) {
         DEBUG_PRINTF("Error reading file: %s\n", fat32_error_string(result));
         free(buffer);
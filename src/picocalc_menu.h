@@ -2,30 +2,40 @@
 #define PICOCALC_MENU_H
 
 #include <stdbool.h>
+#include <stdint.h>
+#include "picocalc_prog_index.h"
 
-#define MAX_MENU_ITEMS 32
-#define MAX_FILENAME_LEN 64
+#define MENU_VISIBLE_ROWS 14  /* Rows on screen, and the only rows held in RAM */
+#define MENU_FILTER_MAX 32
+#define MAX_FILENAME_LEN PROG_INDEX_NAME_MAX  /* Path below /load81 */
 
 /* Menu item structure */
 typedef struct {
     char filename[MAX_FILENAME_LEN];
     char display_name[MAX_FILENAME_LEN];
+    char title[PROG_INDEX_TITLE_MAX];  /* First comment line, may be empty */
+    uint16_t load_ms;                  /* Last key press to first frame, 0 if never run */
 } MenuItem;
 
 /* Initialize menu system */
 void menu_init(void);
 
-/* Load programs from /load81/ directory */
+/* Load programs from the /load81/ index (see picocalc_prog_index.h) */
 int menu_load_programs(void);
 
 /* Display menu and let user select a program */
 /* Returns index of selected program, or -1 if cancelled */
+/* Typing '/' filters the list to names starting with the typed prefix */
 int menu_select_program(void);
 
-/* Get number of menu items */
+/* time_us_64() when the key that ended the last menu_select_program() was read */
+uint64_t menu_selected_at_us(void);
+
+/* Get number of menu items (after filtering) */
 int menu_get_count(void);
 
-/* Get menu item by index */
+/* Get menu item by index; valid until the next call */
+/* The item returned by menu_select_program() stays valid until menu_init() */
 const MenuItem *menu_get_item(int index);
 
 /* Load program file content into buffer */
@@ -7,11 +7,30 @@
 #include <lauxlib.h>
 #include <string.h>
 #include <stdlib.h>
+#include "picocalc_nex_cache.h"
+#include "picocalc_nex_document.h"
+#include "picocalc_file_server.h"
+#include "picocalc_diag_server.h"
 #include "debug.h"
 
 #define NEX_PORT 1900
 #define NEX_TIMEOUT_MS 10000
 #define NEX_BUFFER_SIZE 65536
+#define NEX_LINE_MAX 1024        /* Longer lines are split */
+#define NEX_FETCH_META "nex.fetch"
+#define NEX_DNS_CACHE_SIZE 8
+#define NEX_DNS_TTL_MS (5 * 60 * 1000)   /* lwIP does not pass the record's TTL on */
+#define NEX_PREWARM_IDLE_MS 20000        /* Servers drop idle connections anyway */
+
+/*
+ * Prewarmed connections share MEMP_NUM_TCP_PCB with the file and
+ * diagnostic server clients and the page being loaded, which must always
+ * find a free pcb.
+ */
+#define NEX_PREWARM_MAX (MEMP_NUM_TCP_PCB - FILE_SERVER_MAX_CLIENTS - DIAG_MAX_CLIENTS - 1)
+#if NEX_PREWARM_MAX < 1 || NEX_PREWARM_MAX > 15
+#error "MEMP_NUM_TCP_PCB leaves no room for prewarmed NEX connections"
+#endif
 
 /* NEX connection state */
 typedef struct {
@@ -22,14 +41,334 @@ typedef struct {
     bool connected;
     bool complete;
     err_t error;
+    
+    /* Background revalidation of a cached page (heap-allocated) */
+    bool background;
+    bool dns_pending;
+    char url[256];
+    char path[256];
+    uint64_t start_us;
 } nex_connection_t;
 
+/* At most one revalidation runs at a time */
+static nex_connection_t *g_revalidate = NULL;
+
+/* Streaming fetch state; lives on the heap, owned by a Lua userdata */
+typedef enum {
+    NEX_FETCH_RESOLVING = 0,
+    NEX_FETCH_CONNECTING,
+    NEX_FETCH_RECEIVING,
+    NEX_FETCH_DONE,
+    NEX_FETCH_FAILED
+} nex_fetch_state_t;
+
+typedef struct {
+    struct tcp_pcb *pcb;
+    nex_fetch_state_t state;
+    const char *error;
+    char url[256];
+    char path[256];
+    
+    const char *source;          /* "network", "cache" or "stale" */
+    char *cached;                /* Served from nex_cache instead of the network */
+    size_t cached_len;
+    bool keep_copy;              /* Response still small enough to cache */
+    char *copy;                  /* Network response kept for nex_cache_store */
+    size_t copy_len;
+    
+    struct pbuf *queue;          /* Received, not yet parsed or acknowledged */
+    uint32_t queued;
+    bool remote_closed;
+    char tail[NEX_LINE_MAX];     /* Incomplete last line */
+    size_t tail_len;
+    
+    bool dns_pending;
+    bool prewarmed;              /* Uses a nex.prefetch() connection */
+    bool orphaned;               /* Userdata collected while DNS was pending */
+    int on_line_ref;             /* Function, or the document being filled */
+    bool to_document;
+    
+    uint64_t start_us;
+    uint64_t activity_us;
+    uint64_t first_line_us;
+    uint32_t bytes;
+    uint32_t peak_bytes;         /* Queued pbufs + tail */
+} nex_fetch_t;
+
+typedef struct {
+    nex_fetch_t *fetch;
+} nex_fetch_handle_t;
+
+/* Timings of the last completed nex.load or nex.fetch, for nex.stats() */
+static struct {
+    const char *op;
+    const char *source;          /* "network", "cache" or "stale" */
+    bool prewarmed;              /* Network load used a nex.prefetch() connection */
+    uint32_t first_line_ms;
+    uint32_t total_ms;
+    uint32_t bytes;
+    uint32_t peak_bytes;
+} g_nex_stats;
+
+/* Resolved hostnames, kept longer than lwIP's small DNS table keeps them */
+typedef struct {
+    char host[64];
+    ip_addr_t addr;
+    uint64_t resolved_us;
+} nex_dns_entry_t;
+
+static nex_dns_entry_t g_dns_cache[NEX_DNS_CACHE_SIZE];
+static uint32_t g_dns_hits;
+static uint32_t g_dns_misses;
+
+/* Connection opened ahead of time by nex.prefetch(), no request sent yet */
+typedef struct {
+    bool used;
+    char host[64];
+    struct tcp_pcb *pcb;
+    bool connected;
+    uint64_t opened_us;
+} nex_prewarm_t;
+
+static nex_prewarm_t g_prewarm[NEX_PREWARM_MAX];
+static uint32_t g_prewarm_generation;   /* Bumped on cancel, stale DNS answers are ignored */
+
 /* Initialize NEX */
 void nex_init(void) {
     /* NEX protocol initialization */
     DEBUG_PRINTF("[NEX] Protocol support initialized\n");
 }
 
+static void dns_cache_put(const char *host, const ip_addr_t *addr) {
+    if (!host || !addr || strlen(host) >= sizeof(g_dns_cache[0].host)) {
+        return;
+    }
+    
+    /* Same host, else an empty or the oldest slot */
+    nex_dns_entry_t *slot = &g_dns_cache[0];
+    for (int i = 0; i < NEX_DNS_CACHE_SIZE; i++) {
+        nex_dns_entry_t *entry = &g_dns_cache[i];
+        if (strcmp(entry->host, host) == 0) {
+            slot = entry;
+            break;
+        }
+        if (entry->resolved_us < slot->resolved_us) {
+            slot = entry;
+        }
+    }
+    strcpy(slot->host, host);
+    ip_addr_copy(slot->addr, *addr);
+    slot->resolved_us = time_us_64();
+}
+
+static bool dns_cache_get(const char *host, ip_addr_t *addr) {
+    uint64_t now = time_us_64();
+    for (int i = 0; i < NEX_DNS_CACHE_SIZE; i++) {
+        nex_dns_entry_t *entry = &g_dns_cache[i];
+        if (entry->host[0] && strcmp(entry->host, host) == 0) {
+            if (now - entry->resolved_us > (uint64_t)NEX_DNS_TTL_MS * 1000) {
+                entry->host[0] = '\0';
+                return false;
+            }
+            ip_addr_copy(*addr, entry->addr);
+            return true;
+        }
+    }
+    return false;
+}
+
+/*
+ * dns_gethostbyname() behind the resolver cache. The found callbacks call
+ * dns_cache_put() themselves for answers that arrive later.
+ */
+static err_t nex_resolve(const char *host, ip_addr_t *addr, dns_found_callback found, void *arg) {
+    if (dns_cache_get(host, addr)) {
+        g_dns_hits++;
+        return ERR_OK;
+    }
+    g_dns_misses++;
+    err_t err = dns_gethostbyname(host, addr, found, arg);
+    if (err == ERR_OK) {
+        dns_cache_put(host, addr);
+    }
+    return err;
+}
+
+/* Never used, so nothing is lost by a reset; a close would hold the pcb in FIN_WAIT */
+static void prewarm_free(nex_prewarm_t *slot) {
+    if (slot->pcb) {
+        tcp_arg(slot->pcb, NULL);
+        tcp_recv(slot->pcb, NULL);
+        tcp_err(slot->pcb, NULL);
+        tcp_abort(slot->pcb);
+    }
+    memset(slot, 0, sizeof(*slot));
+}
+
+static err_t prewarm_connected(void *arg, struct tcp_pcb *tpcb, err_t err) {
+    nex_prewarm_t *slot = (nex_prewarm_t *)arg;
+    slot->connected = (err == ERR_OK);
+    return ERR_OK;
+}
+
+/* The server closed (or wrote on) an idle connection: give the slot up */
+static err_t prewarm_recv(void *arg, struct tcp_pcb *tpcb, struct pbuf *p, err_t err) {
+    nex_prewarm_t *slot = (nex_prewarm_t *)arg;
+    if (p) {
+        pbuf_free(p);
+    }
+    tcp_arg(tpcb, NULL);
+    tcp_recv(tpcb, NULL);
+    tcp_err(tpcb, NULL);
+    slot->pcb = NULL;
+    memset(slot, 0, sizeof(*slot));
+    if (tcp_close(tpcb) != ERR_OK) {
+        tcp_abort(tpcb);
+        return ERR_ABRT;
+    }
+    return ERR_OK;
+}
+
+static void prewarm_error(void *arg, err_t err) {
+    nex_prewarm_t *slot = (nex_prewarm_t *)arg;
+    memset(slot, 0, sizeof(*slot));  /* pcb already freed by lwIP */
+}
+
+static void prewarm_connect(nex_prewarm_t *slot, const ip_addr_t *addr) {
+    slot->pcb = tcp_new();
+    if (!slot->pcb) {
+        memset(slot, 0, sizeof(*slot));
+        return;
+    }
+    tcp_arg(slot->pcb, slot);
+    tcp_recv(slot->pcb, prewarm_recv);
+    tcp_err(slot->pcb, prewarm_error);
+    slot->opened_us = time_us_64();
+    if (tcp_connect(slot->pcb, addr, NEX_PORT, prewarm_connected) != ERR_OK) {
+        prewarm_free(slot);
+    }
+}
+
+/* arg packs the slot index and the generation it was started in */
+static void prewarm_dns(const char *name, const ip_addr_t *ipaddr, void *arg) {
+    if (ipaddr) {
+        dns_cache_put(name, ipaddr);
+    }
+    uintptr_t packed = (uintptr_t)arg;
+    if (packed == 0) {
+        return;  /* Resolve only */
+    }
+    nex_prewarm_t *slot = &g_prewarm[(packed & 0xF) - 1];
+    if ((packed >> 4) != (g_prewarm_generation & 0x0FFFFFFF) || !slot->used || slot->pcb) {
+        return;  /* Cancelled meanwhile */
+    }
+    if (ipaddr) {
+        prewarm_connect(slot, ipaddr);
+    } else {
+        memset(slot, 0, sizeof(*slot));
+    }
+}
+
+/* Close every prewarmed connection (navigation, or nex.prefetch_cancel()) */
+static void prewarm_cancel_all(void) {
+    g_prewarm_generation++;
+    for (int i = 0; i < NEX_PREWARM_MAX; i++) {
+        if (g_prewarm[i].used) {
+            prewarm_free(&g_prewarm[i]);
+        }
+    }
+}
+
+/*
+ * Take over a connected prewarmed pcb for host; the caller installs its
+ * own callbacks. NULL if there is none.
+ */
+static struct tcp_pcb *prewarm_claim(const char *host) {
+    uint64_t now = time_us_64();
+    for (int i = 0; i < NEX_PREWARM_MAX; i++) {
+        nex_prewarm_t *slot = &g_prewarm[i];
+        if (!slot->used || !slot->connected || strcmp(slot->host, host) != 0) {
+            continue;
+        }
+        if (now - slot->opened_us > (uint64_t)NEX_PREWARM_IDLE_MS * 1000) {
+            prewarm_free(slot);
+            continue;
+        }
+        struct tcp_pcb *pcb = slot->pcb;
+        memset(slot, 0, sizeof(*slot));
+        DEBUG_PRINTF("[NEX] Using prewarmed connection to %s\n", host);
+        return pcb;
+    }
+    return NULL;
+}
+
+/* Start resolving host and, if connect, opening a connection to it */
+static void prewarm_start(const char *host, bool connect) {
+    nex_prewarm_t *slot = NULL;
+    if (connect && strlen(host) < sizeof(g_prewarm[0].host)) {
+        uint64_t now = time_us_64();
+        for (int i = 0; i < NEX_PREWARM_MAX; i++) {
+            nex_prewarm_t *entry = &g_prewarm[i];
+            if (entry->used && entry->pcb &&
+                now - entry->opened_us > (uint64_t)NEX_PREWARM_IDLE_MS * 1000) {
+                prewarm_free(entry);
+            }
+            if (entry->used && strcmp(entry->host, host) == 0) {
+                return;  /* One per host: NEX pages mostly link to their own server */
+            }
+            if (!entry->used && !slot) {
+                slot = entry;
+            }
+        }
+    }
+    
+    void *arg = NULL;
+    if (slot) {
+        slot->used = true;
+        strcpy(slot->host, host);
+        arg = (void *)(uintptr_t)(((g_prewarm_generation & 0x0FFFFFFF) << 4) | (slot - g_prewarm + 1));
+    }
+    
+    ip_addr_t addr;
+    err_t err = nex_resolve(host, &addr, prewarm_dns, arg);
+    if (err == ERR_OK) {
+        if (slot) {
+            prewarm_connect(slot, &addr);
+        }
+    } else if (err != ERR_INPROGRESS && slot) {
+        memset(slot, 0, sizeof(*slot));
+    }
+}
+
+/*
+ * End a background revalidation: store the response if it completed and
+ * free the connection. Returns ERR_ABRT if the pcb had to be aborted.
+ */
+static err_t revalidate_end(nex_connection_t *conn, bool ok) {
+    err_t result = ERR_OK;
+    
+    if (ok && conn->response_len > 0) {
+        DEBUG_PRINTF("[NEX] Revalidated %s (%zu bytes)\n", conn->url, conn->response_len);
+        nex_cache_store(conn->url, conn->response_buffer, conn->response_len);
+    }
+    if (conn->pcb) {
+        tcp_arg(conn->pcb, NULL);
+        tcp_recv(conn->pcb, NULL);
+        tcp_err(conn->pcb, NULL);
+        if (tcp_close(conn->pcb) != ERR_OK) {
+            tcp_abort(conn->pcb);
+            result = ERR_ABRT;
+        }
+    }
+    
+    if (g_revalidate == conn) {
+        g_revalidate = NULL;
+    }
+    free(conn->response_buffer);
+    free(conn);
+    return result;
+}
+
 /* TCP connection callback */
 static err_t nex_connected_callback(void *arg, struct tcp_pcb *tpcb, err_t err) {
     nex_connection_t *conn = (nex_connection_t *)arg;
@@ -43,6 +382,16 @@ static err_t nex_connected_callback(void *arg, struct tcp_pcb *tpcb, err_t err)
     
     DEBUG_PRINTF("[NEX] TCP connected\n");
     conn->connected = true;
+    
+    /* Nobody waits on a background connection, so send the request here */
+    if (conn->background) {
+        char request[260];
+        int len = snprintf(request, sizeof(request), "%s\r\n", conn->path);
+        if (tcp_write(tpcb, request, len, TCP_WRITE_FLAG_COPY) != ERR_OK) {
+            return revalidate_end(conn, false);
+        }
+        tcp_output(tpcb);
+    }
     return ERR_OK;
 }
 
@@ -54,19 +403,29 @@ static err_t nex_recv_callback(void *arg, struct tcp_pcb *tpcb, struct pbuf *p,
         /* Connection closed or error */
         conn->complete = true;
         if (p) pbuf_free(p);
+        if (conn->background) {
+            return revalidate_end(conn, err == ERR_OK);
+        }
         return ERR_OK;
     }
     
-    /* Append data to response buffer */
+    /* Append data to response buffer, growing geometrically (+1 for the NUL) */
     size_t new_len = conn->response_len + p->tot_len;
-    if (new_len > conn->response_capacity) {
-        size_t new_capacity = new_len + 4096;
+    if (new_len + 1 > conn->response_capacity) {
+        size_t new_capacity = conn->response_capacity * 2;
+        while (new_capacity < new_len + 1) {
+            new_capacity *= 2;
+        }
         char *new_buffer = realloc(conn->response_buffer, new_capacity);
         if (!new_buffer) {
             DEBUG_PRINTF("[NEX] Out of memory\n");
             conn->error = ERR_MEM;
             conn->complete = true;
             pbuf_free(p);
+            if (conn->background) {
+                revalidate_end(conn, false);
+                return ERR_ABRT;
+            }
             return ERR_MEM;
         }
         conn->response_buffer = new_buffer;
@@ -89,16 +448,27 @@ static void nex_error_callback(void *arg, err_t err) {
     DEBUG_PRINTF("[NEX] TCP error: %d\n", err);
     conn->error = err;
     conn->complete = true;
+    if (conn->background) {
+        conn->pcb = NULL;  /* Already freed by lwIP */
+        revalidate_end(conn, false);
+    }
 }
 
 /* DNS resolution callback */
 static void nex_dns_callback(const char *name, const ip_addr_t *ipaddr, void *arg) {
     nex_connection_t *conn = (nex_connection_t *)arg;
+    conn->dns_pending = false;
+    if (ipaddr) {
+        dns_cache_put(name, ipaddr);
+    }
     
     if (ipaddr == NULL) {
         DEBUG_PRINTF("[NEX] DNS resolution failed\n");
         conn->error = ERR_ARG;
         conn->complete = true;
+        if (conn->background) {
+            revalidate_end(conn, false);
+        }
         return;
     }
     
@@ -110,6 +480,9 @@ static void nex_dns_callback(const char *name, const ip_addr_t *ipaddr, void *ar
         DEBUG_PRINTF("[NEX] Failed to create TCP PCB\n");
         conn->error = ERR_MEM;
         conn->complete = true;
+        if (conn->background) {
+            revalidate_end(conn, false);
+        }
         return;
     }
     
@@ -124,139 +497,281 @@ static void nex_dns_callback(const char *name, const ip_addr_t *ipaddr, void *ar
         conn->complete = true;
         tcp_close(conn->pcb);
         conn->pcb = NULL;
+        if (conn->background) {
+            revalidate_end(conn, false);
+        }
     }
 }
 
-/* Lua: nex.load(url) */
-static int lua_nex_load(lua_State *L) {
-    const char *url = luaL_checkstring(L, 1);
-    
-    /* Parse URL: nex://hostname/path */
+/* Split nex://hostname/path; false if url is not a NEX URL */
+static bool parse_url(const char *url, char *hostname, size_t host_size,
+                      char *path, size_t path_size) {
     if (strncmp(url, "nex://", 6) != 0) {
-        lua_pushnil(L);
-        lua_pushstring(L, "Invalid NEX URL (must start with nex://)");
-        return 2;
+        return false;
     }
     
     const char *host_start = url + 6;
     const char *path_start = strchr(host_start, '/');
-    
-    char hostname[256];
-    char path[256];
-    
-    if (path_start) {
-        size_t host_len = path_start - host_start;
-        if (host_len >= sizeof(hostname)) host_len = sizeof(hostname) - 1;
-        strncpy(hostname, host_start, host_len);
-        hostname[host_len] = '\0';
-        strncpy(path, path_start, sizeof(path) - 1);
-        path[sizeof(path) - 1] = '\0';
-    } else {
-        strncpy(hostname, host_start, sizeof(hostname) - 1);
-        hostname[sizeof(hostname) - 1] = '\0';
-        strcpy(path, "/");
+    size_t host_len = path_start ? (size_t)(path_start - host_start) : strlen(host_start);
+    if (host_len >= host_size) host_len = host_size - 1;
+    memcpy(hostname, host_start, host_len);
+    hostname[host_len] = '\0';
+    strncpy(path, path_start ? path_start : "/", path_size - 1);
+    path[path_size - 1] = '\0';
+    return true;
+}
+
+/* Refresh a cached page in the background; the response replaces the copy */
+static void revalidate_start(const char *url, const char *hostname, const char *path) {
+    if (g_revalidate) {
+        /* Give up on a stuck one, unless lwIP's DNS still holds it */
+        if (g_revalidate->dns_pending ||
+            time_us_64() - g_revalidate->start_us < (uint64_t)NEX_TIMEOUT_MS * 1000) {
+            return;
+        }
+        revalidate_end(g_revalidate, false);
     }
     
-    DEBUG_PRINTF("[NEX] Loading nex://%s%s\n", hostname, path);
-    
-    /* Initialize connection state */
-    nex_connection_t conn = {0};
-    conn.response_buffer = malloc(4096);
-    if (!conn.response_buffer) {
-        lua_pushnil(L);
-        lua_pushstring(L, "Out of memory");
-        return 2;
+    nex_connection_t *conn = calloc(1, sizeof(nex_connection_t));
+    if (!conn) {
+        return;
     }
-    conn.response_capacity = 4096;
+    conn->response_buffer = malloc(4096);
+    if (!conn->response_buffer) {
+        free(conn);
+        return;
+    }
+    conn->response_capacity = 4096;
+    conn->background = true;
+    conn->start_us = time_us_64();
+    strncpy(conn->url, url, sizeof(conn->url) - 1);
+    strncpy(conn->path, path, sizeof(conn->path) - 1);
+    g_revalidate = conn;
+    nex_cache_stats()->revalidations++;
     
-    /* Resolve hostname */
     ip_addr_t resolved_addr;
-    err_t dns_err = dns_gethostbyname(hostname, &resolved_addr, nex_dns_callback, &conn);
-    
+    err_t dns_err = nex_resolve(hostname, &resolved_addr, nex_dns_callback, conn);
     if (dns_err == ERR_OK) {
-        /* Already cached */
-        nex_dns_callback(hostname, &resolved_addr, &conn);
-    } else if (dns_err != ERR_INPROGRESS) {
-        DEBUG_PRINTF("[NEX] DNS lookup failed: %d\n", dns_err);
-        free(conn.response_buffer);
-        lua_pushnil(L);
-        lua_pushstring(L, "DNS lookup failed");
-        return 2;
+        nex_dns_callback(hostname, &resolved_addr, conn);
+    } else if (dns_err == ERR_INPROGRESS) {
+        conn->dns_pending = true;
+    } else {
+        revalidate_end(conn, false);
+    }
+}
+
+/* Cache options from an optional table argument */
+static void get_cache_options(lua_State *L, int index, lua_Integer *max_age, bool *stale) {
+    *max_age = NEX_CACHE_DEFAULT_MAX_AGE;
+    *stale = true;
+    if (!lua_istable(L, index)) {
+        return;
+    }
+    lua_getfield(L, index, "max_age");
+    if (!lua_isnil(L, -1)) {
+        *max_age = luaL_checkinteger(L, -1);
+    }
+    lua_getfield(L, index, "stale");
+    if (!lua_isnil(L, -1)) {
+        *stale = lua_toboolean(L, -1);
+    }
+    lua_pop(L, 2);
+}
+
+static void record_stats(const char *op, const char *source, uint64_t start_us,
+                         uint64_t first_line_us, uint32_t bytes, uint32_t peak_bytes) {
+    uint64_t now = time_us_64();
+    g_nex_stats.op = op;
+    g_nex_stats.source = source;
+    g_nex_stats.total_ms = (uint32_t)((now - start_us) / 1000);
+    g_nex_stats.first_line_ms = first_line_us ?
+        (uint32_t)((first_line_us - start_us) / 1000) : g_nex_stats.total_ms;
+    g_nex_stats.bytes = bytes;
+    g_nex_stats.peak_bytes = peak_bytes;
+}
+
+/*
+ * Blocking fetch of path from hostname. On success returns NULL and leaves
+ * the response (NUL-terminated) in conn, which the caller frees; otherwise
+ * returns the error message.
+ */
+static const char *load_network(const char *hostname, const char *path, nex_connection_t *conn) {
+    conn->response_buffer = malloc(4096);
+    if (!conn->response_buffer) {
+        return "Out of memory";
+    }
+    conn->response_capacity = 4096;
+    
+    /* A prewarmed connection skips DNS and the handshake */
+    struct tcp_pcb *prewarmed = prewarm_claim(hostname);
+    prewarm_cancel_all();
+    g_nex_stats.prewarmed = (prewarmed != NULL);
+    if (prewarmed) {
+        conn->pcb = prewarmed;
+        tcp_arg(prewarmed, conn);
+        tcp_recv(prewarmed, nex_recv_callback);
+        tcp_err(prewarmed, nex_error_callback);
+        conn->connected = true;
+    } else {
+        /* Resolve hostname */
+        ip_addr_t resolved_addr;
+        err_t dns_err = nex_resolve(hostname, &resolved_addr, nex_dns_callback, conn);
+        
+        if (dns_err == ERR_OK) {
+            /* Already cached */
+            nex_dns_callback(hostname, &resolved_addr, conn);
+        } else if (dns_err != ERR_INPROGRESS) {
+            DEBUG_PRINTF("[NEX] DNS lookup failed: %d\n", dns_err);
+            return "DNS lookup failed";
+        }
     }
     
     /* Wait for DNS and connection */
     absolute_time_t start_time = get_absolute_time();
-    while (!conn.complete && !conn.connected) {
+    while (!conn->complete && !conn->connected) {
         cyw43_arch_poll();
         sleep_ms(10);
         if (absolute_time_diff_us(start_time, get_absolute_time()) > NEX_TIMEOUT_MS * 1000) {
             DEBUG_PRINTF("[NEX] Connection timeout\n");
-            if (conn.pcb) {
-                tcp_close(conn.pcb);
+            if (conn->pcb) {
+                tcp_close(conn->pcb);
             }
-            free(conn.response_buffer);
-            lua_pushnil(L);
-            lua_pushstring(L, "Connection timeout");
-            return 2;
+            return "Connection timeout";
         }
     }
     
-    if (conn.error != ERR_OK) {
-        if (conn.pcb) tcp_close(conn.pcb);
-        free(conn.response_buffer);
-        lua_pushnil(L);
-        lua_pushstring(L, "Connection error");
-        return 2;
+    if (conn->error != ERR_OK) {
+        if (conn->pcb) tcp_close(conn->pcb);
+        return "Connection error";
     }
     
     /* Send NEX request */
     char request[512];
     snprintf(request, sizeof(request), "%s\r\n", path);
     
-    err_t write_err = tcp_write(conn.pcb, request, strlen(request), TCP_WRITE_FLAG_COPY);
+    err_t write_err = tcp_write(conn->pcb, request, strlen(request), TCP_WRITE_FLAG_COPY);
     if (write_err != ERR_OK) {
         DEBUG_PRINTF("[NEX] Failed to send request: %d\n", write_err);
-        tcp_close(conn.pcb);
-        free(conn.response_buffer);
-        lua_pushnil(L);
-        lua_pushstring(L, "Failed to send request");
-        return 2;
+        tcp_close(conn->pcb);
+        return "Failed to send request";
     }
     
-    tcp_output(conn.pcb);
+    tcp_output(conn->pcb);
     DEBUG_PRINTF("[NEX] Request sent, waiting for response...\n");
     
     /* Wait for response */
-    conn.complete = false;
+    conn->complete = false;
     start_time = get_absolute_time();
-    while (!conn.complete) {
+    while (!conn->complete) {
         cyw43_arch_poll();
         sleep_ms(10);
         if (absolute_time_diff_us(start_time, get_absolute_time()) > NEX_TIMEOUT_MS * 1000) {
             DEBUG_PRINTF("[NEX] Response timeout\n");
-            tcp_close(conn.pcb);
-            free(conn.response_buffer);
-            lua_pushnil(L);
-            lua_pushstring(L, "Response timeout");
-            return 2;
+            tcp_close(conn->pcb);
+            return "Response timeout";
         }
     }
     
-    tcp_close(conn.pcb);
+    tcp_close(conn->pcb);
     
-    /* Return response */
-    if (conn.response_len > 0) {
-        conn.response_buffer[conn.response_len] = '\0';
-        DEBUG_PRINTF("[NEX] Received %zu bytes\n", conn.response_len);
-        lua_pushlstring(L, conn.response_buffer, conn.response_len);
-        free(conn.response_buffer);
-        return 1;
-    } else {
+    if (conn->response_len == 0) {
+        return "Empty response";
+    }
+    conn->response_buffer[conn->response_len] = '\0';
+    DEBUG_PRINTF("[NEX] Received %zu bytes\n", conn->response_len);
+    return NULL;
+}
+
+/*
+ * Lua: nex.load(url [, {max_age=seconds, stale=bool}])
+ * Returns content and where it came from: "network", "cache" (fresher than
+ * max_age) or "stale" (older, served at once while a background fetch
+ * refreshes the cache; also used when the network fails). max_age = 0
+ * always fetches; stale = false waits for the network instead.
+ */
+static int lua_nex_load(lua_State *L) {
+    const char *url = luaL_checkstring(L, 1);
+    lua_Integer max_age;
+    bool serve_stale;
+    get_cache_options(L, 2, &max_age, &serve_stale);
+    
+    char hostname[256];
+    char path[256];
+    if (!parse_url(url, hostname, sizeof(hostname), path, sizeof(path))) {
+        lua_pushnil(L);
+        lua_pushstring(L, "Invalid NEX URL (must start with nex://)");
+        return 2;
+    }
+    
+    uint64_t load_start_us = time_us_64();
+    bool have_fallback = false;
+    if (max_age > 0) {
+        const char *data;
+        size_t len;
+        uint32_t age_s;
+        if (nex_cache_lookup(url, &data, &len, &age_s) != NEX_CACHE_MISS) {
+            lua_pushlstring(L, data, len);
+            if (age_s <= (uint64_t)max_age || serve_stale) {
+                prewarm_cancel_all();
+            }
+            if (age_s <= (uint64_t)max_age) {
+                record_stats("load", "cache", load_start_us, 0, len, 0);
+                lua_pushstring(L, "cache");
+                return 2;
+            }
+            if (serve_stale) {
+                nex_cache_stats()->stale_hits++;
+                revalidate_start(url, hostname, path);
+                record_stats("load", "stale", load_start_us, 0, len, 0);
+                lua_pushstring(L, "stale");
+                return 2;
+            }
+            have_fallback = true;  /* Left on the stack in case the network fails */
+        }
+    }
+    
+    DEBUG_PRINTF("[NEX] Loading nex://%s%s\n", hostname, path);
+    nex_connection_t conn = {0};
+    const char *error = load_network(hostname, path, &conn);
+    if (error) {
         free(conn.response_buffer);
+        if (have_fallback) {
+            record_stats("load", "stale", load_start_us, 0, lua_rawlen(L, -1), 0);
+            lua_pushstring(L, "stale");
+            return 2;
+        }
         lua_pushnil(L);
-        lua_pushstring(L, "Empty response");
+        lua_pushstring(L, error);
         return 2;
     }
+    
+    /* Nothing can be shown before the whole page is here */
+    record_stats("load", "network", load_start_us, 0, conn.response_len, conn.response_capacity);
+    nex_cache_store(url, conn.response_buffer, conn.response_len);
+    lua_pushlstring(L, conn.response_buffer, conn.response_len);
+    free(conn.response_buffer);
+    lua_pushstring(L, "network");
+    return 2;
+}
+
+/* Push a {type=, text=} table for one NEX/Gemtext line */
+static void push_line(lua_State *L, const char *line, size_t len) {
+    lua_newtable(L);
+    
+    if (len >= 2 && strncmp(line, "=>", 2) == 0) {
+        lua_pushstring(L, "link");
+        lua_setfield(L, -2, "type");
+        lua_pushlstring(L, line + 2, len - 2);
+    } else if (len >= 1 && line[0] == '#') {
+        lua_pushstring(L, "heading");
+        lua_setfield(L, -2, "type");
+        lua_pushlstring(L, line + 1, len - 1);
+    } else {
+        lua_pushstring(L, "text");
+        lua_setfield(L, -2, "type");
+        lua_pushlstring(L, line, len);
+    }
+    lua_setfield(L, -2, "text");
 }
 
 /* Lua: nex.parse(content) */
@@ -272,45 +787,564 @@ static int lua_nex_parse(lua_State *L) {
     /* Return structured table */
     lua_newtable(L);
     
-    /* Simple line-by-line parsing */
-    char *dup = strdup(content);
-    char *line = strtok(dup, "\n");
+    /* Line-by-line parsing in place; empty lines are skipped */
+    const char *end = content + len;
     int index = 1;
     
-    while (line) {
-        lua_newtable(L);
-        
-        /* Check line type */
-        if (strncmp(line, "=>", 2) == 0) {
-            /* Link line */
-            lua_pushstring(L, "link");
-            lua_setfield(L, -2, "type");
-            lua_pushstring(L, line + 2);
-            lua_setfield(L, -2, "text");
-        } else if (strncmp(line, "#", 1) == 0) {
-            /* Heading */
-            lua_pushstring(L, "heading");
-            lua_setfield(L, -2, "type");
-            lua_pushstring(L, line + 1);
-            lua_setfield(L, -2, "text");
+    while (content < end) {
+        const char *nl = memchr(content, '\n', end - content);
+        size_t line_len = nl ? (size_t)(nl - content) : (size_t)(end - content);
+        if (line_len > 0) {
+            push_line(L, content, line_len);
+            lua_rawseti(L, -2, index++);
+        }
+        content += line_len + 1;
+    }
+    
+    return 1;
+}
+
+/*
+ * nex.fetch: the lwIP callbacks only queue pbufs. They are parsed and
+ * acknowledged (tcp_recved) from fetch:poll() in the Lua program, so the
+ * TCP window bounds how much is buffered and only the incomplete last line
+ * is copied.
+ */
+
+static void fetch_fail(nex_fetch_t *f, const char *error) {
+    DEBUG_PRINTF("[NEX] Fetch failed: %s\n", error);
+    f->error = error;
+    f->state = NEX_FETCH_FAILED;
+}
+
+/* Detach from lwIP and drop anything not yet parsed */
+static void fetch_close(nex_fetch_t *f) {
+    if (f->pcb) {
+        tcp_arg(f->pcb, NULL);
+        tcp_recv(f->pcb, NULL);
+        tcp_err(f->pcb, NULL);
+        if (tcp_close(f->pcb) != ERR_OK) {
+            tcp_abort(f->pcb);
+        }
+        f->pcb = NULL;
+    }
+    if (f->queue) {
+        pbuf_free(f->queue);
+        f->queue = NULL;
+        f->queued = 0;
+    }
+    free(f->cached);
+    f->cached = NULL;
+    free(f->copy);
+    f->copy = NULL;
+}
+
+static err_t fetch_connected(void *arg, struct tcp_pcb *tpcb, err_t err) {
+    nex_fetch_t *f = (nex_fetch_t *)arg;
+    if (err != ERR_OK) {
+        fetch_fail(f, "Connection error");
+        return err;
+    }
+    
+    char request[260];
+    int len = snprintf(request, sizeof(request), "%s\r\n", f->path);
+    if (tcp_write(tpcb, request, len, TCP_WRITE_FLAG_COPY) != ERR_OK) {
+        fetch_fail(f, "Failed to send request");
+        return ERR_OK;
+    }
+    tcp_output(tpcb);
+    f->state = NEX_FETCH_RECEIVING;
+    f->activity_us = time_us_64();
+    return ERR_OK;
+}
+
+static err_t fetch_recv(void *arg, struct tcp_pcb *tpcb, struct pbuf *p, err_t err) {
+    nex_fetch_t *f = (nex_fetch_t *)arg;
+    if (err != ERR_OK || p == NULL) {
+        f->remote_closed = true;
+        if (p) pbuf_free(p);
+        return ERR_OK;
+    }
+    
+    if (f->queue) {
+        pbuf_cat(f->queue, p);
+    } else {
+        f->queue = p;
+    }
+    f->queued += p->tot_len;
+    f->bytes += p->tot_len;
+    f->activity_us = time_us_64();
+    if (f->queued + f->tail_len > f->peak_bytes) {
+        f->peak_bytes = f->queued + f->tail_len;
+    }
+    return ERR_OK;
+}
+
+static void fetch_error(void *arg, err_t err) {
+    nex_fetch_t *f = (nex_fetch_t *)arg;
+    f->pcb = NULL;  /* Already freed by lwIP */
+    if (f->remote_closed) {
+        return;
+    }
+    DEBUG_PRINTF("[NEX] TCP error: %d\n", err);
+    fetch_fail(f, "Connection error");
+}
+
+static void fetch_connect(nex_fetch_t *f, const ip_addr_t *ipaddr) {
+    f->pcb = tcp_new();
+    if (!f->pcb) {
+        fetch_fail(f, "Out of memory");
+        return;
+    }
+    
+    tcp_arg(f->pcb, f);
+    tcp_recv(f->pcb, fetch_recv);
+    tcp_err(f->pcb, fetch_error);
+    f->state = NEX_FETCH_CONNECTING;
+    if (tcp_connect(f->pcb, ipaddr, NEX_PORT, fetch_connected) != ERR_OK) {
+        fetch_close(f);
+        fetch_fail(f, "Connection error");
+    }
+}
+
+static void fetch_dns(const char *name, const ip_addr_t *ipaddr, void *arg) {
+    nex_fetch_t *f = (nex_fetch_t *)arg;
+    f->dns_pending = false;
+    if (ipaddr) {
+        dns_cache_put(name, ipaddr);
+    }
+    if (f->orphaned) {
+        free(f);
+        return;
+    }
+    if (f->state != NEX_FETCH_RESOLVING) {
+        return;  /* Timed out meanwhile */
+    }
+    if (ipaddr == NULL) {
+        fetch_fail(f, "DNS lookup failed");
+        return;
+    }
+    fetch_connect(f, ipaddr);
+}
+
+/* Complete line: add it to the table on top of the stack */
+static void fetch_emit(lua_State *L, nex_fetch_t *f, const char *line, size_t len, int *count) {
+    if (len == 0) {
+        return;
+    }
+    if (f->first_line_us == 0) {
+        f->first_line_us = time_us_64();
+    }
+    push_line(L, line, len);
+    lua_rawseti(L, -2, ++*count);
+}
+
+/* Bytes of a line split across pbufs collect in the tail */
+static void fetch_append(lua_State *L, nex_fetch_t *f, const char *data, size_t len, int *count) {
+    while (len > 0) {
+        size_t n = sizeof(f->tail) - f->tail_len;
+        if (n > len) {
+            n = len;
+        }
+        memcpy(f->tail + f->tail_len, data, n);
+        f->tail_len += n;
+        data += n;
+        len -= n;
+        if (f->tail_len == sizeof(f->tail)) {
+            fetch_emit(L, f, f->tail, f->tail_len, count);
+            f->tail_len = 0;
+        }
+    }
+}
+
+/* Split received bytes into lines, carrying an unfinished one in the tail */
+static void fetch_parse_bytes(lua_State *L, nex_fetch_t *f, const char *data, size_t len,
+                              int *count) {
+    while (len > 0) {
+        const char *nl = memchr(data, '\n', len);
+        if (!nl) {
+            fetch_append(L, f, data, len, count);
+            break;
+        }
+        size_t line_len = nl - data;
+        if (f->tail_len == 0) {
+            fetch_emit(L, f, data, line_len, count);
         } else {
-            /* Text line */
-            lua_pushstring(L, "text");
-            lua_setfield(L, -2, "type");
-            lua_pushstring(L, line);
-            lua_setfield(L, -2, "text");
+            fetch_append(L, f, data, line_len, count);
+            fetch_emit(L, f, f->tail, f->tail_len, count);
+            f->tail_len = 0;
+        }
+        data += line_len + 1;
+        len -= line_len + 1;
+    }
+}
+
+/* Keep a copy of a small response for the cache */
+static void fetch_keep(nex_fetch_t *f, const char *data, size_t len) {
+    if (!f->keep_copy) {
+        return;
+    }
+    char *copy = NULL;
+    if (f->copy_len + len <= NEX_CACHE_MAX_ENTRY) {
+        copy = realloc(f->copy, f->copy_len + len);
+    }
+    if (!copy) {
+        free(f->copy);
+        f->copy = NULL;
+        f->keep_copy = false;
+        return;
+    }
+    memcpy(copy + f->copy_len, data, len);
+    f->copy = copy;
+    f->copy_len += len;
+}
+
+/* Hand received bytes to the document, or parse them into line records */
+static bool fetch_deliver(lua_State *L, nex_fetch_t *f, nex_document_t *doc,
+                          const char *data, size_t len, int *count) {
+    if (!doc) {
+        fetch_parse_bytes(L, f, data, len, count);
+        return true;
+    }
+    if (!nex_document_append(doc, data, len)) {
+        return false;
+    }
+    if (f->first_line_us == 0 && nex_document_lines(doc) > 0) {
+        f->first_line_us = time_us_64();
+    }
+    return true;
+}
+
+/*
+ * Parse every queued pbuf, into doc if given, otherwise into a table of
+ * line records left on the stack
+ */
+static int fetch_parse_queue(lua_State *L, nex_fetch_t *f, nex_document_t *doc) {
+    int count = 0;
+    if (!doc) {
+        lua_newtable(L);
+    }
+    
+    bool ok = true;
+    if (f->cached) {
+        ok = fetch_deliver(L, f, doc, f->cached, f->cached_len, &count);
+        free(f->cached);
+        f->cached = NULL;
+    }
+    for (struct pbuf *q = f->queue; q && ok; q = q->next) {
+        fetch_keep(f, (const char *)q->payload, q->len);
+        ok = fetch_deliver(L, f, doc, (const char *)q->payload, q->len, &count);
+    }
+    if (!ok) {
+        fetch_close(f);
+        fetch_fail(f, "Out of memory");
+        return count;
+    }
+    
+    /* Parsed, so let the sender continue */
+    if (f->queue) {
+        if (f->pcb) {
+            tcp_recved(f->pcb, f->queued);
+        }
+        pbuf_free(f->queue);
+        f->queue = NULL;
+        f->queued = 0;
+    }
+    
+    if (f->remote_closed && f->state == NEX_FETCH_RECEIVING) {
+        if (doc) {
+            nex_document_finish(doc);
+            if (f->first_line_us == 0 && nex_document_lines(doc) > 0) {
+                f->first_line_us = time_us_64();
+            }
+        }
+        if (f->tail_len > 0) {
+            fetch_emit(L, f, f->tail, f->tail_len, &count);
+            f->tail_len = 0;
         }
+        if (f->copy && f->keep_copy) {
+            nex_cache_store(f->url, f->copy, f->copy_len);
+        }
+        fetch_close(f);
+        f->state = NEX_FETCH_DONE;
         
-        lua_rawseti(L, -2, index++);
-        line = strtok(NULL, "\n");
+        record_stats("fetch", f->source, f->start_us, f->first_line_us, f->bytes, f->peak_bytes);
+        g_nex_stats.prewarmed = f->prewarmed;
+        DEBUG_PRINTF("[NEX] Fetched %lu bytes, first line after %lu ms\n",
+                     (unsigned long)f->bytes, (unsigned long)g_nex_stats.first_line_ms);
+    }
+    return count;
+}
+
+static nex_fetch_t *check_fetch(lua_State *L) {
+    nex_fetch_handle_t *h = (nex_fetch_handle_t *)luaL_checkudata(L, 1, NEX_FETCH_META);
+    return h->fetch;
+}
+
+/* Lua: status, err = fetch:poll() - delivers new lines to on_line */
+static int lua_fetch_poll(lua_State *L) {
+    nex_fetch_t *f = check_fetch(L);
+    if (!f) {
+        return luaL_error(L, "fetch is closed");
+    }
+    
+    uint64_t now = time_us_64();
+    if (f->state < NEX_FETCH_DONE && f->queue == NULL && !f->remote_closed &&
+        now - f->activity_us > (uint64_t)NEX_TIMEOUT_MS * 1000) {
+        fetch_close(f);
+        fetch_fail(f, f->state == NEX_FETCH_RECEIVING ? "Response timeout" : "Connection timeout");
+    }
+    
+    nex_document_t *doc = NULL;
+    if (f->to_document) {
+        lua_rawgeti(L, LUA_REGISTRYINDEX, f->on_line_ref);
+        doc = nex_document_test(L, -1);
+    }
+    int count = 0;
+    if (f->state == NEX_FETCH_RECEIVING) {
+        count = fetch_parse_queue(L, f, doc);
+    } else if (!doc) {
+        lua_newtable(L);
+    }
+    
+    /*
+     * The C side is consistent now, so on_line may raise errors or even
+     * close the fetch; the result is taken before calling it.
+     */
+    nex_fetch_state_t state = f->state;
+    const char *error = f->error;
+    if (!doc) {
+        int lines = lua_gettop(L);
+        lua_rawgeti(L, LUA_REGISTRYINDEX, f->on_line_ref);
+        int on_line = lua_gettop(L);
+        for (int i = 1; i <= count; i++) {
+            lua_pushvalue(L, on_line);
+            lua_rawgeti(L, lines, i);
+            lua_call(L, 1, 0);
+        }
     }
     
-    free(dup);
+    if (state == NEX_FETCH_FAILED) {
+        lua_pushstring(L, "error");
+        lua_pushstring(L, error);
+        return 2;
+    }
+    lua_pushstring(L, state == NEX_FETCH_DONE ? "done" : "loading");
     return 1;
 }
 
+/* Lua: fetch:close() - abort; also run by the garbage collector */
+static int lua_fetch_close(lua_State *L) {
+    nex_fetch_handle_t *h = (nex_fetch_handle_t *)luaL_checkudata(L, 1, NEX_FETCH_META);
+    nex_fetch_t *f = h->fetch;
+    if (!f) {
+        return 0;
+    }
+    h->fetch = NULL;
+    
+    luaL_unref(L, LUA_REGISTRYINDEX, f->on_line_ref);
+    fetch_close(f);
+    if (f->dns_pending) {
+        f->orphaned = true;  /* fetch_dns() frees it */
+    } else {
+        free(f);
+    }
+    return 0;
+}
+
+/*
+ * Serve a fetch from the cache: the copy is parsed by the first poll().
+ * Returns false on a miss, or when the copy is too old to use.
+ */
+static bool fetch_from_cache(nex_fetch_t *f, const char *hostname, lua_Integer max_age,
+                             bool serve_stale) {
+    const char *data;
+    size_t len;
+    uint32_t age_s;
+    if (max_age <= 0 || nex_cache_lookup(f->url, &data, &len, &age_s) == NEX_CACHE_MISS) {
+        return false;
+    }
+    bool fresh = age_s <= (uint64_t)max_age;
+    if (!fresh && !serve_stale) {
+        return false;
+    }
+    
+    f->cached = malloc(len > 0 ? len : 1);
+    if (!f->cached) {
+        return false;
+    }
+    memcpy(f->cached, data, len);
+    f->cached_len = len;
+    f->bytes = len;
+    f->peak_bytes = len;
+    f->state = NEX_FETCH_RECEIVING;
+    f->remote_closed = true;
+    f->source = fresh ? "cache" : "stale";
+    if (!fresh) {
+        nex_cache_stats()->stale_hits++;
+        revalidate_start(f->url, hostname, f->path);
+    }
+    return true;
+}
+
+/*
+ * Lua: nex.fetch(url, on_line [, {max_age=seconds, stale=bool}])
+ * Starts a streaming load and returns a fetch. on_line may instead be an
+ * empty nex.document(), which poll() then fills. Cache options as
+ * nex.load; responses up to NEX_CACHE_MAX_ENTRY bytes are stored in the
+ * cache.
+ */
+static int lua_nex_fetch(lua_State *L) {
+    const char *url = luaL_checkstring(L, 1);
+    nex_document_t *doc = nex_document_test(L, 2);
+    if (doc) {
+        luaL_argcheck(L, nex_document_empty(doc), 2, "document is not empty");
+    } else {
+        luaL_checktype(L, 2, LUA_TFUNCTION);
+    }
+    lua_Integer max_age;
+    bool serve_stale;
+    get_cache_options(L, 3, &max_age, &serve_stale);
+    
+    char hostname[256];
+    char path[256];
+    if (!parse_url(url, hostname, sizeof(hostname), path, sizeof(path))) {
+        lua_pushnil(L);
+        lua_pushstring(L, "Invalid NEX URL (must start with nex://)");
+        return 2;
+    }
+    
+    nex_fetch_t *f = calloc(1, sizeof(nex_fetch_t));
+    if (!f) {
+        lua_pushnil(L);
+        lua_pushstring(L, "Out of memory");
+        return 2;
+    }
+    strncpy(f->url, url, sizeof(f->url) - 1);
+    strcpy(f->path, path);
+    f->start_us = time_us_64();
+    f->activity_us = f->start_us;
+    f->state = NEX_FETCH_RESOLVING;
+    f->source = "network";
+    f->keep_copy = true;
+    
+    nex_fetch_handle_t *h = (nex_fetch_handle_t *)lua_newuserdata(L, sizeof(nex_fetch_handle_t));
+    h->fetch = f;
+    luaL_setmetatable(L, NEX_FETCH_META);
+    lua_pushvalue(L, 2);
+    f->on_line_ref = luaL_ref(L, LUA_REGISTRYINDEX);
+    f->to_document = (doc != NULL);
+    
+    if (fetch_from_cache(f, hostname, max_age, serve_stale)) {
+        prewarm_cancel_all();
+        return 1;
+    }
+    
+    DEBUG_PRINTF("[NEX] Fetching nex://%s%s\n", hostname, f->path);
+    struct tcp_pcb *prewarmed = prewarm_claim(hostname);
+    prewarm_cancel_all();
+    f->prewarmed = (prewarmed != NULL);
+    if (prewarmed) {
+        f->pcb = prewarmed;
+        tcp_arg(prewarmed, f);
+        tcp_recv(prewarmed, fetch_recv);
+        tcp_err(prewarmed, fetch_error);
+        fetch_connected(f, prewarmed, ERR_OK);
+        return 1;
+    }
+    
+    ip_addr_t resolved_addr;
+    err_t dns_err = nex_resolve(hostname, &resolved_addr, fetch_dns, f);
+    if (dns_err == ERR_OK) {
+        fetch_connect(f, &resolved_addr);
+    } else if (dns_err == ERR_INPROGRESS) {
+        f->dns_pending = true;
+    } else {
+        fetch_fail(f, "DNS lookup failed");
+    }
+    return 1;
+}
+
+/* Lua: nex.stats() - timings of the last completed load or fetch */
+static int lua_nex_stats(lua_State *L) {
+    if (!g_nex_stats.op) {
+        lua_pushnil(L);
+        return 1;
+    }
+    nex_cache_stats_t *cache = nex_cache_stats();
+    lua_newtable(L);
+    lua_pushstring(L, g_nex_stats.op);
+    lua_setfield(L, -2, "op");
+    lua_pushstring(L, g_nex_stats.source);
+    lua_setfield(L, -2, "source");
+    lua_pushinteger(L, cache->ram_hits);
+    lua_setfield(L, -2, "ram_hits");
+    lua_pushinteger(L, cache->sd_hits);
+    lua_setfield(L, -2, "sd_hits");
+    lua_pushinteger(L, cache->stale_hits);
+    lua_setfield(L, -2, "stale_hits");
+    lua_pushinteger(L, cache->misses);
+    lua_setfield(L, -2, "misses");
+    lua_pushinteger(L, cache->revalidations);
+    lua_setfield(L, -2, "revalidations");
+    lua_pushboolean(L, g_nex_stats.prewarmed);
+    lua_setfield(L, -2, "prewarmed");
+    lua_pushinteger(L, g_dns_hits);
+    lua_setfield(L, -2, "dns_hits");
+    lua_pushinteger(L, g_dns_misses);
+    lua_setfield(L, -2, "dns_misses");
+    lua_pushinteger(L, g_nex_stats.first_line_ms);
+    lua_setfield(L, -2, "first_line_ms");
+    lua_pushinteger(L, g_nex_stats.total_ms);
+    lua_setfield(L, -2, "total_ms");
+    lua_pushinteger(L, g_nex_stats.bytes);
+    lua_setfield(L, -2, "bytes");
+    lua_pushinteger(L, g_nex_stats.peak_bytes);
+    lua_setfield(L, -2, "peak_bytes");
+    return 1;
+}
+
+/*
+ * Lua: nex.prefetch(url [, connect]) - resolve url's host ahead of time and,
+ * unless connect is false, open a connection the next load or fetch of that
+ * host takes over. At most one per host and NEX_PREWARM_MAX in total; the
+ * rest are closed by the next load or fetch.
+ */
+static int lua_nex_prefetch(lua_State *L) {
+    const char *url = luaL_checkstring(L, 1);
+    bool connect = lua_isnone(L, 2) || lua_toboolean(L, 2);
+    
+    char hostname[256];
+    char path[256];
+    if (!parse_url(url, hostname, sizeof(hostname), path, sizeof(path))) {
+        return 0;
+    }
+    prewarm_start(hostname, connect);
+    return 0;
+}
+
+/* Lua: nex.prefetch_cancel() - close all prewarmed connections */
+static int lua_nex_prefetch_cancel(lua_State *L) {
+    prewarm_cancel_all();
+    return 0;
+}
+
+static const luaL_Reg fetch_methods[] = {
+    {"poll", lua_fetch_poll},
+    {"close", lua_fetch_close},
+    {"__gc", lua_fetch_close},
+    {NULL, NULL}
+};
+
 /* Register NEX Lua API */
 void nex_register_lua(lua_State *L) {
+    /* Fetch handle metatable, methods looked up in itself */
+    luaL_newmetatable(L, NEX_FETCH_META);
+    luaL_setfuncs(L, fetch_methods, 0);
+    lua_pushvalue(L, -1);
+    lua_setfield(L, -2, "__index");
+    lua_pop(L, 1);
+    
     /* Create nex table */
     lua_newtable(L);
     
@@ -320,5 +1354,19 @@ void nex_register_lua(lua_State *L) {
     lua_pushcfunction(L, lua_nex_parse);
     lua_setfield(L, -2, "parse");
     
+    nex_document_register_lua(L);
+    
+    lua_pushcfunction(L, lua_nex_fetch);
+    lua_setfield(L, -2, "fetch");
+    
+    lua_pushcfunction(L, lua_nex_stats);
+    lua_setfield(L, -2, "stats");
+    
+    lua_pushcfunction(L, lua_nex_prefetch);
+    lua_setfield(L, -2, "prefetch");
+    
+    lua_pushcfunction(L, lua_nex_prefetch_cancel);
+    lua_setfield(L, -2, "prefetch_cancel");
+    
     lua_setglobal(L, "nex");
 }
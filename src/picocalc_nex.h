@@ -10,8 +10,21 @@ void nex_init(void);
 void nex_register_lua(lua_State *L);
 
 /* NEX Lua API:
- * nex.load(url) - Load NEX page, returns content, content_type
+ * nex.load(url [, opts]) - Load NEX page, returns content and its source:
+ *     "network", "cache" or "stale" (see picocalc_nex_cache.h). opts:
+ *     max_age (seconds a cached copy is fresh, 0 = always fetch) and
+ *     stale (false = wait for the network rather than serve an old copy
+ *     while it is refreshed in the background)
  * nex.parse(content) - Parse NEX content into structured format
+ * nex.document([content]) - Line index over content, or an empty document
+ *     for nex.fetch, with layout and drawing (picocalc_nex_document.h)
+ * nex.fetch(url, on_line [, opts]) - Start a non-blocking load; returns a
+ *     fetch whose poll() passes each newly parsed line (as nex.parse builds
+ *     them) to on_line, or appends to on_line if it is a document, and
+ *     returns "loading", "done" or "error", message. Call it from draw();
+ *     close() aborts. Cached like nex.load.
+ * nex.stats() - first_line_ms, total_ms, bytes, peak_bytes and source of
+ *     the last completed load or fetch, plus cache hit counters
  */
 
 #endif /* PICOCALC_NEX_H */
@@ -0,0 +1,264 @@
+/**
+ * @file picocalc_nex_cache.c
+ * @brief NEX response cache in RAM and on the SD card
+ *
+ * SD entries are one file per URL: a header line
+ * "NEXC <boot> <fetched_ms> <url>\n" followed by the response bytes. The
+ * URL in the header guards against hash collisions.
+ */
+
+#include "picocalc_nex_cache.h"
+#include "picocalc_fs_handler.h"
+#include "debug.h"
+#include "pico/stdlib.h"
+#include <string.h>
+#include <stdlib.h>
+#include <stdio.h>
+
+typedef struct {
+    char *url;                /* NULL if the slot is free */
+    char *data;
+    size_t len;
+    uint32_t fetched_ms;      /* Since boot */
+    bool this_boot;           /* false: fetched in an earlier boot */
+    uint32_t last_used;
+} nex_cache_entry_t;
+
+static struct {
+    bool initialized;
+    uint32_t boot;
+    nex_cache_entry_t entries[NEX_CACHE_RAM_ENTRIES];
+    size_t ram_bytes;
+    uint32_t use_clock;
+    char *scratch;            /* SD copy too large for RAM, freed on the next call */
+    nex_cache_stats_t stats;
+} g_cache;
+
+static uint32_t now_ms(void) {
+    return (uint32_t)(time_us_64() / 1000);
+}
+
+/* FNV-1a, names the SD file */
+static uint32_t url_hash(const char *url) {
+    uint32_t hash = 2166136261u;
+    while (*url) {
+        hash ^= (uint8_t)*url++;
+        hash *= 16777619u;
+    }
+    return hash;
+}
+
+static void entry_path(const char *url, char *path, size_t path_size) {
+    snprintf(path, path_size, NEX_CACHE_DIR "/%08lx", (unsigned long)url_hash(url));
+}
+
+/* Count boots in NEX_CACHE_DIR/.boot so ages from earlier boots are known to be unknown */
+static void cache_init(void) {
+    if (g_cache.initialized) {
+        return;
+    }
+    g_cache.initialized = true;
+    fs_mkdirs(NEX_CACHE_DIR);
+
+    uint8_t *data = NULL;
+    size_t size = 0;
+    uint32_t boot = 0;
+    if (fs_read_file(NEX_CACHE_DIR "/.boot", &data, &size) == FS_OK) {
+        char text[16];
+        size_t n = size < sizeof(text) - 1 ? size : sizeof(text) - 1;
+        memcpy(text, data, n);
+        text[n] = '\0';
+        boot = (uint32_t)strtoul(text, NULL, 10);
+        free(data);
+    }
+    g_cache.boot = boot + 1;
+
+    char text[16];
+    int n = snprintf(text, sizeof(text), "%lu\n", (unsigned long)g_cache.boot);
+    fs_write_file(NEX_CACHE_DIR "/.boot", (const uint8_t *)text, n);
+    DEBUG_PRINTF("[NEX_CACHE] Boot %lu\n", (unsigned long)g_cache.boot);
+}
+
+static uint32_t entry_age(const nex_cache_entry_t *entry) {
+    if (!entry->this_boot) {
+        return NEX_CACHE_AGE_UNKNOWN;
+    }
+    return (now_ms() - entry->fetched_ms) / 1000;
+}
+
+static void entry_free(nex_cache_entry_t *entry) {
+    g_cache.ram_bytes -= entry->len;
+    free(entry->url);
+    free(entry->data);
+    memset(entry, 0, sizeof(*entry));
+}
+
+static nex_cache_entry_t *ram_find(const char *url) {
+    for (int i = 0; i < NEX_CACHE_RAM_ENTRIES; i++) {
+        if (g_cache.entries[i].url && strcmp(g_cache.entries[i].url, url) == 0) {
+            return &g_cache.entries[i];
+        }
+    }
+    return NULL;
+}
+
+/* Make room for len bytes; returns a free slot */
+static nex_cache_entry_t *ram_evict_for(size_t len) {
+    for (;;) {
+        nex_cache_entry_t *free_slot = NULL;
+        nex_cache_entry_t *oldest = NULL;
+        for (int i = 0; i < NEX_CACHE_RAM_ENTRIES; i++) {
+            nex_cache_entry_t *entry = &g_cache.entries[i];
+            if (!entry->url) {
+                free_slot = entry;
+            } else if (!oldest || entry->last_used < oldest->last_used) {
+                oldest = entry;
+            }
+        }
+        if (free_slot && g_cache.ram_bytes + len <= NEX_CACHE_RAM_BYTES) {
+            return free_slot;
+        }
+        if (!oldest) {
+            return NULL;
+        }
+        entry_free(oldest);
+    }
+}
+
+/* Take ownership of data (malloc'd) as the RAM copy of url */
+static nex_cache_entry_t *ram_insert(const char *url, char *data, size_t len,
+                                     uint32_t fetched_ms, bool this_boot) {
+    nex_cache_entry_t *entry = ram_find(url);
+    if (entry) {
+        entry_free(entry);
+    }
+    entry = ram_evict_for(len);
+    char *url_copy = entry ? strdup(url) : NULL;
+    if (!url_copy) {
+        free(data);
+        return NULL;
+    }
+
+    entry->url = url_copy;
+    entry->data = data;
+    entry->len = len;
+    entry->fetched_ms = fetched_ms;
+    entry->this_boot = this_boot;
+    entry->last_used = ++g_cache.use_clock;
+    g_cache.ram_bytes += len;
+    return entry;
+}
+
+/* Read and validate the SD copy; the response is moved to the buffer start */
+static char *sd_load(const char *url, size_t *len, uint32_t *fetched_ms, bool *this_boot) {
+    char path[32];
+    entry_path(url, path, sizeof(path));
+
+    uint8_t *file = NULL;
+    size_t size = 0;
+    if (fs_read_file(path, &file, &size) != FS_OK) {
+        return NULL;
+    }
+
+    char *text = (char *)file;
+    char *nl = memchr(text, '\n', size);
+    unsigned long boot = 0, fetched = 0;
+    int url_start = 0;
+    if (!nl || sscanf(text, "NEXC %lu %lu %n", &boot, &fetched, &url_start) < 2 ||
+        url_start == 0 || (size_t)(nl - text - url_start) != strlen(url) ||
+        memcmp(text + url_start, url, strlen(url)) != 0) {
+        free(file);
+        return NULL;
+    }
+
+    size_t header = nl - text + 1;
+    *len = size - header;
+    memmove(text, text + header, *len);
+    *fetched_ms = (uint32_t)fetched;
+    *this_boot = (boot == g_cache.boot);
+    return text;
+}
+
+static void sd_store(const char *url, const char *data, size_t len, uint32_t fetched_ms) {
+    char header[FS_MAX_PATH + 48];
+    int header_len = snprintf(header, sizeof(header), "NEXC %lu %lu %s\n",
+                              (unsigned long)g_cache.boot, (unsigned long)fetched_ms, url);
+    if (header_len <= 0 || (size_t)header_len >= sizeof(header)) {
+        return;
+    }
+
+    uint8_t *file = malloc(header_len + len);
+    if (!file) {
+        return;
+    }
+    memcpy(file, header, header_len);
+    memcpy(file + header_len, data, len);
+
+    char path[32];
+    entry_path(url, path, sizeof(path));
+    fs_error_t err = fs_write_file(path, file, header_len + len);
+    if (err != FS_OK) {
+        DEBUG_PRINTF("[NEX_CACHE] Write %s failed: %s\n", path, fs_error_string(err));
+    }
+    free(file);
+}
+
+nex_cache_result_t nex_cache_lookup(const char *url, const char **data, size_t *len,
+                                    uint32_t *age_s) {
+    cache_init();
+    free(g_cache.scratch);
+    g_cache.scratch = NULL;
+
+    nex_cache_entry_t *entry = ram_find(url);
+    if (entry) {
+        entry->last_used = ++g_cache.use_clock;
+        *data = entry->data;
+        *len = entry->len;
+        *age_s = entry_age(entry);
+        g_cache.stats.ram_hits++;
+        return NEX_CACHE_HIT_RAM;
+    }
+
+    uint32_t fetched_ms;
+    bool this_boot;
+    char *copy = sd_load(url, len, &fetched_ms, &this_boot);
+    if (!copy) {
+        g_cache.stats.misses++;
+        return NEX_CACHE_MISS;
+    }
+    g_cache.stats.sd_hits++;
+
+    if (*len <= NEX_CACHE_MAX_ENTRY &&
+        (entry = ram_insert(url, copy, *len, fetched_ms, this_boot)) != NULL) {
+        *data = entry->data;
+        *age_s = entry_age(entry);
+    } else {
+        g_cache.scratch = copy;
+        *data = copy;
+        *age_s = this_boot ? (now_ms() - fetched_ms) / 1000 : NEX_CACHE_AGE_UNKNOWN;
+    }
+    return NEX_CACHE_HIT_SD;
+}
+
+void nex_cache_store(const char *url, const char *data, size_t len) {
+    cache_init();
+    uint32_t fetched_ms = now_ms();
+    sd_store(url, data, len, fetched_ms);
+
+    if (len <= NEX_CACHE_MAX_ENTRY) {
+        char *copy = malloc(len > 0 ? len : 1);
+        if (copy) {
+            memcpy(copy, data, len);
+            ram_insert(url, copy, len, fetched_ms, true);
+        }
+    } else {
+        nex_cache_entry_t *entry = ram_find(url);
+        if (entry) {
+            entry_free(entry);
+        }
+    }
+}
+
+nex_cache_stats_t *nex_cache_stats(void) {
+    return &g_cache.stats;
+}
@@ -0,0 +1,65 @@
+#ifndef PICOCALC_NEX_CACHE_H
+#define PICOCALC_NEX_CACHE_H
+
+#include <stdbool.h>
+#include <stddef.h>
+#include <stdint.h>
+
+/**
+ * @file picocalc_nex_cache.h
+ * @brief NEX response cache in RAM and on the SD card
+ *
+ * Recent responses are kept in a small RAM LRU; every response is also
+ * written to NEX_CACHE_DIR/<hash of the URL> with its fetch time, so pages
+ * survive program restarts and reboots. There is no real-time clock, so
+ * fetch times are milliseconds since boot plus a boot counter: copies from
+ * an earlier boot have an unknown age and always count as stale.
+ */
+
+#define NEX_CACHE_DIR "/cache/nex"
+#define NEX_CACHE_RAM_ENTRIES 8
+#define NEX_CACHE_RAM_BYTES (32 * 1024)    /* Total kept in RAM */
+#define NEX_CACHE_MAX_ENTRY (16 * 1024)    /* Larger responses skip the RAM LRU */
+#define NEX_CACHE_DEFAULT_MAX_AGE 60       /* Seconds a copy counts as fresh */
+#define NEX_CACHE_AGE_UNKNOWN UINT32_MAX
+
+typedef enum {
+    NEX_CACHE_MISS = 0,
+    NEX_CACHE_HIT_RAM,
+    NEX_CACHE_HIT_SD
+} nex_cache_result_t;
+
+/* Counters reported by nex.stats() */
+typedef struct {
+    uint32_t ram_hits;
+    uint32_t sd_hits;
+    uint32_t stale_hits;      /* Served stale while revalidating */
+    uint32_t misses;
+    uint32_t revalidations;
+} nex_cache_stats_t;
+
+/**
+ * Look up a cached response
+ * Copies found on the SD card are promoted into the RAM LRU.
+ *
+ * @param url Full nex:// URL
+ * @param data Set to the cached bytes, valid until the next cache call
+ * @param len Set to the length of data
+ * @param age_s Set to the age in seconds, or NEX_CACHE_AGE_UNKNOWN
+ * @return Where the copy was found, NEX_CACHE_MISS if nowhere
+ */
+nex_cache_result_t nex_cache_lookup(const char *url, const char **data, size_t *len,
+                                    uint32_t *age_s);
+
+/**
+ * Store a response fetched just now, in RAM and on the SD card
+ */
+void nex_cache_store(const char *url, const char *data, size_t len);
+
+/**
+ * Get the cache counters (updated by the caller for stale hits and
+ * revalidations, which the cache itself cannot see)
+ */
+nex_cache_stats_t *nex_cache_stats(void);
+
+#endif /* PICOCALC_NEX_CACHE_H */
@@ -0,0 +1,595 @@
+/**
+ * @file picocalc_nex_document.c
+ * @brief Indexed Gemtext documents and their layout
+ *
+ * Lines and rows are small fixed-size records holding offsets into the
+ * document text; text only becomes Lua strings when doc:line() or
+ * doc:links() ask for it, and doc:draw() reads it in place.
+ */
+
+#include "picocalc_nex_document.h"
+#include "picocalc_graphics.h"
+#include "debug.h"
+#include "pico/stdlib.h"
+#include <lauxlib.h>
+#include <string.h>
+#include <stdlib.h>
+
+#define NEX_ROW_HEIGHT 12        /* Pixels between rows drawn by doc:draw() */
+
+typedef enum {
+    NEX_LINE_TEXT = 0,
+    NEX_LINE_LINK,
+    NEX_LINE_HEADING,
+    NEX_LINE_LIST,
+    NEX_LINE_QUOTE,
+    NEX_LINE_PRE
+} nex_line_type_t;
+
+static const char *const nex_line_names[] = {
+    "text", "link", "heading", "list", "quote", "pre"
+};
+
+/* Per type: columns taken by the marker or indent, and the text color */
+static const struct {
+    uint8_t indent;
+    uint8_t r, g, b;
+} nex_line_styles[] = {
+    {0, 200, 200, 200},          /* text */
+    {2, 100, 200, 255},          /* link */
+    {0, 255, 255, 100},          /* heading */
+    {2, 200, 200, 200},          /* list */
+    {2, 150, 200, 150},          /* quote */
+    {0, 255, 180, 120}           /* pre */
+};
+
+/* One indexed line (16 bytes); spans are relative to offset */
+typedef struct {
+    uint32_t offset;
+    uint16_t text_off;
+    uint16_t text_len;
+    uint16_t target_off;         /* Link URL */
+    uint16_t target_len;
+    uint16_t link;               /* Link number, from 1 */
+    uint8_t type;
+    uint8_t level;               /* Heading level 1-3 */
+} nex_line_t;
+
+/* One wrapped row: part of a line's text */
+typedef struct {
+    uint32_t line;
+    uint16_t start;
+    uint16_t len;
+} nex_row_t;
+
+struct nex_document {
+    const char *base;            /* The anchored string, or buf */
+    char *buf;                   /* Own text, for documents filled by a fetch */
+    size_t bytes;
+    size_t capacity;
+    size_t indexed;              /* Bytes up to the end of the last indexed line */
+    bool in_pre;
+
+    nex_line_t *lines;
+    uint32_t count;
+    uint32_t line_capacity;
+    uint32_t links;
+    uint32_t parse_us;           /* Total time spent indexing */
+
+    /* Layout cache, valid for layout_cols; grows as lines arrive */
+    nex_row_t *rows;
+    uint32_t row_count;
+    uint32_t row_capacity;
+    uint32_t laid_out;           /* Lines already wrapped */
+    uint16_t layout_cols;
+    uint32_t layout_us;
+    uint32_t draw_us;            /* Last doc:draw() */
+};
+
+static size_t skip_space(const char *s, size_t pos, size_t len) {
+    while (pos < len && (s[pos] == ' ' || s[pos] == '\t')) {
+        pos++;
+    }
+    return pos;
+}
+
+/* Classify one line outside a preformatted block */
+static void index_line(const char *line, size_t len, nex_line_t *out) {
+    size_t pos = 0;
+    out->type = NEX_LINE_TEXT;
+
+    if (len >= 2 && line[0] == '=' && line[1] == '>') {
+        out->type = NEX_LINE_LINK;
+        size_t url = skip_space(line, 2, len);
+        size_t url_end = url;
+        while (url_end < len && line[url_end] != ' ' && line[url_end] != '\t') {
+            url_end++;
+        }
+        out->target_off = (uint16_t)url;
+        out->target_len = (uint16_t)(url_end - url);
+        pos = skip_space(line, url_end, len);
+        if (pos == len) {
+            pos = url;           /* No label, show the URL */
+            len = url_end;
+        }
+    } else if (len >= 1 && line[0] == '#') {
+        out->type = NEX_LINE_HEADING;
+        while (pos < len && pos < 3 && line[pos] == '#') {
+            pos++;
+        }
+        out->level = (uint8_t)pos;
+        pos = skip_space(line, pos, len);
+    } else if (len >= 2 && line[0] == '*' && line[1] == ' ') {
+        out->type = NEX_LINE_LIST;
+        pos = skip_space(line, 2, len);
+    } else if (len >= 1 && line[0] == '>') {
+        out->type = NEX_LINE_QUOTE;
+        pos = skip_space(line, 1, len);
+    }
+
+    out->text_off = (uint16_t)pos;
+    out->text_len = (uint16_t)(len - pos);
+}
+
+static bool reserve_lines(nex_document_t *doc, size_t needed) {
+    if (needed <= doc->line_capacity) {
+        return true;
+    }
+    size_t capacity = doc->line_capacity ? doc->line_capacity * 2 : 64;
+    if (capacity < needed) {
+        capacity = needed;
+    }
+    nex_line_t *lines = realloc(doc->lines, capacity * sizeof(nex_line_t));
+    if (!lines) {
+        return false;
+    }
+    doc->lines = lines;
+    doc->line_capacity = (uint32_t)capacity;
+    return true;
+}
+
+/* Index the lines not indexed yet; the last one only if final */
+static void index_text(nex_document_t *doc, bool final) {
+    uint64_t start = time_us_64();
+    const char *end = doc->base + doc->bytes;
+    const char *line = doc->base + doc->indexed;
+
+    while (line < end) {
+        const char *nl = memchr(line, '\n', end - line);
+        if (!nl && !final) {
+            break;
+        }
+        size_t line_len = nl ? (size_t)(nl - line) : (size_t)(end - line);
+        const char *next = nl ? nl + 1 : end;
+        if (line_len > 0 && line[line_len - 1] == '\r') {
+            line_len--;
+        }
+        if (line_len > UINT16_MAX) {
+            line_len = UINT16_MAX;   /* Spans are 16 bit; the rest is not shown */
+        }
+
+        if (line_len >= 3 && memcmp(line, "```", 3) == 0) {
+            doc->in_pre = !doc->in_pre;
+        } else {
+            if (!reserve_lines(doc, doc->count + 1)) {
+                break;               /* Retried by the next append */
+            }
+            nex_line_t *entry = &doc->lines[doc->count++];
+            memset(entry, 0, sizeof(*entry));
+            entry->offset = (uint32_t)(line - doc->base);
+            if (doc->in_pre) {
+                entry->type = NEX_LINE_PRE;
+                entry->text_len = (uint16_t)line_len;
+            } else {
+                index_line(line, line_len, entry);
+                if (entry->type == NEX_LINE_LINK) {
+                    entry->link = (uint16_t)++doc->links;
+                }
+            }
+        }
+        line = next;
+        doc->indexed = line - doc->base;
+    }
+
+    doc->parse_us += (uint32_t)(time_us_64() - start);
+}
+
+bool nex_document_append(nex_document_t *doc, const char *data, size_t len) {
+    if (doc->base && !doc->buf) {
+        return false;            /* Indexes a Lua string */
+    }
+    if (doc->bytes + len > doc->capacity) {
+        size_t capacity = doc->capacity ? doc->capacity * 2 : 4096;
+        while (capacity < doc->bytes + len) {
+            capacity *= 2;
+        }
+        char *buf = realloc(doc->buf, capacity);
+        if (!buf) {
+            return false;
+        }
+        doc->buf = buf;
+        doc->capacity = capacity;
+    }
+    memcpy(doc->buf + doc->bytes, data, len);
+    doc->bytes += len;
+    doc->base = doc->buf;
+    index_text(doc, false);
+    return true;
+}
+
+void nex_document_finish(nex_document_t *doc) {
+    index_text(doc, true);
+}
+
+size_t nex_document_lines(const nex_document_t *doc) {
+    return doc->count;
+}
+
+bool nex_document_empty(const nex_document_t *doc) {
+    return doc->base == NULL;
+}
+
+static bool push_row(nex_document_t *doc, uint32_t line, size_t start, size_t len) {
+    if (doc->row_count == doc->row_capacity) {
+        uint32_t capacity = doc->row_capacity ? doc->row_capacity * 2 : 128;
+        nex_row_t *rows = realloc(doc->rows, capacity * sizeof(nex_row_t));
+        if (!rows) {
+            return false;
+        }
+        doc->rows = rows;
+        doc->row_capacity = capacity;
+    }
+    nex_row_t *row = &doc->rows[doc->row_count++];
+    row->line = line;
+    row->start = (uint16_t)start;
+    row->len = (uint16_t)len;
+    return true;
+}
+
+/* Word-wrap one line into rows; preformatted lines are cut instead */
+static bool wrap_line(nex_document_t *doc, uint32_t index) {
+    const nex_line_t *line = &doc->lines[index];
+    const char *text = doc->base + line->offset + line->text_off;
+    size_t len = line->text_len;
+    size_t indent = nex_line_styles[line->type].indent;
+    size_t avail = doc->layout_cols > indent ? doc->layout_cols - indent : 1;
+
+    if (line->type == NEX_LINE_PRE || len <= avail) {
+        return push_row(doc, index, 0, len < avail ? len : avail);
+    }
+
+    size_t pos = 0;
+    while (pos < len) {
+        if (pos > 0) {
+            pos = skip_space(text, pos, len);
+            if (pos == len) {
+                break;
+            }
+        }
+        size_t n = len - pos;
+        if (n > avail) {
+            /* Break at the last space that keeps the row within avail */
+            size_t brk = pos + avail;
+            while (brk > pos && text[brk] != ' ') {
+                brk--;
+            }
+            n = brk > pos ? brk - pos : avail;
+            while (n > 1 && text[pos + n - 1] == ' ') {
+                n--;
+            }
+        }
+        if (!push_row(doc, index, pos, n)) {
+            return false;
+        }
+        pos += n;
+    }
+    return true;
+}
+
+/* Bring the row cache up to date for cols, rebuilding it if cols changed */
+static void layout(nex_document_t *doc, int cols) {
+    if (cols < 1) {
+        cols = 1;
+    }
+    if (cols != doc->layout_cols) {
+        doc->layout_cols = (uint16_t)cols;
+        doc->row_count = 0;
+        doc->laid_out = 0;
+        doc->layout_us = 0;
+    }
+    if (doc->laid_out == doc->count) {
+        return;
+    }
+
+    uint64_t start = time_us_64();
+    while (doc->laid_out < doc->count && wrap_line(doc, doc->laid_out)) {
+        doc->laid_out++;
+    }
+    doc->layout_us += (uint32_t)(time_us_64() - start);
+}
+
+/* First row of a line under the current layout (rows are in line order) */
+static uint32_t row_of_line(const nex_document_t *doc, uint32_t line) {
+    uint32_t lo = 0, hi = doc->row_count;
+    while (lo < hi) {
+        uint32_t mid = (lo + hi) / 2;
+        if (doc->rows[mid].line < line) {
+            lo = mid + 1;
+        } else {
+            hi = mid;
+        }
+    }
+    return lo;
+}
+
+nex_document_t *nex_document_test(lua_State *L, int index) {
+    return (nex_document_t *)luaL_testudata(L, index, NEX_DOCUMENT_META);
+}
+
+static nex_document_t *check_document(lua_State *L) {
+    return (nex_document_t *)luaL_checkudata(L, 1, NEX_DOCUMENT_META);
+}
+
+/*
+ * Lua: nex.document([content]) - index content without copying it, or
+ * create an empty document for nex.fetch to fill
+ */
+static int lua_nex_document(lua_State *L) {
+    size_t len = 0;
+    const char *content = lua_isnoneornil(L, 1) ? NULL : luaL_checklstring(L, 1, &len);
+
+    nex_document_t *doc = (nex_document_t *)lua_newuserdata(L, sizeof(nex_document_t));
+    memset(doc, 0, sizeof(*doc));
+    luaL_setmetatable(L, NEX_DOCUMENT_META);
+    if (!content) {
+        return 1;
+    }
+
+    /* Keep the string alive (and in place) as long as the index */
+    lua_createtable(L, 1, 0);
+    lua_pushvalue(L, 1);
+    lua_rawseti(L, -2, 1);
+    lua_setuservalue(L, -2);
+    doc->base = content;
+    doc->bytes = len;
+
+    /* Size the index once; ``` toggle lines are not indexed */
+    size_t lines = 0;
+    for (const char *p = content; (p = memchr(p, '\n', content + len - p)) != NULL; p++) {
+        lines++;
+    }
+    if (len > 0 && content[len - 1] != '\n') {
+        lines++;
+    }
+    if (lines > 0 && !reserve_lines(doc, lines)) {
+        return luaL_error(L, "not enough memory");
+    }
+
+    index_text(doc, true);
+    DEBUG_PRINTF("[NEX] Indexed %lu lines in %lu us\n",
+                 (unsigned long)doc->count, (unsigned long)doc->parse_us);
+    return 1;
+}
+
+static int lua_document_gc(lua_State *L) {
+    nex_document_t *doc = check_document(L);
+    free(doc->buf);
+    free(doc->lines);
+    free(doc->rows);
+    doc->buf = NULL;
+    doc->lines = NULL;
+    doc->rows = NULL;
+    doc->base = NULL;
+    doc->bytes = doc->count = doc->row_count = doc->laid_out = 0;
+    doc->capacity = doc->line_capacity = doc->row_capacity = 0;
+    return 0;
+}
+
+/* Lua: lines, links = doc:count(); #doc is the line count */
+static int lua_document_count(lua_State *L) {
+    nex_document_t *doc = check_document(L);
+    lua_pushinteger(L, doc->count);
+    lua_pushinteger(L, doc->links);
+    return 2;
+}
+
+/*
+ * Lua: type, text, extra = doc:line(i) - extra is the URL of a link or the
+ * level of a heading; nothing is returned past the last line
+ */
+static int lua_document_line(lua_State *L) {
+    nex_document_t *doc = check_document(L);
+    lua_Integer i = luaL_checkinteger(L, 2);
+    if (i < 1 || (lua_Unsigned)i > doc->count) {
+        return 0;
+    }
+
+    const nex_line_t *entry = &doc->lines[i - 1];
+    const char *line = doc->base + entry->offset;
+    lua_pushstring(L, nex_line_names[entry->type]);
+    lua_pushlstring(L, line + entry->text_off, entry->text_len);
+    if (entry->type == NEX_LINE_LINK) {
+        lua_pushlstring(L, line + entry->target_off, entry->target_len);
+        return 3;
+    }
+    if (entry->type == NEX_LINE_HEADING) {
+        lua_pushinteger(L, entry->level);
+        return 3;
+    }
+    return 2;
+}
+
+/* Iterator behind doc:links(): returns the next link after line i */
+static int document_next_link(lua_State *L) {
+    nex_document_t *doc = check_document(L);
+    lua_Integer i = luaL_checkinteger(L, 2);
+    for (; i >= 0 && (lua_Unsigned)i < doc->count; i++) {
+        const nex_line_t *entry = &doc->lines[i];
+        if (entry->type == NEX_LINE_LINK) {
+            const char *line = doc->base + entry->offset;
+            lua_pushinteger(L, i + 1);
+            lua_pushlstring(L, line + entry->target_off, entry->target_len);
+            lua_pushlstring(L, line + entry->text_off, entry->text_len);
+            return 3;
+        }
+    }
+    return 0;
+}
+
+/* Lua: for i, url, label in doc:links() do ... end */
+static int lua_document_links(lua_State *L) {
+    check_document(L);
+    lua_pushcfunction(L, document_next_link);
+    lua_pushvalue(L, 1);
+    lua_pushinteger(L, 0);
+    return 3;
+}
+
+/*
+ * Lua: url, label, row = doc:link(n) - the n-th link; row is its first row
+ * under the last layout, nil before doc:layout()
+ */
+static int lua_document_link(lua_State *L) {
+    nex_document_t *doc = check_document(L);
+    lua_Integer n = luaL_checkinteger(L, 2);
+    if (n < 1 || (lua_Unsigned)n > doc->links) {
+        return 0;
+    }
+
+    uint32_t i = 0;
+    while (i < doc->count && doc->lines[i].link != n) {
+        i++;
+    }
+    if (i == doc->count) {
+        return 0;
+    }
+    const nex_line_t *entry = &doc->lines[i];
+    const char *line = doc->base + entry->offset;
+    lua_pushlstring(L, line + entry->target_off, entry->target_len);
+    lua_pushlstring(L, line + entry->text_off, entry->text_len);
+    if (doc->layout_cols == 0 || i >= doc->laid_out) {
+        return 2;
+    }
+    lua_pushinteger(L, row_of_line(doc, i) + 1);
+    return 3;
+}
+
+/* Lua: rows = doc:layout(width) - wrap for a viewport width in pixels */
+static int lua_document_layout(lua_State *L) {
+    nex_document_t *doc = check_document(L);
+    int width = (int)luaL_checkinteger(L, 2);
+    layout(doc, width / GFX_CHAR_ADVANCE);
+    lua_pushinteger(L, doc->row_count);
+    return 1;
+}
+
+/*
+ * Lua: doc:draw(x, y, first, rows [, selected]) - draw rows first to
+ * first + rows - 1 of the last layout downwards from y, highlighting link
+ * number selected
+ */
+static int lua_document_draw(lua_State *L) {
+    nex_document_t *doc = check_document(L);
+    int x = (int)luaL_checkinteger(L, 2);
+    int y = (int)luaL_checkinteger(L, 3);
+    lua_Integer first = luaL_checkinteger(L, 4);
+    lua_Integer rows = luaL_checkinteger(L, 5);
+    lua_Integer selected = luaL_optinteger(L, 6, 0);
+    if (doc->layout_cols == 0) {
+        return luaL_error(L, "doc:layout() must be called before doc:draw()");
+    }
+
+    uint64_t start = time_us_64();
+    layout(doc, doc->layout_cols);   /* Lines that arrived since */
+
+    int saved_r = g_draw_r, saved_g = g_draw_g, saved_b = g_draw_b;
+    int saved_alpha = g_draw_alpha;
+    g_draw_alpha = 255;
+
+    if (first < 1) {
+        first = 1;
+    }
+    for (lua_Integer r = first - 1; r < first - 1 + rows && (lua_Unsigned)r < doc->row_count; r++) {
+        const nex_row_t *row = &doc->rows[r];
+        const nex_line_t *line = &doc->lines[row->line];
+        const char *text = doc->base + line->offset + line->text_off + row->start;
+        int indent = nex_line_styles[line->type].indent * GFX_CHAR_ADVANCE;
+        bool highlight = line->type == NEX_LINE_LINK && line->link == selected;
+
+        g_draw_r = highlight ? 0 : nex_line_styles[line->type].r;
+        g_draw_g = highlight ? 255 : nex_line_styles[line->type].g;
+        g_draw_b = highlight ? 255 : nex_line_styles[line->type].b;
+
+        /* Markers on the first row of a line; quote bars on every row */
+        if (line->type == NEX_LINE_QUOTE) {
+            gfx_draw_char(x, y, '|');
+        } else if (row->start == 0 && line->type == NEX_LINE_LIST) {
+            gfx_draw_char(x, y, '*');
+        } else if (row->start == 0 && highlight) {
+            gfx_draw_char(x, y, '>');
+        }
+        gfx_draw_string(x + indent, y, text, row->len);
+        y -= NEX_ROW_HEIGHT;
+    }
+
+    g_draw_r = saved_r;
+    g_draw_g = saved_g;
+    g_draw_b = saved_b;
+    g_draw_alpha = saved_alpha;
+    doc->draw_us = (uint32_t)(time_us_64() - start);
+    return 0;
+}
+
+/*
+ * Lua: doc:stats() - lines, links, bytes, parse_us, index_bytes (line
+ * records plus any own copy of the text), rows, layout_us, layout_bytes and
+ * draw_us of the last doc:draw()
+ */
+static int lua_document_stats(lua_State *L) {
+    nex_document_t *doc = check_document(L);
+    lua_newtable(L);
+    lua_pushinteger(L, doc->count);
+    lua_setfield(L, -2, "lines");
+    lua_pushinteger(L, doc->links);
+    lua_setfield(L, -2, "links");
+    lua_pushinteger(L, (lua_Integer)doc->bytes);
+    lua_setfield(L, -2, "bytes");
+    lua_pushinteger(L, doc->parse_us);
+    lua_setfield(L, -2, "parse_us");
+    lua_pushinteger(L, (lua_Integer)(sizeof(nex_document_t) + doc->capacity +
+                                     doc->line_capacity * sizeof(nex_line_t)));
+    lua_setfield(L, -2, "index_bytes");
+    lua_pushinteger(L, doc->row_count);
+    lua_setfield(L, -2, "rows");
+    lua_pushinteger(L, doc->layout_us);
+    lua_setfield(L, -2, "layout_us");
+    lua_pushinteger(L, (lua_Integer)(doc->row_capacity * sizeof(nex_row_t)));
+    lua_setfield(L, -2, "layout_bytes");
+    lua_pushinteger(L, doc->draw_us);
+    lua_setfield(L, -2, "draw_us");
+    return 1;
+}
+
+static const luaL_Reg document_methods[] = {
+    {"count", lua_document_count},
+    {"line", lua_document_line},
+    {"links", lua_document_links},
+    {"link", lua_document_link},
+    {"layout", lua_document_layout},
+    {"draw", lua_document_draw},
+    {"stats", lua_document_stats},
+    {"__len", lua_document_count},
+    {"__gc", lua_document_gc},
+    {NULL, NULL}
+};
+
+void nex_document_register_lua(lua_State *L) {
+    luaL_newmetatable(L, NEX_DOCUMENT_META);
+    luaL_setfuncs(L, document_methods, 0);
+    lua_pushvalue(L, -1);
+    lua_setfield(L, -2, "__index");
+    lua_pop(L, 1);
+
+    lua_pushcfunction(L, lua_nex_document);
+    lua_setfield(L, -2, "document");
+}
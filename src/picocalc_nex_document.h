@@ -0,0 +1,64 @@
+#ifndef PICOCALC_NEX_DOCUMENT_H
+#define PICOCALC_NEX_DOCUMENT_H
+
+#include <lua.h>
+#include <stdbool.h>
+#include <stddef.h>
+
+/**
+ * @file picocalc_nex_document.h
+ * @brief Indexed Gemtext documents and their layout
+ *
+ * A document is a compact line index (offset, spans, type) over either a
+ * Lua string it keeps alive (nex.document(content)) or its own text
+ * buffer, filled by nex.fetch while a page downloads (nex.document()).
+ * Wrapped rows are computed once per viewport width and extended as lines
+ * arrive; doc:draw() renders a window of rows straight to the framebuffer,
+ * so scrolling only costs drawing the visible rows.
+ */
+
+#define NEX_DOCUMENT_META "nex.document"
+
+typedef struct nex_document nex_document_t;
+
+/**
+ * Get the document at a stack index
+ *
+ * @return The document, or NULL if the value is not one
+ */
+nex_document_t *nex_document_test(lua_State *L, int index);
+
+/**
+ * Append received bytes to a document created by nex.document()
+ * Complete lines are indexed at once, the last one when the document is
+ * finished.
+ *
+ * @return false if out of memory (the bytes are dropped)
+ */
+bool nex_document_append(nex_document_t *doc, const char *data, size_t len);
+
+/**
+ * Index the unterminated last line, once the response is complete
+ */
+void nex_document_finish(nex_document_t *doc);
+
+/**
+ * Get the number of indexed lines
+ */
+size_t nex_document_lines(const nex_document_t *doc);
+
+/**
+ * Check whether a document can be filled by nex_document_append()
+ *
+ * @return true for a document created by nex.document() that has not
+ *         received any bytes yet
+ */
+bool nex_document_empty(const nex_document_t *doc);
+
+/**
+ * Register the document metatable and nex.document in the table on top of
+ * the stack
+ */
+void nex_document_register_lua(lua_State *L);
+
+#endif /* PICOCALC_NEX_DOCUMENT_H */
@@ -0,0 +1,623 @@
+/**
+ * @file picocalc_pack.c
+ * @brief Single-file asset packs with an indexed name lookup
+ *
+ * The pack's file stays open for the life of the pack. Reads go through
+ * fat_io_read(), so payloads of two sectors or more (they start on a
+ * sector boundary) are moved with multi-block commands, and the driver is
+ * only asked to seek when a read does not continue the previous one.
+ */
+
+#include "picocalc_pack.h"
+#include "picocalc_fat_io.h"
+#include "picocalc_framebuffer.h"
+#include "debug.h"
+#include "lauxlib.h"
+#include <math.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+
+#define PACK_MAX_BUCKET_BITS 12
+
+/* Registry keys */
+#define PACK_VIEW_META "load81.pack.view"
+#define PACK_MOUNTS "load81.pack.mounts"
+#define PACK_SPRITES "load81.pack.sprites"
+
+struct pack {
+    fat32_file_t file;
+    uint32_t count;
+    pack_entry_t *entries;
+    char *names;
+    uint32_t names_size;
+    uint16_t *buckets;           /* First entry of each hash prefix, plus the end */
+    uint32_t bucket_bits;
+};
+
+static uint16_t get_u16(const uint8_t *p) {
+    return (uint16_t)(p[0] | p[1] << 8);
+}
+
+static uint32_t get_u32(const uint8_t *p) {
+    return (uint32_t)p[0] | (uint32_t)p[1] << 8 | (uint32_t)p[2] << 16 | (uint32_t)p[3] << 24;
+}
+
+static uint32_t name_hash(const char *name, size_t len) {
+    uint32_t hash = 2166136261u;
+    for (size_t i = 0; i < len; i++) {
+        hash = (hash ^ (uint8_t)name[i]) * 16777619u;
+    }
+    return hash;
+}
+
+/* Read exactly size bytes at offset */
+static bool read_at(pack_t *pack, uint32_t offset, void *buffer, uint32_t size) {
+    size_t got = 0;
+    return fat32_seek(&pack->file, offset) == FAT32_OK &&
+           fat_io_read(&pack->file, buffer, size, &got) == FAT32_OK && got == size;
+}
+
+/* Decode the index, check it against the file and build the buckets */
+static const char *load_index(pack_t *pack, const uint8_t *header) {
+    uint32_t file_size = pack->file.file_size;
+    uint32_t count = get_u32(header + 8);
+    uint32_t index_offset = get_u32(header + 12);
+    uint32_t names_offset = get_u32(header + 16);
+    uint32_t names_size = get_u32(header + 20);
+    uint32_t data_offset = get_u32(header + 24);
+
+    if (memcmp(header, PACK_MAGIC, 4) != 0) {
+        return "not an asset pack";
+    }
+    if (get_u16(header + 4) != PACK_VERSION) {
+        return "unsupported pack version";
+    }
+    if (count > PACK_MAX_ENTRIES || index_offset < PACK_HEADER_SIZE || names_size > file_size ||
+        names_offset != index_offset + count * PACK_ENTRY_SIZE ||
+        names_offset + names_size > data_offset || data_offset > file_size) {
+        return "corrupt pack header";
+    }
+
+    uint32_t index_size = count * PACK_ENTRY_SIZE;
+    uint8_t *raw = malloc(index_size + names_size + 1);
+    pack->entries = malloc(count * sizeof(pack_entry_t) + 1);
+    if (!raw || !pack->entries) {
+        free(raw);
+        return "out of memory";
+    }
+    if (!read_at(pack, index_offset, raw, index_size + names_size)) {
+        free(raw);
+        return "pack index could not be read";
+    }
+
+    const char *names = (const char *)raw + index_size;
+    for (uint32_t i = 0; i < count; i++) {
+        const uint8_t *p = raw + i * PACK_ENTRY_SIZE;
+        pack_entry_t *entry = &pack->entries[i];
+        entry->hash = get_u32(p);
+        entry->name = get_u32(p + 4);
+        entry->offset = get_u32(p + 8);
+        entry->length = get_u32(p + 12);
+        entry->flags = get_u16(p + 16);
+        entry->name_len = get_u16(p + 18);
+        if (entry->name >= names_size || entry->name_len >= names_size - entry->name ||
+            names[entry->name + entry->name_len] != '\0' ||
+            entry->offset < data_offset || entry->length > file_size - entry->offset ||
+            (i > 0 && entry->hash < entry[-1].hash)) {
+            free(raw);
+            return "corrupt pack index";
+        }
+    }
+
+    /* Keep only the names, in place at the start of the buffer */
+    memmove(raw, names, names_size);
+    pack->names = (char *)raw;
+    pack->names_size = names_size;
+    pack->count = count;
+
+    pack->bucket_bits = 1;
+    while ((1u << pack->bucket_bits) < count && pack->bucket_bits < PACK_MAX_BUCKET_BITS) {
+        pack->bucket_bits++;
+    }
+    uint32_t buckets = 1u << pack->bucket_bits;
+    pack->buckets = malloc((buckets + 1) * sizeof(uint16_t));
+    if (!pack->buckets) {
+        return "out of memory";
+    }
+    uint32_t i = 0;
+    for (uint32_t b = 0; b < buckets; b++) {
+        while (i < count && (pack->entries[i].hash >> (32 - pack->bucket_bits)) < b) {
+            i++;
+        }
+        pack->buckets[b] = i;
+    }
+    pack->buckets[buckets] = count;
+    return NULL;
+}
+
+pack_t *pack_open(const char *path, const char **err) {
+    char full[256];
+    if (path[0] == '/') {
+        snprintf(full, sizeof(full), "%s", path);
+    } else {
+        snprintf(full, sizeof(full), "/load81/%s", path);
+    }
+
+    pack_t *pack = calloc(1, sizeof(pack_t));
+    if (!pack) {
+        *err = "out of memory";
+        return NULL;
+    }
+    if (fat32_open(&pack->file, full) != FAT32_OK) {
+        free(pack);
+        *err = "cannot open pack";
+        return NULL;
+    }
+
+    uint8_t header[PACK_HEADER_SIZE];
+    *err = read_at(pack, 0, header, sizeof(header)) ? load_index(pack, header)
+                                                    : "not an asset pack";
+    if (*err) {
+        DEBUG_PRINTF("[PACK] %s: %s\n", full, *err);
+        pack_close(pack);
+        return NULL;
+    }
+    DEBUG_PRINTF("[PACK] Opened %s: %lu assets\n", full, (unsigned long)pack->count);
+    return pack;
+}
+
+void pack_close(pack_t *pack) {
+    if (!pack) {
+        return;
+    }
+    fat32_close(&pack->file);
+    free(pack->entries);
+    free(pack->names);
+    free(pack->buckets);
+    free(pack);
+}
+
+const pack_entry_t *pack_find(const pack_t *pack, const char *name) {
+    size_t len = strlen(name);
+    uint32_t hash = name_hash(name, len);
+    uint32_t b = hash >> (32 - pack->bucket_bits);
+    for (uint32_t i = pack->buckets[b]; i < pack->buckets[b + 1]; i++) {
+        const pack_entry_t *entry = &pack->entries[i];
+        if (entry->hash == hash && entry->name_len == len &&
+            memcmp(pack->names + entry->name, name, len) == 0) {
+            return entry;
+        }
+    }
+    return NULL;
+}
+
+uint32_t pack_count(const pack_t *pack) {
+    return pack->count;
+}
+
+const pack_entry_t *pack_entry(const pack_t *pack, uint32_t i) {
+    return i < pack->count ? &pack->entries[i] : NULL;
+}
+
+const char *pack_name(const pack_t *pack, const pack_entry_t *entry) {
+    return pack->names + entry->name;
+}
+
+int32_t pack_read(pack_t *pack, const pack_entry_t *entry, uint32_t offset,
+                  void *buffer, uint32_t size) {
+    if (offset >= entry->length) {
+        return 0;
+    }
+    if (size > entry->length - offset) {
+        size = entry->length - offset;
+    }
+    uint32_t position = entry->offset + offset;
+    if (pack->file.position != position && fat32_seek(&pack->file, position) != FAT32_OK) {
+        return -1;
+    }
+    size_t got = 0;
+    if (fat_io_read(&pack->file, buffer, size, &got) != FAT32_OK) {
+        return -1;
+    }
+    return (int32_t)got;
+}
+
+/* Lua bindings */
+
+typedef struct {
+    pack_t *pack;                /* NULL once closed */
+} lua_pack_t;
+
+typedef struct {
+    lua_pack_t *owner;           /* Kept alive through the view's user value */
+    const pack_entry_t *entry;
+    uint32_t position;
+} lua_pack_view_t;
+
+typedef struct {
+    uint16_t width;
+    uint16_t height;
+    /* width*height RGB565 then width*height alpha, top row first */
+    uint8_t data[];
+} sprite_t;
+
+static pack_t *check_pack(lua_State *L, int index) {
+    lua_pack_t *box = (lua_pack_t *)luaL_checkudata(L, index, PACK_META);
+    if (!box->pack) {
+        luaL_error(L, "pack is closed");
+    }
+    return box->pack;
+}
+
+static lua_pack_view_t *check_view(lua_State *L) {
+    lua_pack_view_t *view = (lua_pack_view_t *)luaL_checkudata(L, 1, PACK_VIEW_META);
+    if (!view->owner->pack) {
+        luaL_error(L, "pack is closed");
+    }
+    return view;
+}
+
+/* Push size bytes of an asset from offset as a string, or nil on error */
+static int push_asset(lua_State *L, pack_t *pack, const pack_entry_t *entry,
+                      uint32_t offset, uint32_t size) {
+    luaL_Buffer b;
+    char *data = luaL_buffinitsize(L, &b, size);
+    int32_t got = pack_read(pack, entry, offset, data, size);
+    if (got < 0) {
+        lua_pushnil(L);
+        lua_pushstring(L, "read failed");
+        return 2;
+    }
+    luaL_pushresultsize(&b, (size_t)got);
+    return 1;
+}
+
+/* Lua: pack.open(path) - open a pack, or nil and a message */
+static int lua_pack_open(lua_State *L) {
+    const char *path = luaL_checkstring(L, 1);
+    lua_pack_t *box = (lua_pack_t *)lua_newuserdata(L, sizeof(lua_pack_t));
+    box->pack = NULL;
+    luaL_setmetatable(L, PACK_META);
+
+    const char *err = NULL;
+    box->pack = pack_open(path, &err);
+    if (!box->pack) {
+        lua_pushnil(L);
+        lua_pushstring(L, err);
+        return 2;
+    }
+    return 1;
+}
+
+/* Lua: p:close() */
+static int lua_pack_close(lua_State *L) {
+    lua_pack_t *box = (lua_pack_t *)luaL_checkudata(L, 1, PACK_META);
+    pack_close(box->pack);
+    box->pack = NULL;
+    return 0;
+}
+
+/* Lua: p:read(name) - the whole asset, or nil if the pack has none */
+static int lua_pack_read(lua_State *L) {
+    pack_t *pack = check_pack(L, 1);
+    const pack_entry_t *entry = pack_find(pack, luaL_checkstring(L, 2));
+    if (!entry) {
+        lua_pushnil(L);
+        lua_pushstring(L, "no such asset");
+        return 2;
+    }
+    return push_asset(L, pack, entry, 0, entry->length);
+}
+
+/* Lua: p:has(name) */
+static int lua_pack_has(lua_State *L) {
+    pack_t *pack = check_pack(L, 1);
+    lua_pushboolean(L, pack_find(pack, luaL_checkstring(L, 2)) != NULL);
+    return 1;
+}
+
+/* Lua: p:list() - table of asset names in index order */
+static int lua_pack_list(lua_State *L) {
+    pack_t *pack = check_pack(L, 1);
+    lua_createtable(L, (int)pack->count, 0);
+    for (uint32_t i = 0; i < pack->count; i++) {
+        lua_pushstring(L, pack_name(pack, &pack->entries[i]));
+        lua_rawseti(L, -2, (int)i + 1);
+    }
+    return 1;
+}
+
+/* Lua: p:view(name) - a stream over one asset, read in pieces */
+static int lua_pack_view(lua_State *L) {
+    pack_t *pack = check_pack(L, 1);
+    const pack_entry_t *entry = pack_find(pack, luaL_checkstring(L, 2));
+    if (!entry) {
+        lua_pushnil(L);
+        lua_pushstring(L, "no such asset");
+        return 2;
+    }
+    lua_pack_view_t *view = (lua_pack_view_t *)lua_newuserdata(L, sizeof(lua_pack_view_t));
+    view->owner = (lua_pack_t *)lua_touserdata(L, 1);
+    view->entry = entry;
+    view->position = 0;
+    luaL_setmetatable(L, PACK_VIEW_META);
+    lua_pushvalue(L, 1);
+    lua_setuservalue(L, -2);
+    return 1;
+}
+
+/* Lua: v:read([n]) - the next n bytes (default the rest), nil at the end */
+static int lua_view_read(lua_State *L) {
+    lua_pack_view_t *view = check_view(L);
+    uint32_t left = view->entry->length - view->position;
+    lua_Integer n = luaL_optinteger(L, 2, left);
+    if (left == 0) {
+        lua_pushnil(L);
+        return 1;
+    }
+    if (n < 0) {
+        n = 0;
+    }
+    uint32_t size = (lua_Unsigned)n < left ? (uint32_t)n : left;
+    int results = push_asset(L, view->owner->pack, view->entry, view->position, size);
+    if (results == 1) {
+        view->position += (uint32_t)lua_rawlen(L, -1);
+    }
+    return results;
+}
+
+/* Lua: v:seek(position) - 0-based, clamped to the asset; returns it */
+static int lua_view_seek(lua_State *L) {
+    lua_pack_view_t *view = check_view(L);
+    lua_Integer position = luaL_checkinteger(L, 2);
+    if (position < 0) {
+        position = 0;
+    }
+    if ((lua_Unsigned)position > view->entry->length) {
+        position = view->entry->length;
+    }
+    view->position = (uint32_t)position;
+    lua_pushinteger(L, position);
+    return 1;
+}
+
+/* Lua: v:tell() */
+static int lua_view_tell(lua_State *L) {
+    lua_pushinteger(L, check_view(L)->position);
+    return 1;
+}
+
+/* Lua: v:size(), #v */
+static int lua_view_size(lua_State *L) {
+    lua_pushinteger(L, check_view(L)->entry->length);
+    return 1;
+}
+
+/* Find an asset in the mounted packs, most recent first; pushes nothing */
+static const pack_entry_t *find_mounted(lua_State *L, const char *name, pack_t **found) {
+    const pack_entry_t *entry = NULL;
+    lua_getfield(L, LUA_REGISTRYINDEX, PACK_MOUNTS);
+    if (lua_istable(L, -1)) {
+        for (size_t i = lua_rawlen(L, -1); i > 0 && !entry; i--) {
+            lua_rawgeti(L, -1, (int)i);
+            lua_pack_t *box = (lua_pack_t *)luaL_testudata(L, -1, PACK_META);
+            if (box && box->pack) {
+                entry = pack_find(box->pack, name);
+                *found = box->pack;
+            }
+            lua_pop(L, 1);
+        }
+    }
+    lua_pop(L, 1);
+    return entry;
+}
+
+/* package.searchers entry: "a.b" loads a/b.lua from a mounted pack */
+static int pack_searcher(lua_State *L) {
+    const char *module = luaL_checkstring(L, 1);
+    luaL_gsub(L, module, ".", "/");
+    lua_pushliteral(L, ".lua");
+    lua_concat(L, 2);
+    const char *name = lua_tostring(L, -1);
+
+    pack_t *pack = NULL;
+    const pack_entry_t *entry = find_mounted(L, name, &pack);
+    if (!entry) {
+        lua_pushfstring(L, "\n\tno asset '%s' in mounted packs", name);
+        return 1;
+    }
+    if (push_asset(L, pack, entry, 0, entry->length) != 1) {
+        return luaL_error(L, "error reading '%s' from pack", name);
+    }
+    size_t len;
+    const char *code = lua_tolstring(L, -1, &len);
+    lua_pushfstring(L, "@%s", name);
+    if (luaL_loadbuffer(L, code, len, lua_tostring(L, -1)) != LUA_OK) {
+        return luaL_error(L, "error loading module '%s' from pack:\n\t%s",
+                          module, lua_tostring(L, -1));
+    }
+    lua_pushstring(L, name);
+    return 2;
+}
+
+/* Put pack_searcher second in package.searchers, after preload */
+static void install_searcher(lua_State *L) {
+    lua_getglobal(L, "package");
+    if (!lua_istable(L, -1)) {
+        lua_pop(L, 1);
+        return;
+    }
+    lua_getfield(L, -1, "searchers");
+    if (lua_istable(L, -1)) {
+        for (int i = (int)lua_rawlen(L, -1); i >= 2; i--) {
+            lua_rawgeti(L, -1, i);
+            lua_rawseti(L, -2, i + 1);
+        }
+        lua_pushcfunction(L, pack_searcher);
+        lua_rawseti(L, -2, 2);
+    }
+    lua_pop(L, 2);
+}
+
+/*
+ * Lua: pack.mount(p or path) - make a pack's assets available to require()
+ * and sprite(); returns the pack
+ */
+static int lua_pack_mount(lua_State *L) {
+    if (lua_type(L, 1) == LUA_TSTRING) {
+        int results = lua_pack_open(L);
+        if (results != 1) {
+            return results;
+        }
+        lua_replace(L, 1);
+    }
+    check_pack(L, 1);
+    lua_settop(L, 1);
+
+    lua_getfield(L, LUA_REGISTRYINDEX, PACK_MOUNTS);
+    if (!lua_istable(L, -1)) {
+        lua_pop(L, 1);
+        lua_newtable(L);
+        lua_pushvalue(L, -1);
+        lua_setfield(L, LUA_REGISTRYINDEX, PACK_MOUNTS);
+        install_searcher(L);
+    }
+    lua_pushvalue(L, 1);
+    lua_rawseti(L, -2, (int)lua_rawlen(L, -2) + 1);
+    lua_pop(L, 1);
+    return 1;
+}
+
+/* Decode a sprite asset from the mounted packs into a userdata; pushes it */
+static sprite_t *load_sprite(lua_State *L, const char *name) {
+    pack_t *pack = NULL;
+    const pack_entry_t *entry = find_mounted(L, name, &pack);
+    if (!entry) {
+        luaL_error(L, "sprite '%s' not found in mounted packs", name);
+    }
+    uint8_t size[4];
+    if (!(entry->flags & PACK_FLAG_SPRITE) || pack_read(pack, entry, 0, size, 4) != 4) {
+        luaL_error(L, "'%s' is not a sprite", name);
+    }
+    uint32_t width = get_u16(size);
+    uint32_t height = get_u16(size + 2);
+    uint32_t pixels = width * height * 3;
+    if (entry->length != 4 + pixels) {
+        luaL_error(L, "'%s' is not a sprite", name);
+    }
+
+    sprite_t *sprite = (sprite_t *)lua_newuserdata(L, sizeof(sprite_t) + pixels);
+    sprite->width = width;
+    sprite->height = height;
+    if (pack_read(pack, entry, 4, sprite->data, pixels) != (int32_t)pixels) {
+        luaL_error(L, "error reading sprite '%s'", name);
+    }
+    return sprite;
+}
+
+static void sprite_pixel(const sprite_t *sprite, uint32_t u, uint32_t row, int x, int y) {
+    uint32_t i = row * sprite->width + u;
+    uint8_t alpha = sprite->data[sprite->width * sprite->height * 2 + i];
+    if (alpha) {
+        uint16_t c = get_u16(sprite->data + i * 2);
+        fb_set_pixel(x, y, (c >> 11) << 3, ((c >> 5) & 0x3F) << 2, (c & 0x1F) << 3, alpha);
+    }
+}
+
+/*
+ * Lua: sprite(name, x, y [, angle]) - draw a sprite from a mounted pack
+ * with its bottom-left corner at x,y, rotated by angle degrees
+ * counterclockwise about its center. Decoded sprites are kept for reuse.
+ */
+static int lua_sprite(lua_State *L) {
+    const char *name = luaL_checkstring(L, 1);
+    int x = (int)luaL_checknumber(L, 2);
+    int y = (int)luaL_checknumber(L, 3);
+    lua_Number angle = luaL_optnumber(L, 4, 0);
+
+    lua_getfield(L, LUA_REGISTRYINDEX, PACK_SPRITES);
+    lua_getfield(L, -1, name);
+    sprite_t *sprite = (sprite_t *)lua_touserdata(L, -1);
+    if (!sprite) {
+        lua_pop(L, 1);
+        sprite = load_sprite(L, name);
+        lua_setfield(L, -2, name);
+    }
+    int w = sprite->width;
+    int h = sprite->height;
+
+    if (fmod(angle, 360.0) == 0) {
+        for (int row = 0; row < h; row++) {
+            for (int u = 0; u < w; u++) {
+                sprite_pixel(sprite, u, row, x + u, y + h - 1 - row);
+            }
+        }
+        return 0;
+    }
+
+    /* Map each pixel of the rotated bounding square back into the sprite (16.16) */
+    double rad = angle * 3.14159265358979323846 / 180.0;
+    int32_t c = (int32_t)(cos(rad) * 65536);
+    int32_t s = (int32_t)(sin(rad) * 65536);
+    int radius = (int)(sqrt((double)(w * w + h * h)) / 2) + 1;
+    int cx = x + w / 2;
+    int cy = y + h / 2;
+    for (int dy = -radius; dy <= radius; dy++) {
+        for (int dx = -radius; dx <= radius; dx++) {
+            int32_t su = (c * dx + s * dy + (w << 15)) >> 16;
+            int32_t sv = (-s * dx + c * dy + (h << 15)) >> 16;
+            if (su >= 0 && su < w && sv >= 0 && sv < h) {
+                sprite_pixel(sprite, su, h - 1 - sv, cx + dx, cy + dy);
+            }
+        }
+    }
+    return 0;
+}
+
+static const luaL_Reg pack_methods[] = {
+    {"read", lua_pack_read},
+    {"view", lua_pack_view},
+    {"has", lua_pack_has},
+    {"list", lua_pack_list},
+    {"close", lua_pack_close},
+    {"__gc", lua_pack_close},
+    {NULL, NULL}
+};
+
+static const luaL_Reg view_methods[] = {
+    {"read", lua_view_read},
+    {"seek", lua_view_seek},
+    {"tell", lua_view_tell},
+    {"size", lua_view_size},
+    {"__len", lua_view_size},
+    {NULL, NULL}
+};
+
+void pack_register_lua(lua_State *L) {
+    luaL_newmetatable(L, PACK_META);
+    luaL_setfuncs(L, pack_methods, 0);
+    lua_pushvalue(L, -1);
+    lua_setfield(L, -2, "__index");
+    lua_pop(L, 1);
+
+    luaL_newmetatable(L, PACK_VIEW_META);
+    luaL_setfuncs(L, view_methods, 0);
+    lua_pushvalue(L, -1);
+    lua_setfield(L, -2, "__index");
+    lua_pop(L, 1);
+
+    /* Decoded sprites by name, for the life of the state */
+    lua_newtable(L);
+    lua_setfield(L, LUA_REGISTRYINDEX, PACK_SPRITES);
+
+    lua_newtable(L);
+    lua_pushcfunction(L, lua_pack_open);
+    lua_setfield(L, -2, "open");
+    lua_pushcfunction(L, lua_pack_mount);
+    lua_setfield(L, -2, "mount");
+    lua_setglobal(L, "pack");
+
+    lua_pushcfunction(L, lua_sprite);
+    lua_setglobal(L, "sprite");
+}
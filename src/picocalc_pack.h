@@ -0,0 +1,98 @@
+#ifndef PICOCALC_PACK_H
+#define PICOCALC_PACK_H
+
+#include <lua.h>
+#include <stdbool.h>
+#include <stddef.h>
+#include <stdint.h>
+#include "fat32.h"
+
+/**
+ * @file picocalc_pack.h
+ * @brief Single-file asset packs with an indexed name lookup
+ *
+ * A pack bundles many small assets (sprites, levels, modules) into one
+ * file, built on the host by tools/load81pack.py, so a program pays one
+ * path walk and open instead of one per asset and its data sits in one
+ * run of clusters. Layout, all integers little-endian:
+ *
+ *   header   32 bytes, see below
+ *   index    count entries of 20 bytes, sorted by name hash
+ *   names    NUL-terminated names (paths relative to the packed root)
+ *   payloads each starting on a 512-byte boundary
+ *
+ * The header and index are read into RAM when the pack is opened; an
+ * asset is then found by its FNV-1a hash through a bucket table built
+ * from the sorted index, and read with one seek and one fat_io_read().
+ */
+
+#define PACK_MAGIC "L81P"
+#define PACK_VERSION 1
+#define PACK_HEADER_SIZE 32
+#define PACK_ENTRY_SIZE 20
+#define PACK_ALIGN 512
+#define PACK_MAX_ENTRIES 4096
+
+/* Entry flags */
+#define PACK_FLAG_SPRITE 0x0001      /* u16 w, u16 h, w*h RGB565, w*h alpha */
+
+#define PACK_META "load81.pack"
+
+typedef struct {
+    uint32_t hash;               /* FNV-1a of the name */
+    uint32_t name;               /* Offset into the names block */
+    uint32_t offset;             /* Payload position in the file */
+    uint32_t length;
+    uint16_t flags;
+    uint16_t name_len;
+} pack_entry_t;
+
+typedef struct pack pack_t;
+
+/**
+ * Open a pack and load its index
+ *
+ * @param path Absolute path, or relative to /load81
+ * @param err Set to the reason when NULL is returned
+ * @return The pack, kept open until pack_close(), or NULL
+ */
+pack_t *pack_open(const char *path, const char **err);
+
+/**
+ * Close the file and free the index
+ */
+void pack_close(pack_t *pack);
+
+/**
+ * Find an asset by name
+ *
+ * @return The entry, or NULL if the pack has no such asset
+ */
+const pack_entry_t *pack_find(const pack_t *pack, const char *name);
+
+/**
+ * Get the number of assets and the i-th entry in index order
+ */
+uint32_t pack_count(const pack_t *pack);
+const pack_entry_t *pack_entry(const pack_t *pack, uint32_t i);
+const char *pack_name(const pack_t *pack, const pack_entry_t *entry);
+
+/**
+ * Read part of an asset
+ *
+ * Sequential reads through an asset (a view) continue from where the last
+ * one stopped without seeking again.
+ *
+ * @param offset Position within the asset
+ * @return Bytes read (short only at the end of the asset), or -1 on error
+ */
+int32_t pack_read(pack_t *pack, const pack_entry_t *entry, uint32_t offset,
+                  void *buffer, uint32_t size);
+
+/**
+ * Register the pack library (pack.open, pack.mount), the pack and view
+ * metatables and sprite()
+ */
+void pack_register_lua(lua_State *L);
+
+#endif /* PICOCALC_PACK_H */
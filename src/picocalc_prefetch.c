@@ -0,0 +1,257 @@
+/**
+ * @file picocalc_prefetch.c
+ * @brief Speculative load of the program under the menu cursor
+ *
+ * The read is an FS_JOB_READ on the filesystem worker, which the menu
+ * advances in place of its idle sleep. A job cannot be withdrawn once
+ * submitted, so an abandoned read runs to completion and is thrown away;
+ * no new read starts until it has.
+ *
+ * The parse cannot be split, so it runs in one call from the menu's key
+ * wait: only once the source has been in RAM for PREFETCH_COMPILE_DWELL_MS
+ * with no key waiting, so scrolling through the list never pays for it.
+ */
+
+#include "picocalc_prefetch.h"
+#include "picocalc_fs_worker.h"
+#include "picocalc_prog_index.h"
+#include "picocalc_keyboard.h"
+#include "debug.h"
+#include "pico/stdlib.h"
+#include "pico/cyw43_arch.h"
+#include <lua.h>
+#include <lauxlib.h>
+#include <string.h>
+#include <stdlib.h>
+#include <stdio.h>
+
+/* A buffer with the change generation its file was read at */
+typedef struct {
+    char name[PROG_INDEX_NAME_MAX];
+    char *data;
+    size_t size;
+    uint32_t generation;
+} prefetch_buffer_t;
+
+static struct {
+    char selected[PROG_INDEX_NAME_MAX];  /* Program under the cursor, "" if none */
+    uint64_t selected_us;
+
+    fs_job_t *job;                       /* Read in flight */
+    char job_name[PROG_INDEX_NAME_MAX];  /* "" once abandoned */
+    uint32_t job_generation;
+    uint64_t job_start_us;
+    uint32_t job_ticket;                 /* Its number in fs_worker_stats()->submitted */
+
+    prefetch_buffer_t source;            /* Read, waiting to be compiled */
+    uint64_t source_us;                  /* When the read finished */
+    prefetch_buffer_t chunk;             /* Compiled */
+    char failed[PROG_INDEX_NAME_MAX];    /* Too large or not compilable */
+
+    prefetch_stats_t stats;
+} g_prefetch;
+
+static void buffer_free(prefetch_buffer_t *buffer) {
+    free(buffer->data);
+    buffer->data = NULL;
+    buffer->size = 0;
+    buffer->name[0] = '\0';
+}
+
+static void program_path(const char *name, char *path, size_t path_size) {
+    snprintf(path, path_size, "%s/%s", PROG_INDEX_DIR, name);
+}
+
+/* True if buffer holds name and the file has not been written since */
+static bool buffer_current(const prefetch_buffer_t *buffer, const char *name) {
+    if (!buffer->data || strcmp(buffer->name, name) != 0) {
+        return false;
+    }
+    char path[FS_MAX_PATH];
+    program_path(name, path, sizeof(path));
+    return !fs_changed_since(path, buffer->generation);
+}
+
+static void read_done(fs_job_t *job) {
+    g_prefetch.job = NULL;
+    if (g_prefetch.job_name[0] && job->result == FS_OK) {
+        buffer_free(&g_prefetch.source);
+        snprintf(g_prefetch.source.name, sizeof(g_prefetch.source.name), "%s", g_prefetch.job_name);
+        g_prefetch.source.data = (char *)job->data;
+        g_prefetch.source.size = job->size;
+        g_prefetch.source.generation = g_prefetch.job_generation;
+        job->data = NULL;
+        g_prefetch.source_us = time_us_64();
+        g_prefetch.stats.last_read_us = (uint32_t)(g_prefetch.source_us - g_prefetch.job_start_us);
+    } else if (g_prefetch.job_name[0]) {
+        snprintf(g_prefetch.failed, sizeof(g_prefetch.failed), "%s", g_prefetch.job_name);
+    }
+    g_prefetch.job_name[0] = '\0';
+    fs_job_free(job);
+}
+
+static void start_read(const char *name) {
+    char path[FS_MAX_PATH];
+    program_path(name, path, sizeof(path));
+
+    size_t size = 0;
+    if (fs_get_file_size(path, &size) != FS_OK || size == 0 || size > PREFETCH_MAX_SOURCE) {
+        snprintf(g_prefetch.failed, sizeof(g_prefetch.failed), "%s", name);
+        return;
+    }
+    uint32_t generation = fs_change_generation();
+    fs_job_t *job = fs_job_new(FS_JOB_READ, path, read_done, NULL);
+    if (!job) {
+        return;
+    }
+    if (!fs_worker_submit(job)) {
+        fs_job_free(job);
+        return;
+    }
+    g_prefetch.job = job;
+    snprintf(g_prefetch.job_name, sizeof(g_prefetch.job_name), "%s", name);
+    g_prefetch.job_generation = generation;
+    g_prefetch.job_start_us = time_us_64();
+    g_prefetch.job_ticket = fs_worker_stats()->submitted;
+    g_prefetch.stats.started++;
+}
+
+typedef struct {
+    char *data;
+    size_t size;
+    bool overflow;
+} dump_t;
+
+static int dump_writer(lua_State *L, const void *p, size_t sz, void *ud) {
+    (void)L;
+    dump_t *dump = ud;
+    if (dump->size + sz > PREFETCH_MAX_CHUNK) {
+        dump->overflow = true;
+        return 1;
+    }
+    char *grown = realloc(dump->data, dump->size + sz);
+    if (!grown) {
+        dump->overflow = true;
+        return 1;
+    }
+    memcpy(grown + dump->size, p, sz);
+    dump->data = grown;
+    dump->size += sz;
+    return 0;
+}
+
+/* Compile the source into the chunk buffer; the source is released */
+static void compile_source(void) {
+    prefetch_buffer_t *source = &g_prefetch.source;
+    uint64_t start = time_us_64();
+    dump_t dump = { NULL, 0, false };
+    buffer_free(&g_prefetch.chunk);  /* Replaced either way; bounds the peak */
+
+    /* A bare state: compiling needs no libraries, and it is closed at once */
+    lua_State *L = luaL_newstate();
+    bool ok = L && luaL_loadbuffer(L, source->data, source->size, source->name) == LUA_OK &&
+              lua_dump(L, dump_writer, &dump) == 0 && !dump.overflow;
+    if (L) {
+        lua_close(L);
+    }
+
+    if (ok) {
+        snprintf(g_prefetch.chunk.name, sizeof(g_prefetch.chunk.name), "%s", source->name);
+        g_prefetch.chunk.data = dump.data;
+        g_prefetch.chunk.size = dump.size;
+        g_prefetch.chunk.generation = source->generation;
+        g_prefetch.stats.compiled++;
+        g_prefetch.stats.last_compile_us = (uint32_t)(time_us_64() - start);
+        DEBUG_PRINTF("[PREFETCH] %s: %lu bytes read in %lu us, compiled to %lu in %lu us\n",
+                     source->name, (unsigned long)source->size,
+                     (unsigned long)g_prefetch.stats.last_read_us, (unsigned long)dump.size,
+                     (unsigned long)g_prefetch.stats.last_compile_us);
+    } else {
+        /* Syntax errors are reported by the normal load */
+        free(dump.data);
+        snprintf(g_prefetch.failed, sizeof(g_prefetch.failed), "%s", source->name);
+    }
+    buffer_free(source);
+}
+
+void prefetch_select(const char *name) {
+    if (!name) {
+        name = "";
+    }
+    if (strcmp(name, g_prefetch.selected) == 0) {
+        return;
+    }
+    snprintf(g_prefetch.selected, sizeof(g_prefetch.selected), "%s", name);
+    g_prefetch.selected_us = time_us_64();
+    g_prefetch.failed[0] = '\0';  /* Retried if the cursor comes back */
+
+    if (g_prefetch.job_name[0] && strcmp(g_prefetch.job_name, name) != 0) {
+        g_prefetch.job_name[0] = '\0';
+        g_prefetch.stats.cancelled++;
+    }
+    if (g_prefetch.source.data && strcmp(g_prefetch.source.name, name) != 0) {
+        buffer_free(&g_prefetch.source);
+        g_prefetch.stats.cancelled++;
+    }
+}
+
+void prefetch_service(void) {
+    const char *name = g_prefetch.selected;
+    if (g_prefetch.source.data) {
+        if (time_us_64() - g_prefetch.source_us >= PREFETCH_COMPILE_DWELL_MS * 1000 &&
+            !kb_key_available()) {
+            compile_source();
+        }
+        return;
+    }
+    if (!name[0] || g_prefetch.job || strcmp(g_prefetch.failed, name) == 0 ||
+        buffer_current(&g_prefetch.chunk, name) ||
+        time_us_64() - g_prefetch.selected_us < PREFETCH_DWELL_MS * 1000) {
+        return;
+    }
+    start_read(name);
+}
+
+bool prefetch_take(const char *name, char **chunk, size_t *size) {
+    /*
+     * Enter pressed before the read finished: finish it here, unless other
+     * jobs (a large PUT) are queued ahead of it; the launch then reads the
+     * file itself rather than waiting for them
+     */
+    if (g_prefetch.job && strcmp(g_prefetch.job_name, name) == 0) {
+        if (fs_worker_stats()->completed + 1 < g_prefetch.job_ticket) {
+            g_prefetch.job_name[0] = '\0';
+            g_prefetch.stats.cancelled++;
+        }
+        while (g_prefetch.job && g_prefetch.job_name[0]) {
+            cyw43_arch_poll();
+            fs_worker_run(FS_WORKER_IDLE_US);
+            fs_worker_poll();
+        }
+    }
+    if (g_prefetch.source.data && strcmp(g_prefetch.source.name, name) == 0) {
+        compile_source();
+    }
+
+    bool hit = buffer_current(&g_prefetch.chunk, name);
+    if (hit) {
+        *chunk = g_prefetch.chunk.data;
+        *size = g_prefetch.chunk.size;
+        g_prefetch.chunk.data = NULL;
+        g_prefetch.stats.hits++;
+    } else {
+        g_prefetch.stats.misses++;
+    }
+    prefetch_reset();
+    return hit;
+}
+
+void prefetch_reset(void) {
+    prefetch_select(NULL);
+    buffer_free(&g_prefetch.chunk);
+    g_prefetch.failed[0] = '\0';
+}
+
+const prefetch_stats_t *prefetch_stats(void) {
+    return &g_prefetch.stats;
+}
@@ -0,0 +1,75 @@
+#ifndef PICOCALC_PREFETCH_H
+#define PICOCALC_PREFETCH_H
+
+#include <stdbool.h>
+#include <stddef.h>
+#include <stdint.h>
+
+/**
+ * @file picocalc_prefetch.h
+ * @brief Speculative load of the program under the menu cursor
+ *
+ * Once the cursor has rested on a program for PREFETCH_DWELL_MS, its
+ * source is read through the filesystem worker; after a further
+ * PREFETCH_COMPILE_DWELL_MS with no key waiting it is compiled in a bare
+ * Lua state and the compiled chunk is dumped into RAM. When the program is then
+ * started, the launch path loads that chunk instead of reading and
+ * parsing the file, so only the top-level code is left to run.
+ *
+ * At most one source buffer (PREFETCH_MAX_SOURCE) and one compiled chunk
+ * (PREFETCH_MAX_CHUNK) are held at a time. Moving the cursor abandons a
+ * read or compile for the previous program; the last compiled chunk is
+ * kept until another one replaces it, so coming back is free. A chunk is
+ * only used if fs_changed_since() shows no write to the file since it was
+ * read.
+ */
+
+#define PREFETCH_DWELL_MS 150          /* Cursor rest before reading starts */
+#define PREFETCH_COMPILE_DWELL_MS 100  /* Further rest before compiling */
+#define PREFETCH_MAX_SOURCE 32768      /* Larger programs load as before */
+#define PREFETCH_MAX_CHUNK 49152       /* Compiled size limit */
+
+typedef struct {
+    uint32_t started;            /* Reads submitted */
+    uint32_t cancelled;          /* Reads or sources dropped on a cursor move */
+    uint32_t compiled;
+    uint32_t hits;               /* Launches that used a prepared chunk */
+    uint32_t misses;
+    uint32_t last_read_us;       /* Submit to source in RAM */
+    uint32_t last_compile_us;
+} prefetch_stats_t;
+
+/**
+ * Report the program under the cursor
+ *
+ * @param name Path below /load81, or NULL when the cursor is not on a program
+ */
+void prefetch_select(const char *name);
+
+/**
+ * Start a read once the cursor has rested, compile a finished read
+ * Called by the menu while it waits for a key, after fs_worker_poll().
+ */
+void prefetch_service(void);
+
+/**
+ * Get the prepared chunk for name, finishing a read or compile under way
+ * Everything else held is released.
+ *
+ * @param chunk Set to the compiled chunk (caller frees) on success
+ * @param size Set to its size
+ * @return false if name was not prefetched or changed since
+ */
+bool prefetch_take(const char *name, char **chunk, size_t *size);
+
+/**
+ * Drop all prefetched data (the menu was left without starting a program)
+ */
+void prefetch_reset(void);
+
+/**
+ * Get the counters
+ */
+const prefetch_stats_t *prefetch_stats(void);
+
+#endif /* PICOCALC_PREFETCH_H */
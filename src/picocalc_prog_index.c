@@ -0,0 +1,737 @@
+/**
+ * @file picocalc_prog_index.c
+ * @brief Persistent index of the programs under /load81
+ *
+ * A rebuild never holds more than PROG_INDEX_RUN records in RAM. The
+ * rescanned directories are walked into runs of up to PROG_INDEX_RUN
+ * records, each sorted and appended to a scratch file; the runs and the
+ * old index are then merged in one pass into a new index file, which
+ * replaces the old one by rename. Records of the old index outside the
+ * rescanned directories are copied through untouched.
+ */
+
+#include "picocalc_prog_index.h"
+#include "picocalc_fat_io.h"
+#include "fat32.h"
+#include "debug.h"
+#include "pico/stdlib.h"
+#include <string.h>
+#include <stdlib.h>
+#include <stdio.h>
+#include <strings.h>
+
+#define RECORD_SIZE 128
+#define MAX_RUNS (PROG_INDEX_MAX_ENTRIES / PROG_INDEX_RUN)
+#define TITLE_PEEK 256               /* Bytes searched for the title comment */
+#define PENDING_RUNS 4               /* Launches recorded between refreshes */
+
+_Static_assert(sizeof(prog_record_t) == RECORD_SIZE, "index record layout");
+
+/* Order-independent summary of the programs in a tree */
+typedef struct {
+    uint32_t count;
+    uint32_t sum;
+    uint32_t xor;
+} stamp_t;
+
+/* A directory to rescan: its direct files, or everything below it */
+typedef struct {
+    char path[FS_MAX_PATH];
+    bool recursive;
+} scope_t;
+
+/* Sequential reader over a sorted stream of records */
+typedef struct {
+    fat32_file_t file;
+    bool opened;
+    uint32_t left;
+    bool valid;
+    prog_record_t head;
+} record_reader_t;
+
+static struct {
+    char root[FS_MAX_PATH];
+    char index_path[FS_MAX_PATH];
+    bool validated;              /* Stamp checked against the tree since boot */
+    bool open;
+    fat32_file_t file;
+    uint32_t count;
+    uint32_t position;           /* Record the file is positioned at */
+
+    scope_t scopes[PROG_INDEX_SCOPES];
+    int scope_count;
+    bool scopes_overflow;        /* Too many changes: rescan everything */
+
+    struct {
+        char name[PROG_INDEX_NAME_MAX];
+        uint16_t load_ms;
+    } pending_runs[PENDING_RUNS];
+    int pending_run_count;
+
+    prog_index_stats_t stats;
+} g_index;
+
+static uint32_t get_u32(const uint8_t *p) {
+    return (uint32_t)p[0] | (uint32_t)p[1] << 8 | (uint32_t)p[2] << 16 | (uint32_t)p[3] << 24;
+}
+
+static void put_u16(uint8_t *p, uint16_t value) {
+    p[0] = value;
+    p[1] = value >> 8;
+}
+
+static void put_u32(uint8_t *p, uint32_t value) {
+    p[0] = value;
+    p[1] = value >> 8;
+    p[2] = value >> 16;
+    p[3] = value >> 24;
+}
+
+static void stamp_add(stamp_t *stamp, const char *name, uint32_t size, uint16_t date,
+                      uint16_t time) {
+    uint32_t hash = 2166136261u;
+    while (*name) {
+        hash ^= (uint8_t)*name++;
+        hash *= 16777619u;
+    }
+    hash ^= size * 2654435761u;
+    hash ^= ((uint32_t)date << 16 | time) * 40503u;
+    stamp->count++;
+    stamp->sum += hash;
+    stamp->xor ^= hash << 7 | hash >> 25;
+}
+
+/* Path of a file below root, or NULL if it is not a program to list */
+static const char *program_name(const char *root, const char *path) {
+    size_t root_len = strlen(root);
+    if (strncasecmp(path, root, root_len) != 0 || path[root_len] != '/') {
+        return NULL;
+    }
+    const char *name = path + root_len + 1;
+    size_t len = strlen(name);
+    if (len <= 4 || len >= PROG_INDEX_NAME_MAX || strcasecmp(name + len - 4, ".lua") != 0) {
+        return NULL;
+    }
+    if (name[0] == '.' || strstr(name, "/.")) {
+        return NULL;  /* Hidden files and anything in hidden directories */
+    }
+    return name;
+}
+
+/* True if name (relative to the root) is covered by scope */
+static bool scope_covers(const scope_t *scope, const char *root, const char *name) {
+    size_t root_len = strlen(root);
+    const char *dir = scope->path[root_len] == '/' ? scope->path + root_len + 1 : "";
+    size_t dir_len = strlen(dir);
+    if (dir_len && (strncmp(name, dir, dir_len) != 0 || name[dir_len] != '/')) {
+        return false;
+    }
+    const char *rest = dir_len ? name + dir_len + 1 : name;
+    return scope->recursive || !strchr(rest, '/');
+}
+
+/*
+ * Title comment of a program: the text of its first line if that line is
+ * a comment ("-- Snake", "--[[ Snake ]]"), otherwise empty
+ */
+static void read_title(const char *root, prog_record_t *record) {
+    record->title[0] = '\0';
+    char path[FS_MAX_PATH + PROG_INDEX_NAME_MAX];
+    snprintf(path, sizeof(path), "%s/%s", root, record->name);
+    fat32_file_t file;
+    if (fat32_open(&file, path) != FAT32_OK) {
+        return;
+    }
+    char text[TITLE_PEEK + 1];
+    size_t got = 0;
+    fat32_read(&file, text, TITLE_PEEK, &got);
+    fat32_close(&file);
+    text[got] = '\0';
+    g_index.stats.titles_read++;
+
+    const char *p = text;
+    while (*p == ' ' || *p == '\t' || *p == '\r' || *p == '\n') p++;
+    if (p[0] != '-' || p[1] != '-') {
+        return;
+    }
+    while (*p == '-' || *p == '[' || *p == ' ' || *p == '\t') p++;
+    size_t len = strcspn(p, "\r\n");
+    while (len && (p[len - 1] == ' ' || p[len - 1] == ']' || p[len - 1] == '\t')) len--;
+    if (len >= PROG_INDEX_TITLE_MAX) {
+        len = PROG_INDEX_TITLE_MAX - 1;
+    }
+    memcpy(record->title, p, len);
+    record->title[len] = '\0';
+}
+
+/* Walks: every program below root into a stamp, or scopes into sorted runs */
+
+typedef struct {
+    const char *root;
+    stamp_t stamp;
+    prog_record_t *run;          /* PROG_INDEX_RUN records being filled (or merged) */
+    uint32_t fill;
+    fat32_file_t *out;           /* Scratch file the sorted runs go to */
+    uint32_t run_len[MAX_RUNS];
+    uint32_t runs;
+    uint32_t total;
+    bool failed;
+} collect_t;
+
+static int record_compare(const void *a, const void *b) {
+    return strcasecmp(((const prog_record_t *)a)->name, ((const prog_record_t *)b)->name);
+}
+
+static bool collect_flush(collect_t *c) {
+    if (c->fill == 0) {
+        return true;
+    }
+    qsort(c->run, c->fill, sizeof(prog_record_t), record_compare);
+    size_t written = 0;
+    size_t bytes = c->fill * sizeof(prog_record_t);
+    if (fat_io_write(c->out, c->run, bytes, &written) != FAT32_OK || written != bytes) {
+        c->failed = true;
+        return false;
+    }
+    c->run_len[c->runs++] = c->fill;
+    c->fill = 0;
+    return true;
+}
+
+static bool collect_entry(const char *path, const fs_entry_t *entry, void *user_data) {
+    collect_t *c = (collect_t *)user_data;
+    const char *name = entry->is_dir ? NULL : program_name(c->root, path);
+    if (!name) {
+        return true;
+    }
+    if (!c->run) {
+        stamp_add(&c->stamp, name, entry->size, entry->date, entry->time);
+        return true;
+    }
+    if (c->total >= PROG_INDEX_MAX_ENTRIES) {
+        return true;  /* Listed up to the limit, the rest is left out */
+    }
+
+    prog_record_t *record = &c->run[c->fill++];
+    memset(record, 0, sizeof(*record));
+    strcpy(record->name, name);
+    record->size = entry->size;
+    record->date = entry->date;
+    record->time = entry->time;
+    c->total++;
+    g_index.stats.walked++;
+    return c->fill < PROG_INDEX_RUN || collect_flush(c);
+}
+
+/* The files directly in dir, like one level of fs_walk() */
+static void collect_dir(const char *dir, collect_t *c) {
+    fat32_file_t handle;
+    if (fat32_open(&handle, dir) != FAT32_OK) {
+        return;
+    }
+    if (handle.attributes & FAT32_ATTR_DIRECTORY) {
+        fat32_entry_t entry;
+        fs_entry_t out;
+        char path[FS_MAX_PATH];
+        while (!c->failed && fat32_dir_read(&handle, &entry) == FAT32_OK && entry.filename[0]) {
+            if (entry.attr & FAT32_ATTR_DIRECTORY) {
+                continue;
+            }
+            if (snprintf(path, sizeof(path), "%s/%s", dir, entry.filename) >= (int)sizeof(path)) {
+                continue;
+            }
+            strncpy(out.name, entry.filename, sizeof(out.name) - 1);
+            out.name[sizeof(out.name) - 1] = '\0';
+            out.size = entry.size;
+            out.is_dir = false;
+            out.date = entry.date;
+            out.time = entry.time;
+            collect_entry(path, &out, c);
+        }
+    }
+    fat32_close(&handle);
+}
+
+/* Index file access */
+
+static bool read_header(const char *index_path, uint32_t *count, stamp_t *stamp) {
+    fat32_file_t file;
+    if (fat32_open(&file, index_path) != FAT32_OK) {
+        return false;
+    }
+    uint8_t header[PROG_INDEX_HEADER_SIZE];
+    size_t got = 0;
+    fat32_read(&file, header, sizeof(header), &got);
+    uint32_t size = fat32_size(&file);
+    fat32_close(&file);
+
+    if (got != sizeof(header) || memcmp(header, PROG_INDEX_MAGIC, 4) != 0 ||
+        (header[4] | header[5] << 8) != PROG_INDEX_VERSION ||
+        (header[6] | header[7] << 8) != RECORD_SIZE) {
+        return false;
+    }
+    *count = get_u32(header + 8);
+    stamp->count = *count;
+    stamp->sum = get_u32(header + 12);
+    stamp->xor = get_u32(header + 16);
+    return *count <= PROG_INDEX_MAX_ENTRIES &&
+           size == PROG_INDEX_HEADER_SIZE + *count * RECORD_SIZE;
+}
+
+static bool write_header(fat32_file_t *file, const stamp_t *stamp) {
+    uint8_t header[PROG_INDEX_HEADER_SIZE] = {0};
+    memcpy(header, PROG_INDEX_MAGIC, 4);
+    put_u16(header + 4, PROG_INDEX_VERSION);
+    put_u16(header + 6, RECORD_SIZE);
+    put_u32(header + 8, stamp->count);
+    put_u32(header + 12, stamp->sum);
+    put_u32(header + 16, stamp->xor);
+    size_t written = 0;
+    return fat32_seek(file, 0) == FAT32_OK &&
+           fat32_write(file, header, sizeof(header), &written) == FAT32_OK &&
+           written == sizeof(header);
+}
+
+static void reader_next(record_reader_t *reader) {
+    size_t got = 0;
+    reader->valid = reader->left > 0 &&
+                    fat32_read(&reader->file, &reader->head, RECORD_SIZE, &got) == FAT32_OK &&
+                    got == RECORD_SIZE;
+    if (reader->valid) {
+        reader->left--;
+        reader->head.name[PROG_INDEX_NAME_MAX - 1] = '\0';
+        reader->head.title[PROG_INDEX_TITLE_MAX - 1] = '\0';
+    }
+}
+
+static bool reader_open(record_reader_t *reader, const char *path, uint32_t offset, uint32_t count) {
+    reader->valid = false;
+    reader->left = 0;
+    reader->opened = fat32_open(&reader->file, path) == FAT32_OK;
+    if (!reader->opened || fat32_seek(&reader->file, offset) != FAT32_OK) {
+        return false;
+    }
+    reader->left = count;
+    reader_next(reader);
+    return true;
+}
+
+/* Apply launches recorded by prog_index_note_run() to a record */
+static void apply_runs(prog_record_t *record) {
+    for (int i = 0; i < g_index.pending_run_count; i++) {
+        if (strcasecmp(g_index.pending_runs[i].name, record->name) == 0) {
+            if (record->runs < UINT16_MAX) {
+                record->runs++;
+            }
+            record->load_ms = g_index.pending_runs[i].load_ms;
+        }
+    }
+}
+
+/* Output of a merge: records go out PROG_INDEX_RUN at a time */
+typedef struct {
+    fat32_file_t file;
+    prog_record_t *buffer;
+    uint32_t fill;
+    stamp_t stamp;
+    bool failed;
+} index_writer_t;
+
+static void writer_flush(index_writer_t *w) {
+    size_t bytes = w->fill * sizeof(prog_record_t);
+    size_t written = 0;
+    if (bytes && (fat_io_write(&w->file, w->buffer, bytes, &written) != FAT32_OK ||
+                  written != bytes)) {
+        w->failed = true;
+    }
+    w->fill = 0;
+}
+
+static void writer_add(index_writer_t *w, prog_record_t *record) {
+    if (w->stamp.count >= PROG_INDEX_MAX_ENTRIES) {
+        return;
+    }
+    apply_runs(record);
+    stamp_add(&w->stamp, record->name, record->size, record->date, record->time);
+    w->buffer[w->fill++] = *record;
+    if (w->fill == PROG_INDEX_RUN) {
+        writer_flush(w);
+    }
+}
+
+/* Walk the scopes into sorted runs in the scratch file */
+static fs_error_t write_runs(collect_t *c, const scope_t *scopes, int scope_count,
+                             const char *runs_path) {
+    fat32_file_t runs_file;
+    fat32_delete(runs_path);
+    if (fat32_create(&runs_file, runs_path) != FAT32_OK) {
+        return FS_ERR_IO;
+    }
+    c->out = &runs_file;
+    for (int i = 0; i < scope_count && !c->failed; i++) {
+        if (scopes[i].recursive) {
+            fs_walk(scopes[i].path, collect_entry, c);
+        } else {
+            collect_dir(scopes[i].path, c);
+        }
+    }
+    collect_flush(c);
+    fat32_close(&runs_file);
+    return c->failed ? FS_ERR_IO : FS_OK;
+}
+
+/* Merge the runs with the old index (old_count records) into new_path */
+static fs_error_t merge_runs(const collect_t *c, const scope_t *scopes, int scope_count,
+                             uint32_t old_count, const char *runs_path, const char *new_path) {
+    const char *root = g_index.root;
+    record_reader_t *readers = calloc(c->runs + 1, sizeof(record_reader_t));
+    if (!readers) {
+        return FS_ERR_NO_MEMORY;
+    }
+    uint32_t offset = 0;
+    for (uint32_t r = 0; r < c->runs; r++) {
+        reader_open(&readers[r], runs_path, offset, c->run_len[r]);
+        offset += c->run_len[r] * RECORD_SIZE;
+    }
+    record_reader_t *old = &readers[c->runs];
+    if (old_count) {
+        reader_open(old, g_index.index_path, PROG_INDEX_HEADER_SIZE, old_count);
+    }
+
+    index_writer_t writer;
+    memset(&writer, 0, sizeof(writer));
+    writer.buffer = c->run;
+    fat32_delete(new_path);
+    writer.failed = fat32_create(&writer.file, new_path) != FAT32_OK;
+    bool created = !writer.failed;
+    if (created && !write_header(&writer.file, &writer.stamp)) {
+        writer.failed = true;
+    }
+
+    while (!writer.failed) {
+        record_reader_t *next = NULL;
+        for (uint32_t r = 0; r < c->runs; r++) {
+            if (readers[r].valid && (!next || strcasecmp(readers[r].head.name, next->head.name) < 0)) {
+                next = &readers[r];
+            }
+        }
+        int order = !old->valid ? 1 : !next ? -1 : strcasecmp(old->head.name, next->head.name);
+
+        if (order < 0) {
+            /* Only in the old index: kept unless its directory was rescanned */
+            bool rescanned = false;
+            for (int i = 0; i < scope_count && !rescanned; i++) {
+                rescanned = scope_covers(&scopes[i], root, old->head.name);
+            }
+            if (!rescanned) {
+                writer_add(&writer, &old->head);
+                g_index.stats.records_reused++;
+            }
+            reader_next(old);
+            continue;
+        }
+        if (!next) {
+            break;
+        }
+
+        prog_record_t *record = &next->head;
+        if (order == 0) {
+            /* Same program: keep its statistics, and its title if unchanged */
+            record->runs = old->head.runs;
+            record->load_ms = old->head.load_ms;
+            if (record->size == old->head.size && record->date == old->head.date &&
+                record->time == old->head.time) {
+                memcpy(record->title, old->head.title, sizeof(record->title));
+                g_index.stats.records_reused++;
+            } else {
+                read_title(root, record);
+            }
+            reader_next(old);
+        } else {
+            read_title(root, record);
+        }
+        writer_add(&writer, record);
+        reader_next(next);
+    }
+    writer_flush(&writer);
+    if (!writer.failed && !write_header(&writer.file, &writer.stamp)) {
+        writer.failed = true;
+    }
+    if (created) {
+        fat32_close(&writer.file);
+    }
+
+    for (uint32_t r = 0; r <= c->runs; r++) {
+        if (readers[r].opened) {
+            fat32_close(&readers[r].file);
+        }
+    }
+    free(readers);
+    if (!writer.failed) {
+        DEBUG_PRINTF("[INDEX] Rebuilt %s: %lu programs, %lu titles read\n", g_index.index_path,
+                     (unsigned long)writer.stamp.count, (unsigned long)g_index.stats.titles_read);
+    }
+    return writer.failed ? FS_ERR_IO : FS_OK;
+}
+
+/*
+ * Rescan the scopes and merge the result with the old index (old_count
+ * records, or none) into a new index file
+ */
+static fs_error_t rebuild(const scope_t *scopes, int scope_count, uint32_t old_count) {
+    char runs_path[FS_MAX_PATH + 8];
+    char new_path[FS_MAX_PATH + 8];
+    snprintf(runs_path, sizeof(runs_path), "%s.runs", g_index.index_path);
+    snprintf(new_path, sizeof(new_path), "%s.new", g_index.index_path);
+
+    collect_t *c = calloc(1, sizeof(collect_t));
+    prog_record_t *buffer = malloc(PROG_INDEX_RUN * sizeof(prog_record_t));
+    if (!c || !buffer) {
+        free(c);
+        free(buffer);
+        return FS_ERR_NO_MEMORY;
+    }
+    c->root = g_index.root;
+    c->run = buffer;
+
+    fs_error_t err = write_runs(c, scopes, scope_count, runs_path);
+    if (err == FS_OK) {
+        err = merge_runs(c, scopes, scope_count, old_count, runs_path, new_path);
+    }
+    if (err == FS_OK) {
+        fat32_delete(g_index.index_path);
+        if (fat32_rename(new_path, g_index.index_path) != FAT32_OK) {
+            err = FS_ERR_IO;
+        }
+        g_index.pending_run_count = 0;
+        g_index.stats.last_rebuilt = true;
+    } else {
+        fat32_delete(new_path);
+    }
+    fat32_delete(runs_path);
+    /* Written with the driver directly: drop what the dentry cache holds */
+    fs_notify_change(runs_path, FS_CHANGE_DELETED);
+    fs_notify_change(new_path, FS_CHANGE_DELETED);
+    fs_notify_change(g_index.index_path, FS_CHANGE_MODIFIED);
+    free(buffer);
+    free(c);
+    return err;
+}
+
+/* Write recorded launches straight into their records */
+static void update_runs(void) {
+    for (int i = 0; i < g_index.pending_run_count; i++) {
+        uint32_t pos = prog_index_find(g_index.pending_runs[i].name);
+        prog_record_t record;
+        if (!prog_index_get(pos, &record) || strcasecmp(record.name, g_index.pending_runs[i].name) != 0) {
+            continue;
+        }
+        if (record.runs < UINT16_MAX) {
+            record.runs++;
+        }
+        record.load_ms = g_index.pending_runs[i].load_ms;
+        size_t written = 0;
+        if (fat32_seek(&g_index.file, PROG_INDEX_HEADER_SIZE + pos * RECORD_SIZE) == FAT32_OK) {
+            fat32_write(&g_index.file, &record, RECORD_SIZE, &written);
+        }
+        g_index.position = UINT32_MAX;
+    }
+    if (g_index.pending_run_count) {
+        fs_notify_change(g_index.index_path, FS_CHANGE_MODIFIED);
+    }
+    g_index.pending_run_count = 0;
+}
+
+/* True if rescanning scope could change the index */
+static bool scope_matters(const scope_t *scope) {
+    if (!scope->recursive || fs_is_dir(scope->path) == FS_OK) {
+        return true;
+    }
+    /* Gone or not a directory: matters only if programs were listed below it */
+    const char *name = scope->path + strlen(g_index.root);
+    name += *name == '/';
+    char prefix[PROG_INDEX_NAME_MAX];
+    if (snprintf(prefix, sizeof(prefix), "%s/", name) >= (int)sizeof(prefix)) {
+        return false;
+    }
+    prog_record_t record;
+    return prog_index_get(prog_index_find(prefix), &record) &&
+           strncasecmp(record.name, prefix, strlen(prefix)) == 0;
+}
+
+fs_error_t prog_index_refresh(const char *root, const char *index_path) {
+    uint64_t start = time_us_64();
+    prog_index_close();
+    memset(&g_index.stats, 0, sizeof(g_index.stats));
+
+    if (strcmp(root, g_index.root) != 0 || strcmp(index_path, g_index.index_path) != 0) {
+        snprintf(g_index.root, sizeof(g_index.root), "%s", root);
+        snprintf(g_index.index_path, sizeof(g_index.index_path), "%s", index_path);
+        g_index.validated = false;
+    }
+    bool own_scopes = strcasecmp(root, PROG_INDEX_DIR) == 0;
+
+    uint32_t count = 0;
+    stamp_t stored;
+    bool readable = read_header(index_path, &count, &stored);
+    bool full = !readable || (own_scopes && g_index.scopes_overflow);
+    fs_error_t err = FS_OK;
+
+    if (readable && !full && !g_index.validated) {
+        /* First use since boot: the card may have been edited elsewhere */
+        collect_t c;
+        memset(&c, 0, sizeof(c));
+        c.root = root;
+        err = fs_walk(root, collect_entry, &c);
+        g_index.stats.last_validated = true;
+        full = err != FS_OK || c.stamp.count != stored.count || c.stamp.sum != stored.sum ||
+               c.stamp.xor != stored.xor;
+        DEBUG_PRINTF("[INDEX] %s %s the tree (%lu programs)\n", index_path,
+                     full ? "does not match" : "matches", (unsigned long)c.stamp.count);
+    }
+
+    if (full) {
+        if (fs_is_dir(root) != FS_OK) {
+            g_index.count = 0;
+            return FS_ERR_NOT_FOUND;
+        }
+        scope_t everything;
+        snprintf(everything.path, sizeof(everything.path), "%s", root);
+        everything.recursive = true;
+        err = rebuild(&everything, 1, readable ? count : 0);
+        g_index.scopes_overflow = false;
+        g_index.scope_count = 0;
+    } else if (own_scopes && g_index.scope_count) {
+        /* Only the directories written to since the last refresh */
+        g_index.open = fat32_open(&g_index.file, index_path) == FAT32_OK;
+        g_index.count = count;
+        g_index.position = UINT32_MAX;
+        int kept = 0;
+        for (int i = 0; i < g_index.scope_count; i++) {
+            if (scope_matters(&g_index.scopes[i])) {
+                g_index.scopes[kept++] = g_index.scopes[i];
+            }
+        }
+        prog_index_close();
+        err = kept ? rebuild(g_index.scopes, kept, count) : FS_OK;
+        g_index.scope_count = 0;
+    }
+    g_index.validated = err == FS_OK;
+
+    if (!read_header(index_path, &count, &stored) ||
+        fat32_open(&g_index.file, index_path) != FAT32_OK) {
+        g_index.count = 0;
+        return err != FS_OK ? err : FS_ERR_IO;
+    }
+    g_index.open = true;
+    g_index.count = count;
+    g_index.position = UINT32_MAX;
+    if (own_scopes && g_index.pending_run_count) {
+        update_runs();
+    }
+    g_index.stats.last_refresh_us = (uint32_t)(time_us_64() - start);
+    return FS_OK;
+}
+
+uint32_t prog_index_count(void) {
+    return g_index.open ? g_index.count : 0;
+}
+
+bool prog_index_get(uint32_t i, prog_record_t *record) {
+    if (!g_index.open || i >= g_index.count) {
+        return false;
+    }
+    if (g_index.position != i &&
+        fat32_seek(&g_index.file, PROG_INDEX_HEADER_SIZE + i * RECORD_SIZE) != FAT32_OK) {
+        g_index.position = UINT32_MAX;
+        return false;
+    }
+    size_t got = 0;
+    if (fat32_read(&g_index.file, record, RECORD_SIZE, &got) != FAT32_OK || got != RECORD_SIZE) {
+        g_index.position = UINT32_MAX;
+        return false;
+    }
+    g_index.position = i + 1;
+    record->name[PROG_INDEX_NAME_MAX - 1] = '\0';
+    record->title[PROG_INDEX_TITLE_MAX - 1] = '\0';
+    return true;
+}
+
+uint32_t prog_index_find(const char *name) {
+    uint32_t lo = 0;
+    uint32_t hi = prog_index_count();
+    prog_record_t record;
+    while (lo < hi) {
+        uint32_t mid = lo + (hi - lo) / 2;
+        if (!prog_index_get(mid, &record)) {
+            break;
+        }
+        if (strcasecmp(record.name, name) < 0) {
+            lo = mid + 1;
+        } else {
+            hi = mid;
+        }
+    }
+    return lo;
+}
+
+void prog_index_find_prefix(const char *prefix, uint32_t *first, uint32_t *end) {
+    /* Byte 0xFF sorts after every character a name can contain */
+    char past[PROG_INDEX_NAME_MAX + 1];
+    snprintf(past, sizeof(past), "%s\xff", prefix);
+    *first = prog_index_find(prefix);
+    *end = prefix[0] ? prog_index_find(past) : prog_index_count();
+}
+
+void prog_index_close(void) {
+    if (g_index.open) {
+        fat32_close(&g_index.file);
+        g_index.open = false;
+    }
+}
+
+void prog_index_invalidate(void) {
+    g_index.validated = false;
+}
+
+void prog_index_note_change(const char *path, fs_change_t change) {
+    (void)change;
+    size_t root_len = strlen(PROG_INDEX_DIR);
+    if (!path || strncasecmp(path, PROG_INDEX_DIR, root_len) != 0 || path[root_len] != '/' ||
+        strstr(path + root_len, "/.")) {
+        return;  /* Outside the tree, or hidden (the index itself included) */
+    }
+
+    scope_t scope;
+    snprintf(scope.path, sizeof(scope.path), "%s", path);
+    scope.recursive = !program_name(PROG_INDEX_DIR, path);
+    if (!scope.recursive) {
+        *strrchr(scope.path, '/') = '\0';  /* A program: rescan its directory */
+    }
+
+    for (int i = 0; i < g_index.scope_count; i++) {
+        if (strcmp(g_index.scopes[i].path, scope.path) == 0) {
+            g_index.scopes[i].recursive |= scope.recursive;
+            return;
+        }
+    }
+    if (g_index.scope_count == PROG_INDEX_SCOPES) {
+        g_index.scopes_overflow = true;
+        return;
+    }
+    g_index.scopes[g_index.scope_count++] = scope;
+}
+
+void prog_index_note_run(const char *name, uint32_t load_ms) {
+    if (!name || strlen(name) >= PROG_INDEX_NAME_MAX || g_index.pending_run_count == PENDING_RUNS) {
+        return;
+    }
+    strcpy(g_index.pending_runs[g_index.pending_run_count].name, name);
+    g_index.pending_runs[g_index.pending_run_count].load_ms =
+        load_ms > UINT16_MAX ? UINT16_MAX : (uint16_t)load_ms;
+    g_index.pending_run_count++;
+}
+
+const prog_index_stats_t *prog_index_stats(void) {
+    return &g_index.stats;
+}
@@ -0,0 +1,130 @@
+#ifndef PICOCALC_PROG_INDEX_H
+#define PICOCALC_PROG_INDEX_H
+
+#include <stdbool.h>
+#include <stdint.h>
+#include "picocalc_fs_handler.h"
+
+/**
+ * @file picocalc_prog_index.h
+ * @brief Persistent index of the programs under /load81
+ *
+ * The menu reads its rows from PROG_INDEX_FILE instead of scanning the
+ * card: one fixed-size record per .lua file below /load81 (hidden names
+ * excluded), sorted by path ignoring case, so row i is a single seek
+ * away and a library of any size is listed in constant memory. Records
+ * carry the size and modification time from the directory entry, the
+ * program's title (its first "--" comment line) and the last-run
+ * statistics.
+ *
+ * The header stores a stamp of the directory state the index was built
+ * from: the file count and two order-independent hashes of every path,
+ * size and time. The first refresh after boot walks the tree and
+ * compares stamps. After that, fs_notify_change() reports writes made by
+ * the file server, the editor and Lua, and the next refresh rescans only
+ * the directories they touched. Either way the new index is produced by
+ * merging the rescanned entries into the old one, so titles and run
+ * statistics are kept for files that did not change, and only new or
+ * modified files are opened.
+ *
+ * File layout (little-endian):
+ *
+ *   header  "L81I", u16 version, u16 record size, u32 count,
+ *           u32 stamp sum, u32 stamp xor, 16 reserved bytes
+ *   records count x prog_record_t, sorted by name, ignoring case
+ */
+
+#define PROG_INDEX_DIR "/load81"
+#define PROG_INDEX_FILE "/load81/.index"
+#define PROG_INDEX_MAGIC "L81I"
+#define PROG_INDEX_VERSION 2
+#define PROG_INDEX_HEADER_SIZE 32
+#define PROG_INDEX_NAME_MAX 80       /* Path below the root, with its NUL */
+#define PROG_INDEX_TITLE_MAX 32
+#define PROG_INDEX_MAX_ENTRIES 4096
+#define PROG_INDEX_RUN 64            /* Records sorted in RAM at a time */
+#define PROG_INDEX_SCOPES 8          /* Directories awaiting a rescan */
+
+/* One program, as stored in the index (128 bytes) */
+typedef struct {
+    char name[PROG_INDEX_NAME_MAX];     /* e.g. "games/snake.lua" */
+    char title[PROG_INDEX_TITLE_MAX];   /* First comment line, may be empty */
+    uint32_t size;
+    uint16_t date;                      /* FAT date and time of the file */
+    uint16_t time;
+    uint16_t runs;                      /* Times started from the menu */
+    uint16_t load_ms;                   /* Last launch to first frame */
+    uint32_t reserved;
+} prog_record_t;
+
+typedef struct {
+    uint32_t walked;             /* Files seen by the last tree walk */
+    uint32_t titles_read;        /* Programs opened for their title */
+    uint32_t records_reused;     /* Records carried over unchanged */
+    uint32_t last_refresh_us;
+    bool last_validated;         /* The last refresh walked the whole tree */
+    bool last_rebuilt;           /* The last refresh wrote a new index */
+} prog_index_stats_t;
+
+/**
+ * Bring the index up to date and open it for reading
+ * Walks the tree on the first call (or after prog_index_invalidate()),
+ * otherwise only rescans directories reported changed since the last call.
+ *
+ * @param root Directory to index (PROG_INDEX_DIR for the menu)
+ * @param index_path Index file (PROG_INDEX_FILE for the menu)
+ * @return FS_OK, or an error if the index could neither be read nor built
+ */
+fs_error_t prog_index_refresh(const char *root, const char *index_path);
+
+/**
+ * Number of programs in the index opened by prog_index_refresh()
+ */
+uint32_t prog_index_count(void);
+
+/**
+ * Read record i
+ *
+ * @return false if i is out of range or the read failed
+ */
+bool prog_index_get(uint32_t i, prog_record_t *record);
+
+/**
+ * Position of name in the index, or of the first record after it
+ */
+uint32_t prog_index_find(const char *name);
+
+/**
+ * Range of records whose name starts with prefix, ignoring case
+ *
+ * @param first Set to the first match
+ * @param end Set to one past the last match (equal to first if none)
+ */
+void prog_index_find_prefix(const char *prefix, uint32_t *first, uint32_t *end);
+
+/**
+ * Close the index file (reopened by the next prog_index_refresh())
+ */
+void prog_index_close(void);
+
+/**
+ * Forget the validated state so the next refresh walks the whole tree
+ */
+void prog_index_invalidate(void);
+
+/**
+ * Note a change below PROG_INDEX_DIR, called from fs_notify_change()
+ */
+void prog_index_note_change(const char *path, fs_change_t change);
+
+/**
+ * Record a launch of name; written at the next refresh
+ */
+void prog_index_note_run(const char *name, uint32_t load_ms);
+
+/**
+ * Get the counters of the last refresh
+ */
+const prog_index_stats_t *prog_index_stats(void);
+
+#endif /* PICOCALC_PROG_INDEX_H */
@@ -0,0 +1,143 @@
+/**
+ * @file picocalc_reload.c
+ * @brief Live code reload into the running program
+ *
+ * Everything runs on core 0: the file server queues a request from its
+ * TCP callback and the program loop picks it up after cyw43_arch_poll(),
+ * so the Lua state is never touched in the middle of draw().
+ */
+
+#include "picocalc_reload.h"
+#include "picocalc_fs_handler.h"
+#include "picocalc_lua.h"
+#include "debug.h"
+#include "pico/stdlib.h"
+#include <string.h>
+#include <stdlib.h>
+#include <stdio.h>
+
+typedef enum {
+    RELOAD_IDLE = 0,
+    RELOAD_QUEUED,      /* Waiting for the program loop */
+    RELOAD_WAIT_FRAME   /* New code loaded, waiting for its first frame */
+} reload_state_t;
+
+static struct {
+    bool running;
+    char program[FS_MAX_PATH];
+    
+    reload_state_t state;
+    char path[FS_MAX_PATH];
+    uint64_t start_us;
+    uint32_t compile_us;   /* luaL_loadbuffer + top-level chunk */
+    reload_done_t done;
+    void *user_data;
+    
+    uint32_t last_latency_us;
+} g_reload;
+
+/* Clear the request before calling back, the callback may queue another */
+static void reload_finish(bool ok, const char *message) {
+    reload_done_t done = g_reload.done;
+    void *user_data = g_reload.user_data;
+    
+    g_reload.state = RELOAD_IDLE;
+    g_reload.done = NULL;
+    g_reload.user_data = NULL;
+    
+    if (done) {
+        done(ok, message, user_data);
+    }
+}
+
+void reload_set_program(const char *path) {
+    if (g_reload.state != RELOAD_IDLE) {
+        reload_finish(false, "Program exited");
+    }
+    
+    g_reload.running = (path != NULL);
+    if (path) {
+        strncpy(g_reload.program, path, sizeof(g_reload.program) - 1);
+        g_reload.program[sizeof(g_reload.program) - 1] = '\0';
+    } else {
+        g_reload.program[0] = '\0';
+    }
+}
+
+const char *reload_program_path(void) {
+    return g_reload.running ? g_reload.program : NULL;
+}
+
+bool reload_request(const char *path, uint64_t start_us, reload_done_t done, void *user_data) {
+    if (!g_reload.running || g_reload.state != RELOAD_IDLE || !path) {
+        return false;
+    }
+    
+    strncpy(g_reload.path, path, sizeof(g_reload.path) - 1);
+    g_reload.path[sizeof(g_reload.path) - 1] = '\0';
+    g_reload.start_us = start_us;
+    g_reload.done = done;
+    g_reload.user_data = user_data;
+    g_reload.state = RELOAD_QUEUED;
+    return true;
+}
+
+void reload_cancel(void *user_data) {
+    if (g_reload.state != RELOAD_IDLE && g_reload.user_data == user_data) {
+        g_reload.done = NULL;
+        g_reload.user_data = NULL;
+    }
+}
+
+void reload_service(struct lua_State *L) {
+    if (g_reload.state != RELOAD_QUEUED) {
+        return;
+    }
+    
+    uint8_t *code = NULL;
+    size_t size = 0;
+    fs_error_t err = fs_read_file(g_reload.path, &code, &size);
+    if (err != FS_OK) {
+        reload_finish(false, fs_error_string(err));
+        return;
+    }
+    
+    /* Chunk name "@path" makes Lua report errors as path:line: */
+    char name[FS_MAX_PATH + 1];
+    snprintf(name, sizeof(name), "@%s", g_reload.path);
+    
+    char message[256];
+    uint64_t start = time_us_64();
+    int result = lua_reload_program(L, (const char *)code, size, name,
+                                    message, sizeof(message));
+    g_reload.compile_us = (uint32_t)(time_us_64() - start);
+    free(code);
+    
+    if (result != 0) {
+        DEBUG_PRINTF("[RELOAD] %s failed: %s\n", g_reload.path, message);
+        reload_finish(false, message);
+        return;
+    }
+    
+    DEBUG_PRINTF("[RELOAD] Loaded %s in %lu us\n", g_reload.path,
+                 (unsigned long)g_reload.compile_us);
+    g_reload.state = RELOAD_WAIT_FRAME;
+}
+
+void reload_frame_presented(void) {
+    if (g_reload.state != RELOAD_WAIT_FRAME) {
+        return;
+    }
+    
+    g_reload.last_latency_us = (uint32_t)(time_us_64() - g_reload.start_us);
+    
+    char json[96];
+    snprintf(json, sizeof(json), "{\"compile_us\":%lu,\"latency_ms\":%lu}",
+             (unsigned long)g_reload.compile_us,
+             (unsigned long)(g_reload.last_latency_us / 1000));
+    reload_finish(true, json);
+}
+
+uint32_t reload_last_latency_us(void) {
+    return g_reload.last_latency_us;
+}
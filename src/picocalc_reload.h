@@ -0,0 +1,81 @@
+#ifndef PICOCALC_RELOAD_H
+#define PICOCALC_RELOAD_H
+
+#include <stdbool.h>
+#include <stdint.h>
+
+/**
+ * @file picocalc_reload.h
+ * @brief Live code reload into the running program
+ *
+ * The file server queues a reload request; the program loop services it
+ * between frames by compiling the new source in the running Lua state and
+ * re-running its top-level chunk. Functions such as draw() are replaced,
+ * globals that the chunk does not assign keep their values, and setup()
+ * is not called again. The requester is told the outcome once the first
+ * frame drawn with the new code has been presented, or immediately on a
+ * compile or runtime error (the program keeps running the old code).
+ */
+
+struct lua_State;
+
+/**
+ * Completion callback
+ *
+ * @param ok true if the new code is running
+ * @param message JSON timings on success, the Lua error message otherwise
+ * @param user_data Value passed to reload_request()
+ */
+typedef void (*reload_done_t)(bool ok, const char *message, void *user_data);
+
+/**
+ * Set the absolute path of the running program (NULL when it exits)
+ * A pending request fails with "Program exited" when the program stops.
+ */
+void reload_set_program(const char *path);
+
+/**
+ * Get the absolute path of the running program
+ *
+ * @return Path, or NULL if no program is running
+ */
+const char *reload_program_path(void);
+
+/**
+ * Queue a reload of path into the running program
+ *
+ * @param path Absolute path of the Lua source to load
+ * @param start_us time_us_64() the latency is measured from (e.g. PUT start)
+ * @param done Called once with the outcome
+ * @param user_data Passed to done
+ * @return false if no program is running or a reload is already pending
+ */
+bool reload_request(const char *path, uint64_t start_us, reload_done_t done, void *user_data);
+
+/**
+ * Drop a pending request without calling its callback
+ * Used when the requesting connection goes away.
+ */
+void reload_cancel(void *user_data);
+
+/**
+ * Perform a pending reload (program loop, between frames)
+ *
+ * @param L Lua state of the running program
+ */
+void reload_service(struct lua_State *L);
+
+/**
+ * Report that a frame has been presented (program loop, after fb_present)
+ * Completes a reload waiting for its first new frame.
+ */
+void reload_frame_presented(void);
+
+/**
+ * Get the latency of the last successful reload in microseconds
+ *
+ * @return Request start to first new frame, 0 if none yet
+ */
+uint32_t reload_last_latency_us(void);
+
+#endif /* PICOCALC_RELOAD_H */
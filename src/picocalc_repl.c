@@ -2,6 +2,15 @@
 #include "picocalc_keyboard.h"
 #include "picocalc_framebuffer.h"
 #include "picocalc_graphics.h"
+#include "picocalc_repl_handler.h"
+#include "picocalc_block_cache.h"
+#include "picocalc_fs_handler.h"
+#include "picocalc_fat_alloc.h"
+#include "picocalc_fat_io.h"
+#include "picocalc_fs_worker.h"
+#include "picocalc_lua.h"
+#include "picocalc_pack.h"
+#include "picocalc_prog_index.h"
 #include "pico/stdlib.h"
 #include "pico/cyw43_arch.h"
 #include "debug.h"
@@ -54,12 +63,415 @@ static int lua_fat32_list_dir(lua_State *L) {
 
 static int lua_sd_reinit(lua_State *L) {
     /* Unmount and remount to force reinitialization */
+    block_cache_invalidate();
+    fs_dentry_cache_clear();
     fat32_unmount();
     fat32_error_t result = fat32_mount();
     lua_pushinteger(L, result);
     return 1;
 }
 
+/* Write path in chunk-sized pieces, alternating with other (if open) */
+static bool bench_write(fat32_file_t *file, fat32_file_t *other, const uint8_t *chunk,
+                        size_t chunk_size, uint32_t size) {
+    for (uint32_t done = 0; done < size; done += chunk_size) {
+        size_t written;
+        if (fat32_write(file, chunk, chunk_size, &written) != FAT32_OK ||
+            (other && fat32_write(other, chunk, chunk_size, &written) != FAT32_OK)) {
+            return false;
+        }
+    }
+    return true;
+}
+
+/* Read a whole file; returns KB/s, 0 on error */
+static uint32_t bench_read(const char *path, uint8_t *buffer, size_t buffer_size) {
+    fat32_file_t file;
+    if (fat32_open(&file, path) != FAT32_OK) {
+        return 0;
+    }
+    uint32_t total = 0;
+    uint64_t start = time_us_64();
+    size_t got;
+    while (fat32_read(&file, buffer, buffer_size, &got) == FAT32_OK && got > 0) {
+        total += got;
+    }
+    uint64_t elapsed = time_us_64() - start;
+    fat32_close(&file);
+    return elapsed ? (uint32_t)((uint64_t)total * 1000000 / 1024 / elapsed) : 0;
+}
+
+#define BENCH_FRAGMENTED "/load81/.bench_frag"
+#define BENCH_INTERLEAVED "/load81/.bench_frag2"
+#define BENCH_CONTIGUOUS "/load81/.bench_contig"
+
+/*
+ * sd_alloc_bench([kb]): write a file the way the driver lays it out when
+ * another file grows at the same time (one cluster each in turn), and one
+ * preallocated with fat_alloc_reserve(), then time reading both back.
+ * Returns fragmented KB/s, contiguous KB/s.
+ */
+static int lua_sd_alloc_bench(lua_State *L) {
+    uint32_t size = (uint32_t)luaL_optinteger(L, 1, 256) * 1024;
+    const block_cache_volume_t *volume = block_cache_volume();
+    size_t cluster = volume->sectors_per_cluster * 512;
+    if (!fat32_is_mounted() || cluster == 0) {
+        return luaL_error(L, "SD card not mounted");
+    }
+    
+    uint8_t *buffer = malloc(cluster);
+    if (!buffer) {
+        return luaL_error(L, "out of memory");
+    }
+    memset(buffer, 0xA5, cluster);
+    size = (size + cluster - 1) / cluster * cluster;
+    
+    fat32_delete(BENCH_FRAGMENTED);
+    fat32_delete(BENCH_INTERLEAVED);
+    fat32_delete(BENCH_CONTIGUOUS);
+    
+    fat32_file_t a, b, c;
+    bool ok = false;
+    if (fat32_create(&a, BENCH_FRAGMENTED) == FAT32_OK) {
+        if (fat32_create(&b, BENCH_INTERLEAVED) == FAT32_OK) {
+            ok = bench_write(&a, &b, buffer, cluster, size);
+            fat32_close(&b);
+        }
+        fat32_close(&a);
+    }
+    if (ok && fat32_create(&c, BENCH_CONTIGUOUS) == FAT32_OK) {
+        fat_alloc_reserve(&c, size);
+        ok = bench_write(&c, NULL, buffer, cluster, size);
+        fat32_close(&c);
+    } else {
+        ok = false;
+    }
+    
+    uint32_t fragmented = ok ? bench_read(BENCH_FRAGMENTED, buffer, cluster) : 0;
+    uint32_t contiguous = ok ? bench_read(BENCH_CONTIGUOUS, buffer, cluster) : 0;
+    free(buffer);
+    fat32_delete(BENCH_FRAGMENTED);
+    fat32_delete(BENCH_INTERLEAVED);
+    fat32_delete(BENCH_CONTIGUOUS);
+    fs_notify_change(BENCH_FRAGMENTED, FS_CHANGE_DELETED);
+    fs_notify_change(BENCH_INTERLEAVED, FS_CHANGE_DELETED);
+    fs_notify_change(BENCH_CONTIGUOUS, FS_CHANGE_DELETED);
+    
+    if (!ok) {
+        return luaL_error(L, "benchmark files could not be written");
+    }
+    lua_pushinteger(L, fragmented);
+    lua_pushinteger(L, contiguous);
+    return 2;
+}
+
+#define BENCH_TRANSFER "/load81/.bench_io"
+#define BENCH_CHUNK 32768
+
+typedef fat32_error_t (*bench_io_t)(fat32_file_t *file, void *buffer, size_t size, size_t *done);
+
+static fat32_error_t bench_driver_write(fat32_file_t *file, void *buffer, size_t size, size_t *done) {
+    return fat32_write(file, buffer, size, done);
+}
+
+static fat32_error_t bench_direct_write(fat32_file_t *file, void *buffer, size_t size, size_t *done) {
+    return fat_io_write(file, buffer, size, done);
+}
+
+/* Write (create and preallocate) or read BENCH_TRANSFER in BENCH_CHUNK pieces; returns KB/s */
+static uint32_t bench_transfer(bench_io_t io, bool write, uint8_t *buffer, uint32_t size) {
+    fat32_file_t file;
+    if (write) {
+        fat32_delete(BENCH_TRANSFER);
+        if (fat32_create(&file, BENCH_TRANSFER) != FAT32_OK) {
+            return 0;
+        }
+        fat_alloc_reserve(&file, size);
+    } else if (fat32_open(&file, BENCH_TRANSFER) != FAT32_OK) {
+        return 0;
+    }
+    
+    uint64_t start = time_us_64();
+    uint32_t total = 0;
+    while (total < size) {
+        size_t done = 0;
+        if (io(&file, buffer, BENCH_CHUNK, &done) != FAT32_OK || done == 0) {
+            break;
+        }
+        total += done;
+    }
+    fat32_close(&file);
+    uint64_t elapsed = time_us_64() - start;
+    if (total < size || elapsed == 0) {
+        return 0;
+    }
+    return (uint32_t)((uint64_t)total * 1000000 / 1024 / elapsed);
+}
+
+/*
+ * sd_bench([kb]): SD throughput through the FAT32 driver (single-block
+ * commands) and through fat_io (multi-block), writing then reading a
+ * preallocated file. Returns a table of KB/s.
+ */
+static int lua_sd_bench(lua_State *L) {
+    uint32_t size = (uint32_t)luaL_optinteger(L, 1, 1024) * 1024;
+    size = (size + BENCH_CHUNK - 1) / BENCH_CHUNK * BENCH_CHUNK;
+    if (!fat32_is_mounted()) {
+        return luaL_error(L, "SD card not mounted");
+    }
+    uint8_t *buffer = malloc(BENCH_CHUNK);
+    if (!buffer) {
+        return luaL_error(L, "out of memory");
+    }
+    memset(buffer, 0x5A, BENCH_CHUNK);
+    
+    lua_newtable(L);
+    lua_pushinteger(L, bench_transfer(bench_driver_write, true, buffer, size));
+    lua_setfield(L, -2, "write_single");
+    lua_pushinteger(L, bench_transfer(fat32_read, false, buffer, size));
+    lua_setfield(L, -2, "read_single");
+    lua_pushinteger(L, bench_transfer(bench_direct_write, true, buffer, size));
+    lua_setfield(L, -2, "write_multi");
+    lua_pushinteger(L, bench_transfer(fat_io_read, false, buffer, size));
+    lua_setfield(L, -2, "read_multi");
+    
+    free(buffer);
+    fat32_delete(BENCH_TRANSFER);
+    fs_notify_change(BENCH_TRANSFER, FS_CHANGE_DELETED);
+    return 1;
+}
+
+#define BENCH_LOOSE "/load81/.bench_pack"
+
+/*
+ * pack_bench(pak [, n]): copy the first n assets (default 100) of a pack
+ * out as loose files, then time loading all of them from the loose files
+ * and from the pack, opening it included. Returns a table with assets,
+ * bytes, loose_ms and pack_ms.
+ */
+static int lua_pack_bench(lua_State *L) {
+    const char *path = luaL_checkstring(L, 1);
+    uint32_t limit = (uint32_t)luaL_optinteger(L, 2, 100);
+    if (!fat32_is_mounted()) {
+        return luaL_error(L, "SD card not mounted");
+    }
+    const char *err = NULL;
+    pack_t *pack = pack_open(path, &err);
+    if (!pack) {
+        return luaL_error(L, "%s", err);
+    }
+    uint32_t count = pack_count(pack) < limit ? pack_count(pack) : limit;
+    
+    fs_rmtree(BENCH_LOOSE, NULL);
+    bool ok = fs_mkdirs(BENCH_LOOSE) == FS_OK;
+    uint32_t bytes = 0;
+    char loose[64];
+    for (uint32_t i = 0; ok && i < count; i++) {
+        const pack_entry_t *entry = pack_entry(pack, i);
+        uint8_t *data = malloc(entry->length + 1);
+        ok = data && pack_read(pack, entry, 0, data, entry->length) == (int32_t)entry->length;
+        snprintf(loose, sizeof(loose), BENCH_LOOSE "/%04lu", (unsigned long)i);
+        ok = ok && fs_write_file(loose, data, entry->length) == FS_OK;
+        bytes += entry->length;
+        free(data);
+    }
+    pack_close(pack);
+    
+    uint64_t start = time_us_64();
+    for (uint32_t i = 0; ok && i < count; i++) {
+        uint8_t *data = NULL;
+        size_t size = 0;
+        snprintf(loose, sizeof(loose), BENCH_LOOSE "/%04lu", (unsigned long)i);
+        ok = fs_read_file(loose, &data, &size) == FS_OK;
+        free(data);
+    }
+    uint64_t loose_us = time_us_64() - start;
+    
+    start = time_us_64();
+    pack = ok ? pack_open(path, &err) : NULL;
+    for (uint32_t i = 0; pack && ok && i < count; i++) {
+        /* A name the index cannot find again fails the run */
+        const pack_entry_t *entry = pack_find(pack, pack_name(pack, pack_entry(pack, i)));
+        uint8_t *data = entry ? malloc(entry->length + 1) : NULL;
+        ok = data && pack_read(pack, entry, 0, data, entry->length) == (int32_t)entry->length;
+        free(data);
+    }
+    uint64_t pack_us = time_us_64() - start;
+    ok = ok && pack;
+    pack_close(pack);
+    fs_rmtree(BENCH_LOOSE, NULL);
+    
+    if (!ok) {
+        return luaL_error(L, "benchmark assets could not be written or read");
+    }
+    lua_newtable(L);
+    lua_pushinteger(L, count);
+    lua_setfield(L, -2, "assets");
+    lua_pushinteger(L, bytes);
+    lua_setfield(L, -2, "bytes");
+    lua_pushinteger(L, (lua_Integer)(loose_us / 1000));
+    lua_setfield(L, -2, "loose_ms");
+    lua_pushinteger(L, (lua_Integer)(pack_us / 1000));
+    lua_setfield(L, -2, "pack_ms");
+    return 1;
+}
+
+#define BENCH_TEXT "/load81/.bench_text"
+
+/* Lines of 8 to 77 bytes up to kb KB through io.open; returns the line count */
+static const char bench_text_write[] =
+    "local path, kb = ...\n"
+    "local f = assert(io.open(path, 'w'))\n"
+    "local n, size = 0, 0\n"
+    "while size < kb * 1024 do\n"
+    "    local line = string.format('%06d %s\\n', n, string.rep('x', n % 70))\n"
+    "    f:write(line)\n"
+    "    n, size = n + 1, size + #line\n"
+    "end\n"
+    "assert(f:close())\n"
+    "return n\n";
+
+static const char bench_text_read[] =
+    "local n = 0\n"
+    "for line in io.lines(...) do n = n + 1 end\n"
+    "return n\n";
+
+/* Run a benchmark chunk with path and kb as arguments; returns microseconds */
+static uint64_t bench_chunk(lua_State *L, const char *code, uint32_t kb, lua_Integer *result) {
+    if (luaL_loadstring(L, code) != LUA_OK) {
+        lua_error(L);
+    }
+    lua_pushstring(L, BENCH_TEXT);
+    lua_pushinteger(L, kb);
+    uint64_t start = time_us_64();
+    if (lua_pcall(L, 2, 1, 0) != LUA_OK) {
+        fs_delete(BENCH_TEXT);
+        lua_error(L);
+    }
+    uint64_t elapsed = time_us_64() - start;
+    *result = lua_tointeger(L, -1);
+    lua_pop(L, 1);
+    return elapsed;
+}
+
+/*
+ * io_bench([kb]): write a text file of kb KB (default 1024) with io.open,
+ * then count its lines with io.lines. Returns a table with lines,
+ * write_ms, read_ms and lines_per_s.
+ */
+static int lua_io_bench(lua_State *L) {
+    uint32_t kb = (uint32_t)luaL_optinteger(L, 1, 1024);
+    if (!fat32_is_mounted()) {
+        return luaL_error(L, "SD card not mounted");
+    }
+    
+    lua_Integer written = 0;
+    lua_Integer read = 0;
+    uint64_t write_us = bench_chunk(L, bench_text_write, kb, &written);
+    uint64_t read_us = bench_chunk(L, bench_text_read, kb, &read);
+    fs_delete(BENCH_TEXT);
+    if (read != written) {
+        return luaL_error(L, "wrote %d lines but read %d", (int)written, (int)read);
+    }
+    
+    lua_newtable(L);
+    lua_pushinteger(L, read);
+    lua_setfield(L, -2, "lines");
+    lua_pushinteger(L, (lua_Integer)(write_us / 1000));
+    lua_setfield(L, -2, "write_ms");
+    lua_pushinteger(L, (lua_Integer)(read_us / 1000));
+    lua_setfield(L, -2, "read_ms");
+    lua_pushinteger(L, read_us ? (lua_Integer)((uint64_t)read * 1000000 / read_us) : 0);
+    lua_setfield(L, -2, "lines_per_s");
+    return 1;
+}
+
+#define BENCH_INDEX_ROOT "/.bench_index"
+#define BENCH_INDEX_FILE "/.bench_index/.index"
+
+/* Time a directory read of root the way the menu listed programs before the index */
+static uint64_t bench_dir_scan(const char *root, uint32_t *found) {
+    uint64_t start = time_us_64();
+    fat32_file_t dir;
+    fat32_entry_t entry;
+    *found = 0;
+    if (fat32_open(&dir, root) != FAT32_OK) {
+        return 0;
+    }
+    while (fat32_dir_read(&dir, &entry) == FAT32_OK && entry.filename[0]) {
+        size_t len = strlen(entry.filename);
+        if (!(entry.attr & FAT32_ATTR_DIRECTORY) && len > 4 &&
+            strcmp(&entry.filename[len - 4], ".lua") == 0) {
+            (*found)++;
+        }
+    }
+    fat32_close(&dir);
+    return time_us_64() - start;
+}
+
+/*
+ * index_bench([n]): write n small programs (default 500) and time the
+ * program index: a plain directory scan, the first build, the check made
+ * on the first menu after boot, and a refresh with nothing changed.
+ * Returns a table of the times in microseconds.
+ */
+static int lua_index_bench(lua_State *L) {
+    uint32_t count = (uint32_t)luaL_optinteger(L, 1, 500);
+    if (!fat32_is_mounted()) {
+        return luaL_error(L, "SD card not mounted");
+    }
+    
+    fs_rmtree(BENCH_INDEX_ROOT, NULL);
+    bool ok = fs_mkdirs(BENCH_INDEX_ROOT) == FS_OK;
+    for (uint32_t i = 0; ok && i < count; i++) {
+        char path[64];
+        char code[96];
+        snprintf(path, sizeof(path), BENCH_INDEX_ROOT "/prog%04lu.lua", (unsigned long)i);
+        int len = snprintf(code, sizeof(code), "-- Benchmark program %lu\nfunction draw() end\n",
+                           (unsigned long)i);
+        ok = fs_write_file(path, (const uint8_t *)code, len) == FS_OK;
+    }
+    
+    uint32_t scanned = 0;
+    uint64_t scan_us = ok ? bench_dir_scan(BENCH_INDEX_ROOT, &scanned) : 0;
+    uint32_t build_us = 0, validate_us = 0, warm_us = 0;
+    if (ok) {
+        ok = prog_index_refresh(BENCH_INDEX_ROOT, BENCH_INDEX_FILE) == FS_OK;
+        build_us = prog_index_stats()->last_refresh_us;
+    }
+    if (ok) {
+        prog_index_invalidate();
+        ok = prog_index_refresh(BENCH_INDEX_ROOT, BENCH_INDEX_FILE) == FS_OK &&
+             !prog_index_stats()->last_rebuilt;
+        validate_us = prog_index_stats()->last_refresh_us;
+    }
+    if (ok) {
+        ok = prog_index_refresh(BENCH_INDEX_ROOT, BENCH_INDEX_FILE) == FS_OK;
+        warm_us = prog_index_stats()->last_refresh_us;
+    }
+    ok = ok && prog_index_count() == count && scanned == count;
+    
+    /* The menu's next refresh sees a new root and checks /load81 again */
+    prog_index_close();
+    fs_rmtree(BENCH_INDEX_ROOT, NULL);
+    
+    if (!ok) {
+        return luaL_error(L, "benchmark programs could not be written or indexed");
+    }
+    lua_newtable(L);
+    lua_pushinteger(L, count);
+    lua_setfield(L, -2, "programs");
+    lua_pushinteger(L, (lua_Integer)scan_us);
+    lua_setfield(L, -2, "scan_us");
+    lua_pushinteger(L, build_us);
+    lua_setfield(L, -2, "build_us");
+    lua_pushinteger(L, validate_us);
+    lua_setfield(L, -2, "validate_us");
+    lua_pushinteger(L, warm_us);
+    lua_setfield(L, -2, "warm_us");
+    return 1;
+}
+
 #define REPL_LINE_MAX 256
 #define REPL_HISTORY_SIZE 100
 #define SCREEN_LINES 18  /* Number of lines visible on screen */
@@ -247,6 +659,21 @@ void repl_run(lua_State *L) {
     lua_pushcfunction(L, lua_sd_reinit);
     lua_setglobal(L, "sd_reinit");
     
+    lua_pushcfunction(L, lua_sd_alloc_bench);
+    lua_setglobal(L, "sd_alloc_bench");
+    
+    lua_pushcfunction(L, lua_sd_bench);
+    lua_setglobal(L, "sd_bench");
+    
+    lua_pushcfunction(L, lua_pack_bench);
+    lua_setglobal(L, "pack_bench");
+    
+    lua_pushcfunction(L, lua_io_bench);
+    lua_setglobal(L, "io_bench");
+    
+    lua_pushcfunction(L, lua_index_bench);
+    lua_setglobal(L, "index_bench");
+    
     bool running = true;
     while (running) {
         draw_repl_screen();
@@ -256,7 +683,14 @@ void repl_run(lua_State *L) {
         char key = 0;
         while (!kb_key_available()) {
             cyw43_arch_poll();  /* Poll network stack for file server */
-            sleep_ms(10);
+            repl_service(L);    /* Remote REPL shares this session's state */
+            lua_call_async(L);
+            if (fs_worker_busy()) {
+                fs_worker_run(FS_WORKER_IDLE_US);
+            } else {
+                sleep_ms(10);
+            }
+            fs_worker_poll();
         }
         key = kb_get_char();
         
@@ -1,22 +1,42 @@
 #include "picocalc_repl_handler.h"
+#include "picocalc_lua.h"
 #include "debug.h"
 #include "pico/stdlib.h"
-#include "pico/multicore.h"
 #include <string.h>
 #include <stdlib.h>
 #include <stdio.h>
 
-/* REPL request/response structure for inter-core communication */
-typedef struct {
-    char code[512];
-    char output[1024];
-    bool complete;
-    bool error;
-    uint32_t magic;
-} repl_message_t;
+/*
+ * Single-slot mailbox. The producer (file server) fills the slot and sets
+ * the doorbell last; the consumer (whichever loop owns a Lua state) only
+ * reads the slot after seeing the doorbell and empties it when done. Both
+ * sides run on core 0 today, so volatile ordering is enough.
+ */
+typedef enum {
+    MAILBOX_EMPTY = 0,
+    MAILBOX_POSTED,     /* Waiting for repl_service() */
+    MAILBOX_RUNNING     /* Executing, output being captured */
+} mailbox_state_t;
 
-#define REPL_MAGIC 0x5245504C  /* "REPL" */
-#define REPL_TIMEOUT_MS 5000
+static struct {
+    volatile mailbox_state_t state;
+    volatile bool doorbell;
+    char *code;
+    repl_output_t output;
+    repl_done_t done;
+    void *user_data;
+    uint64_t posted_us;
+    
+    /* Bounded staging buffer between print() and the output callback */
+    char chunk[REPL_CHUNK_SIZE];
+    size_t chunk_len;
+    uint64_t flushed_us;
+    uint32_t output_bytes;
+    
+    lua_State *scratch;   /* Used when no program state is available */
+    uint32_t last_latency_us;
+    uint32_t last_output_bytes;
+} g_mailbox;
 
 /* Error message strings */
 static const char *repl_error_messages[] = {
@@ -28,11 +48,13 @@ static const char *repl_error_messages[] = {
     "REPL is busy"
 };
 
-static volatile bool repl_busy = false;
-
 repl_error_t repl_init(void) {
-    /* REPL initialization - multicore FIFO is already initialized by SDK */
-    repl_busy = false;
+    free(g_mailbox.code);
+    g_mailbox.code = NULL;
+    g_mailbox.output = NULL;
+    g_mailbox.done = NULL;
+    g_mailbox.doorbell = false;
+    g_mailbox.state = MAILBOX_EMPTY;
     DEBUG_PRINTF("[REPL] Handler initialized\n");
     return REPL_OK;
 }
@@ -45,96 +67,156 @@ const char *repl_error_string(repl_error_t error) {
 }
 
 bool repl_is_available(void) {
-    return !repl_busy;
+    return g_mailbox.state == MAILBOX_EMPTY;
+}
+
+uint32_t repl_last_latency_us(void) {
+    return g_mailbox.last_latency_us;
 }
 
-repl_error_t repl_execute(const char *code, char **output) {
-    if (!code || !output) {
+uint32_t repl_last_output_bytes(void) {
+    return g_mailbox.last_output_bytes;
+}
+
+repl_error_t repl_submit(const char *code, repl_output_t output, repl_done_t done,
+                         void *user_data) {
+    if (!code || !output || !done) {
         return REPL_ERR_RUNTIME;
     }
     
-    if (repl_busy) {
+    if (g_mailbox.state != MAILBOX_EMPTY) {
         return REPL_ERR_BUSY;
     }
     
-    repl_busy = true;
-    
-    /* Prepare request message */
-    repl_message_t request;
-    memset(&request, 0, sizeof(request));
-    request.magic = REPL_MAGIC;
-    strncpy(request.code, code, sizeof(request.code) - 1);
-    request.code[sizeof(request.code) - 1] = '\0';
-    request.complete = false;
-    request.error = false;
-    
-    /* Send request to Core 0 via FIFO */
-    /* Note: We send the struct in chunks since FIFO is 32-bit */
-    uint32_t *data = (uint32_t *)&request;
-    size_t words = (sizeof(request) + 3) / 4;
-    
-    for (size_t i = 0; i < words; i++) {
-        multicore_fifo_push_blocking(data[i]);
+    g_mailbox.code = strdup(code);
+    if (!g_mailbox.code) {
+        return REPL_ERR_NO_MEMORY;
     }
+    g_mailbox.output = output;
+    g_mailbox.done = done;
+    g_mailbox.user_data = user_data;
+    g_mailbox.posted_us = time_us_64();
+    g_mailbox.output_bytes = 0;
+    g_mailbox.state = MAILBOX_POSTED;
+    g_mailbox.doorbell = true;
     
-    DEBUG_PRINTF("[REPL] Sent code to Core 0: %.50s...\n", code);
+    DEBUG_PRINTF("[REPL] Posted: %.50s\n", code);
+    return REPL_OK;
+}
+
+void repl_cancel(void *user_data) {
+    if (g_mailbox.state != MAILBOX_EMPTY && g_mailbox.user_data == user_data) {
+        g_mailbox.output = NULL;
+        g_mailbox.done = NULL;
+        g_mailbox.user_data = NULL;
+    }
+}
+
+/* Empty the slot, then report; the callback may post the next request */
+static void mailbox_complete(repl_error_t error, const char *message) {
+    repl_done_t done = g_mailbox.done;
+    void *user_data = g_mailbox.user_data;
     
-    /* Wait for response with timeout */
-    absolute_time_t start = get_absolute_time();
-    repl_message_t response;
-    bool got_response = false;
+    g_mailbox.last_latency_us = (uint32_t)(time_us_64() - g_mailbox.posted_us);
+    g_mailbox.last_output_bytes = g_mailbox.output_bytes;
+    free(g_mailbox.code);
+    g_mailbox.code = NULL;
+    g_mailbox.output = NULL;
+    g_mailbox.done = NULL;
+    g_mailbox.user_data = NULL;
+    g_mailbox.state = MAILBOX_EMPTY;
     
-    while (!got_response) {
-        /* Check for timeout */
-        if (absolute_time_diff_us(start, get_absolute_time()) > REPL_TIMEOUT_MS * 1000) {
-            DEBUG_PRINTF("[REPL] Timeout waiting for response\n");
-            repl_busy = false;
-            return REPL_ERR_TIMEOUT;
+    if (done) {
+        done(error, message, user_data);
+    }
+}
+
+/* Hand the staged output to the requester */
+static void flush_output(void) {
+    if (g_mailbox.chunk_len > 0 && g_mailbox.output) {
+        g_mailbox.output(g_mailbox.chunk, g_mailbox.chunk_len, g_mailbox.user_data);
+    }
+    g_mailbox.chunk_len = 0;
+    g_mailbox.flushed_us = time_us_64();
+}
+
+/* print() sink: stage output, flushing full chunks and stale partial ones */
+static void stream_output(const char *text, size_t len, void *user_data) {
+    (void)user_data;
+    g_mailbox.output_bytes += len;
+    while (len > 0) {
+        size_t n = sizeof(g_mailbox.chunk) - g_mailbox.chunk_len;
+        if (n > len) {
+            n = len;
         }
-        
-        /* Check if data available */
-        if (multicore_fifo_rvalid()) {
-            /* Receive response */
-            uint32_t *resp_data = (uint32_t *)&response;
-            for (size_t i = 0; i < words; i++) {
-                resp_data[i] = multicore_fifo_pop_blocking();
-            }
-            
-            /* Verify magic */
-            if (response.magic == REPL_MAGIC && response.complete) {
-                got_response = true;
-            }
+        memcpy(g_mailbox.chunk + g_mailbox.chunk_len, text, n);
+        g_mailbox.chunk_len += n;
+        text += n;
+        len -= n;
+        if (g_mailbox.chunk_len == sizeof(g_mailbox.chunk)) {
+            flush_output();
         }
-        
-        sleep_ms(10);
+    }
+    if (time_us_64() - g_mailbox.flushed_us > (uint64_t)REPL_FLUSH_MS * 1000) {
+        flush_output();
+    }
+}
+
+void repl_service(lua_State *L) {
+    if (!g_mailbox.doorbell) {
+        /* A program owns the CPU now, the menu's scratch state can go */
+        if (L && g_mailbox.scratch) {
+            lua_close_load81(g_mailbox.scratch);
+            g_mailbox.scratch = NULL;
+        }
+        return;
+    }
+    g_mailbox.doorbell = false;
+    if (g_mailbox.state != MAILBOX_POSTED) {
+        return;
     }
     
-    repl_busy = false;
-    
-    /* Check for errors */
-    if (response.error) {
-        /* Allocate output for error message */
-        *output = malloc(strlen(response.output) + 1);
-        if (*output) {
-            strcpy(*output, response.output);
+    if (!L) {
+        if (!g_mailbox.scratch) {
+            g_mailbox.scratch = lua_init_load81();
         }
-        
-        /* Determine error type from message */
-        if (strstr(response.output, "syntax")) {
-            return REPL_ERR_SYNTAX;
-        } else {
-            return REPL_ERR_RUNTIME;
+        L = g_mailbox.scratch;
+        if (!L) {
+            mailbox_complete(REPL_ERR_NO_MEMORY, repl_error_string(REPL_ERR_NO_MEMORY));
+            return;
         }
+    } else if (g_mailbox.scratch) {
+        lua_close_load81(g_mailbox.scratch);
+        g_mailbox.scratch = NULL;
     }
     
-    /* Success - allocate and copy output */
-    *output = malloc(strlen(response.output) + 1);
-    if (!*output) {
-        return REPL_ERR_NO_MEMORY;
-    }
+    g_mailbox.state = MAILBOX_RUNNING;
+    g_mailbox.chunk_len = 0;
+    g_mailbox.flushed_us = time_us_64();
+    g_mailbox.output_bytes = 0;
     
-    strcpy(*output, response.output);
-    DEBUG_PRINTF("[REPL] Got response: %.50s...\n", response.output);
+    char err[256];
+    lua_set_print_sink(stream_output, NULL);
+    int result = lua_run_repl_chunk(L, g_mailbox.code, strlen(g_mailbox.code), err, sizeof(err));
+    lua_set_print_sink(NULL, NULL);
+    flush_output();
     
-    return REPL_OK;
-}
\ No newline at end of file
+    if (result == 1) {
+        mailbox_complete(REPL_ERR_SYNTAX, err);
+    } else if (result == 2) {
+        mailbox_complete(REPL_ERR_RUNTIME, err);
+    } else {
+        mailbox_complete(REPL_OK, NULL);
+    }
+}
+
+void repl_check_timeout(void) {
+    if (g_mailbox.state != MAILBOX_POSTED) {
+        return;
+    }
+    if (time_us_64() - g_mailbox.posted_us > (uint64_t)REPL_TIMEOUT_MS * 1000) {
+        DEBUG_PRINTF("[REPL] Timeout waiting for the Lua state\n");
+        g_mailbox.doorbell = false;
+        mailbox_complete(REPL_ERR_TIMEOUT, repl_error_string(REPL_ERR_TIMEOUT));
+    }
+}
@@ -3,13 +3,24 @@
 
 #include <stddef.h>
 #include <stdbool.h>
+#include <stdint.h>
 
 /**
  * @file picocalc_repl_handler.h
  * @brief Lua REPL handler for LOAD81R server
- * 
- * Provides remote Lua code execution with output capture.
- * Uses inter-core communication to execute code on Core 0.
+ *
+ * Provides remote Lua code execution with streamed output.
+ * The file server posts code into a single-slot mailbox and rings a
+ * doorbell; whichever loop owns the current Lua state (program frame loop,
+ * on-screen REPL, menu) runs it between frames via repl_service(). print()
+ * output and results are handed to an output callback in chunks of at most
+ * REPL_CHUNK_SIZE bytes while the code runs, then a completion callback
+ * reports the outcome. Nothing blocks in the TCP callback waiting for the
+ * Lua state.
+ *
+ * Code runs in a REPL environment kept in the Lua state's registry, so
+ * REPL globals survive between commands: reads fall through to _G,
+ * assignments to existing globals update them, new names stay private.
  */
 
 /* Error codes */
@@ -22,38 +33,98 @@ typedef enum {
     REPL_ERR_BUSY
 } repl_error_t;
 
+#define REPL_TIMEOUT_MS 5000       /* Unserviced requests fail after this */
+#define REPL_CHUNK_SIZE 256        /* Output buffered before it is handed on */
+#define REPL_FLUSH_MS 50           /* Hand on a partial chunk after this */
+
+struct lua_State;
+
+/**
+ * Output callback, called while the code runs
+ *
+ * @param text Next piece of print() output or results (not NUL-terminated)
+ * @param len Length of text, at most REPL_CHUNK_SIZE
+ * @param user_data Value passed to repl_submit()
+ */
+typedef void (*repl_output_t)(const char *text, size_t len, void *user_data);
+
+/**
+ * Completion callback
+ *
+ * @param error REPL_OK, or why the code did not run to completion
+ * @param message Lua error message, or NULL on success
+ * @param user_data Value passed to repl_submit()
+ */
+typedef void (*repl_done_t)(repl_error_t error, const char *message, void *user_data);
+
 /**
  * Initialize REPL handler
- * Sets up inter-core communication
- * 
+ * Empties the mailbox
+ *
  * @return REPL_OK on success, error code otherwise
  */
 repl_error_t repl_init(void);
 
 /**
- * Execute Lua code and capture output
- * Sends code to Core 0 for execution via FIFO
- * Waits for response with timeout
- * 
+ * Post Lua code to the mailbox
+ * The code is copied; output is called for each chunk and done once, from
+ * repl_service() or repl_check_timeout().
+ *
  * @param code Lua code to execute
- * @param output Output: allocated string with result (caller must free)
- * @return REPL_OK on success, error code otherwise
+ * @param output Output callback
+ * @param done Completion callback
+ * @param user_data Passed to done
+ * @return REPL_OK if queued, REPL_ERR_BUSY or REPL_ERR_NO_MEMORY otherwise
+ */
+repl_error_t repl_submit(const char *code, repl_output_t output, repl_done_t done,
+                         void *user_data);
+
+/**
+ * Drop the callbacks of a pending request (requester went away)
  */
-repl_error_t repl_execute(const char *code, char **output);
+void repl_cancel(void *user_data);
+
+/**
+ * Run a posted request, if the doorbell is set
+ * Call between frames, never from inside a Lua call.
+ *
+ * @param L Lua state to run in, or NULL for the handler's own scratch
+ *          state (menu), which is closed again once a program state is
+ *          passed in
+ */
+void repl_service(struct lua_State *L);
+
+/**
+ * Fail a request nobody serviced within REPL_TIMEOUT_MS
+ * (e.g. the device is showing a modal error screen)
+ */
+void repl_check_timeout(void);
 
 /**
  * Check if REPL is available
- * 
+ *
  * @return true if REPL can accept requests, false if busy
  */
 bool repl_is_available(void);
 
+/**
+ * Get the latency of the last completed request in microseconds
+ *
+ * @return repl_submit() to completion, 0 if none yet
+ */
+uint32_t repl_last_latency_us(void);
+
+/**
+ * Get the output size of the last completed request in bytes
+ */
+uint32_t repl_last_output_bytes(void);
+
 /**
  * Get error message string
- * 
+ *
  * @param error Error code
  * @return Human-readable error message
  */
 const char *repl_error_string(repl_error_t error);
 
-#endif /* PICOCALC_REPL_HANDLER_H */
\ No newline at end of file
+#endif /* PICOCALC_REPL_HANDLER_H */
@@ -0,0 +1,437 @@
+#!/usr/bin/env python3
+"""
+LOAD81R File Server Benchmark
+Drives load81r client operations (PUT/CAT/LS/SSHOT, many small files, large
+files, concurrent clients) against a file server and reports throughput in
+MB/s and request latency percentiles. A tree phase times device-side
+DU/COPY/MOVE/RMTREE against the equivalent client-side LS/CAT/PUT/RM chains
+and reports the device-side GREP scan rate. A reload phase re-uploads the
+running program with AUTORELOAD on and reports PUT to first new frame.
+A frame phase reports the program loop's longest frame while idle and
+while large PUTs are written by the filesystem worker (--card-latency
+slows the host build's file transfers down to SD card speed).
+Directory walks (LS, DU) and sequential reads (CAT large) also report the
+device's sector cache counters from STATS (all zero on the host build).
+
+Works against a device or the host build in this directory:
+
+  bench_server.py --spawn ./load81-hostsim      # temp root, free port
+  bench_server.py 192.168.1.100                 # real PicoCalc
+
+Usage:
+  bench_server.py [HOST] [-p PORT] [--spawn BINARY] [--protocol {1,2}]
+                  [--small N] [--small-size BYTES] [--large N]
+                  [--large-size BYTES] [--sshot N] [--clients N] [--tree N]
+                  [--reload PATH] [--reloads N] [--frame-puts N]
+                  [--card-latency US_PER_KB]
+"""
+
+import os
+import sys
+import time
+import socket
+import shutil
+import argparse
+import tempfile
+import threading
+import subprocess
+
+sys.path.insert(0, os.path.join(os.path.dirname(os.path.abspath(__file__)), '..', 'load81r'))
+from client import Load81Client  # noqa: E402
+from bench_protocol import percentile  # noqa: E402
+
+BENCH_DIR = "/bench"
+RELOAD_PROGRAM = "/load81/bench_reload.lua"  # Running program under --spawn
+
+
+def report(name, latencies, total_bytes, elapsed):
+    """Print one result line: ops, MB/s and latency percentiles"""
+    latencies = sorted(latencies)
+    rate = total_bytes / elapsed / (1024 * 1024) if elapsed > 0 else 0.0
+    print(f"  {name:<14} ops={len(latencies):<5} {rate:8.2f} MB/s "
+          f"p50={percentile(latencies, 50):7.2f}ms "
+          f"p95={percentile(latencies, 95):7.2f}ms "
+          f"p99={percentile(latencies, 99):7.2f}ms")
+
+
+def cache_report(name, before, after):
+    """Print the sector cache counters STATS moved by between two calls"""
+    if not before or not after or 'cache_hits' not in after:
+        return
+    delta = {k: after[k] - before.get(k, 0) for k in
+             ('cache_hits', 'cache_misses', 'cache_readahead', 'cache_readahead_hits',
+              'sd_reads')}
+    lookups = delta['cache_hits'] + delta['cache_misses']
+    rate = 100.0 * delta['cache_hits'] / lookups if lookups else 0.0
+    print(f"  {name:<14} cache hits={delta['cache_hits']} misses={delta['cache_misses']} "
+          f"({rate:.0f}%) readahead={delta['cache_readahead']} "
+          f"used={delta['cache_readahead_hits']} sd_reads={delta['sd_reads']}")
+
+
+def dentry_report(name, before, after):
+    """Print the directory entry cache counters STATS moved by between two calls"""
+    if not before or not after or 'dentry_hits' not in after:
+        return
+    hits = after['dentry_hits'] - before.get('dentry_hits', 0)
+    misses = after['dentry_misses'] - before.get('dentry_misses', 0)
+    rate = 100.0 * hits / (hits + misses) if hits + misses else 0.0
+    print(f"  {name:<14} dentry hits={hits} misses={misses} ({rate:.0f}%)")
+
+
+def timed(op, count, size_of=None):
+    """Run op(i) count times; returns (latencies_ms, bytes, elapsed_s, failures)"""
+    latencies = []
+    total = 0
+    failures = 0
+    start = time.perf_counter()
+    for i in range(count):
+        t0 = time.perf_counter()
+        result = op(i)
+        latencies.append((time.perf_counter() - t0) * 1000.0)
+        if result is None or result is False:
+            failures += 1
+        elif size_of:
+            total += size_of(result)
+    return latencies, total, time.perf_counter() - start, failures
+
+
+def connect(host, port, protocol, deadline=10.0):
+    """Connect, retrying while the single-client server is busy"""
+    client = Load81Client()
+    retries = 0
+    end = time.time() + deadline
+    while not client.connect(host, port, timeout=30.0, protocol=protocol):
+        retries += 1
+        if time.time() > end:
+            return None, retries
+        time.sleep(0.01)
+    return client, retries
+
+
+def run_single(args):
+    client, _ = connect(args.host, args.port, args.protocol)
+    if not client:
+        print(f"Error: Cannot connect to {args.host}:{args.port}", file=sys.stderr)
+        return 1
+    print(f"Protocol v{client.protocol}, {args.host}:{args.port}")
+
+    client.mkdir(BENCH_DIR)
+    small = os.urandom(args.small_size)
+    large = os.urandom(args.large_size)
+    failures = 0
+
+    lat, _, elapsed, f = timed(lambda i: client.put(f"{BENCH_DIR}/s{i:04d}.bin", small),
+                               args.small)
+    report("PUT small", lat, args.small * args.small_size, elapsed)
+    failures += f
+
+    lat, total, elapsed, f = timed(lambda i: client.cat(f"{BENCH_DIR}/s{i:04d}.bin"),
+                                   args.small, len)
+    report("CAT small", lat, total, elapsed)
+    failures += f
+
+    before = client.stats()
+    lat, total, elapsed, f = timed(lambda i: client.ls(BENCH_DIR), 20, lambda r: len(str(r)))
+    report("LS full", lat, total, elapsed)
+    cache_report("LS full", before, client.stats())
+    failures += f
+
+    pages = max(1, args.small // 32)
+    lat, total, elapsed, f = timed(lambda i: client.ls(BENCH_DIR, (i % pages) * 32, 32),
+                                   20, lambda r: len(str(r)))
+    report("LS page(32)", lat, total, elapsed)
+    failures += f
+
+    # Sweep of STATs cycling over a working set of small files and the bench
+    # directory, the way a program looks up its own files again and again
+    paths = [BENCH_DIR] + [f"{BENCH_DIR}/s{i:04d}.bin"
+                           for i in range(min(args.stat_paths, args.small) - 1)]
+    before = client.stats()
+    lat, _, elapsed, f = timed(lambda i: client.stat(paths[i % len(paths)]), args.stat)
+    report(f"STAT x{args.stat}", lat, 0, elapsed)
+    dentry_report(f"STAT x{args.stat}", before, client.stats())
+    failures += f
+
+    lat, _, elapsed, f = timed(lambda i: client.put(f"{BENCH_DIR}/l{i}.bin", large), args.large)
+    report("PUT large", lat, args.large * args.large_size, elapsed)
+    failures += f
+
+    before = client.stats()
+    lat, total, elapsed, f = timed(lambda i: client.cat(f"{BENCH_DIR}/l{i}.bin"), args.large, len)
+    report("CAT large", lat, total, elapsed)
+    cache_report("CAT large", before, client.stats())
+    failures += f
+
+    lat, total, elapsed, f = timed(lambda i: client.sshot(), args.sshot, len)
+    report("SSHOT", lat, total, elapsed)
+    failures += f
+
+    stats = client.stats()
+    if stats:
+        print(f"  server: requests={stats.get('requests')} parse_us={stats.get('parse_us')} "
+              f"heap_used={stats.get('heap_used')} ls_heap_peak={stats.get('ls_heap_peak')}")
+    client.close()
+
+    if failures:
+        print(f"  {failures} operations failed", file=sys.stderr)
+    return 1 if failures else 0
+
+
+def run_concurrent(args):
+    """N clients each CAT the small files; the server serves one at a time"""
+    results = []
+    lock = threading.Lock()
+    per_client = max(1, args.small // args.clients)
+
+    def worker(index):
+        client, retries = connect(args.host, args.port, args.protocol, deadline=60.0)
+        if not client:
+            with lock:
+                results.append(([], 0, retries, per_client))
+            return
+        lat, total, _, failures = timed(
+            lambda i: client.cat(f"{BENCH_DIR}/s{(index * per_client + i) % args.small:04d}.bin"),
+            per_client, len)
+        client.close()
+        with lock:
+            results.append((lat, total, retries, failures))
+
+    threads = [threading.Thread(target=worker, args=(i,)) for i in range(args.clients)]
+    start = time.perf_counter()
+    for t in threads:
+        t.start()
+    for t in threads:
+        t.join()
+    elapsed = time.perf_counter() - start
+
+    latencies = [x for r in results for x in r[0]]
+    total = sum(r[1] for r in results)
+    retries = sum(r[2] for r in results)
+    failures = sum(r[3] for r in results)
+    report(f"CAT x{args.clients} cli", latencies, total, elapsed)
+    print(f"  concurrent: {retries} busy rejections retried, {failures} failed")
+    return 1 if failures else 0
+
+
+def _walk(client, path):
+    """Client-side recursive listing: yields (path, entry)"""
+    for entry in client.ls(path) or []:
+        child = f"{path}/{entry['name']}"
+        yield child, entry
+        if entry['is_dir']:
+            yield from _walk(client, child)
+
+
+def _client_du(client, path):
+    return sum(e['size'] for _, e in _walk(client, path) if not e['is_dir'])
+
+
+def _client_copy(client, src, dst):
+    client.mkdir(dst)
+    for path, entry in list(_walk(client, src)):
+        target = dst + path[len(src):]
+        if entry['is_dir']:
+            client.mkdir(target)
+        else:
+            client.put(target, client.cat(path) or b'')
+    return True
+
+
+def _client_rmtree(client, path):
+    entries = list(_walk(client, path))
+    for child, entry in reversed(entries):
+        client.rm(child)
+    return client.rm(path)
+
+
+def run_tree(args):
+    """Time recursive operations on a tree of args.tree files"""
+    client, _ = connect(args.host, args.port, args.protocol)
+    if not client:
+        return 1
+    root = f"{BENCH_DIR}/tree"
+    data = os.urandom(args.small_size)
+    per_dir = 10
+    for i in range(args.tree):
+        if i % per_dir == 0:
+            client.mkdirs(f"{root}/d{i // per_dir:02d}")
+        client.put(f"{root}/d{i // per_dir:02d}/f{i:03d}.bin", data)
+
+    print(f"Tree of {args.tree} files ({args.small_size} bytes each):")
+    steps = [
+        ("DU", lambda: client.du(root), lambda: _client_du(client, root)),
+        ("COPY", lambda: client.copy(root, root + "_s"),
+         lambda: _client_copy(client, root, root + "_c")),
+        ("MOVE", lambda: client.move(root + "_s", root + "_m"), None),
+        ("RMTREE", lambda: client.rmtree(root + "_m"),
+         lambda: _client_rmtree(client, root + "_c")),
+    ]
+    failures = 0
+    totals = client.grep(root, "zz*q") or {}
+    print(f"  GREP    device scan {totals.get('bytes', 0) / 1024:.0f}K in "
+          f"{totals.get('ms', 0)}ms = {totals.get('kbps', 0)} KB/s")
+    for name, server_op, client_op in steps:
+        before = client.stats()
+        t0 = time.perf_counter()
+        ok = server_op()
+        server_ms = (time.perf_counter() - t0) * 1000.0
+        after = client.stats()
+        line = f"  {name:<7} device={server_ms:8.1f}ms"
+        if client_op:
+            t0 = time.perf_counter()
+            client_op()
+            line += f"  client-side={(time.perf_counter() - t0) * 1000.0:8.1f}ms"
+        print(line)
+        if name == "DU":
+            cache_report("DU walk", before, after)
+        if ok is None or ok is False:
+            failures += 1
+
+    client.rmtree(root)
+    client.close()
+    return 1 if failures else 0
+
+
+def run_reload(args):
+    """Time PUT of the running program to its first frame with the new code"""
+    client, _ = connect(args.host, args.port, args.protocol)
+    if not client:
+        return 1
+    # Re-upload the program's own source so a device keeps running the same code
+    source = client.cat(args.reload)
+    if source is None:
+        print(f"Cannot read {args.reload}", file=sys.stderr)
+        client.close()
+        return 1
+    client.autoreload(True)
+
+    failures = 0
+    latencies, total, elapsed, _ = timed(lambda i: client.put(args.reload, source),
+                                         args.reloads, lambda r: len(source))
+    print(f"Reload of {args.reload} ({len(source)} bytes), PUT to first new frame:")
+    report("PUT+RELOAD", latencies, total, elapsed)
+    if client.last_reload is None or 'error' in client.last_reload:
+        print(f"  not reloaded: {client.last_reload}", file=sys.stderr)
+        failures += 1
+    else:
+        stats = client.stats() or {}
+        print(f"  last device-side latency {stats.get('reload_us', 0) / 1000:.1f}ms, "
+              f"compile {client.last_reload.get('compile_us', 0) / 1000:.1f}ms")
+    client.close()
+    return 1 if failures else 0
+
+
+def run_frames(args):
+    """Longest program loop iteration, idle and while large PUTs are written"""
+    client, _ = connect(args.host, args.port, args.protocol)
+    if not client:
+        return 1
+    data = os.urandom(args.large_size)
+    failures = 0
+    client.mkdir(BENCH_DIR)
+
+    client.stats()  # Restarts the loop gap measurement
+    time.sleep(1.0)
+    idle = (client.stats() or {}).get('loop_gap_max_us', 0)
+
+    gaps = []
+    busy_before = (client.stats() or {}).get('fs_busy_us', 0)
+    start = time.time()
+    for i in range(args.frame_puts):
+        if not client.put(f"{BENCH_DIR}/frame{i}.bin", data):
+            failures += 1
+        gaps.append((client.stats() or {}).get('loop_gap_max_us', 0))
+    elapsed = time.time() - start
+    busy = (client.stats() or {}).get('fs_busy_us', 0) - busy_before
+    client.rmtree(BENCH_DIR)
+
+    print(f"Frame time while PUT writes {args.large_size} bytes "
+          f"(x{args.frame_puts}, {elapsed:.2f}s):")
+    print(f"  longest frame idle {idle / 1000:.1f}ms, during PUT max "
+          f"{max(gaps, default=0) / 1000:.1f}ms, p50 "
+          f"{percentile(sorted(gaps), 50) / 1000:.1f}ms; worker busy {busy / 1000:.1f}ms")
+    client.close()
+    return 1 if failures else 0
+
+
+def free_port():
+    with socket.socket() as s:
+        s.bind(("127.0.0.1", 0))
+        return s.getsockname()[1]
+
+
+def main():
+    parser = argparse.ArgumentParser(description='LOAD81R file server benchmark')
+    parser.add_argument('host', nargs='?', default='127.0.0.1',
+                        help='Server address (default: 127.0.0.1)')
+    parser.add_argument('-p', '--port', type=int, default=1900,
+                        help='Server port (default: 1900)')
+    parser.add_argument('--spawn', metavar='BINARY',
+                        help='Start this host server on a temp root and free port')
+    parser.add_argument('--protocol', type=int, choices=(1, 2), default=2,
+                        help='Protocol version (default: 2)')
+    parser.add_argument('--small', type=int, default=200,
+                        help='Number of small files (default: 200)')
+    parser.add_argument('--small-size', type=int, default=1024,
+                        help='Small file size in bytes (default: 1024)')
+    parser.add_argument('--large', type=int, default=4,
+                        help='Number of large files (default: 4)')
+    parser.add_argument('--large-size', type=int, default=512 * 1024,
+                        help='Large file size in bytes (default: 512K, max 1M)')
+    parser.add_argument('--stat', type=int, default=200,
+                        help='STATs in the sweep (default: 200)')
+    parser.add_argument('--stat-paths', type=int, default=32,
+                        help='Distinct paths the STAT sweep cycles over (default: 32)')
+    parser.add_argument('--sshot', type=int, default=10,
+                        help='Number of screenshots (default: 10)')
+    parser.add_argument('--clients', type=int, default=4,
+                        help='Concurrent clients (default: 4)')
+    parser.add_argument('--tree', type=int, default=100,
+                        help='Files in the recursive operations tree (default: 100)')
+    parser.add_argument('--reload', metavar='PATH',
+                        help='Path of the running program for the reload phase '
+                             f'(default with --spawn: {RELOAD_PROGRAM})')
+    parser.add_argument('--reloads', type=int, default=20,
+                        help='Number of reloads (default: 20)')
+    parser.add_argument('--frame-puts', type=int, default=4,
+                        help='Large PUTs in the frame phase (default: 4)')
+    parser.add_argument('--card-latency', type=int, default=0, metavar='US_PER_KB',
+                        help='With --spawn, host file transfer time per KB (default: 0)')
+    args = parser.parse_args()
+
+    server = None
+    root = None
+    if args.spawn:
+        root = tempfile.mkdtemp(prefix='load81-bench-')
+        args.host = '127.0.0.1'
+        args.port = free_port()
+        args.reload = args.reload or RELOAD_PROGRAM
+        os.makedirs(root + os.path.dirname(args.reload), exist_ok=True)
+        with open(root + args.reload, 'w') as f:
+            f.write("function draw()\n    background(0, 0, 0)\nend\n")
+        server = subprocess.Popen([args.spawn, '-p', str(args.port),
+                                   '-l', str(args.card_latency), '-r', args.reload, root],
+                                  stdout=subprocess.DEVNULL)
+        time.sleep(0.3)
+
+    try:
+        result = run_single(args)
+        if args.clients > 1:
+            result |= run_concurrent(args)
+        if args.tree:
+            result |= run_tree(args)
+        if args.reload and args.reloads:
+            result |= run_reload(args)
+        if args.reload and args.frame_puts:
+            result |= run_frames(args)
+    finally:
+        if server:
+            server.terminate()
+            server.wait()
+        if root:
+            shutil.rmtree(root, ignore_errors=True)
+    return result
+
+
+if __name__ == '__main__':
+    sys.exit(main())
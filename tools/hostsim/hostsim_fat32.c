@@ -0,0 +1,236 @@
+/*
+ * FAT32 driver shim for the host build
+ *
+ * Maps fat32_* calls onto stdio/dirent calls under a host directory so the
+ * unmodified file system handler can be exercised without an SD card.
+ */
+
+#include "fat32.h"
+#include "picocalc_block_cache.h"
+#include "picocalc_fat_alloc.h"
+#include "picocalc_fat_io.h"
+#include <string.h>
+#include <errno.h>
+#include <unistd.h>
+#include <sys/stat.h>
+#include <time.h>
+
+static char g_root[4096];
+static bool g_mounted = false;
+static uint32_t g_us_per_kb = 0;
+
+void fat32_host_set_latency(uint32_t us_per_kb) {
+    g_us_per_kb = us_per_kb;
+}
+
+/* Stand-in for the time the card takes to move size bytes */
+static void card_delay(size_t size) {
+    if (g_us_per_kb && size) {
+        usleep((useconds_t)((uint64_t)size * g_us_per_kb / 1024));
+    }
+}
+
+/* There are no sectors under the shim; STATS reports zero cache counters */
+static block_cache_stats_t g_cache_stats;
+
+const block_cache_stats_t *block_cache_stats(void) {
+    return &g_cache_stats;
+}
+
+/* Nor clusters: files grow however the host file system lays them out */
+fat32_error_t fat_alloc_reserve(fat32_file_t *file, uint32_t size) {
+    return FAT32_ERROR_INVALID_PARAMETER;
+}
+
+fat32_error_t fat_io_read(fat32_file_t *file, void *buffer, size_t size, size_t *bytes_read) {
+    card_delay(size);
+    return fat32_read(file, buffer, size, bytes_read);
+}
+
+fat32_error_t fat_io_write(fat32_file_t *file, const void *buffer, size_t size,
+                           size_t *bytes_written) {
+    card_delay(size);
+    return fat32_write(file, buffer, size, bytes_written);
+}
+
+fat32_error_t fat32_host_mount(const char *root) {
+    struct stat st;
+    if (!root || stat(root, &st) != 0 || !S_ISDIR(st.st_mode)) {
+        return FAT32_ERROR_DIR_NOT_FOUND;
+    }
+    strncpy(g_root, root, sizeof(g_root) - 1);
+    g_root[sizeof(g_root) - 1] = '\0';
+    g_mounted = true;
+    return FAT32_OK;
+}
+
+bool fat32_is_mounted(void) {
+    return g_mounted;
+}
+
+/* Build a host path; rejects relative paths and ".." components */
+static fat32_error_t host_path(const char *path, char *out, size_t out_len) {
+    if (!g_mounted) return FAT32_ERROR_NOT_MOUNTED;
+    if (!path || path[0] != '/' || strstr(path, "..")) return FAT32_ERROR_INVALID_PATH;
+    
+    int n = snprintf(out, out_len, "%s%s", g_root, path);
+    if (n < 0 || (size_t)n >= out_len) return FAT32_ERROR_INVALID_PATH;
+    return FAT32_OK;
+}
+
+static fat32_error_t errno_to_fat32(int err) {
+    switch (err) {
+        case ENOENT: return FAT32_ERROR_FILE_NOT_FOUND;
+        case ENOTDIR: return FAT32_ERROR_NOT_A_DIRECTORY;
+        case EISDIR: return FAT32_ERROR_NOT_A_FILE;
+        case EEXIST: return FAT32_ERROR_FILE_EXISTS;
+        case ENOSPC: return FAT32_ERROR_DISK_FULL;
+        case ENAMETOOLONG: return FAT32_ERROR_INVALID_PATH;
+        default: return FAT32_ERROR_INVALID_PARAMETER;
+    }
+}
+
+fat32_error_t fat32_open(fat32_file_t *file, const char *path) {
+    char full[4352];
+    fat32_error_t err = host_path(path, full, sizeof(full));
+    if (err != FAT32_OK) return err;
+    
+    struct stat st;
+    if (stat(full, &st) != 0) return errno_to_fat32(errno);
+    
+    memset(file, 0, sizeof(*file));
+    if (S_ISDIR(st.st_mode)) {
+        file->dir = opendir(full);
+        if (!file->dir) return errno_to_fat32(errno);
+        file->attributes = FAT32_ATTR_DIRECTORY;
+    } else {
+        file->fp = fopen(full, "r+b");
+        if (!file->fp) file->fp = fopen(full, "rb");
+        if (!file->fp) return errno_to_fat32(errno);
+        file->attributes = FAT32_ATTR_ARCHIVE;
+        file->file_size = (uint32_t)st.st_size;
+    }
+    file->is_open = true;
+    return FAT32_OK;
+}
+
+fat32_error_t fat32_create(fat32_file_t *file, const char *path) {
+    char full[4352];
+    fat32_error_t err = host_path(path, full, sizeof(full));
+    if (err != FAT32_OK) return err;
+    
+    memset(file, 0, sizeof(*file));
+    file->fp = fopen(full, "w+b");
+    if (!file->fp) return errno_to_fat32(errno);
+    file->attributes = FAT32_ATTR_ARCHIVE;
+    file->is_open = true;
+    return FAT32_OK;
+}
+
+fat32_error_t fat32_close(fat32_file_t *file) {
+    if (!file || !file->is_open) return FAT32_ERROR_INVALID_PARAMETER;
+    if (file->fp) fclose(file->fp);
+    if (file->dir) closedir(file->dir);
+    memset(file, 0, sizeof(*file));
+    return FAT32_OK;
+}
+
+fat32_error_t fat32_read(fat32_file_t *file, void *buffer, size_t size, size_t *bytes_read) {
+    if (!file || !file->fp) return FAT32_ERROR_NOT_A_FILE;
+    size_t n = fread(buffer, 1, size, file->fp);
+    if (n < size && ferror(file->fp)) return FAT32_ERROR_READ_FAILED;
+    file->position += n;
+    if (bytes_read) *bytes_read = n;
+    return FAT32_OK;
+}
+
+fat32_error_t fat32_write(fat32_file_t *file, const void *buffer, size_t size, size_t *bytes_written) {
+    if (!file || !file->fp) return FAT32_ERROR_NOT_A_FILE;
+    size_t n = fwrite(buffer, 1, size, file->fp);
+    file->position += n;
+    if (file->position > file->file_size) file->file_size = file->position;
+    if (bytes_written) *bytes_written = n;
+    return n == size ? FAT32_OK : FAT32_ERROR_DISK_FULL;
+}
+
+fat32_error_t fat32_seek(fat32_file_t *file, uint32_t position) {
+    if (!file || !file->fp) return FAT32_ERROR_NOT_A_FILE;
+    if (fseek(file->fp, position, SEEK_SET) != 0) return FAT32_ERROR_INVALID_PARAMETER;
+    file->position = position;
+    return FAT32_OK;
+}
+
+uint32_t fat32_size(fat32_file_t *file) {
+    return file ? file->file_size : 0;
+}
+
+fat32_error_t fat32_delete(const char *path) {
+    char full[4352];
+    fat32_error_t err = host_path(path, full, sizeof(full));
+    if (err != FAT32_OK) return err;
+    
+    if (remove(full) != 0) return errno_to_fat32(errno);
+    return FAT32_OK;
+}
+
+fat32_error_t fat32_rename(const char *old_path, const char *new_path) {
+    char old_full[4352], new_full[4352];
+    fat32_error_t err = host_path(old_path, old_full, sizeof(old_full));
+    if (err != FAT32_OK) return err;
+    err = host_path(new_path, new_full, sizeof(new_full));
+    if (err != FAT32_OK) return err;
+    
+    if (access(new_full, F_OK) == 0) return FAT32_ERROR_FILE_EXISTS;
+    if (rename(old_full, new_full) != 0) return errno_to_fat32(errno);
+    return FAT32_OK;
+}
+
+fat32_error_t fat32_dir_read(fat32_file_t *dir, fat32_entry_t *entry) {
+    if (!dir || !dir->dir) return FAT32_ERROR_NOT_A_DIRECTORY;
+    
+    memset(entry, 0, sizeof(*entry));
+    struct dirent *de = readdir(dir->dir);
+    if (!de) return FAT32_OK;  /* Empty filename marks the end */
+    
+    snprintf(entry->filename, sizeof(entry->filename), "%s", de->d_name);
+    
+    struct stat st;
+    if (fstatat(dirfd(dir->dir), de->d_name, &st, 0) == 0) {
+        entry->attr = S_ISDIR(st.st_mode) ? FAT32_ATTR_DIRECTORY : FAT32_ATTR_ARCHIVE;
+        entry->size = S_ISDIR(st.st_mode) ? 0 : (uint32_t)st.st_size;
+        
+        /* FAT packed date/time */
+        struct tm tm;
+        localtime_r(&st.st_mtime, &tm);
+        entry->date = (uint16_t)(((tm.tm_year - 80) << 9) | ((tm.tm_mon + 1) << 5) | tm.tm_mday);
+        entry->time = (uint16_t)((tm.tm_hour << 11) | (tm.tm_min << 5) | (tm.tm_sec / 2));
+    }
+    return FAT32_OK;
+}
+
+fat32_error_t fat32_dir_create(fat32_file_t *dir, const char *path) {
+    char full[4352];
+    fat32_error_t err = host_path(path, full, sizeof(full));
+    if (err != FAT32_OK) return err;
+    
+    if (mkdir(full, 0755) != 0) return errno_to_fat32(errno);
+    return fat32_open(dir, path);
+}
+
+const char *fat32_error_string(fat32_error_t error) {
+    switch (error) {
+        case FAT32_OK: return "OK";
+        case FAT32_ERROR_NOT_MOUNTED: return "Not mounted";
+        case FAT32_ERROR_FILE_NOT_FOUND: return "File not found";
+        case FAT32_ERROR_DIR_NOT_FOUND: return "Directory not found";
+        case FAT32_ERROR_NOT_A_DIRECTORY: return "Not a directory";
+        case FAT32_ERROR_NOT_A_FILE: return "Not a file";
+        case FAT32_ERROR_FILE_EXISTS: return "File exists";
+        case FAT32_ERROR_DISK_FULL: return "Disk full";
+        case FAT32_ERROR_INVALID_PATH: return "Invalid path";
+        case FAT32_ERROR_INVALID_PARAMETER: return "Invalid parameter";
+        case FAT32_ERROR_READ_FAILED: return "Read failed";
+        case FAT32_ERROR_WRITE_FAILED: return "Write failed";
+    }
+    return "Unknown error";
+}
@@ -0,0 +1,367 @@
+/*
+ * lwIP raw TCP API shim for the host build
+ *
+ * Each tcp_pcb wraps a non-blocking POSIX socket. tcp_write() queues into a
+ * TCP_SND_BUF sized buffer that tcp_output() drains into the kernel, so the
+ * server sees the same sndbuf back-pressure as on the device. Callbacks run
+ * from hostsim_poll(); nested polls (cyw43_arch_poll() inside a handler)
+ * only flush output, like the device never re-entering a busy handler.
+ * tcp_poll() callbacks fire from the outermost poll on lwIP's 500ms grid.
+ */
+
+#include "lwip/tcp.h"
+#include "pico/cyw43_arch.h"
+#include "pico/stdlib.h"
+#include <stdio.h>
+#include <stdlib.h>
+#include <stdbool.h>
+#include <string.h>
+#include <errno.h>
+#include <fcntl.h>
+#include <poll.h>
+#include <unistd.h>
+#include <netinet/in.h>
+#include <netinet/tcp.h>
+#include <sys/socket.h>
+
+#define HOSTSIM_MAX_PCBS 16
+
+struct tcp_pcb {
+    int fd;
+    bool listening;
+    bool dead;             /* Closed; freed once the outermost poll returns */
+    void *arg;
+    tcp_accept_fn accept;
+    tcp_recv_fn recv;
+    tcp_err_fn err;
+    tcp_poll_fn poll;
+    uint64_t poll_interval_us;
+    uint64_t poll_next_us;
+    uint8_t snd_buf[TCP_SND_BUF];
+    size_t snd_len;
+};
+
+const ip_addr_t ip_addr_any = { 0 };
+
+static struct tcp_pcb *g_pcbs[HOSTSIM_MAX_PCBS];
+static u16_t g_port_override = 0;
+static int g_poll_depth = 0;
+
+void hostsim_set_port(u16_t port) {
+    g_port_override = port;
+}
+
+/* pbufs */
+struct pbuf *pbuf_alloc_copy(const void *data, u16_t len) {
+    struct pbuf *p = malloc(sizeof(struct pbuf) + len);
+    if (!p) return NULL;
+    p->next = NULL;
+    p->payload = (uint8_t *)(p + 1);
+    p->len = len;
+    p->tot_len = len;
+    memcpy(p->payload, data, len);
+    return p;
+}
+
+u8_t pbuf_free(struct pbuf *p) {
+    u8_t count = 0;
+    while (p) {
+        struct pbuf *next = p->next;
+        free(p);
+        p = next;
+        count++;
+    }
+    return count;
+}
+
+u16_t pbuf_copy_partial(const struct pbuf *p, void *dataptr, u16_t len, u16_t offset) {
+    u16_t copied = 0;
+    for (; p && copied < len; p = p->next) {
+        if (offset >= p->len) {
+            offset -= p->len;
+            continue;
+        }
+        u16_t n = p->len - offset;
+        if (n > len - copied) n = len - copied;
+        memcpy((uint8_t *)dataptr + copied, (const uint8_t *)p->payload + offset, n);
+        copied += n;
+        offset = 0;
+    }
+    return copied;
+}
+
+/* PCB bookkeeping */
+static struct tcp_pcb *pcb_register(int fd) {
+    for (int i = 0; i < HOSTSIM_MAX_PCBS; i++) {
+        if (!g_pcbs[i]) {
+            struct tcp_pcb *pcb = calloc(1, sizeof(struct tcp_pcb));
+            if (!pcb) return NULL;
+            pcb->fd = fd;
+            g_pcbs[i] = pcb;
+            return pcb;
+        }
+    }
+    return NULL;
+}
+
+static void pcb_kill(struct tcp_pcb *pcb) {
+    if (pcb->fd >= 0) {
+        close(pcb->fd);
+        pcb->fd = -1;
+    }
+    pcb->dead = true;
+}
+
+static void pcb_reap(void) {
+    for (int i = 0; i < HOSTSIM_MAX_PCBS; i++) {
+        if (g_pcbs[i] && g_pcbs[i]->dead) {
+            free(g_pcbs[i]);
+            g_pcbs[i] = NULL;
+        }
+    }
+}
+
+/* Connection reset: lwIP frees the pcb and then reports via the err callback */
+static void pcb_fail(struct tcp_pcb *pcb) {
+    tcp_err_fn err = pcb->err;
+    void *arg = pcb->arg;
+    pcb_kill(pcb);
+    if (err) err(arg, ERR_RST);
+}
+
+static void set_nonblocking(int fd) {
+    fcntl(fd, F_SETFL, fcntl(fd, F_GETFL, 0) | O_NONBLOCK);
+}
+
+/* Raw API */
+struct tcp_pcb *tcp_new(void) {
+    return pcb_register(-1);
+}
+
+err_t tcp_bind(struct tcp_pcb *pcb, const ip_addr_t *ipaddr, u16_t port) {
+    (void)ipaddr;
+    int fd = socket(AF_INET, SOCK_STREAM, 0);
+    if (fd < 0) return ERR_MEM;
+    
+    int one = 1;
+    setsockopt(fd, SOL_SOCKET, SO_REUSEADDR, &one, sizeof(one));
+    
+    struct sockaddr_in addr;
+    memset(&addr, 0, sizeof(addr));
+    addr.sin_family = AF_INET;
+    addr.sin_addr.s_addr = htonl(INADDR_ANY);
+    addr.sin_port = htons(g_port_override ? g_port_override : port);
+    if (bind(fd, (struct sockaddr *)&addr, sizeof(addr)) != 0) {
+        close(fd);
+        return ERR_USE;
+    }
+    
+    set_nonblocking(fd);
+    pcb->fd = fd;
+    return ERR_OK;
+}
+
+struct tcp_pcb *tcp_listen(struct tcp_pcb *pcb) {
+    if (!pcb || listen(pcb->fd, 8) != 0) return NULL;
+    pcb->listening = true;
+    return pcb;
+}
+
+void tcp_accept(struct tcp_pcb *pcb, tcp_accept_fn accept) { pcb->accept = accept; }
+void tcp_arg(struct tcp_pcb *pcb, void *arg) { pcb->arg = arg; }
+void tcp_recv(struct tcp_pcb *pcb, tcp_recv_fn recv) { pcb->recv = recv; }
+void tcp_err(struct tcp_pcb *pcb, tcp_err_fn err) { pcb->err = err; }
+void tcp_recved(struct tcp_pcb *pcb, u16_t len) { (void)pcb; (void)len; }
+
+void tcp_poll(struct tcp_pcb *pcb, tcp_poll_fn poll, u8_t interval) {
+    pcb->poll = poll;
+    pcb->poll_interval_us = (uint64_t)interval * TCP_SLOW_INTERVAL_MS * 1000;
+    pcb->poll_next_us = time_us_64() + pcb->poll_interval_us;
+}
+
+err_t tcp_write(struct tcp_pcb *pcb, const void *dataptr, u16_t len, u8_t apiflags) {
+    (void)apiflags;
+    if (!pcb || pcb->dead) return ERR_CONN;
+    if (len > sizeof(pcb->snd_buf) - pcb->snd_len) return ERR_MEM;
+    memcpy(pcb->snd_buf + pcb->snd_len, dataptr, len);
+    pcb->snd_len += len;
+    return ERR_OK;
+}
+
+err_t tcp_output(struct tcp_pcb *pcb) {
+    if (!pcb || pcb->dead) return ERR_CONN;
+    
+    size_t sent = 0;
+    while (sent < pcb->snd_len) {
+        ssize_t n = send(pcb->fd, pcb->snd_buf + sent, pcb->snd_len - sent, MSG_NOSIGNAL);
+        if (n > 0) {
+            sent += (size_t)n;
+        } else if (n < 0 && errno == EINTR) {
+            continue;
+        } else {
+            if (n < 0 && errno != EAGAIN && errno != EWOULDBLOCK) {
+                pcb->snd_len = 0;
+                pcb_fail(pcb);
+                return ERR_RST;
+            }
+            break;
+        }
+    }
+    
+    memmove(pcb->snd_buf, pcb->snd_buf + sent, pcb->snd_len - sent);
+    pcb->snd_len -= sent;
+    return ERR_OK;
+}
+
+u16_t tcp_sndbuf(struct tcp_pcb *pcb) {
+    if (!pcb || pcb->dead) return 0;
+    return (u16_t)(sizeof(pcb->snd_buf) - pcb->snd_len);
+}
+
+/* The host queue is a byte buffer: only tcp_sndbuf() limits it */
+u16_t tcp_sndqueuelen(struct tcp_pcb *pcb) {
+    (void)pcb;
+    return 0;
+}
+
+err_t tcp_close(struct tcp_pcb *pcb) {
+    if (!pcb || pcb->dead) return ERR_OK;
+    
+    /* Like lwIP, queued data is still delivered before the FIN */
+    for (int i = 0; i < 1000 && pcb->snd_len > 0 && !pcb->dead; i++) {
+        tcp_output(pcb);
+        if (pcb->snd_len > 0) {
+            struct pollfd pfd = { pcb->fd, POLLOUT, 0 };
+            poll(&pfd, 1, 1);
+        }
+    }
+    if (!pcb->dead) {
+        shutdown(pcb->fd, SHUT_WR);
+        pcb_kill(pcb);
+    }
+    return ERR_OK;
+}
+
+void tcp_abort(struct tcp_pcb *pcb) {
+    if (pcb && !pcb->dead) {
+        pcb_kill(pcb);
+    }
+}
+
+/* Run poll callbacks that are due */
+static void run_poll_callbacks(void) {
+    uint64_t now = time_us_64();
+    for (int i = 0; i < HOSTSIM_MAX_PCBS; i++) {
+        struct tcp_pcb *pcb = g_pcbs[i];
+        if (!pcb || pcb->dead || !pcb->poll || !pcb->poll_interval_us) continue;
+        if (now < pcb->poll_next_us) continue;
+        
+        pcb->poll_next_us = now + pcb->poll_interval_us;
+        pcb->poll(pcb->arg, pcb);
+    }
+}
+
+static void handle_accept(struct tcp_pcb *listener) {
+    int fd = accept(listener->fd, NULL, NULL);
+    if (fd < 0) return;
+    
+    set_nonblocking(fd);
+    int one = 1;
+    setsockopt(fd, IPPROTO_TCP, TCP_NODELAY, &one, sizeof(one));
+    
+    struct tcp_pcb *pcb = pcb_register(fd);
+    if (!pcb) {
+        close(fd);
+        return;
+    }
+    
+    err_t err = listener->accept ? listener->accept(listener->arg, pcb, ERR_OK) : ERR_VAL;
+    if (err != ERR_OK) {
+        tcp_abort(pcb);
+    }
+}
+
+static void handle_input(struct tcp_pcb *pcb) {
+    uint8_t buffer[TCP_MSS];
+    ssize_t n = recv(pcb->fd, buffer, sizeof(buffer), 0);
+    
+    if (n < 0) {
+        if (errno != EAGAIN && errno != EWOULDBLOCK && errno != EINTR) {
+            pcb_fail(pcb);
+        }
+        return;
+    }
+    
+    if (!pcb->recv) {
+        if (n == 0) pcb_kill(pcb);
+        return;
+    }
+    
+    if (n == 0) {
+        pcb->recv(pcb->arg, pcb, NULL, ERR_OK);
+        return;
+    }
+    
+    struct pbuf *p = pbuf_alloc_copy(buffer, (u16_t)n);
+    if (p) {
+        pcb->recv(pcb->arg, pcb, p, ERR_OK);
+    }
+}
+
+void hostsim_poll(int timeout_ms) {
+    struct tcp_pcb *pcbs[HOSTSIM_MAX_PCBS];
+    struct pollfd fds[HOSTSIM_MAX_PCBS];
+    int count = 0;
+    bool deliver_input = (g_poll_depth == 0);
+    
+    g_poll_depth++;
+    
+    for (int i = 0; i < HOSTSIM_MAX_PCBS; i++) {
+        struct tcp_pcb *pcb = g_pcbs[i];
+        if (!pcb || pcb->dead || pcb->fd < 0) continue;
+        
+        short events = 0;
+        if (deliver_input) events |= POLLIN;
+        if (pcb->snd_len > 0) events |= POLLOUT;
+        if (!events) continue;
+        
+        pcbs[count] = pcb;
+        fds[count].fd = pcb->fd;
+        fds[count].events = events;
+        fds[count].revents = 0;
+        count++;
+    }
+    
+    if (poll(fds, count, timeout_ms) > 0) {
+        for (int i = 0; i < count; i++) {
+            struct tcp_pcb *pcb = pcbs[i];
+            if (pcb->dead || !fds[i].revents) continue;
+            
+            if (fds[i].revents & POLLOUT) {
+                tcp_output(pcb);
+            }
+            if (pcb->dead) continue;
+            
+            if (fds[i].revents & (POLLIN | POLLHUP | POLLERR)) {
+                if (pcb->listening) {
+                    handle_accept(pcb);
+                } else if (deliver_input) {
+                    handle_input(pcb);
+                }
+            }
+        }
+    }
+    
+    if (deliver_input) {
+        run_poll_callbacks();
+    }
+    
+    g_poll_depth--;
+    if (g_poll_depth == 0) {
+        pcb_reap();
+    }
+}
+
+void cyw43_arch_poll(void) {
+    hostsim_poll(0);
+}
@@ -0,0 +1,183 @@
+/*
+ * Host build of the LOAD81R file server
+ *
+ * Runs src/picocalc_file_server.c and src/picocalc_fs_handler.c unmodified
+ * on Linux, with lwIP and the FAT32 driver replaced by shims over POSIX
+ * sockets and a host directory. Intended for load testing with
+ * bench_server.py; see README.md.
+ *
+ * With -r PATH a program loop is simulated at the device frame rate, so
+ * RELOAD and auto-reload on PUT can be timed. -l US makes file transfers
+ * take US microseconds per KB, like a slow SD card, so the filesystem
+ * worker's effect on frame times shows in STATS.
+ *
+ * Usage: load81-hostsim [-p port] [-v] [-l US_PER_KB] [-r PROGRAM] ROOT_DIR
+ */
+
+#include "picocalc_file_server.h"
+#include "picocalc_repl_handler.h"
+#include "picocalc_debug_log.h"
+#include "picocalc_framebuffer.h"
+#include "picocalc_reload.h"
+#include "picocalc_fs_worker.h"
+#include "picocalc_lua.h"
+#include "lwip/tcp.h"
+#include "fat32.h"
+#include "pico/stdlib.h"
+#include <stdio.h>
+#include <stdlib.h>
+#include <stdarg.h>
+#include <string.h>
+#include <signal.h>
+#include <unistd.h>
+
+#define HOSTSIM_FRAME_US 33333  /* FRAME_TIME_MS in main.c */
+#define HOSTSIM_WORKER_MARGIN_US 2000  /* FS_WORKER_MARGIN_MS in main.c */
+
+static volatile sig_atomic_t g_stop = 0;
+static bool g_verbose = false;
+
+/* Framebuffer served by SSHOT: a fixed gradient test pattern */
+static uint16_t g_pixels[FB_WIDTH * FB_HEIGHT];
+PicoFrameBuffer g_fb = { g_pixels, FB_WIDTH, FB_HEIGHT };
+
+/* Debug log goes to stderr with -v */
+void debug_log(const char *format, ...) {
+    if (!g_verbose) return;
+    va_list args;
+    va_start(args, format);
+    vfprintf(stderr, format, args);
+    va_end(args);
+}
+
+/*
+ * Lua stand-ins: no Lua VM on the host. The REPL mailbox is the real one;
+ * "running" a chunk prints the code back through the print sink.
+ */
+static lua_print_sink_t g_print_sink = NULL;
+static void *g_print_sink_data = NULL;
+static int g_scratch_state;
+
+lua_State *lua_init_load81(void) {
+    return (lua_State *)&g_scratch_state;
+}
+
+void lua_close_load81(lua_State *L) {
+    (void)L;
+}
+
+void lua_set_print_sink(lua_print_sink_t sink, void *user_data) {
+    g_print_sink = sink;
+    g_print_sink_data = user_data;
+}
+
+int lua_run_repl_chunk(lua_State *L, const char *code, size_t len, char *err, size_t err_size) {
+    (void)L;
+    if (len == 0) {
+        snprintf(err, err_size, "repl: empty chunk");
+        return 1;
+    }
+    if (g_print_sink) {
+        g_print_sink(code, len, g_print_sink_data);
+        g_print_sink("\n", 1, g_print_sink_data);
+    }
+    return 0;
+}
+
+/* Any source "compiles" unless it is empty */
+int lua_reload_program(lua_State *L, const char *code, size_t len, const char *name,
+                       char *err, size_t err_size) {
+    (void)L; (void)code;
+    if (len == 0) {
+        snprintf(err, err_size, "%s: empty chunk", name[0] == '@' ? name + 1 : name);
+        return 1;
+    }
+    return 0;
+}
+
+static void on_signal(int sig) {
+    (void)sig;
+    g_stop = 1;
+}
+
+int main(int argc, char **argv) {
+    int port = FILE_SERVER_PORT;
+    const char *program = NULL;
+    int opt;
+    while ((opt = getopt(argc, argv, "p:vl:r:")) != -1) {
+        switch (opt) {
+            case 'p': port = atoi(optarg); break;
+            case 'v': g_verbose = true; break;
+            case 'l': fat32_host_set_latency((uint32_t)atoi(optarg)); break;
+            case 'r': program = optarg; break;
+            default:
+                fprintf(stderr, "Usage: %s [-p port] [-v] [-l US_PER_KB] [-r PROGRAM] ROOT_DIR\n",
+                        argv[0]);
+                return 1;
+        }
+    }
+    if (optind >= argc) {
+        fprintf(stderr, "Usage: %s [-p port] [-v] [-l US_PER_KB] [-r PROGRAM] ROOT_DIR\n",
+                argv[0]);
+        return 1;
+    }
+    
+    if (fat32_host_mount(argv[optind]) != FAT32_OK) {
+        fprintf(stderr, "Cannot use %s as SD card root\n", argv[optind]);
+        return 1;
+    }
+    
+    for (int y = 0; y < FB_HEIGHT; y++) {
+        for (int x = 0; x < FB_WIDTH; x++) {
+            g_pixels[y * FB_WIDTH + x] = RGB565(x * 255 / FB_WIDTH, y * 255 / FB_HEIGHT, 128);
+        }
+    }
+    
+    hostsim_set_port((u16_t)port);
+    if (!file_server_init() || !file_server_start()) {
+        fprintf(stderr, "Failed to start file server on port %d\n", port);
+        return 1;
+    }
+    
+    signal(SIGINT, on_signal);
+    signal(SIGTERM, on_signal);
+    printf("LOAD81R host server on port %d, root %s\n", port, argv[optind]);
+    fflush(stdout);
+    
+    if (program) {
+        reload_set_program(program);
+    }
+    
+    /* Like program_loop(): network, pending reload, draw, present */
+    uint64_t next_frame = time_us_64();
+    while (!g_stop) {
+        if (!program) {
+            /* Like the menu: network, then the remote REPL in a scratch state */
+            hostsim_poll(fs_worker_busy() ? 0 : 100);
+            repl_service(NULL);
+            fs_worker_run(FS_WORKER_IDLE_US);
+            fs_worker_poll();
+            continue;
+        }
+        
+        uint64_t now = time_us_64();
+        hostsim_poll(next_frame > now ? (int)((next_frame - now) / 1000) : 0);
+        if (time_us_64() < next_frame) continue;
+        
+        reload_service(NULL);
+        repl_service(NULL);
+        reload_frame_presented();
+        
+        /* Queued filesystem work takes the slack, less the device's margin */
+        uint64_t slack_end = next_frame + HOSTSIM_FRAME_US - HOSTSIM_WORKER_MARGIN_US;
+        now = time_us_64();
+        if (fs_worker_busy()) {
+            fs_worker_run(slack_end > now ? (uint32_t)(slack_end - now) : 0);
+        }
+        fs_worker_poll();
+        next_frame += HOSTSIM_FRAME_US;
+    }
+    
+    file_server_stop();
+    return 0;
+}
@@ -0,0 +1,74 @@
+/*
+ * Host build shim for the FAT32 driver
+ *
+ * Provides the fat32_* subset used by the file server, backed by a
+ * directory on the host (see hostsim_fat32.c). Paths are absolute
+ * FAT32-style paths relative to that root.
+ */
+
+#ifndef HOSTSIM_FAT32_H
+#define HOSTSIM_FAT32_H
+
+#include <stdint.h>
+#include <stdbool.h>
+#include <stddef.h>
+#include <stdio.h>
+#include <dirent.h>
+
+typedef enum {
+    FAT32_OK = 0,
+    FAT32_ERROR_NOT_MOUNTED,
+    FAT32_ERROR_FILE_NOT_FOUND,
+    FAT32_ERROR_DIR_NOT_FOUND,
+    FAT32_ERROR_NOT_A_DIRECTORY,
+    FAT32_ERROR_NOT_A_FILE,
+    FAT32_ERROR_FILE_EXISTS,
+    FAT32_ERROR_DISK_FULL,
+    FAT32_ERROR_INVALID_PATH,
+    FAT32_ERROR_INVALID_PARAMETER,
+    FAT32_ERROR_READ_FAILED,
+    FAT32_ERROR_WRITE_FAILED
+} fat32_error_t;
+
+#define FAT32_ATTR_READ_ONLY 0x01
+#define FAT32_ATTR_DIRECTORY 0x10
+#define FAT32_ATTR_ARCHIVE   0x20
+
+typedef struct {
+    char filename[256];
+    uint32_t size;
+    uint8_t attr;
+    uint16_t date;
+    uint16_t time;
+} fat32_entry_t;
+
+typedef struct {
+    bool is_open;
+    uint8_t attributes;
+    uint32_t file_size;
+    uint32_t position;
+    FILE *fp;      /* Regular files */
+    DIR *dir;      /* Directories */
+} fat32_file_t;
+
+/* Host-only: directory that stands in for the SD card root */
+fat32_error_t fat32_host_mount(const char *root);
+
+/* Host-only: make file reads and writes take us_per_kb like a slow card */
+void fat32_host_set_latency(uint32_t us_per_kb);
+
+bool fat32_is_mounted(void);
+fat32_error_t fat32_open(fat32_file_t *file, const char *path);
+fat32_error_t fat32_create(fat32_file_t *file, const char *path);
+fat32_error_t fat32_close(fat32_file_t *file);
+fat32_error_t fat32_read(fat32_file_t *file, void *buffer, size_t size, size_t *bytes_read);
+fat32_error_t fat32_write(fat32_file_t *file, const void *buffer, size_t size, size_t *bytes_written);
+fat32_error_t fat32_seek(fat32_file_t *file, uint32_t position);
+uint32_t fat32_size(fat32_file_t *file);
+fat32_error_t fat32_delete(const char *path);
+fat32_error_t fat32_rename(const char *old_path, const char *new_path);
+fat32_error_t fat32_dir_read(fat32_file_t *dir, fat32_entry_t *entry);
+fat32_error_t fat32_dir_create(fat32_file_t *dir, const char *path);
+const char *fat32_error_string(fat32_error_t error);
+
+#endif /* HOSTSIM_FAT32_H */
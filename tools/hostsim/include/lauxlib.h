@@ -0,0 +1,2 @@
+/* Host build stand-in, see lua.h */
+#include "lua.h"
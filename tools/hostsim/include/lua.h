@@ -0,0 +1,15 @@
+/*
+ * Host build stand-in for the Lua headers
+ *
+ * The host server has no Lua VM; only the opaque state type is needed so
+ * src/picocalc_lua.h can be included.
+ */
+
+#ifndef HOSTSIM_LUA_H
+#define HOSTSIM_LUA_H
+
+#include <stddef.h>
+
+typedef struct lua_State lua_State;
+
+#endif /* HOSTSIM_LUA_H */
@@ -0,0 +1,17 @@
+/*
+ * Host build shim for lwip/ip_addr.h
+ */
+
+#ifndef HOSTSIM_LWIP_IP_ADDR_H
+#define HOSTSIM_LWIP_IP_ADDR_H
+
+#include <stdint.h>
+
+typedef struct {
+    uint32_t addr;
+} ip_addr_t;
+
+extern const ip_addr_t ip_addr_any;
+#define IP_ADDR_ANY (&ip_addr_any)
+
+#endif /* HOSTSIM_LWIP_IP_ADDR_H */
@@ -0,0 +1,26 @@
+/*
+ * Host build shim for lwip/pbuf.h
+ * Received data is delivered as a single-segment pbuf.
+ */
+
+#ifndef HOSTSIM_LWIP_PBUF_H
+#define HOSTSIM_LWIP_PBUF_H
+
+#include <stdint.h>
+
+typedef uint8_t u8_t;
+typedef uint16_t u16_t;
+typedef uint32_t u32_t;
+
+struct pbuf {
+    struct pbuf *next;
+    void *payload;
+    u16_t tot_len;
+    u16_t len;
+};
+
+struct pbuf *pbuf_alloc_copy(const void *data, u16_t len);
+u8_t pbuf_free(struct pbuf *p);
+u16_t pbuf_copy_partial(const struct pbuf *p, void *dataptr, u16_t len, u16_t offset);
+
+#endif /* HOSTSIM_LWIP_PBUF_H */
@@ -0,0 +1,57 @@
+/*
+ * Host build shim for the lwIP raw TCP API
+ *
+ * Implements the subset used by the file server on top of non-blocking
+ * POSIX sockets. Buffer sizes mirror src/lwipopts.h so tcp_sndbuf()
+ * back-pressure behaves like the device.
+ */
+
+#ifndef HOSTSIM_LWIP_TCP_H
+#define HOSTSIM_LWIP_TCP_H
+
+#include <stddef.h>
+#include "lwip/err.h"
+#include "lwip/pbuf.h"
+#include "lwip/ip_addr.h"
+
+#define TCP_MSS       1460
+#define TCP_WND       (8 * TCP_MSS)
+#define TCP_SND_BUF   (8 * TCP_MSS)
+#define TCP_SND_QUEUELEN ((4 * (TCP_SND_BUF) + (TCP_MSS - 1)) / (TCP_MSS))
+
+#define TCP_WRITE_FLAG_COPY 0x01
+#define TCP_WRITE_FLAG_MORE 0x02
+
+struct tcp_pcb;
+
+typedef err_t (*tcp_accept_fn)(void *arg, struct tcp_pcb *newpcb, err_t err);
+typedef err_t (*tcp_recv_fn)(void *arg, struct tcp_pcb *tpcb, struct pbuf *p, err_t err);
+typedef void (*tcp_err_fn)(void *arg, err_t err);
+typedef err_t (*tcp_poll_fn)(void *arg, struct tcp_pcb *tpcb);
+
+/* lwIP runs poll callbacks from its coarse timer, every interval * 500ms */
+#define TCP_SLOW_INTERVAL_MS 500
+
+struct tcp_pcb *tcp_new(void);
+err_t tcp_bind(struct tcp_pcb *pcb, const ip_addr_t *ipaddr, u16_t port);
+struct tcp_pcb *tcp_listen(struct tcp_pcb *pcb);
+void tcp_accept(struct tcp_pcb *pcb, tcp_accept_fn accept);
+void tcp_arg(struct tcp_pcb *pcb, void *arg);
+void tcp_recv(struct tcp_pcb *pcb, tcp_recv_fn recv);
+void tcp_err(struct tcp_pcb *pcb, tcp_err_fn err);
+void tcp_poll(struct tcp_pcb *pcb, tcp_poll_fn poll, u8_t interval);
+void tcp_recved(struct tcp_pcb *pcb, u16_t len);
+err_t tcp_write(struct tcp_pcb *pcb, const void *dataptr, u16_t len, u8_t apiflags);
+err_t tcp_output(struct tcp_pcb *pcb);
+u16_t tcp_sndbuf(struct tcp_pcb *pcb);
+u16_t tcp_sndqueuelen(struct tcp_pcb *pcb);
+err_t tcp_close(struct tcp_pcb *pcb);
+void tcp_abort(struct tcp_pcb *pcb);
+
+/* Host-only: override the port passed to tcp_bind (0 keeps it) */
+void hostsim_set_port(u16_t port);
+
+/* Host-only: wait up to timeout_ms for socket activity and run callbacks */
+void hostsim_poll(int timeout_ms);
+
+#endif /* HOSTSIM_LWIP_TCP_H */
@@ -0,0 +1,11 @@
+/*
+ * Host build shim for pico/cyw43_arch.h
+ * cyw43_arch_poll() services the POSIX socket backend of the lwIP shim.
+ */
+
+#ifndef HOSTSIM_PICO_CYW43_ARCH_H
+#define HOSTSIM_PICO_CYW43_ARCH_H
+
+void cyw43_arch_poll(void);
+
+#endif /* HOSTSIM_PICO_CYW43_ARCH_H */
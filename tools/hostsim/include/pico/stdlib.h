@@ -0,0 +1,26 @@
+/*
+ * Host build shim for pico/stdlib.h
+ * Only the timing helpers used by the file server are provided.
+ */
+
+#ifndef HOSTSIM_PICO_STDLIB_H
+#define HOSTSIM_PICO_STDLIB_H
+
+#include <stdint.h>
+#include <stdbool.h>
+#include <time.h>
+
+typedef unsigned int uint;
+
+static inline uint64_t time_us_64(void) {
+    struct timespec ts;
+    clock_gettime(CLOCK_MONOTONIC, &ts);
+    return (uint64_t)ts.tv_sec * 1000000u + (uint64_t)ts.tv_nsec / 1000u;
+}
+
+static inline void sleep_ms(uint32_t ms) {
+    struct timespec ts = { ms / 1000, (long)(ms % 1000) * 1000000L };
+    nanosleep(&ts, NULL);
+}
+
+#endif /* HOSTSIM_PICO_STDLIB_H */
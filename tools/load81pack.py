@@ -0,0 +1,253 @@
+#!/usr/bin/env python3
+"""
+LOAD81 Asset Packer
+Bundles files into a single asset pack that programs open once with
+pack.open()/pack.mount() instead of opening every asset on the SD card.
+PNG images are converted to sprites (RGB565 plus an alpha plane) for
+sprite(); everything else, Lua modules included, is stored as is.
+
+Pack layout (little-endian, see src/picocalc_pack.h):
+
+  header   "L81P", u16 version, u16 flags, u32 count, u32 index_offset,
+           u32 names_offset, u32 names_size, u32 data_offset, u32 reserved
+  index    count x (u32 fnv1a(name), u32 name_offset, u32 offset,
+           u32 length, u16 flags, u16 name_length), sorted by hash
+  names    NUL-terminated names
+  payloads each starting on a 512-byte boundary
+
+Usage:
+  load81pack.py -o game.pak assets/          # names relative to assets/
+  load81pack.py -o game.pak a.png lvl/1.txt  # names as given
+  load81pack.py --list game.pak
+  load81pack.py --sample 100 -o bench.pak    # synthetic assets for pack_bench()
+"""
+
+import os
+import sys
+import zlib
+import struct
+import random
+import argparse
+
+MAGIC = b'L81P'
+VERSION = 1
+HEADER_SIZE = 32
+ENTRY_SIZE = 20
+ALIGN = 512
+MAX_ENTRIES = 4096
+
+FLAG_SPRITE = 0x0001
+
+
+def fnv1a(data):
+    """32-bit FNV-1a, as pack_find() computes it"""
+    h = 2166136261
+    for b in data:
+        h = ((h ^ b) * 16777619) & 0xFFFFFFFF
+    return h
+
+
+def png_pixels(data):
+    """Decode an 8-bit (or paletted) non-interlaced PNG to (w, h, RGBA rows)"""
+    if data[:8] != b'\x89PNG\r\n\x1a\n':
+        raise ValueError('not a PNG')
+    pos = 8
+    idat = b''
+    palette = []
+    trns = b''
+    while pos < len(data):
+        length, kind = struct.unpack('>I4s', data[pos:pos + 8])
+        chunk = data[pos + 8:pos + 8 + length]
+        pos += 12 + length
+        if kind == b'IHDR':
+            w, h, depth, color, _, _, interlace = struct.unpack('>IIBBBBB', chunk)
+        elif kind == b'PLTE':
+            palette = [chunk[i:i + 3] for i in range(0, len(chunk), 3)]
+        elif kind == b'tRNS':
+            trns = chunk
+        elif kind == b'IDAT':
+            idat += chunk
+        elif kind == b'IEND':
+            break
+    if interlace:
+        raise ValueError('interlaced PNGs are not supported')
+    if depth != 8 and not (color == 3 and depth in (1, 2, 4)):
+        raise ValueError('unsupported bit depth %d' % depth)
+
+    channels = {0: 1, 2: 3, 3: 1, 4: 2, 6: 4}[color]
+    bpp = max(1, channels * depth // 8)
+    stride = (w * channels * depth + 7) // 8
+    raw = zlib.decompress(idat)
+    rows = []
+    prev = bytearray(stride)
+    for y in range(h):
+        start = y * (stride + 1)
+        ftype = raw[start]
+        line = bytearray(raw[start + 1:start + 1 + stride])
+        for i in range(stride):
+            a = line[i - bpp] if i >= bpp else 0
+            b = prev[i]
+            c = prev[i - bpp] if i >= bpp else 0
+            if ftype == 1:
+                line[i] = (line[i] + a) & 0xFF
+            elif ftype == 2:
+                line[i] = (line[i] + b) & 0xFF
+            elif ftype == 3:
+                line[i] = (line[i] + (a + b) // 2) & 0xFF
+            elif ftype == 4:
+                p = a + b - c
+                pa, pb, pc = abs(p - a), abs(p - b), abs(p - c)
+                pred = a if pa <= pb and pa <= pc else (b if pb <= pc else c)
+                line[i] = (line[i] + pred) & 0xFF
+        prev = line
+
+        row = []
+        for x in range(w):
+            if color == 3:
+                bit = x * depth
+                index = (line[bit // 8] >> (8 - depth - bit % 8)) & ((1 << depth) - 1)
+                r, g, b = palette[index]
+                alpha = trns[index] if index < len(trns) else 255
+            elif color == 0:
+                r = g = b = line[x]
+                alpha = 255
+            elif color == 4:
+                r = g = b = line[x * 2]
+                alpha = line[x * 2 + 1]
+            elif color == 2:
+                r, g, b = line[x * 3:x * 3 + 3]
+                alpha = 255
+            else:
+                r, g, b, alpha = line[x * 4:x * 4 + 4]
+            row.append((r, g, b, alpha))
+        rows.append(row)
+    return w, h, rows
+
+
+def png_to_sprite(data):
+    """u16 w, u16 h, w*h RGB565 then w*h alpha, top row first"""
+    w, h, rows = png_pixels(data)
+    if w > 0xFFFF or h > 0xFFFF:
+        raise ValueError('image too large')
+    colors = bytearray()
+    alphas = bytearray()
+    for row in rows:
+        for r, g, b, alpha in row:
+            colors += struct.pack('<H', (r >> 3) << 11 | (g >> 2) << 5 | (b >> 3))
+            alphas.append(alpha)
+    return struct.pack('<HH', w, h) + bytes(colors) + bytes(alphas)
+
+
+def build(assets):
+    """Pack bytes for a list of (name, payload, flags)"""
+    if len(assets) > MAX_ENTRIES:
+        raise ValueError('too many assets (max %d)' % MAX_ENTRIES)
+    names = [a[0] for a in assets]
+    if len(set(names)) != len(names):
+        raise ValueError('duplicate asset names')
+
+    entries = sorted(((fnv1a(n.encode()), n.encode(), data, flags)
+                      for n, data, flags in assets), key=lambda e: (e[0], e[1]))
+    names_block = bytearray()
+    name_offsets = []
+    for _, name, _, _ in entries:
+        name_offsets.append(len(names_block))
+        names_block += name + b'\0'
+
+    index_offset = HEADER_SIZE
+    names_offset = index_offset + len(entries) * ENTRY_SIZE
+    data_offset = (names_offset + len(names_block) + ALIGN - 1) // ALIGN * ALIGN
+
+    index = bytearray()
+    payloads = bytearray()
+    for (h, name, data, flags), name_off in zip(entries, name_offsets):
+        offset = data_offset + len(payloads)
+        index += struct.pack('<IIIIHH', h, name_off, offset, len(data), flags, len(name))
+        payloads += data
+        payloads += b'\0' * (-len(payloads) % ALIGN)
+
+    header = struct.pack('<4sHHIIIIII', MAGIC, VERSION, 0, len(entries), index_offset,
+                         names_offset, len(names_block), data_offset, 0)
+    out = header + index + names_block
+    return out + b'\0' * (data_offset - len(out)) + payloads
+
+
+def collect(paths, raw_png):
+    """(name, payload, flags) for files and directory trees"""
+    assets = []
+
+    def add(path, name):
+        with open(path, 'rb') as f:
+            data = f.read()
+        flags = 0
+        if name.lower().endswith('.png') and not raw_png:
+            data = png_to_sprite(data)
+            flags = FLAG_SPRITE
+        assets.append((name.replace(os.sep, '/'), data, flags))
+
+    for path in paths:
+        if os.path.isdir(path):
+            for root, dirs, files in os.walk(path):
+                dirs.sort()
+                for f in sorted(files):
+                    full = os.path.join(root, f)
+                    add(full, os.path.relpath(full, path))
+        else:
+            add(path, os.path.normpath(path))
+    return assets
+
+
+def sample(count):
+    """Synthetic assets of 200 bytes to 6KB, like small levels and sprites"""
+    rng = random.Random(81)
+    return [('sample/%03d.bin' % i, bytes(rng.getrandbits(8) for _ in range(rng.randint(200, 6144))), 0)
+            for i in range(count)]
+
+
+def list_pack(path):
+    with open(path, 'rb') as f:
+        data = f.read()
+    magic, version, _, count, index_offset, names_offset, _, _, _ = \
+        struct.unpack('<4sHHIIIIII', data[:HEADER_SIZE])
+    if magic != MAGIC:
+        raise ValueError('not an asset pack')
+    print('%s: version %d, %d assets, %d bytes' % (path, version, count, len(data)))
+    for i in range(count):
+        _, name_off, offset, length, flags, name_len = struct.unpack(
+            '<IIIIHH', data[index_offset + i * ENTRY_SIZE:index_offset + (i + 1) * ENTRY_SIZE])
+        name = data[names_offset + name_off:names_offset + name_off + name_len].decode()
+        print('%8d %8d %s%s' % (offset, length, name, ' (sprite)' if flags & FLAG_SPRITE else ''))
+
+
+def main():
+    """Main entry point"""
+    parser = argparse.ArgumentParser(description='LOAD81 Asset Packer')
+    parser.add_argument('paths', nargs='*', help='Files or directories to pack')
+    parser.add_argument('-o', '--output', help='Pack file to write')
+    parser.add_argument('--raw-png', action='store_true',
+                        help='Store PNGs as they are instead of as sprites')
+    parser.add_argument('--list', metavar='PACK', help='List the assets in a pack')
+    parser.add_argument('--sample', type=int, metavar='N',
+                        help='Pack N synthetic assets instead of files')
+    args = parser.parse_args()
+
+    try:
+        if args.list:
+            list_pack(args.list)
+            return 0
+        if not args.output or not (args.paths or args.sample):
+            parser.error('need -o PACK and files, directories or --sample N')
+        assets = sample(args.sample) if args.sample else collect(args.paths, args.raw_png)
+        data = build(assets)
+    except (OSError, ValueError) as e:
+        print('Error: %s' % e, file=sys.stderr)
+        return 1
+
+    with open(args.output, 'wb') as f:
+        f.write(data)
+    print('%s: %d assets, %d bytes' % (args.output, len(assets), len(data)))
+    return 0
+
+
+if __name__ == '__main__':
+    sys.exit(main())
@@ -0,0 +1,90 @@
+#!/usr/bin/env python3
+"""
+LOAD81R Protocol Benchmark
+Compares small-command latency and parse cost of protocol v1 (text lines)
+and v2 (binary frames) against a running file server. REPL includes the
+wait for the device's Lua loop to service the mailbox.
+
+Usage:
+  bench_protocol.py HOST [-p PORT] [-n COUNT]
+"""
+
+import sys
+import time
+import argparse
+from client import Load81Client
+
+
+def percentile(samples, pct):
+    """Nearest-rank percentile of a sorted list"""
+    if not samples:
+        return 0.0
+    index = min(len(samples) - 1, int(round(pct / 100.0 * (len(samples) - 1))))
+    return samples[index]
+
+
+def run(host: str, port: int, protocol: int, count: int) -> int:
+    client = Load81Client()
+    if not client.connect(host, port, protocol=protocol):
+        print(f"Error: Cannot connect to {host}:{port}", file=sys.stderr)
+        return 1
+    if client.protocol != protocol:
+        print(f"Server does not support protocol v{protocol}", file=sys.stderr)
+        client.close()
+        return 1
+
+    before = client.stats() or {}
+    operations = [
+        ("PING", lambda: client.ping()),
+        ("PWD", lambda: client.pwd()),
+        ("STAT", lambda: client.stat("/")),
+        ("REPL", lambda: client.repl("1+1")),
+    ]
+
+    print(f"Protocol v{protocol}:")
+    total_requests = 0
+    for name, op in operations:
+        latencies = []
+        cpu_start = time.process_time()
+        for _ in range(count):
+            start = time.perf_counter()
+            op()
+            latencies.append((time.perf_counter() - start) * 1000.0)
+        cpu_us = (time.process_time() - cpu_start) * 1e6 / count
+        total_requests += count
+
+        latencies.sort()
+        print(f"  {name:<5} p50={percentile(latencies, 50):7.2f}ms "
+              f"p95={percentile(latencies, 95):7.2f}ms "
+              f"p99={percentile(latencies, 99):7.2f}ms "
+              f"client_cpu={cpu_us:6.1f}us/req")
+
+    after = client.stats() or {}
+    if 'parse_us' in before and 'parse_us' in after:
+        # The trailing STATS request is included in the delta
+        parse_us = (after['parse_us'] - before['parse_us']) / (total_requests + 1)
+        print(f"  server parse={parse_us:.1f}us/req")
+    if after.get('repl_us'):
+        print(f"  server repl round trip={after['repl_us']}us (last)")
+
+    client.close()
+    return 0
+
+
+def main():
+    parser = argparse.ArgumentParser(description='LOAD81R protocol benchmark')
+    parser.add_argument('host', help='PicoCalc hostname or IP address')
+    parser.add_argument('-p', '--port', type=int, default=1900,
+                        help='Server port (default: 1900)')
+    parser.add_argument('-n', '--count', type=int, default=200,
+                        help='Requests per command (default: 200)')
+    args = parser.parse_args()
+
+    result = 0
+    for protocol in (1, 2):
+        result |= run(args.host, args.port, protocol, args.count)
+    return result
+
+
+if __name__ == '__main__':
+    sys.exit(main())
@@ -5,10 +5,36 @@ Handles TCP communication with PicoCalc file server
 """
 
 import socket
+import struct
 import sys
 import json
 from dataclasses import dataclass
-from typing import Optional, List, Dict, Any
+from typing import Optional, List, Dict, Any, Callable, Tuple
+
+
+# Protocol v2 framing (see picocalc_file_server.h)
+FRAME_HEADER = struct.Struct('<BBHI')  # opcode, flags, tag, payload length
+FLAG_MORE = 0x01
+
+OPCODES = {
+    'HELLO': 0x01, 'PWD': 0x02, 'CD': 0x03, 'LS': 0x04, 'CAT': 0x05,
+    'PUT': 0x06, 'MKDIR': 0x07, 'RM': 0x08, 'STAT': 0x09, 'REPL': 0x0A,
+    'SSHOT': 0x0B, 'PING': 0x0C, 'QUIT': 0x0D, 'STATS': 0x0E,
+    'RMTREE': 0x0F, 'MKDIRS': 0x10, 'COPY': 0x11, 'MOVE': 0x12, 'DU': 0x13,
+    'FIND': 0x14, 'GREP': 0x15, 'WATCH': 0x16, 'UNWATCH': 0x17,
+    'RELOAD': 0x18, 'AUTORELOAD': 0x19,
+}
+OP_OK = 0x80
+OP_ERR = 0x81
+OP_DATA = 0x82
+OP_READY = 0x83
+OP_LINE = 0x84
+OP_EVENT = 0x85
+OP_OUT = 0x86
+OP_DONE = 0x87
+
+PROTOCOL_V1 = "load81r/1.0"
+PROTOCOL_V2 = "load81r/2.0"
 
 
 @dataclass
@@ -30,8 +56,17 @@ class Load81Client:
         self.connected = False
         self.current_dir = "/"
         self.last_error = None
+        self.protocol = 1
+        self._rbuf = bytearray()
+        self._tag = 0
+        self._on_line = None
+        self._on_output: Optional[Callable[[str], None]] = None
+        self.events: List[Tuple[str, str]] = []  # WATCH events not yet taken
+        self.last_reload: Optional[Dict[str, Any]] = None  # Set by PUT after AUTORELOAD on
+        self.last_repl: Optional[Dict[str, Any]] = None  # bytes/dropped/us of the last REPL
         
-    def connect(self, host: str, port: int = 1900, timeout: float = 30.0) -> bool:
+    def connect(self, host: str, port: int = 1900, timeout: float = 30.0,
+                protocol: int = 2) -> bool:
         """
         Connect to LOAD81R server
         
@@ -39,22 +74,30 @@ class Load81Client:
             host: Server hostname or IP address
             port: Server port (default: 1900)
             timeout: Connection timeout in seconds (default: 30s for slow SD card reads)
+            protocol: Preferred protocol version; 2 falls back to 1 when the
+                      server does not support binary framing
             
         Returns:
             True if connected successfully, False otherwise
         """
         try:
             self.sock = socket.socket(socket.AF_INET, socket.SOCK_STREAM)
+            self.sock.setsockopt(socket.IPPROTO_TCP, socket.TCP_NODELAY, 1)
             self.sock.settimeout(timeout)
             self.sock.connect((host, port))
             self.host = host
             self.port = port
+            self.protocol = 1
+            self._rbuf = bytearray()
             
-            # Send HELLO handshake
-            response = self.send_command("HELLO", "load81r/1.0")
+            # Send HELLO handshake (always as a text line)
+            version = PROTOCOL_V2 if protocol == 2 else PROTOCOL_V1
+            response = self.send_command("HELLO", version)
             if not response.success:
                 self.close()
                 return False
+            if response.data == PROTOCOL_V2:
+                self.protocol = 2
             
             # Get initial directory
             pwd_response = self.send_command("PWD")
@@ -96,14 +139,22 @@ class Load81Client:
             return Response(success=False, error="Not connected")
         
         try:
-            # Format command
-            if args:
-                command_line = f"{cmd} {' '.join(str(arg) for arg in args)}\n"
-            else:
-                command_line = f"{cmd}\n"
+            arg_str = ' '.join(str(arg) for arg in args)
             
-            # Send command
-            self.sock.sendall(command_line.encode('utf-8'))
+            if self.protocol == 2:
+                opcode = OPCODES.get(cmd)
+                if opcode is None:
+                    return Response(success=False, error=f"Unknown command: {cmd}")
+                self._send_frame(opcode, arg_str.encode('utf-8'))
+            else:
+                # Format command
+                if args:
+                    command_line = f"{cmd} {arg_str}\n"
+                else:
+                    command_line = f"{cmd}\n"
+                
+                # Send command
+                self.sock.sendall(command_line.encode('utf-8'))
             
             # Receive response
             return self._receive_response()
@@ -111,6 +162,20 @@ class Load81Client:
         except (socket.error, socket.timeout) as e:
             return Response(success=False, error=f"Communication error: {e}")
     
+    def stream_command(self, cmd: str, args: str,
+                       on_line: Callable[[str], None]) -> Response:
+        """Send a streaming command; on_line is called for each result record"""
+        self._on_line = on_line
+        try:
+            return self.send_command(cmd, args)
+        finally:
+            self._on_line = None
+    
+    def _send_frame(self, opcode: int, payload: bytes = b"", flags: int = 0):
+        """Send one v2 frame with a fresh tag"""
+        self._tag = (self._tag + 1) & 0xFFFF
+        self.sock.sendall(FRAME_HEADER.pack(opcode, flags, self._tag, len(payload)) + payload)
+    
     def _receive_response(self) -> Response:
         """
         Receive and parse server response
@@ -118,11 +183,31 @@ class Load81Client:
         Returns:
             Response object
         """
+        if self.protocol == 2:
+            return self._receive_frames()
+        
         try:
-            # Read response line
+            # Read response line, passing streamed records to the handler
+            # and queueing WATCH events that arrived between replies
             line = self._read_line()
+            while True:
+                if line.startswith("+EVENT"):
+                    self._queue_event(line[7:])
+                elif line.startswith("+LINE") and self._on_line:
+                    self._on_line(line[6:])
+                elif line.startswith("+OUT"):
+                    try:
+                        length = int(line[5:])
+                    except ValueError:
+                        return Response(success=False, error="Invalid OUT length")
+                    self._output(self._read_bytes(length))
+                else:
+                    break
+                line = self._read_line()
             if not line:
                 return Response(success=False, error="Empty response")
+            if line.startswith("+DONE"):
+                return self._done_response(line[6:])
             
             # Parse response
             if line.startswith("+OK"):
@@ -167,28 +252,145 @@ class Load81Client:
         except (socket.error, socket.timeout) as e:
             return Response(success=False, error=f"Receive error: {e}")
     
+    def _receive_frames(self) -> Response:
+        """Receive one v2 response (DATA may span several frames)"""
+        try:
+            payload = bytearray()
+            while True:
+                header = self._read_bytes(FRAME_HEADER.size)
+                if len(header) < FRAME_HEADER.size:
+                    return Response(success=False, error="Connection closed")
+                opcode, flags, tag, length = FRAME_HEADER.unpack(header)
+                if opcode != OP_EVENT and tag != self._tag:
+                    return Response(success=False, error=f"Tag mismatch ({tag} != {self._tag})")
+                
+                body = self._read_bytes(length)
+                if len(body) < length:
+                    return Response(success=False, error="Truncated frame")
+                if opcode == OP_EVENT:
+                    self._queue_event(body.decode('utf-8', errors='replace'))
+                    continue
+                
+                if opcode == OP_DATA:
+                    payload += body
+                    if flags & FLAG_MORE:
+                        continue
+                    return Response(success=True, binary=bytes(payload))
+                
+                if opcode == OP_OUT:
+                    self._output(body)
+                    continue
+                
+                text = body.decode('utf-8', errors='replace')
+                if opcode == OP_DONE:
+                    return self._done_response(text)
+                if opcode == OP_LINE:
+                    if self._on_line:
+                        for record in text.splitlines():
+                            self._on_line(record)
+                    continue
+                if opcode == OP_OK:
+                    return Response(success=True, data=text or None)
+                if opcode == OP_ERR:
+                    return Response(success=False, error=text or "Unknown error")
+                if opcode == OP_READY:
+                    return Response(success=True, data="READY")
+                return Response(success=False, error=f"Unknown frame opcode 0x{opcode:02x}")
+                
+        except (socket.error, socket.timeout) as e:
+            return Response(success=False, error=f"Receive error: {e}")
+    
+    def _output(self, data: bytes):
+        if self._on_output:
+            self._on_output(data.decode('utf-8', errors='replace'))
+    
+    @staticmethod
+    def _done_response(text: str) -> Response:
+        """Parse the end of a REPL reply (ok {stats} or error message)"""
+        status, _, rest = text.strip().partition(' ')
+        if status == "ok":
+            return Response(success=True, data=rest or None)
+        return Response(success=False, error=rest or "Unknown error")
+    
+    def _queue_event(self, text: str):
+        kind, _, path = text.strip().partition(' ')
+        self.events.append((kind, path))
+    
+    def wait_event(self, timeout: Optional[float] = None) -> Optional[Tuple[str, str]]:
+        """
+        Wait for the next WATCH event
+        
+        Returns:
+            (kind, path) with kind created, modified, deleted or overflow;
+            None if nothing arrived within timeout seconds
+        """
+        previous = self.sock.gettimeout()
+        self.sock.settimeout(timeout)
+        try:
+            while not self.events:
+                if not self._read_event():
+                    break
+        except socket.timeout:
+            pass
+        finally:
+            self.sock.settimeout(previous)
+        return self.events.pop(0) if self.events else None
+    
+    def _read_event(self) -> bool:
+        """Read one unsolicited message; the buffer is untouched on timeout"""
+        if self.protocol == 2:
+            while len(self._rbuf) < FRAME_HEADER.size:
+                if not self._fill():
+                    return False
+            opcode, _, _, length = FRAME_HEADER.unpack_from(self._rbuf)
+            while len(self._rbuf) < FRAME_HEADER.size + length:
+                if not self._fill():
+                    return False
+            body = bytes(self._rbuf[FRAME_HEADER.size:FRAME_HEADER.size + length])
+            del self._rbuf[:FRAME_HEADER.size + length]
+            if opcode == OP_EVENT:
+                self._queue_event(body.decode('utf-8', errors='replace'))
+            return True
+        
+        while b'\n' not in self._rbuf:
+            if not self._fill():
+                return False
+        line = self._read_line()
+        if line.startswith("+EVENT"):
+            self._queue_event(line[7:])
+        return True
+    
+    def _fill(self) -> bool:
+        """Append the next chunk from the socket to the receive buffer"""
+        chunk = self.sock.recv(65536)
+        if not chunk:
+            return False
+        self._rbuf += chunk
+        return True
+    
     def _read_line(self) -> str:
         """Read a line from socket (terminated by \\n)"""
-        line = b""
+        start = 0
         while True:
-            char = self.sock.recv(1)
-            if not char:
+            pos = self._rbuf.find(b'\n', start)
+            if pos >= 0:
+                line = bytes(self._rbuf[:pos])
+                del self._rbuf[:pos + 1]
                 break
-            if char == b'\n':
+            start = len(self._rbuf)
+            if not self._fill():
+                line = bytes(self._rbuf)
+                self._rbuf.clear()
                 break
-            line += char
         return line.decode('utf-8', errors='replace').strip()
     
     def _read_bytes(self, length: int) -> bytes:
         """Read exact number of bytes from socket"""
-        data = b""
-        remaining = length
-        while remaining > 0:
-            chunk = self.sock.recv(min(remaining, 8192))
-            if not chunk:
+        while len(self._rbuf) < length:
+            if not self._fill():
                 break
-            data += chunk
-            remaining -= len(chunk)
+        data = bytes(self._rbuf[:length])
+        del self._rbuf[:length]
         return data
     
     def send_data(self, data: bytes) -> bool:
@@ -205,6 +407,9 @@ class Load81Client:
             return False
         
         try:
+            if self.protocol == 2:
+                header = FRAME_HEADER.pack(OP_DATA, 0, self._tag, len(data))
+                self.sock.sendall(header)
             self.sock.sendall(data)
             return True
         except (socket.error, socket.timeout):
@@ -229,9 +434,12 @@ class Load81Client:
             return True
         return False
     
-    def ls(self, path: Optional[str] = None) -> Optional[List[Dict[str, Any]]]:
-        """List directory contents"""
-        if path:
+    def ls(self, path: Optional[str] = None, offset: int = 0,
+           count: int = 0) -> Optional[List[Dict[str, Any]]]:
+        """List directory contents, optionally one page of count entries from offset"""
+        if offset or count:
+            response = self.send_command("LS", f"{path or '.'} {offset} {count}")
+        elif path:
             response = self.send_command("LS", path)
         else:
             response = self.send_command("LS")
@@ -270,10 +478,16 @@ class Load81Client:
             print(f"DEBUG: Failed to send data", file=sys.stderr)
             return False
         
-        # Wait for confirmation
+        # Wait for confirmation (after the reload if the running program was replaced)
         response = self._receive_response()
         if not response.success:
             print(f"DEBUG: Upload confirmation failed: {response.error}", file=sys.stderr)
+        self.last_reload = None
+        if response.success and response.data:
+            try:
+                self.last_reload = json.loads(response.data)
+            except json.JSONDecodeError:
+                pass
         return response.success
     
     def mkdir(self, path: str) -> bool:
@@ -286,6 +500,103 @@ class Load81Client:
         response = self.send_command("RM", path)
         return response.success
     
+    def rmtree(self, path: str) -> Optional[Dict[str, Any]]:
+        """Delete a file or directory tree on the device; returns totals"""
+        return self._tree_command("RMTREE", path)
+    
+    def mkdirs(self, path: str) -> bool:
+        """Create directory and any missing parents"""
+        response = self.send_command("MKDIRS", path)
+        return response.success
+    
+    def copy(self, src: str, dst: str) -> Optional[Dict[str, Any]]:
+        """Copy a file or directory tree on the device; returns totals"""
+        return self._tree_command("COPY", f"{src} {dst}")
+    
+    def move(self, src: str, dst: str) -> bool:
+        """Move or rename a file or directory on the device"""
+        response = self.send_command("MOVE", f"{src} {dst}")
+        if response.error:
+            self.last_error = response.error
+        return response.success
+    
+    def du(self, path: str) -> Optional[Dict[str, Any]]:
+        """Get file count, directory count and total bytes below a path"""
+        return self._tree_command("DU", path)
+    
+    def find(self, path: str, pattern: str,
+             on_match: Optional[Callable[[str], None]] = None) -> Optional[Dict[str, Any]]:
+        """Find names matching a glob below path; returns totals"""
+        return self._search("FIND", path, pattern, on_match)
+    
+    def grep(self, path: str, pattern: str,
+             on_match: Optional[Callable[[str], None]] = None) -> Optional[Dict[str, Any]]:
+        """Search file contents on the device; matches are path:line:text"""
+        return self._search("GREP", path, pattern, on_match)
+    
+    def _search(self, cmd: str, path: str, pattern: str,
+                on_match: Optional[Callable[[str], None]]) -> Optional[Dict[str, Any]]:
+        matches = []
+        response = self.stream_command(cmd, f"{path} {pattern}", on_match or matches.append)
+        if not response.success:
+            self.last_error = response.error
+            return None
+        try:
+            totals = json.loads(response.data) if response.data else {}
+        except json.JSONDecodeError:
+            totals = {}
+        if on_match is None:
+            totals['results'] = matches
+        return totals
+    
+    def watch(self, path: str) -> Optional[str]:
+        """Subscribe to changes below path; returns the watched absolute path"""
+        self.events.clear()
+        response = self.send_command("WATCH", path)
+        if not response.success:
+            self.last_error = response.error
+            return None
+        return response.data
+    
+    def unwatch(self) -> bool:
+        """Stop receiving WATCH events"""
+        response = self.send_command("UNWATCH")
+        self.events.clear()
+        return response.success
+    
+    def reload(self, path: Optional[str] = None) -> Optional[Dict[str, Any]]:
+        """
+        Swap new code into the running program (default: the program itself)
+        
+        Returns:
+            {"compile_us": N, "latency_ms": N} once the first new frame is
+            shown, None on error (Lua message in last_error)
+        """
+        response = self.send_command("RELOAD", path) if path else self.send_command("RELOAD")
+        if not response.success:
+            self.last_error = response.error
+            return None
+        try:
+            return json.loads(response.data) if response.data else {}
+        except json.JSONDecodeError:
+            return {}
+    
+    def autoreload(self, enabled: bool) -> bool:
+        """Reload the running program whenever it is uploaded with PUT"""
+        response = self.send_command("AUTORELOAD", "on" if enabled else "off")
+        return response.success
+    
+    def _tree_command(self, cmd: str, args: str) -> Optional[Dict[str, Any]]:
+        response = self.send_command(cmd, args)
+        if response.success and response.data:
+            try:
+                return json.loads(response.data)
+            except json.JSONDecodeError:
+                return None
+        if response.error:
+            self.last_error = response.error
+        return None
+    
     def stat(self, path: str) -> Optional[Dict[str, Any]]:
         """Get file/directory information"""
         response = self.send_command("STAT", path)
@@ -296,11 +607,47 @@ class Load81Client:
                 return None
         return None
     
-    def repl(self, code: str) -> Optional[str]:
-        """Execute Lua code"""
-        response = self.send_command("REPL", code)
-        if response.success:
-            return response.data
+    def repl(self, code: str,
+             on_output: Optional[Callable[[str], None]] = None) -> Optional[str]:
+        """
+        Execute Lua code in the device's current Lua state
+        
+        Output is streamed while the code runs; on_output, if given, is
+        called with each chunk as it arrives.
+        
+        Returns:
+            print() output and expression results ("" if none), or None on
+            error with the Lua message in last_error
+        """
+        chunks = []
+        
+        def collect(text: str):
+            chunks.append(text)
+            if on_output:
+                on_output(text)
+        
+        self._on_output = collect
+        try:
+            response = self.send_command("REPL", code)
+        finally:
+            self._on_output = None
+        if not response.success:
+            self.last_error = response.error
+            return None
+        try:
+            self.last_repl = json.loads(response.data) if response.data else None
+        except json.JSONDecodeError:
+            self.last_repl = None
+        return "".join(chunks)
+    
+    def stats(self) -> Optional[Dict[str, Any]]:
+        """Get server statistics (request counters, parse time)"""
+        response = self.send_command("STATS")
+        if response.success and response.data:
+            try:
+                return json.loads(response.data)
+            except json.JSONDecodeError:
+                return None
         return None
     
     def ping(self) -> bool:
@@ -8,6 +8,7 @@ import os
 import sys
 import tempfile
 import subprocess
+import time
 from typing import Optional
 from client import Load81Client
 
@@ -71,8 +72,16 @@ def cmd_cp(client: Load81Client, src: str, dst: str) -> int:
     dst_is_remote = dst.startswith("remote:")
     
     if src_is_remote and dst_is_remote:
-        print("Error: Server-side copy not yet implemented", file=sys.stderr)
-        return 1
+        # Copy on the device, no data crosses the network
+        remote_src = src[7:]
+        remote_dst = _into_dir(client, remote_src, dst[7:])
+        totals = client.copy(remote_src, remote_dst)
+        if totals is None:
+            error_msg = client.last_error if client.last_error else "Cannot copy"
+            print(f"Error: {error_msg} '{remote_src}'", file=sys.stderr)
+            return 1
+        print(f"Copied {totals['files']} files, {totals['bytes']} bytes")
+        return 0
     
     if src_is_remote:
         # Download
@@ -119,6 +128,128 @@ def cmd_cp(client: Load81Client, src: str, dst: str) -> int:
         return 1
 
 
+def _into_dir(client: Load81Client, src: str, dst: str) -> str:
+    """Like cp/mv: a destination that is an existing directory receives src by name"""
+    info = client.stat(dst)
+    if info and info.get('is_dir'):
+        return f"{dst.rstrip('/')}/{src.rstrip('/').split('/')[-1]}"
+    return dst
+
+
+def cmd_du(client: Load81Client, path: Optional[str] = None) -> int:
+    """Show disk usage of a file or directory tree"""
+    path = path or "."
+    totals = client.du(path)
+    if totals is None:
+        error_msg = client.last_error if client.last_error else "Cannot read"
+        print(f"Error: {error_msg} '{path}'", file=sys.stderr)
+        return 1
+    
+    size = totals['bytes']
+    if size < 1024:
+        size_str = f"{size}B"
+    elif size < 1024 * 1024:
+        size_str = f"{size/1024:.1f}K"
+    else:
+        size_str = f"{size/(1024*1024):.1f}M"
+    print(f"{size_str:>7}  {path}  ({totals['files']} files, {totals['dirs']} dirs)")
+    return 0
+
+
+def _print_search_totals(totals: dict) -> None:
+    kb = totals.get('bytes', 0) / 1024
+    print(f"{totals.get('matches', 0)} matches, {totals.get('files', 0)} scanned, "
+          f"{kb:.1f}K read at {totals.get('kbps', 0)} KB/s", file=sys.stderr)
+
+
+def cmd_find(client: Load81Client, path: str, pattern: str) -> int:
+    """Find files by name on the device"""
+    if not path or not pattern:
+        print("Error: Missing directory or pattern", file=sys.stderr)
+        print("Usage: find DIR PATTERN", file=sys.stderr)
+        return 1
+    
+    totals = client.find(path, pattern, on_match=print)
+    if totals is None:
+        print(f"Error: {client.last_error or 'Cannot search'} '{path}'", file=sys.stderr)
+        return 1
+    return 0
+
+
+def cmd_grep(client: Load81Client, pattern: str, path: Optional[str] = None) -> int:
+    """Search file contents on the device"""
+    if not pattern:
+        print("Error: Missing pattern", file=sys.stderr)
+        print("Usage: grep PATTERN [PATH]", file=sys.stderr)
+        return 1
+    
+    path = path or "."
+    totals = client.grep(path, pattern, on_match=print)
+    if totals is None:
+        print(f"Error: {client.last_error or 'Cannot search'} '{path}'", file=sys.stderr)
+        return 1
+    _print_search_totals(totals)
+    return 0 if totals.get('matches') else 1
+
+
+def cmd_reload(client: Load81Client, path: Optional[str] = None,
+               upload: Optional[str] = None) -> int:
+    """Reload code into the running program, optionally uploading it first"""
+    start = time.perf_counter()
+    if upload:
+        if not path:
+            print("Error: Missing remote path for upload", file=sys.stderr)
+            return 1
+        try:
+            with open(upload, 'rb') as f:
+                data = f.read()
+        except IOError as e:
+            print(f"Error: Cannot read local file: {e}", file=sys.stderr)
+            return 1
+        if not client.autoreload(True) or not client.put(path, data):
+            print(f"Error: Cannot write remote file '{path}'", file=sys.stderr)
+            return 1
+        result = client.last_reload
+        if not result:
+            print(f"Uploaded {len(data)} bytes ({path} is not the running program)")
+            return 0
+        if 'error' in result:
+            print(f"Reload failed: {result['error']}", file=sys.stderr)
+            return 1
+    else:
+        result = client.reload(path)
+        if result is None:
+            print(f"Reload failed: {client.last_error}", file=sys.stderr)
+            return 1
+    
+    elapsed_ms = (time.perf_counter() - start) * 1000
+    print(f"Reloaded: first new frame after {result.get('latency_ms', 0)} ms on the device "
+          f"({elapsed_ms:.0f} ms round trip, compile {result.get('compile_us', 0) / 1000:.1f} ms)")
+    return 0
+
+
+def cmd_watch(client: Load81Client, path: Optional[str] = None) -> int:
+    """Print changes below a path until interrupted"""
+    watched = client.watch(path or ".")
+    if watched is None:
+        print(f"Error: {client.last_error or 'Cannot watch'} '{path or '.'}'", file=sys.stderr)
+        return 1
+    
+    print(f"Watching {watched} (Ctrl-C to stop)", file=sys.stderr)
+    try:
+        while True:
+            event = client.wait_event(timeout=None)
+            if event is None:
+                print("Error: Connection closed", file=sys.stderr)
+                return 1
+            kind, changed = event
+            print(f"{kind:<9} {changed}", flush=True)
+    except KeyboardInterrupt:
+        print()
+    client.unwatch()
+    return 0
+
+
 def cmd_edit(client: Load81Client, filename: str) -> int:
     """Edit remote file with local editor"""
     if not filename:
@@ -194,15 +325,21 @@ def cmd_help(client: Load81Client, command: Optional[str] = None) -> int:
         help_text = {
             'cat': 'cat FILE [FILE...]\n  Display contents of one or more files',
             'cd': 'cd [DIRECTORY]\n  Change current directory (default: /)',
-            'cp': 'cp SOURCE DEST\n  Copy files\n  Examples:\n    cp remote:/file.txt ./local.txt  (download)\n    cp ./local.txt remote:/file.txt  (upload)',
+            'cp': 'cp SOURCE DEST\n  Copy files\n  Examples:\n    cp remote:/file.txt ./local.txt  (download)\n    cp ./local.txt remote:/file.txt  (upload)\n    cp remote:/dir remote:/backup    (on the device)',
+            'du': 'du [PATH]\n  Show total size, file and directory count of a tree',
             'edit': 'edit FILENAME\n  Edit remote file with local editor ($EDITOR)',
+            'find': 'find DIR PATTERN\n  Find files whose name matches a glob (* and ?) on the device',
+            'grep': 'grep PATTERN [PATH]\n  Search file contents on the device\n  Pattern: text with ^ $ . x* and \\x escapes\n  Output: path:line:text',
             'help': 'help [COMMAND]\n  Show help information',
             'ls': 'ls [PATH]\n  List directory contents',
-            'mkdir': 'mkdir DIRECTORY\n  Create directory',
+            'mkdir': 'mkdir [-p] DIRECTORY\n  Create directory\n  -p  Create missing parent directories',
+            'mv': 'mv SOURCE DEST\n  Move or rename a file or directory on the device',
+            'reload': 'reload [-u LOCAL] [PATH]\n  Swap new code into the running program without restarting it\n  Functions are replaced, other globals keep their values, setup() is not re-run\n  PATH defaults to the running program; -u LOCAL uploads LOCAL to PATH first\n  Lua errors are reported here and the program keeps running the old code',
             'repl': 'repl\n  Enter interactive Lua REPL',
-            'rm': 'rm PATH [PATH...]\n  Delete files or directories',
+            'rm': 'rm [-r] PATH [PATH...]\n  Delete files or directories\n  -r  Delete directories and their contents',
             'rsync': 'rsync SOURCE DEST\n  Synchronize directories\n  Remote paths must start with /\n  Examples:\n    rsync /load81 ./backup  (download from remote)\n    rsync ./backup /load81  (upload to remote)',
             'sshot': 'sshot FILENAME\n  Capture screenshot from PicoCalc display and save as PNG\n  Requires PIL/Pillow: pip install pillow',
+            'watch': 'watch [PATH]\n  Print files created, modified or deleted below PATH until Ctrl-C\n  Changes made on the device (editor, Lua, uploads) are reported\n  "overflow" means too many changes at once: rescan PATH',
         }
         
         if command in help_text:
@@ -218,14 +355,20 @@ def cmd_help(client: Load81Client, command: Optional[str] = None) -> int:
         print("  cat FILE...       Display file contents")
         print("  cd [DIR]          Change directory")
         print("  cp SRC DST        Copy files (use remote: prefix)")
+        print("  du [PATH]         Show disk usage")
         print("  edit FILE         Edit file with local editor")
+        print("  find DIR PATTERN  Find files by name")
+        print("  grep PAT [PATH]   Search file contents")
         print("  help [CMD]        Show help")
         print("  ls [PATH]         List directory")
-        print("  mkdir DIR         Create directory")
+        print("  mkdir [-p] DIR    Create directory")
+        print("  mv SRC DST        Move or rename")
+        print("  reload [-u F] [P] Live-reload the running program")
         print("  repl              Interactive Lua REPL")
-        print("  rm PATH...        Delete files/directories")
+        print("  rm [-r] PATH...   Delete files/directories")
         print("  rsync SRC DST     Synchronize directories")
         print("  sshot FILE        Capture screenshot to PNG")
+        print("  watch [PATH]      Print changes as they happen")
         print()
         print("  exit, quit        Exit shell")
         print()
@@ -266,14 +409,15 @@ def cmd_ls(client: Load81Client, path: Optional[str] = None) -> int:
     return 0
 
 
-def cmd_mkdir(client: Load81Client, path: str) -> int:
+def cmd_mkdir(client: Load81Client, path: str, parents: bool = False) -> int:
     """Create directory"""
     if not path:
         print("Error: Missing directory name", file=sys.stderr)
-        print("Usage: mkdir DIRECTORY", file=sys.stderr)
+        print("Usage: mkdir [-p] DIRECTORY", file=sys.stderr)
         return 1
     
-    if client.mkdir(path):
+    created = client.mkdirs(path) if parents else client.mkdir(path)
+    if created:
         return 0
     else:
         print(f"Error: Cannot create directory '{path}'", file=sys.stderr)
@@ -304,24 +448,49 @@ def cmd_repl(client: Load81Client) -> int:
             print("  .help         Show this help")
             continue
         
-        # Execute Lua code
-        result = client.repl(line)
-        if result is not None:
-            print(result)
+        # Execute Lua code, printing output as it streams in
+        def show(text):
+            sys.stdout.write(text)
+            sys.stdout.flush()
+        
+        result = client.repl(line, on_output=show)
+        if result is None:
+            print(f"Error: {client.last_error}", file=sys.stderr)
+        elif result and not result.endswith("\n"):
+            print()
     
     return 0
 
 
-def cmd_rm(client: Load81Client, *paths) -> int:
+def cmd_mv(client: Load81Client, src: str, dst: str) -> int:
+    """Move or rename on the device"""
+    if not src or not dst:
+        print("Error: Missing source or destination", file=sys.stderr)
+        print("Usage: mv SOURCE DEST", file=sys.stderr)
+        return 1
+    
+    dst = _into_dir(client, src, dst)
+    if client.move(src, dst):
+        return 0
+    error_msg = client.last_error if client.last_error else "Cannot move"
+    print(f"Error: {error_msg} '{src}'", file=sys.stderr)
+    return 1
+
+
+def cmd_rm(client: Load81Client, *paths, recursive: bool = False) -> int:
     """Delete files or directories"""
     if not paths:
         print("Error: Missing path", file=sys.stderr)
-        print("Usage: rm PATH [PATH...]", file=sys.stderr)
+        print("Usage: rm [-r] PATH [PATH...]", file=sys.stderr)
         return 1
     
     exit_code = 0
     for path in paths:
-        if client.rm(path):
+        if recursive:
+            deleted = client.rmtree(path) is not None
+        else:
+            deleted = client.rm(path)
+        if deleted:
             print(f"Deleted: {path}")
         else:
             print(f"Error: Cannot delete '{path}'", file=sys.stderr)
@@ -9,8 +9,9 @@ import argparse
 from client import Load81Client
 from shell import run_shell
 from commands import (
-    cmd_cat, cmd_cd, cmd_cp, cmd_edit, cmd_help,
-    cmd_ls, cmd_mkdir, cmd_repl, cmd_rm, cmd_rsync, cmd_sshot
+    cmd_cat, cmd_cd, cmd_cp, cmd_du, cmd_edit, cmd_find, cmd_grep, cmd_help,
+    cmd_ls, cmd_mkdir, cmd_mv, cmd_reload, cmd_repl, cmd_rm, cmd_rsync,
+    cmd_sshot, cmd_watch
 )
 
 
@@ -28,7 +29,11 @@ Examples:
   %(prog)s 192.168.1.100 cp ./local.txt remote:/file.txt  # Upload
   %(prog)s 192.168.1.100 rsync /load81 ./backup  # Download directory
   %(prog)s 192.168.1.100 rsync ./backup /load81  # Upload directory
+  %(prog)s 192.168.1.100 rm -r /load81/old     # Delete directory tree
+  %(prog)s 192.168.1.100 cp remote:/a remote:/b  # Copy on the device
   %(prog)s 192.168.1.100 sshot screenshot.png  # Capture screenshot
+  %(prog)s 192.168.1.100 watch /load81        # Print changes as they happen
+  %(prog)s 192.168.1.100 reload -u game.lua /load81/game.lua  # Upload and live-reload
         """
     )
     
@@ -40,8 +45,8 @@ Examples:
                        help='Command to execute (omit for interactive shell)')
     
     parser.add_argument('args',
-                       nargs='*',
-                       help='Command arguments')
+                       nargs=argparse.REMAINDER,
+                       help='Command arguments (options such as rm -r are passed through)')
     
     parser.add_argument('-p', '--port',
                        type=int,
@@ -81,12 +86,29 @@ Examples:
                 return 1
             return cmd_cp(client, cmd_args[0], cmd_args[1])
         
+        elif cmd == 'du':
+            path = cmd_args[0] if cmd_args else None
+            return cmd_du(client, path)
+        
         elif cmd == 'edit':
             if not cmd_args:
                 print("Error: Missing filename", file=sys.stderr)
                 return 1
             return cmd_edit(client, cmd_args[0])
         
+        elif cmd == 'find':
+            if len(cmd_args) < 2:
+                print("Error: Missing arguments", file=sys.stderr)
+                print("Usage: find DIR PATTERN", file=sys.stderr)
+                return 1
+            return cmd_find(client, cmd_args[0], cmd_args[1])
+        
+        elif cmd == 'grep':
+            if not cmd_args:
+                print("Error: Missing pattern", file=sys.stderr)
+                return 1
+            return cmd_grep(client, cmd_args[0], cmd_args[1] if len(cmd_args) > 1 else None)
+        
         elif cmd == 'help':
             topic = cmd_args[0] if cmd_args else None
             return cmd_help(client, topic)
@@ -96,19 +118,42 @@ Examples:
             return cmd_ls(client, path)
         
         elif cmd == 'mkdir':
-            if not cmd_args:
+            parents = '-p' in cmd_args
+            paths = [x for x in cmd_args if x != '-p']
+            if not paths:
                 print("Error: Missing directory name", file=sys.stderr)
                 return 1
-            return cmd_mkdir(client, cmd_args[0])
+            return cmd_mkdir(client, paths[0], parents)
+        
+        elif cmd == 'mv':
+            if len(cmd_args) < 2:
+                print("Error: Missing arguments", file=sys.stderr)
+                print("Usage: mv SOURCE DEST", file=sys.stderr)
+                return 1
+            return cmd_mv(client, cmd_args[0], cmd_args[1])
+        
+        elif cmd == 'reload':
+            upload = None
+            rest = list(cmd_args)
+            if '-u' in rest:
+                i = rest.index('-u')
+                if i + 1 >= len(rest):
+                    print("Usage: reload [-u LOCAL] [PATH]", file=sys.stderr)
+                    return 1
+                upload = rest.pop(i + 1)
+                rest.pop(i)
+            return cmd_reload(client, rest[0] if rest else None, upload)
         
         elif cmd == 'repl':
             return cmd_repl(client)
         
         elif cmd == 'rm':
-            if not cmd_args:
+            recursive = '-r' in cmd_args
+            paths = [x for x in cmd_args if x != '-r']
+            if not paths:
                 print("Error: Missing path", file=sys.stderr)
                 return 1
-            return cmd_rm(client, *cmd_args)
+            return cmd_rm(client, *paths, recursive=recursive)
         
         elif cmd == 'rsync':
             if len(cmd_args) < 2:
@@ -123,6 +168,10 @@ Examples:
                 return 1
             return cmd_sshot(client, cmd_args[0])
         
+        elif cmd == 'watch':
+            path = cmd_args[0] if cmd_args else None
+            return cmd_watch(client, path)
+        
         else:
             print(f"Unknown command: {cmd}", file=sys.stderr)
             print("Use 'help' to see available commands", file=sys.stderr)
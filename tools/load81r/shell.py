@@ -11,8 +11,9 @@ import os
 from typing import Optional
 from client import Load81Client
 from commands import (
-    cmd_cat, cmd_cd, cmd_cp, cmd_edit, cmd_help,
-    cmd_ls, cmd_mkdir, cmd_repl, cmd_rm, cmd_rsync, cmd_sshot
+    cmd_cat, cmd_cd, cmd_cp, cmd_du, cmd_edit, cmd_find, cmd_grep, cmd_help,
+    cmd_ls, cmd_mkdir, cmd_mv, cmd_reload, cmd_repl, cmd_rm, cmd_rsync,
+    cmd_sshot, cmd_watch
 )
 
 
@@ -56,8 +57,8 @@ class Load81Shell:
         
         # Complete command names
         if not tokens or (len(tokens) == 1 and not line.endswith(' ')):
-            commands = ['cat', 'cd', 'cp', 'edit', 'help', 'ls',
-                       'mkdir', 'repl', 'rm', 'rsync', 'sshot', 'exit', 'quit']
+            commands = ['cat', 'cd', 'cp', 'du', 'edit', 'find', 'grep', 'help', 'ls',
+                       'mkdir', 'mv', 'reload', 'repl', 'rm', 'rsync', 'sshot', 'watch', 'exit', 'quit']
             matches = [cmd for cmd in commands if cmd.startswith(text)]
             return matches[state] if state < len(matches) else None
         
@@ -154,12 +155,29 @@ class Load81Shell:
                     return 1
                 return cmd_cp(self.client, args[0], args[1])
             
+            elif cmd == 'du':
+                path = args[0] if args else None
+                return cmd_du(self.client, path)
+            
             elif cmd == 'edit':
                 if not args:
                     print("Error: Missing filename", file=sys.stderr)
                     return 1
                 return cmd_edit(self.client, args[0])
             
+            elif cmd == 'find':
+                if len(args) < 2:
+                    print("Error: Missing arguments", file=sys.stderr)
+                    print("Usage: find DIR PATTERN", file=sys.stderr)
+                    return 1
+                return cmd_find(self.client, args[0], args[1])
+            
+            elif cmd == 'grep':
+                if not args:
+                    print("Error: Missing pattern", file=sys.stderr)
+                    return 1
+                return cmd_grep(self.client, args[0], args[1] if len(args) > 1 else None)
+            
             elif cmd == 'help':
                 topic = args[0] if args else None
                 return cmd_help(self.client, topic)
@@ -169,19 +187,42 @@ class Load81Shell:
                 return cmd_ls(self.client, path)
             
             elif cmd == 'mkdir':
-                if not args:
+                parents = '-p' in args
+                paths = [x for x in args if x != '-p']
+                if not paths:
                     print("Error: Missing directory name", file=sys.stderr)
                     return 1
-                return cmd_mkdir(self.client, args[0])
+                return cmd_mkdir(self.client, paths[0], parents)
+            
+            elif cmd == 'mv':
+                if len(args) < 2:
+                    print("Error: Missing arguments", file=sys.stderr)
+                    print("Usage: mv SOURCE DEST", file=sys.stderr)
+                    return 1
+                return cmd_mv(self.client, args[0], args[1])
+            
+            elif cmd == 'reload':
+                upload = None
+                rest = list(args)
+                if '-u' in rest:
+                    i = rest.index('-u')
+                    if i + 1 >= len(rest):
+                        print("Usage: reload [-u LOCAL] [PATH]", file=sys.stderr)
+                        return 1
+                    upload = rest.pop(i + 1)
+                    rest.pop(i)
+                return cmd_reload(self.client, rest[0] if rest else None, upload)
             
             elif cmd == 'repl':
                 return cmd_repl(self.client)
             
             elif cmd == 'rm':
-                if not args:
+                recursive = '-r' in args
+                paths = [x for x in args if x != '-r']
+                if not paths:
                     print("Error: Missing path", file=sys.stderr)
                     return 1
-                return cmd_rm(self.client, *args)
+                return cmd_rm(self.client, *paths, recursive=recursive)
             
             elif cmd == 'rsync':
                 if len(args) < 2:
@@ -196,6 +237,10 @@ class Load81Shell:
                     return 1
                 return cmd_sshot(self.client, args[0])
             
+            elif cmd == 'watch':
+                path = args[0] if args else None
+                return cmd_watch(self.client, path)
+            
             else:
                 print(f"Unknown command: {cmd}", file=sys.stderr)
                 print("Type 'help' for available commands", file=sys.stderr)